@@ -0,0 +1,9 @@
+#include <loge.hpp>
+
+void sample_key_elsewhere(uint64_t key) {
+  loge_sample_key(key);
+}
+
+bool sampled_elsewhere(uint64_t rate) {
+  return loge_sample(rate);
+}
@@ -0,0 +1,1845 @@
+#if defined(__linux) || defined(__linux__)
+#include <unistd.h>
+#endif
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <loge.hpp>
+
+using bench_logger = loge<true>;
+
+extern void sample_key_elsewhere(uint64_t key);
+extern bool sampled_elsewhere(uint64_t rate);
+
+enum { ITERATIONS = 200000, THREADS = 4, BURST = 4000 };
+
+static
+double elapsed_ns(std::chrono::steady_clock::time_point start,
+    std::chrono::steady_clock::time_point end, int n) {
+
+  return static_cast<double>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+      .count()) / n;
+}
+
+static
+double per_msg_ns(std::chrono::steady_clock::duration total, int n) {
+  return static_cast<double>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(total).count()) / n;
+}
+
+static
+void report(const char *name, double ns) {
+  printf("%-32s %10.1f ns/msg\n", name, ns);
+}
+
+/*
+ * Caller side cost of log() with the output going to a file. Messages are
+ * logged in bursts that fit the async ring, waiting for the backend to catch
+ * up is not counted.
+ */
+static
+void bench_log(const char *name, bench_logger *logger) {
+  std::chrono::steady_clock::duration total{};
+
+  for (int i = 0; i < ITERATIONS; i += BURST) {
+    auto start = std::chrono::steady_clock::now();
+    for (int j = i; j < i + BURST; j++) {
+      LOGE(logger, bench_logger::INFO, "Benchmark message %d %s", j, "foo");
+    }
+    total += std::chrono::steady_clock::now() - start;
+
+    logger->async_wait();
+  }
+
+  report(name, per_msg_ns(total, ITERATIONS));
+}
+
+/* Format string parsed at compile time */
+static
+void bench_fmt(const char *name, bench_logger *logger) {
+  std::chrono::steady_clock::duration total{};
+
+  for (int i = 0; i < ITERATIONS; i += BURST) {
+    auto start = std::chrono::steady_clock::now();
+    for (int j = i; j < i + BURST; j++) {
+      LOGE_FMT(logger, bench_logger::INFO, "Benchmark message %d %s", j,
+          "foo");
+    }
+    total += std::chrono::steady_clock::now() - start;
+
+    logger->async_wait();
+  }
+
+  report(name, per_msg_ns(total, ITERATIONS));
+}
+
+/* Caller side cost of capturing arguments for the backend to format */
+static
+void bench_defer(const char *name, bench_logger *logger) {
+  std::chrono::steady_clock::duration total{};
+
+  for (int i = 0; i < ITERATIONS; i += BURST) {
+    auto start = std::chrono::steady_clock::now();
+    for (int j = i; j < i + BURST; j++) {
+      LOGE_DEFER(logger, bench_logger::INFO, "Benchmark message %d %s", j,
+          "foo");
+    }
+    total += std::chrono::steady_clock::now() - start;
+
+    logger->async_wait();
+  }
+
+  report(name, per_msg_ns(total, ITERATIONS));
+}
+
+/*
+ * LOGE_DEFER() with a std::string and a std::string_view that is not null
+ * terminated, formatted on the calling thread, on the backend thread and
+ * into the flight recorder of an asynchronous logger.
+ */
+static
+bool check_defer_strings() {
+  enum { MESSAGES = 100 };
+
+  const char *names[] = { "sync", "async", "recorder" };
+  const std::string str = "string";
+  const char text[] = "viewed text";
+  const std::string_view view(text, 6);
+  bool ok = true;
+
+  for (int mode = 0; mode < 3; mode++) {
+    bench_logger logger(mode == 2 ? bench_logger::ERROR : bench_logger::ALL);
+    logger.set_file("./ccbench.log", false);
+    if (mode > 0) {
+      logger.enable_async(1024);
+    }
+    if (mode == 2) {
+      logger.enable_recorder(MESSAGES);
+    }
+
+    for (int i = 0; i < MESSAGES; i++) {
+      LOGE_DEFER(&logger, bench_logger::INFO, "defer %d %s %s <eol>", i,
+          str, view);
+    }
+
+    if (mode == 2) {
+      logger.dump_recorder();
+    }
+    logger.async_wait();
+    logger.unset_file();
+
+    std::ifstream ifs("./ccbench.log");
+    std::string line;
+    int count = 0;
+    int bad = 0;
+
+    while (std::getline(ifs, line)) {
+      std::string expected = "defer " + std::to_string(count) +
+        " string viewed <eol>";
+      if (line.size() < expected.size() ||
+          line.compare(line.size() - expected.size(), expected.size(),
+            expected) != 0) {
+        bad++;
+      }
+      count++;
+    }
+
+    printf("%-32s %s %d lines, %d bad\n", "LOGE_DEFER() strings",
+        names[mode], count, bad);
+
+    ok = ok && count == MESSAGES && bad == 0;
+  }
+
+  return ok;
+}
+
+/*
+ * Cost of one insertion into the message buffer, against snprintf with the
+ * conversion the insertion operator used to go through.
+ */
+template <typename T>
+static
+void bench_insert(const char *name, const char *conv, T value) {
+  bench_logger logger(bench_logger::ALL);
+  char buf[64];
+  char label[48];
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < ITERATIONS; i++) {
+    logger << value;
+    logger.reset();
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  snprintf(label, sizeof(label), "operator<<(%s)", name);
+  report(label, elapsed_ns(start, end, ITERATIONS));
+
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < ITERATIONS; i++) {
+    snprintf(buf, sizeof(buf), conv, value);
+    asm volatile("" : : "r"(buf) : "memory");
+  }
+  end = std::chrono::steady_clock::now();
+
+  snprintf(label, sizeof(label), "snprintf(%s)", conv);
+  report(label, elapsed_ns(start, end, ITERATIONS));
+}
+
+/*
+ * Cost of a flush policy for a synchronous logger writing to a file, and
+ * its loss window: the most messages and bytes that were written but not
+ * yet flushed at any point.
+ */
+static
+void bench_flush(const char *name, const loge_flush_policy &policy, int n) {
+  bench_logger logger(bench_logger::ALL);
+  logger.set_file("./ccbench.log", false);
+  logger.set_flush_policy(policy);
+
+  std::size_t max_messages = 0;
+  std::size_t max_bytes = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < n; i++) {
+    LOGE(&logger, i % 200 ? bench_logger::INFO : bench_logger::ERROR,
+        "Benchmark message %d %s", i, "foo");
+
+    const loge_flush_state &state = logger.get_flush_state();
+    if (state.messages > max_messages) {
+      max_messages = state.messages;
+      max_bytes = state.bytes;
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  logger.unset_file();
+
+  printf("%-32s %10.1f ns/msg  pending <= %zu msgs, %zu bytes\n", name,
+      elapsed_ns(start, end, n), max_messages, max_bytes);
+}
+
+/*
+ * Messages per second to a file, until everything has been written, and
+ * the slowest single call. Shows what batching many records per write
+ * saves over a write per record, and what io_uring or a memory mapped
+ * file take off the logging thread.
+ */
+enum bench_sink { SINK_FD, SINK_URING, SINK_MMAP };
+
+/*
+ * Lines of "Benchmark message %d foo" have to follow each other, next is
+ * the number expected first, -1 for any, and is moved past the last one
+ * read. Returns the number of lines out of sequence.
+ */
+static
+int check_sequence(std::istream &is, int &next, int &count) {
+  std::string line;
+  int bad = 0;
+
+  while (std::getline(is, line)) {
+    count++;
+
+    std::size_t at = line.find("Benchmark message ");
+    if (at == std::string::npos) {
+      bad++;
+      continue;
+    }
+
+    char *end;
+    long n = strtol(line.c_str() + at + 18, &end, 10);
+    if ((next >= 0 && n != next) || strcmp(end, " foo") != 0) {
+      bad++;
+    }
+    next = static_cast<int>(n) + 1;
+  }
+
+  return bad;
+}
+
+static
+bool bench_throughput(const char *name, const loge_flush_policy &policy,
+    bool async, bench_sink sink = SINK_FD) {
+
+  bench_logger logger(bench_logger::ALL);
+  if (sink == SINK_URING) {
+    logger.set_file_uring("./ccbench.log", false);
+  } else if (sink == SINK_MMAP) {
+    logger.set_file_mmap("./ccbench.log", false);
+  } else {
+    logger.set_file("./ccbench.log", false);
+  }
+  logger.set_flush_policy(policy);
+  if (async) {
+    logger.enable_async(8192);
+  }
+
+  std::chrono::steady_clock::duration slowest{};
+
+  auto start = std::chrono::steady_clock::now();
+  auto last = start;
+  for (int i = 0; i < ITERATIONS; i++) {
+    LOGE(&logger, bench_logger::INFO, "Benchmark message %d %s", i, "foo");
+
+    auto now = std::chrono::steady_clock::now();
+    if (now - last > slowest) {
+      slowest = now - last;
+    }
+    last = now;
+  }
+  logger.flush_output();
+  auto end = std::chrono::steady_clock::now();
+
+  logger.disable_async();
+  logger.unset_file();
+
+  printf("%-32s %10.0f msgs/s  slowest %8.1f us\n", name,
+      1e9 / elapsed_ns(start, end, ITERATIONS), per_msg_ns(slowest, 1000));
+
+  /*
+   * A memory mapped file is preallocated and cut back to its data on close,
+   * what was left of an extent would read as zeros after the last line
+   */
+  if (sink == SINK_MMAP) {
+    std::ifstream data("./ccbench.log", std::ios::binary);
+    std::string text((std::istreambuf_iterator<char>(data)),
+        std::istreambuf_iterator<char>());
+
+    if (text.empty() || text.back() != '\n' ||
+        text.find('\0') != std::string::npos) {
+      printf("%-32s %zu bytes, not truncated to its data\n",
+          "./ccbench.log", text.size());
+      return false;
+    }
+  }
+
+  std::ifstream ifs("./ccbench.log");
+  int next = 0;
+  int count = 0;
+  int bad = check_sequence(ifs, next, count);
+
+  if (bad || count != ITERATIONS) {
+    printf("%-32s %d lines, %d out of sequence, %d missing\n",
+        "./ccbench.log", count, bad, ITERATIONS - count);
+    return false;
+  }
+
+  return true;
+}
+
+/* Files rotated from ./ccbench.log, oldest first */
+static
+std::vector<std::string> rotated_files() {
+  const std::string prefix = "ccbench.log.";
+  std::vector<std::pair<std::pair<std::string, unsigned long>, std::string>>
+    files;
+
+  for (const auto &entry : std::filesystem::directory_iterator(".")) {
+    std::string name = entry.path().filename().string();
+    if (name.compare(0, prefix.size(), prefix) != 0 ||
+        name.size() < prefix.size() + 15) {
+      continue;
+    }
+
+    /* ccbench.log.YYYYmmdd-HHMMSS[.seq][.gz] */
+    std::string stamp = name.substr(prefix.size(), 15);
+    const char *rest = name.c_str() + prefix.size() + 15;
+    unsigned long seq = *rest == '.' ? strtoul(rest + 1, nullptr, 10) : 0;
+
+    files.push_back({ { stamp, seq }, "./" + name });
+  }
+
+  std::sort(files.begin(), files.end());
+
+  std::vector<std::string> paths;
+  for (const auto &file : files) {
+    paths.push_back(file.second);
+  }
+  return paths;
+}
+
+static
+void remove_rotated() {
+  for (const std::string &path : rotated_files()) {
+    unlink(path.c_str());
+  }
+  unlink("./ccbench.log");
+}
+
+/*
+ * Rotated files, then the current one, have to hold the last messages
+ * logged in order, each of them once. Retention may have removed the
+ * oldest files.
+ */
+static
+bool check_rotated(int expected) {
+  std::vector<std::string> paths = rotated_files();
+  int next = -1;
+  int count = 0;
+  int bad = 0;
+
+  for (const std::string &path : paths) {
+    const char *gz = ".gz";
+    if (path.size() > 3 && path.compare(path.size() - 3, 3, gz) == 0) {
+      std::string cmd = "gzip -dc " + path;
+      FILE *pipe = popen(cmd.c_str(), "r");
+      if (!pipe) {
+        return false;
+      }
+
+      std::string text;
+      char buf[65536];
+      std::size_t n;
+      while ((n = fread(buf, 1, sizeof(buf), pipe)) > 0) {
+        text.append(buf, n);
+      }
+      if (pclose(pipe) != 0) {
+        bad++;
+      }
+
+      std::istringstream iss(text);
+      bad += check_sequence(iss, next, count);
+
+    } else {
+      std::ifstream ifs(path);
+      bad += check_sequence(ifs, next, count);
+    }
+  }
+
+  std::ifstream ifs("./ccbench.log");
+  bad += check_sequence(ifs, next, count);
+
+  printf("%-32s %zu rotated, %d lines, %d out of sequence, last %d\n",
+      "./ccbench.log", paths.size(), count, bad, next - 1);
+
+  return bad == 0 && next == expected && count > 0;
+}
+
+/*
+ * Messages per second to a file rotated every few MiB, and the slowest
+ * single call. Renaming and reopening happens on the logging path,
+ * compression and removal of old files should not show up there.
+ */
+static
+bool bench_rotate(const char *name, const loge_rotate_policy &rotation,
+    bool async) {
+
+  remove_rotated();
+
+  bench_logger logger(bench_logger::ALL);
+  logger.set_file_rotate("./ccbench.log", rotation);
+
+  loge_flush_policy batch = { 64 * 1024, 0, 100, 0, 0 };
+  logger.set_flush_policy(batch);
+  if (async) {
+    logger.enable_async(8192);
+  }
+
+  std::chrono::steady_clock::duration slowest{};
+
+  auto start = std::chrono::steady_clock::now();
+  auto last = start;
+  for (int i = 0; i < ITERATIONS * 5; i++) {
+    LOGE(&logger, bench_logger::INFO, "Benchmark message %d %s", i, "foo");
+
+    auto now = std::chrono::steady_clock::now();
+    if (now - last > slowest) {
+      slowest = now - last;
+    }
+    last = now;
+  }
+  logger.flush_output();
+  auto end = std::chrono::steady_clock::now();
+
+  logger.disable_async();
+  logger.unset_file();
+
+  printf("%-32s %10.0f msgs/s  slowest %8.1f us\n", name,
+      1e9 / elapsed_ns(start, end, ITERATIONS * 5), per_msg_ns(slowest, 1000));
+
+  return check_rotated(ITERATIONS * 5);
+}
+
+/*
+ * A failing dependency logging the same error in a tight loop, written out
+ * every time or rate limited at the call site. After a pause the next
+ * message has to be preceded by the count of the suppressed ones. A last
+ * run of errors that stops is counted by a flush once the window is over.
+ */
+static
+bool bench_ratelimit() {
+  enum { BURST_LIMIT = 10, INTERVAL_MS = 1000, LAST_RUN = 1000 };
+
+  {
+    bench_logger logger(bench_logger::ALL);
+    logger.set_file("./ccbench.log", false);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < ITERATIONS; i++) {
+      LOGE(&logger, bench_logger::ERROR, "connect failed: %s", "refused");
+    }
+    report("error loop LOGE()", elapsed_ns(start,
+          std::chrono::steady_clock::now(), ITERATIONS));
+
+    logger.unset_file();
+  }
+
+  bench_logger logger(bench_logger::ALL);
+  logger.set_file("./ccbench.log", false);
+
+  /* One call site for all the runs */
+  auto fail = [&] {
+    LOGE_RATELIMIT(&logger, bench_logger::ERROR, BURST_LIMIT, INTERVAL_MS,
+        "connect failed: %s", "refused");
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i <= ITERATIONS; i++) {
+    fail();
+
+    /* Long enough for one token */
+    if (i == ITERATIONS - 1) {
+      report("error loop LOGE_RATELIMIT()", elapsed_ns(start,
+            std::chrono::steady_clock::now(), ITERATIONS));
+      std::this_thread::sleep_for(
+          std::chrono::milliseconds(INTERVAL_MS / BURST_LIMIT + 10));
+    }
+  }
+
+  for (int i = 0; i < LAST_RUN; i++) {
+    fail();
+  }
+  std::this_thread::sleep_for(
+      std::chrono::milliseconds(INTERVAL_MS / BURST_LIMIT + 10));
+  logger.flush_expired();
+
+  logger.unset_file();
+
+  std::ifstream ifs("./ccbench.log");
+  std::string line;
+  int count = 0;
+  unsigned long long suppressed = 0;
+
+  while (std::getline(ifs, line)) {
+    count++;
+    std::size_t at = line.find("suppressed ");
+    if (at != std::string::npos) {
+      suppressed += strtoull(line.c_str() + at + 11, nullptr, 10);
+    }
+  }
+
+  printf("%-32s %d lines, %llu suppressed\n", "./ccbench.log", count,
+      suppressed);
+
+  /*
+   * The burst, one summary and the message after the pause, then the
+   * summary of the last run
+   */
+  bool ok = count == BURST_LIMIT + 3 &&
+    suppressed == static_cast<unsigned long long>(ITERATIONS) - BURST_LIMIT +
+    LAST_RUN;
+
+  /* A site outlives the logger it was listed for, the next one takes over */
+  auto limited = [](bench_logger *l) {
+    LOGE_RATELIMIT(l, bench_logger::ERROR, 1, INTERVAL_MS, "taken over");
+  };
+
+  auto first = std::make_unique<bench_logger>(bench_logger::ALL);
+  auto second = std::make_unique<bench_logger>(bench_logger::ALL);
+  first->set_file("./ccbench.log", false);
+  limited(first.get());
+  limited(first.get());
+  first.reset();
+
+  second->set_file("./ccbench.log", false);
+  limited(second.get());
+  limited(second.get());
+  std::this_thread::sleep_for(std::chrono::milliseconds(INTERVAL_MS + 10));
+  second->flush_expired();
+  second.reset();
+
+  std::ifstream taken("./ccbench.log");
+  std::string summary;
+  std::getline(taken, summary);
+  bool taken_over = summary.find("suppressed 2 ") != std::string::npos;
+
+  printf("%-32s %s\n", "rate limited site taken over",
+      taken_over ? "reported" : "lost");
+
+  return ok && taken_over;
+}
+
+/*
+ * Debug messages kept 1 in 1000 at random, then 1 in 10 requests by key.
+ * Every request that is kept has to have all of its lines.
+ */
+static
+bool bench_sampling() {
+  enum { RATE = 1000, REQUESTS = 2000, LINES = 20, KEY_RATE = 10 };
+
+  bench_logger logger(bench_logger::ALL);
+  logger.set_file("./ccbench.log", false);
+  logger.set_sample_rate(bench_logger::DEBUG, RATE);
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < ITERATIONS; i++) {
+    LOGE(&logger, bench_logger::DEBUG, "Benchmark message %d %s", i, "foo");
+  }
+  report("sampled 1 in 1000 log()", elapsed_ns(start,
+        std::chrono::steady_clock::now(), ITERATIONS));
+
+  /* enabled() only checks the level, log() samples direct calls too */
+  int enabled = 0;
+  for (int i = 0; i < RATE; i++) {
+    enabled += logger.enabled(bench_logger::DEBUG);
+    logger.log(bench_logger::DEBUG, __LINE__, __FILE__, "Direct %d", i);
+  }
+
+  logger.set_sample_rate(bench_logger::DEBUG, KEY_RATE);
+
+  for (int r = 0; r < REQUESTS; r++) {
+    loge_sample_key(r + 1);
+    for (int i = 0; i < LINES; i++) {
+      LOGE(&logger, bench_logger::DEBUG, "request %d line %d", r, i);
+    }
+  }
+  loge_sample_key(0);
+
+  logger.unset_file();
+
+  /* A key set in one file holds for decisions made in another */
+  int differ = 0;
+  for (int r = 1; r <= REQUESTS; r++) {
+    loge_sample_key(r);
+    bool here = loge_sample(KEY_RATE);
+    differ += sampled_elsewhere(KEY_RATE) != here;
+
+    loge_sample_key(0);
+    sample_key_elsewhere(r);
+    differ += loge_sample(KEY_RATE) != here;
+    sample_key_elsewhere(0);
+  }
+
+  std::ifstream ifs("./ccbench.log");
+  std::string line;
+  std::vector<int> lines(REQUESTS);
+  int random = 0;
+
+  while (std::getline(ifs, line)) {
+    std::size_t at = line.find("request ");
+    if (at == std::string::npos) {
+      random++;
+    } else {
+      lines[atoi(line.c_str() + at + 8)]++;
+    }
+  }
+
+  int requests = 0;
+  int partial = 0;
+  for (int n : lines) {
+    requests += n > 0;
+    partial += n > 0 && n != LINES;
+  }
+
+  printf("%-32s %d random, %d requests, %d partial, %d differ\n",
+      "./ccbench.log", random, requests, partial, differ);
+
+  /* Loose bounds, the expected counts are 201 and 200 */
+  return random > 100 && random < 300 && requests > 100 && requests < 300 &&
+    partial == 0 && enabled == RATE && differ == 0;
+}
+
+/* Wait up to two seconds for the watcher thread to apply a change */
+template <typename F>
+static
+bool wait_for(F &&done) {
+  for (int i = 0; i < 200 && !done(); i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return done();
+}
+
+static
+void write_levels(const char *path, const char *text) {
+  std::ofstream ofs(path, std::ios::trunc);
+  ofs << text;
+}
+
+/*
+ * Levels of named loggers set by category rules, then by a file that is
+ * watched and reloaded on a signal. Messages below the level still cost
+ * one relaxed load.
+ */
+static
+bool bench_registry() {
+  bench_logger net(bench_logger::INFO);
+  bench_logger http(bench_logger::INFO);
+  bench_logger db(bench_logger::INFO);
+  bench_logger other(bench_logger::INFO);
+
+  bool ok = net.register_as("net") && http.register_as("net.http") &&
+    db.register_as("db") && !other.register_as("net");
+  ok = ok && bench_logger::find("net.http") == &http &&
+    !bench_logger::find("net.h");
+
+  /* "net" covers "net.http", not "db" */
+  bench_logger::set_category_level("net", bench_logger::ERROR);
+  ok = ok && !http.enabled(bench_logger::WARNING) &&
+    net.enabled(bench_logger::ERROR) && db.enabled(bench_logger::WARNING);
+
+  /* Without a rule a logger has its own level again */
+  bench_logger::set_category_level("net", -1);
+  ok = ok && http.current_level() == bench_logger::INFO;
+
+  /* A level set under a rule is the one the logger goes back to */
+  bench_logger::set_category_level("net", bench_logger::ERROR);
+  http.set_level(bench_logger::WARNING);
+  ok = ok && http.current_level() == bench_logger::WARNING;
+  bench_logger::set_category_level("net", -1);
+  ok = ok && http.current_level() == bench_logger::WARNING;
+  http.set_level(bench_logger::INFO);
+
+  /* Rules use the C levels where DEBUG comes before INFO */
+  write_levels("./ccbench.levels", "net = INFO\n");
+  ok = ok && loge_load_levels("./ccbench.levels") == 1 &&
+    http.current_level() == bench_logger::INFO;
+  write_levels("./ccbench.levels", "net = debug\n");
+  ok = ok && loge_load_levels("./ccbench.levels") == 1 &&
+    http.current_level() == bench_logger::DEBUG;
+  bench_logger::set_category_level("net", bench_logger::INFO);
+  ok = ok && http.current_level() == bench_logger::INFO;
+  bench_logger::set_category_level("net", -1);
+  ok = ok && http.current_level() == bench_logger::INFO;
+
+  write_levels("./ccbench.levels", "* = error\nnet.http = WARNING # noisy\n");
+  if (loge_watch_levels("./ccbench.levels", SIGUSR1) < 0) {
+    perror("loge_watch_levels");
+    return false;
+  }
+  ok = ok && !db.enabled(bench_logger::WARNING) &&
+    !net.enabled(bench_logger::WARNING) && http.enabled(bench_logger::WARNING);
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < ITERATIONS; i++) {
+    LOGE(&net, bench_logger::INFO, "Benchmark message %d %s", i, "foo");
+  }
+  report("below a category level", elapsed_ns(start,
+        std::chrono::steady_clock::now(), ITERATIONS));
+
+  /* Replaced through a rename like editors do */
+  write_levels("./ccbench.levels.tmp", "net = critical\n");
+  rename("./ccbench.levels.tmp", "./ccbench.levels");
+  bool renamed = wait_for([&] {
+    return !http.enabled(bench_logger::ERROR) &&
+      db.enabled(bench_logger::WARNING);
+  });
+
+  /* Rules set in between last until the next reload */
+  bench_logger::set_category_level("net", bench_logger::WARNING);
+  raise(SIGUSR1);
+  bool signalled = wait_for([&] {
+    return !http.enabled(bench_logger::ERROR);
+  });
+
+  loge_unwatch_levels();
+
+  write_levels("./ccbench.levels", "");
+  ok = ok && loge_load_levels("./ccbench.levels") == 0 &&
+    http.enabled(bench_logger::WARNING);
+
+  printf("%-32s rename %s, signal %s\n", "./ccbench.levels",
+      renamed ? "reloaded" : "missed", signalled ? "reloaded" : "missed");
+
+  return ok && renamed && signalled;
+}
+
+/*
+ * The same records going to three files, formatted by three loggers or
+ * once by a logger that fans them out.
+ */
+static
+void bench_fanout() {
+  loge_flush_policy batch = { 64 * 1024, 0, 0, 0, 0 };
+  std::chrono::steady_clock::duration separate{};
+  std::chrono::steady_clock::duration fanout{};
+
+  {
+    bench_logger warnings(bench_logger::WARNING);
+    bench_logger infos(bench_logger::INFO);
+    bench_logger all(bench_logger::ALL);
+    warnings.set_file("./ccbench.log", false);
+    infos.set_file("./ccbench.log.1", false);
+    all.set_file("./ccbench.log.2", false);
+    warnings.set_flush_policy(batch);
+    infos.set_flush_policy(batch);
+    all.set_flush_policy(batch);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < ITERATIONS; i++) {
+      LOGE(&warnings, bench_logger::INFO, "Benchmark message %d %s", i, "foo");
+      LOGE(&infos, bench_logger::INFO, "Benchmark message %d %s", i, "foo");
+      LOGE(&all, bench_logger::INFO, "Benchmark message %d %s", i, "foo");
+    }
+    separate = std::chrono::steady_clock::now() - start;
+  }
+
+  {
+    bench_logger warnings(bench_logger::ALL);
+    bench_logger infos(bench_logger::ALL);
+    bench_logger logger(bench_logger::ALL);
+    warnings.set_file("./ccbench.log", false);
+    infos.set_file("./ccbench.log.1", false);
+    logger.set_file("./ccbench.log.2", false);
+    warnings.set_flush_policy(batch);
+    infos.set_flush_policy(batch);
+    logger.set_flush_policy(batch);
+    logger.add_sink(warnings, bench_logger::WARNING);
+    logger.add_sink(infos, bench_logger::INFO);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < ITERATIONS; i++) {
+      LOGE(&logger, bench_logger::INFO, "Benchmark message %d %s", i, "foo");
+    }
+    fanout = std::chrono::steady_clock::now() - start;
+
+    logger.clear_sinks();
+  }
+
+  unlink("./ccbench.log.1");
+  unlink("./ccbench.log.2");
+
+  report("three loggers", per_msg_ns(separate, ITERATIONS));
+  report("fan-out to two sinks", per_msg_ns(fanout, ITERATIONS));
+}
+
+/*
+ * Custom sinks that only count bytes, through either callback. datafn() is
+ * called without being turned on. They chain to the base version, which has
+ * to leave them enabled.
+ */
+class datafn_sink : public bench_logger {
+  public:
+
+  std::size_t bytes = 0;
+  int calls = 0;
+
+  datafn_sink() : bench_logger(bench_logger::ALL) {
+  }
+
+  bool datafn(std::ostream *p_os, std::time_t &time,
+      const std::string &filename, unsigned int linenum,
+      enum loge_level loglevel, const std::string &msg) override {
+
+    bytes += filename.size() + msg.size();
+    calls++;
+    return !bench_logger::datafn(p_os, time, filename, linenum, loglevel,
+        msg);
+  }
+};
+
+class recordfn_sink : public bench_logger {
+  public:
+
+  std::size_t bytes = 0;
+  int calls = 0;
+
+  recordfn_sink() : bench_logger(bench_logger::ALL) {
+    use_datafn(false);
+    use_recordfn();
+  }
+
+  bool recordfn(const record &rec) override {
+    bytes += rec.filename.size() + rec.line.size();
+    calls++;
+    return !bench_logger::recordfn(rec);
+  }
+};
+
+/*
+ * Several threads log to one shared logger. Every line has to come out
+ * whole, a torn or interleaved line fails the check.
+ */
+static
+void stress_concurrent(const char *name, bench_logger *logger) {
+
+  std::vector<std::thread> threads;
+
+  auto start = std::chrono::steady_clock::now();
+  for (int t = 0; t < THREADS; t++) {
+    threads.emplace_back([logger, t]() {
+      for (int i = 0; i < ITERATIONS / THREADS; i++) {
+        LOGE(logger, bench_logger::INFO, "thread %d message %06d <eol>",
+            t, i);
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  report(name, elapsed_ns(start, end, ITERATIONS));
+}
+
+/*
+ * Log the same messages as text and as binary records. The decoded binary
+ * log has to match the text log line for line.
+ */
+template <typename Logger>
+static
+void log_samples(Logger *logger, int i) {
+  std::string str = "std::string";
+
+  LOGE(logger, Logger::INFO, "plain %d %u %ld %lld %x %o %c %%", -i,
+      static_cast<unsigned int>(i), -123456789L, 1LL << 40, i, i, 'a' + i % 26);
+  LOGE_COLOR(logger, Logger::ERROR, "%-8s|%8s|%.3s|%*d|%-*.*f|", "left",
+      "right", "truncated", 6, i, 10, 2, i / 3.0);
+  LOGE(logger, Logger::WARNING, "%e %g %p %hd %hhu %zu", 1e-5 * i, 0.1 * i,
+      static_cast<void*>(nullptr), static_cast<short>(-i),
+      static_cast<unsigned char>(i), static_cast<std::size_t>(i));
+  LOGE_FMT(logger, Logger::CRITICAL, "fmt %d %s %08.3f %x", i, str,
+      i * 1.5, 1ULL << 36);
+  LOGE_DEFER(logger, Logger::INFO, "defer %d %s %s %5.1f", i, str, "lit",
+      i * 0.25);
+  LOGE(logger, Logger::INFO, "No conversions at all");
+
+  logger->reset();
+  *logger << "insertion " << i << " " << (i * 0.5) << Logger::endl;
+}
+
+static
+bool check_binary(const char *text_path, const char *bin_path) {
+  using check_logger = loge<false>;
+
+  {
+    check_logger text(check_logger::ALL);
+    check_logger bin(check_logger::ALL);
+    text.set_file(text_path, false);
+    bin.set_binary(bin_path, false);
+
+    for (int i = 0; i < 100; i++) {
+      log_samples(&text, i);
+      log_samples(&bin, i);
+    }
+
+    text.unset_file();
+    bin.unset_binary();
+  }
+
+  std::ifstream txt(text_path);
+  std::ifstream bin(bin_path, std::ios_base::in | std::ios_base::binary);
+  loge_binary::decoder dec(bin);
+
+  std::string line;
+  int count = 0;
+  int bad = 0;
+  const char *msg;
+  std::size_t len;
+
+  while (std::getline(txt, line)) {
+    count++;
+    msg = dec.next(len);
+    if (!msg || line != std::string(msg, len)) {
+      if (bad++ == 0) {
+        printf("text:   %s\nbinary: %.*s\n", line.c_str(),
+            msg ? static_cast<int>(len) : 0, msg ? msg : "");
+      }
+    }
+  }
+  if (dec.next(len) || dec.error()) {
+    bad++;
+  }
+
+  printf("%-32s %d lines, %d mismatched\n", bin_path, count, bad);
+
+  /* A record cut short at the end is an error, not the end of the log */
+  std::ifstream whole(bin_path, std::ios_base::in | std::ios_base::binary);
+  std::string data((std::istreambuf_iterator<char>(whole)),
+      std::istreambuf_iterator<char>());
+  data.resize(data.size() - 3);
+
+  std::istringstream cut(data);
+  loge_binary::decoder trunc(cut);
+  int decoded = 0;
+  while (trunc.next(len)) {
+    decoded++;
+  }
+  bool reported = trunc.error() && decoded == count - 1;
+
+  printf("%-32s %d lines, %s\n", "truncated binary log", decoded,
+      trunc.error() ? trunc.error() : "no error");
+
+  return bad == 0 && count > 0 && reported;
+}
+
+static
+bool check_lines(const char *path, int expected) {
+  std::ifstream ifs(path);
+  std::string line;
+  int count = 0;
+  int bad = 0;
+
+  while (std::getline(ifs, line)) {
+    count++;
+
+    /* Exactly one message per line, terminated by its own marker */
+    std::size_t first = line.find("thread ");
+    if (first == std::string::npos ||
+        line.find("thread ", first + 1) != std::string::npos ||
+        line.size() < 5 ||
+        line.compare(line.size() - 5, 5, "<eol>") != 0) {
+      bad++;
+    }
+  }
+
+  printf("%-32s %d lines, %d interleaved, %d missing\n", path, count, bad,
+      expected - count);
+
+  return bad == 0 && count == expected;
+}
+
+#if defined(__linux) || defined(__linux__)
+/* An ostream output opens its file once more only when a policy syncs */
+static
+bool check_sync_fd() {
+  loge_flush_policy every_sync = { 0, 0, 0, 0, 1 };
+  auto open_fds = [] {
+    return std::distance(std::filesystem::directory_iterator("/proc/self/fd"),
+        std::filesystem::directory_iterator());
+  };
+
+  bench_logger logger(bench_logger::ALL);
+  auto before = open_fds();
+
+  logger.set_file("./ccbench.log", false, true);
+  LOGE(&logger, bench_logger::INFO, "not synced");
+  logger.flush_output();
+  auto unsynced = open_fds() - before;
+
+  logger.set_flush_policy(every_sync);
+  LOGE(&logger, bench_logger::INFO, "synced");
+  auto synced = open_fds() - before;
+
+  logger.unset_file();
+  auto closed = open_fds() - before;
+
+  printf("%-32s %ld unsynced, %ld synced, %ld closed\n", "ostream sync fd",
+      static_cast<long>(unsynced), static_cast<long>(synced),
+      static_cast<long>(closed));
+
+  return unsynced == 1 && synced == 2 && closed == 0;
+}
+#endif
+
+/*
+ * Threads wrap a small flight recorder over and over while it is switched
+ * on and off. Every record dumped has to be whole.
+ */
+static
+bool check_recorder_switched() {
+  enum { ROUNDS = 500, RECORDS = 16 };
+
+  bench_logger logger(bench_logger::ERROR);
+  logger.set_file("./ccbench.log", false);
+
+  std::atomic<bool> stop(false);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < THREADS; t++) {
+    threads.emplace_back([&logger, &stop, t] {
+      for (int i = 0; !stop.load(std::memory_order_relaxed); i++) {
+        LOGE(&logger, bench_logger::INFO, "record %d %d record %d %d <eol>",
+            t, i, t, i);
+      }
+    });
+  }
+
+  for (int round = 0; round < ROUNDS; round++) {
+    logger.enable_recorder(RECORDS);
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+    logger.dump_recorder();
+    logger.disable_recorder();
+  }
+
+  stop.store(true, std::memory_order_relaxed);
+  for (auto &th : threads) {
+    th.join();
+  }
+  logger.unset_file();
+
+  std::ifstream ifs("./ccbench.log");
+  std::string line;
+  int count = 0;
+  int bad = 0;
+
+  while (std::getline(ifs, line)) {
+    count++;
+    std::size_t at = line.find("record ");
+    int t1, i1, t2, i2, end = 0;
+    if (at == std::string::npos ||
+        sscanf(line.c_str() + at, "record %d %d record %d %d <eol>%n",
+          &t1, &i1, &t2, &i2, &end) != 4 ||
+        t1 != t2 || i1 != i2 || line.c_str()[at + end] != '\0') {
+      bad++;
+    }
+  }
+
+  printf("%-32s %d records, %d torn\n", "flight recorder switched", count,
+      bad);
+
+  return count > 0 && bad == 0;
+}
+
+/* A site of constant level and literal format needs no guard */
+static constinit
+loge_site constant_site(__FILE__, __LINE__, bench_logger::INFO,
+    LOGE_SITE_FMT("constant site"));
+
+/* Sites are listed by for_each() once their call has been made */
+static
+bool check_sites() {
+  bench_logger logger(bench_logger::ALL);
+  logger.set_file("./ccbench.log", false);
+
+  auto listed = [](const char *fmt) {
+    int n = 0;
+    loge_site::for_each([&](const loge_site &site) {
+      if (site.fmt && strcmp(site.fmt, fmt) == 0) {
+        n++;
+      }
+    });
+    return n;
+  };
+
+  int before = listed("listed site %d");
+  for (int i = 0; i < 2; i++) {
+    LOGE(&logger, bench_logger::INFO, "listed site %d", i);
+  }
+  int after = listed("listed site %d");
+
+  logger.unset_file();
+
+  bool ok = before == 0 && after == 1 &&
+    constant_site.fmt && strcmp(constant_site.fmt, "constant site") == 0;
+  printf("%-32s %d listed before, %d after%s\n", "call sites", before, after,
+      ok ? "" : ", wrong");
+
+  return ok;
+}
+
+#if defined(__linux) || defined(__linux__)
+
+/*
+ * Records sent through the TCP sink to a stand-in server that comes up
+ * late and drops its first connection half way. Records logged while it
+ * is down are spooled and replayed first, every line has to be whole and
+ * in order. Records in flight when it drops the connection may be lost, a
+ * collector only keeps complete lines.
+ */
+static
+bool check_tcp() {
+  enum { RECORDS = 3000 };
+
+  int lsock = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if (lsock < 0 || bind(lsock, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      getsockname(lsock, (struct sockaddr*)&addr, &addrlen) < 0) {
+    perror("check_tcp");
+    return false;
+  }
+
+  std::string received;
+
+  std::thread server([&]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    listen(lsock, 1);
+
+    for (int conn = 0; conn < 2; conn++) {
+      int c = accept(lsock, nullptr, nullptr);
+      std::string data;
+      char buf[4096];
+      ssize_t n;
+
+      while ((n = recv(c, buf, sizeof(buf), 0)) > 0) {
+        data.append(buf, n);
+        if (conn == 0 && data.find("tcp message 001500") !=
+            std::string::npos) {
+          break;
+        }
+      }
+      close(c);
+
+      received.append(data, 0, data.rfind('\n') + 1);
+    }
+  });
+
+  /* While the server is down, then while it drops the first connection */
+  loge_tcp_policy policy = { 64 * 1024, 10, 200, "./ccbench.spool", 0 };
+  bench_logger logger(bench_logger::ALL);
+  logger.set_tcp("127.0.0.1", ntohs(addr.sin_port), policy);
+
+  for (int i = 0; i < RECORDS; i++) {
+    LOGE(&logger, bench_logger::INFO, "tcp message %06d <eol>", i);
+    if (i % 100 == 99) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+  }
+
+  unsigned long long dropped = logger.tcp_dropped();
+  logger.unset_file();
+  server.join();
+  close(lsock);
+
+  std::size_t pos = 0;
+  int count = 0;
+  int bad = 0;
+  int last = -1;
+
+  while (pos < received.size()) {
+    std::size_t end = received.find('\n', pos);
+    std::string line = received.substr(pos, end - pos);
+    pos = end + 1;
+    count++;
+
+    std::size_t at = line.find("tcp message ");
+    int n = at == std::string::npos ? -1 : atoi(line.c_str() + at + 12);
+    if (n <= last || line.size() < 5 ||
+        line.compare(line.size() - 5, 5, "<eol>") != 0) {
+      bad++;
+    }
+    last = n;
+  }
+
+  printf("%-32s %d lines, %d bad, %d lost, %llu dropped\n", "tcp sink",
+      count, bad, RECORDS - count, dropped);
+
+  return bad == 0 && last == RECORDS - 1 && !dropped;
+}
+
+/*
+ * Records sent to a local UDP receiver, one datagram per record through
+ * connect() or packed into datagrams sent in batches by the UDP sink.
+ * Every datagram has to hold whole records only.
+ */
+static
+bool bench_udp(const char *name, bool batched) {
+  enum { RECORDS = ITERATIONS / 4 };
+
+  int rsock = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  int rcvbuf = 4 << 20;
+  struct timeval timeout = { 0, 200 * 1000 };
+  setsockopt(rsock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  setsockopt(rsock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  if (rsock < 0 || bind(rsock, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      getsockname(rsock, (struct sockaddr*)&addr, &addrlen) < 0) {
+    perror("bench_udp");
+    return false;
+  }
+
+  long datagrams = 0;
+  long lines = 0;
+  long bad = 0;
+
+  std::thread receiver([&]() {
+    char buf[65536];
+    ssize_t n;
+
+    while ((n = recv(rsock, buf, sizeof(buf), 0)) > 0) {
+      datagrams++;
+      lines += std::count(buf, buf + n, '\n');
+      if (buf[n - 1] != '\n') {
+        bad++;
+      }
+    }
+  });
+
+  loge_flush_policy batch = { 16 * 1024, 0, 100, 0, 0 };
+  bench_logger logger(bench_logger::ALL);
+  unsigned long long dropped = 0;
+
+  auto start = std::chrono::steady_clock::now();
+
+  if (batched) {
+    logger.set_flush_policy(batch);
+    logger.set_udp("127.0.0.1", ntohs(addr.sin_port));
+  } else {
+    logger.connect("127.0.0.1", ntohs(addr.sin_port), 0);
+  }
+
+  for (int i = 0; i < RECORDS; i++) {
+    LOGE(&logger, bench_logger::INFO, "udp message %06d <eol>", i);
+  }
+
+  if (batched) {
+    dropped = logger.udp_dropped();
+    logger.unset_file();
+  } else {
+    logger.disconnect();
+  }
+
+  auto end = std::chrono::steady_clock::now();
+
+  receiver.join();
+  close(rsock);
+
+  printf("%-32s %10.0f msgs/s  %ld datagrams, %ld lines, %llu dropped\n",
+      name, 1e9 / elapsed_ns(start, end, RECORDS), datagrams, lines,
+      dropped);
+
+  return bad == 0;
+}
+
+/*
+ * Records sent to a collector on the same host, over TCP through loopback
+ * or packed into the messages of a Unix domain socket. Every message of
+ * the Unix socket has to hold whole records only.
+ */
+static
+bool bench_local(const char *name, int type) {
+  enum { RECORDS = ITERATIONS / 4 };
+  const char *path = "./ccbench.sock";
+
+  int lsock;
+  unsigned short port = 0;
+
+  if (type == SOCK_STREAM) {
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    lsock = socket(AF_INET, SOCK_STREAM, 0);
+    if (lsock < 0 || bind(lsock, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        getsockname(lsock, (struct sockaddr*)&addr, &addrlen) < 0) {
+      perror("bench_local");
+      return false;
+    }
+    port = ntohs(addr.sin_port);
+
+  } else {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    unlink(path);
+    lsock = socket(AF_UNIX, type, 0);
+    if (lsock < 0 || bind(lsock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+      perror("bench_local");
+      return false;
+    }
+  }
+
+  struct timeval timeout = { 0, 200 * 1000 };
+  if (type == SOCK_DGRAM) {
+    setsockopt(lsock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  } else {
+    listen(lsock, 1);
+  }
+
+  long messages = 0;
+  long lines = 0;
+  long bad = 0;
+
+  std::thread receiver([&]() {
+    int c = type == SOCK_DGRAM ? lsock : accept(lsock, nullptr, nullptr);
+    char buf[65536];
+    ssize_t n;
+
+    while ((n = recv(c, buf, sizeof(buf), 0)) > 0) {
+      messages++;
+      lines += std::count(buf, buf + n, '\n');
+      if (type != SOCK_STREAM && buf[n - 1] != '\n') {
+        bad++;
+      }
+    }
+
+    if (c != lsock) {
+      close(c);
+    }
+  });
+
+  loge_flush_policy batch = { 16 * 1024, 0, 100, 0, 0 };
+  bench_logger logger(bench_logger::ALL);
+  logger.set_flush_policy(batch);
+
+  if (type == SOCK_STREAM) {
+    logger.connect("127.0.0.1", port, 1);
+  } else {
+    logger.set_unix(path, type);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+
+  for (int i = 0; i < RECORDS; i++) {
+    LOGE(&logger, bench_logger::INFO, "local message %06d <eol>", i);
+  }
+  logger.flush_output();
+
+  auto end = std::chrono::steady_clock::now();
+
+  unsigned long long dropped = logger.udp_dropped();
+  if (type == SOCK_STREAM) {
+    logger.disconnect();
+  } else {
+    logger.unset_file();
+  }
+
+  receiver.join();
+  close(lsock);
+  unlink(path);
+
+  printf("%-32s %10.0f msgs/s  %ld messages, %ld lines, %llu dropped\n",
+      name, 1e9 / elapsed_ns(start, end, RECORDS), messages, lines, dropped);
+
+  return bad == 0 && lines == RECORDS;
+}
+
+/*
+ * A collector that is not up yet when the Unix socket sink is set up is
+ * connected to later, nothing is reported meanwhile.
+ */
+static
+bool check_unix_later() {
+  const char *path = "./ccbench-later.sock";
+  unlink(path);
+
+  bench_logger logger(bench_logger::ALL);
+
+  fflush(stderr);
+  int saved = dup(STDERR_FILENO);
+  FILE *err = tmpfile();
+  if (saved < 0 || !err) {
+    perror("check_unix_later");
+    return false;
+  }
+  dup2(fileno(err), STDERR_FILENO);
+
+  logger.set_unix(path, SOCK_DGRAM);
+  LOGE(&logger, bench_logger::INFO, "before the collector <eol>");
+  logger.flush_output();
+
+  fflush(stderr);
+  dup2(saved, STDERR_FILENO);
+  close(saved);
+  long reported = fseek(err, 0, SEEK_END) == 0 ? ftell(err) : -1;
+  fclose(err);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  int lsock = socket(AF_UNIX, SOCK_DGRAM, 0);
+  if (lsock < 0 || bind(lsock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    perror("check_unix_later");
+    return false;
+  }
+  struct timeval timeout = { 0, 200 * 1000 };
+  setsockopt(lsock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  /* Past the first retry */
+  std::this_thread::sleep_for(std::chrono::milliseconds(250));
+  LOGE(&logger, bench_logger::INFO, "after the collector <eol>");
+  logger.flush_output();
+  logger.unset_file();
+
+  char buf[65536];
+  ssize_t n;
+  int received = 0;
+  while ((n = recv(lsock, buf, sizeof(buf) - 1, 0)) > 0) {
+    buf[n] = '\0';
+    received += strstr(buf, "after the collector <eol>") != nullptr;
+  }
+  close(lsock);
+  unlink(path);
+
+  printf("%-32s %ld bytes reported, %d received\n", "unix collector later",
+      reported, received);
+
+  return reported == 0 && received == 1;
+}
+
+/*
+ * Records sent to a local socket standing in for journald or a syslog
+ * daemon. Every datagram has to be one record with the level and the
+ * fields, and the message without the text prefix of loge.
+ */
+static
+bool bench_journal(const char *name, int format) {
+  enum { RECORDS = ITERATIONS / 4 };
+  const char *path = "./ccbench.sock";
+
+  unlink(path);
+  int rsock = socket(AF_UNIX, SOCK_DGRAM, 0);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  int rcvbuf = 8 << 20;
+  struct timeval timeout = { 0, 200 * 1000 };
+  setsockopt(rsock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  setsockopt(rsock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  if (rsock < 0 || bind(rsock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    perror("bench_journal");
+    return false;
+  }
+
+  const char *expect = format == LOGE_JOURNAL_RFC5424 ?
+    " [loge@32473 service=\"ccbench\" file=\"" :
+    "SYSLOG_IDENTIFIER=ccbench\nSYSLOG_FACILITY=1\n";
+  const char *level = format == LOGE_JOURNAL_RFC5424 ?
+    "<12>1 " : "PRIORITY=4\n";
+  const char *message = format == LOGE_JOURNAL_RFC5424 ?
+    "\"] journal message " : "MESSAGE=journal message ";
+
+  long datagrams = 0;
+  long bad = 0;
+
+  std::thread receiver([&]() {
+    char buf[65536];
+    ssize_t n;
+
+    while ((n = recv(rsock, buf, sizeof(buf) - 1, 0)) > 0) {
+      buf[n] = '\0';
+      datagrams++;
+      if (!strstr(buf, expect) || !strstr(buf, level) ||
+          !strstr(buf, message) || strstr(buf, "WARNING") ||
+          !strstr(buf, "<eol>")) {
+        bad++;
+      }
+    }
+  });
+
+  const char *fields[] = { "SERVICE=ccbench", nullptr };
+  const char *sdfields[] = { "service=ccbench", nullptr };
+  loge_journal_policy policy = { format, path, "ccbench", 0,
+    format == LOGE_JOURNAL_RFC5424 ? sdfields : fields, 0 };
+
+  bench_logger logger(bench_logger::ALL);
+  logger.set_journal(policy);
+
+  auto start = std::chrono::steady_clock::now();
+
+  for (int i = 0; i < RECORDS; i++) {
+    LOGE(&logger, bench_logger::WARNING, "journal message %06d <eol>", i);
+  }
+
+  auto end = std::chrono::steady_clock::now();
+
+  unsigned long long dropped = logger.journal_dropped();
+  logger.unset_file();
+
+  receiver.join();
+  close(rsock);
+  unlink(path);
+
+  printf("%-32s %10.0f msgs/s  %ld datagrams, %ld bad, %llu dropped\n",
+      name, 1e9 / elapsed_ns(start, end, RECORDS), datagrams, bad, dropped);
+
+  return bad == 0 && datagrams + (long)dropped == RECORDS && datagrams > 0;
+}
+
+#endif
+
+int main() {
+
+  bench_insert<short>("short", "%hd", -12345);
+  bench_insert<int>("int", "%d", 1234567);
+  bench_insert<long>("long", "%ld", -1234567890123L);
+  bench_insert<unsigned long>("unsigned long", "%lu", 18446744073709551615UL);
+  bench_insert<float>("float", "%#f", 3.14159f);
+  bench_insert<double>("double", "%#f", -2718281.828459);
+
+  {
+    bench_logger logger(bench_logger::ALL);
+    logger.set_file("./ccbench.log", false);
+
+    bench_log("sync log()", &logger);
+    bench_fmt("sync LOGE_FMT()", &logger);
+
+    logger.unset_file();
+  }
+
+  {
+    bench_logger logger(bench_logger::ALL);
+    logger.set_file("./ccbench.log", false, true);
+
+    bench_log("sync log() ostream", &logger);
+
+    logger.unset_file();
+  }
+
+  {
+    bench_logger logger(bench_logger::ALL);
+    logger.set_file("./ccbench.log", false);
+    logger.enable_async(8192);
+
+    bench_log("async log()", &logger);
+    bench_fmt("async LOGE_FMT()", &logger);
+
+    logger.disable_async();
+    logger.unset_file();
+  }
+
+  {
+    bench_logger logger(bench_logger::ALL);
+    logger.set_file("./ccbench.log", false);
+    logger.enable_async(8192);
+
+    bench_defer("async deferred LOGE_DEFER()", &logger);
+
+    logger.disable_async();
+    logger.unset_file();
+  }
+
+  {
+    /* bytes, messages, interval_ms, level, sync */
+    loge_flush_policy every = { 0, 0, 0, 0, 0 };
+    loge_flush_policy every_sync = { 0, 0, 0, 0, 1 };
+    loge_flush_policy bytes = { 64 * 1024, 0, 0, 0, 0 };
+    loge_flush_policy messages = { 0, 1000, 0, 0, 0 };
+    loge_flush_policy interval = { 0, 0, 100, 0, 0 };
+    loge_flush_policy errors = { 64 * 1024, 0, 0, bench_logger::ERROR, 0 };
+    loge_flush_policy group = { 64 * 1024, 0, 100, 0, 1 };
+
+    bench_flush("flush every message", every, ITERATIONS);
+    bench_flush("flush + sync every message", every_sync, ITERATIONS / 20);
+    bench_flush("flush every 64 KiB", bytes, ITERATIONS);
+    bench_flush("flush every 1000 messages", messages, ITERATIONS);
+    bench_flush("flush every 100 ms", interval, ITERATIONS);
+    bench_flush("flush 64 KiB or at ERROR", errors, ITERATIONS);
+    bench_flush("group sync 64 KiB or 100 ms", group, ITERATIONS);
+  }
+
+  bool ok = check_sites();
+#if defined(__linux) || defined(__linux__)
+  ok = check_sync_fd() && ok;
+#endif
+
+  {
+    loge_flush_policy every = { 0, 0, 0, 0, 0 };
+    loge_flush_policy batch = { 64 * 1024, 0, 100, 0, 0 };
+
+    ok = bench_throughput("write per record", every, false) && ok;
+    ok = bench_throughput("batched 64 KiB", batch, false) && ok;
+    ok = bench_throughput("async write per record", every, true) && ok;
+    ok = bench_throughput("async writev from ring 64 KiB", batch, true) &&
+      ok;
+  }
+
+  {
+    loge_flush_policy batch = { 64 * 1024, 0, 100, 0, 0 };
+    loge_flush_policy group = { 64 * 1024, 0, 100, 0, 1 };
+
+    bench_logger probe(bench_logger::ALL);
+    probe.set_file_uring("./ccbench.log", false);
+    if (!probe.is_uring()) {
+      printf("io_uring not available, plain descriptor sink instead\n");
+    }
+    probe.unset_file();
+
+    ok = bench_throughput("fd 64 KiB", batch, false) && ok;
+    ok = bench_throughput("io_uring 64 KiB", batch, false, SINK_URING) &&
+      ok;
+    ok = bench_throughput("fd group sync 64 KiB", group, false) && ok;
+    ok = bench_throughput("io_uring group sync 64 KiB", group, false,
+        SINK_URING) && ok;
+  }
+
+  {
+    loge_flush_policy every = { 0, 0, 0, 0, 0 };
+    loge_flush_policy group = { 64 * 1024, 0, 100, 0, 1 };
+
+    ok = bench_throughput("fd write per record", every, false) && ok;
+    ok = bench_throughput("mmap per record", every, false, SINK_MMAP) &&
+      ok;
+    ok = bench_throughput("mmap group sync 64 KiB", group, false,
+        SINK_MMAP) && ok;
+    ok = bench_throughput("mmap async", every, true, SINK_MMAP) && ok;
+  }
+
+  {
+    loge_rotate_policy none = { 0, 0, 4, 0, 0 };
+    loge_rotate_policy size = { 4 << 20, 0, 4, 0, 0 };
+    loge_rotate_policy gzip = { 4 << 20, 0, 4, 0, 1 };
+
+    ok = bench_rotate("no rotation", none, false) && ok;
+    ok = bench_rotate("rotate 4 MiB", size, false) && ok;
+    ok = bench_rotate("rotate 4 MiB + gzip, keep 4", gzip, false) && ok;
+    ok = bench_rotate("async rotate 4 MiB + gzip", gzip, true) && ok;
+  }
+
+  bench_fanout();
+
+  ok = bench_ratelimit() && ok;
+  ok = check_defer_strings() && ok;
+  ok = bench_sampling() && ok;
+  ok = bench_registry() && ok;
+
+  {
+    datafn_sink datasink;
+    recordfn_sink recordsink;
+
+    bench_log("custom sink datafn()", &datasink);
+    bench_log("custom sink recordfn()", &recordsink);
+
+    if (datasink.calls != ITERATIONS || recordsink.calls != ITERATIONS) {
+      printf("custom sinks called %d and %d times, expected %d\n",
+          datasink.calls, recordsink.calls, ITERATIONS);
+      ok = false;
+    }
+  }
+
+  {
+    bench_logger logger(bench_logger::ALL);
+    logger.set_binary("./ccbench.bin", false);
+
+    bench_log("binary log()", &logger);
+    bench_fmt("binary LOGE_FMT()", &logger);
+    bench_defer("binary LOGE_DEFER()", &logger);
+
+    logger.unset_binary();
+  }
+
+  {
+    bench_logger logger(bench_logger::ALL);
+    logger.set_binary("./ccbench.bin", false);
+    logger.enable_async(8192);
+
+    bench_log("async binary log()", &logger);
+
+    logger.disable_async();
+    logger.unset_binary();
+  }
+
+  ok = check_binary("./ccbench.log", "./ccbench.bin") && ok;
+
+  {
+    /* Messages below the logger level, dropped or kept in memory */
+    bench_logger logger(bench_logger::ERROR);
+    logger.set_file("./ccbench.log", false);
+
+    bench_log("filtered log()", &logger);
+
+    logger.enable_recorder(1024);
+    bench_log("flight recorder log()", &logger);
+
+    logger.enable_recorder(1024, bench_logger::ALL, bench_logger::ERROR,
+        "./ccbench.rec");
+    bench_log("flight recorder log() mmap", &logger);
+
+    /* Only the last 1024 records are left to dump */
+    std::size_t dumped = logger.dump_recorder();
+    printf("%-32s %zu records dumped\n", "./ccbench.rec", dumped);
+    ok = dumped == 1024 && ok;
+
+    logger.disable_recorder();
+    logger.unset_file();
+  }
+
+  ok = check_recorder_switched() && ok;
+
+  {
+    bench_logger logger(bench_logger::ALL);
+    logger.set_file("./ccbench.log", false);
+    logger.set_concurrent();
+
+    stress_concurrent("concurrent log()", &logger);
+
+    logger.unset_file();
+    ok = check_lines("./ccbench.log", ITERATIONS / THREADS * THREADS) && ok;
+  }
+
+  {
+    bench_logger logger(bench_logger::ALL);
+    logger.set_file("./ccbench.log", false);
+    logger.enable_async(8192);
+
+    stress_concurrent("concurrent async log()", &logger);
+
+    logger.disable_async();
+    logger.unset_file();
+    ok = check_lines("./ccbench.log", ITERATIONS / THREADS * THREADS) && ok;
+  }
+
+#if defined(__linux) || defined(__linux__)
+  ok = check_tcp() && ok;
+  ok = bench_udp("udp write per record", false) && ok;
+  ok = bench_udp("udp sendmmsg batched", true) && ok;
+  ok = bench_local("tcp loopback batched", SOCK_STREAM) && ok;
+  ok = bench_local("unix seqpacket batched", SOCK_SEQPACKET) && ok;
+  ok = bench_local("unix dgram batched", SOCK_DGRAM) && ok;
+  ok = check_unix_later() && ok;
+  ok = bench_journal("journald native", LOGE_JOURNAL_NATIVE) && ok;
+  ok = bench_journal("syslog rfc 5424", LOGE_JOURNAL_RFC5424) && ok;
+#endif
+
+  {
+    /* Records written in batches straight from the ring */
+    loge_flush_policy batch = { 64 * 1024, 0, 100, 0, 0 };
+
+    bench_logger logger(bench_logger::ALL);
+    logger.set_file("./ccbench.log", false);
+    logger.set_flush_policy(batch);
+    logger.enable_async(8192);
+
+    stress_concurrent("concurrent async batched log()", &logger);
+
+    logger.disable_async();
+    logger.unset_file();
+    ok = check_lines("./ccbench.log", ITERATIONS / THREADS * THREADS) && ok;
+  }
+
+  {
+    /* Policy switched back and forth while the backend writes batches */
+    loge_flush_policy batch = { 64 * 1024, 0, 100, 0, 0 };
+    loge_flush_policy every = { 0, 0, 0, 0, 0 };
+
+    bench_logger logger(bench_logger::ALL);
+    logger.set_file("./ccbench.log", false);
+    logger.set_flush_policy(batch);
+    logger.enable_async(8192);
+
+    std::atomic<bool> done(false);
+    std::thread switcher([&]() {
+      for (int i = 0; !done.load(); i++) {
+        logger.set_flush_policy(i % 2 ? batch : every);
+      }
+    });
+
+    stress_concurrent("async log() policy switched", &logger);
+
+    done.store(true);
+    switcher.join();
+
+    logger.disable_async();
+    logger.unset_file();
+    ok = check_lines("./ccbench.log", ITERATIONS / THREADS * THREADS) && ok;
+  }
+
+  return ok ? 0 : 1;
+}
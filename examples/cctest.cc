@@ -39,6 +39,41 @@ class custom_logger  : public custom_logger_base {
   }
 };
 
+class record_logger  : public custom_logger_base {
+
+  public:
+
+  /* Formatted record and its data, nothing allocated per message */
+  bool recordfn(const record &rec) override {
+
+    const char *loglvl_str = get_level_color(rec.level);
+
+    char buf[1024];
+
+    int done = snprintf(buf, sizeof(buf),
+#ifdef _MSC_VER
+        "%llu: %.*s:%04u: %-22s - %.*s\n",
+#else
+        "%lu: %.*s:%04u: %-22s - %.*s\n",
+#endif
+        rec.time,
+        static_cast<int>(rec.filename.size()), rec.filename.data(),
+        rec.linenumber,
+        loglvl_str,
+        static_cast<int>(rec.format.size()), rec.format.data());
+
+    p_os->write(buf, done);
+
+    return false;
+  }
+
+  record_logger(custom_logger_base::loge_level loglevel)
+    : loge(loglevel) {
+    use_datafn(false);
+    use_recordfn();
+  }
+};
+
 int main() {
 
   loge<true> logger(loge<>::ALL);
@@ -49,6 +84,10 @@ int main() {
   LOGE_COLOR(&logger, loge<>::ERROR, "Default stdout %d %s", 10, "pebkac");
   LOGE_COLOR(&logger, loge<>::CRITICAL, "Default stdout %d %s", 10, "grokking");
 
+  /* Format string checked against the arguments at compile time */
+  LOGE_FMT(&logger, loge<>::INFO, "Compile time format %d %s", 10, "foo");
+  LOGE_FMT(&logger, loge<>::INFO, "Constant message, nothing to format");
+
   logger.set_file("./cctest.log");
   LOGE(&logger, loge<>::INFO, "File %d %s", 10, "foo");
   LOGE(&logger, loge<>::DEBUG, "File %d %s", 10, "bar");
@@ -180,6 +219,14 @@ int main() {
   LOGE(&customlogger, custom_logger_base::CRITICAL,
       "Custom log function with unformatted log data %d %s", 10, "grokking");
 
+  /* Log using custom record function, nothing allocated per message */
+  record_logger recordlogger(custom_logger_base::ALL);
+  LOGE(&recordlogger, custom_logger_base::INFO,
+      "Custom record function with unformatted log data %d %s", 10, "foo");
+  LOGE(&recordlogger, custom_logger_base::CRITICAL,
+      "Custom record function with unformatted log data %d %s", 10,
+      "grokking");
+
 #if defined(__linux) || defined(__linux__)
 
   /* Reuse to log to syslog */
@@ -192,6 +239,20 @@ int main() {
 
 #endif
 
+  /* Hand writes over to a backend thread */
+  loge<true> asynclogger(loge<>::ALL);
+  asynclogger.enable_async();
+  LOGE(&asynclogger, loge<>::INFO, "Async logging %d %s", 10, "foo");
+  LOGE(&asynclogger, loge<>::DEBUG, "Async logging %d %s", 10, "bar");
+  LOGE(&asynclogger, loge<>::WARNING, "Async logging %d %s", 10, "baz");
+  LOGE(&asynclogger, loge<>::ERROR, "Async logging %d %s", 10, "pebkac");
+  LOGE(&asynclogger, loge<>::CRITICAL, "Async logging %d %s", 10, "grokking");
+  /* Formatting happens on the backend thread too */
+  LOGE_DEFER(&asynclogger, loge<>::INFO, "Deferred formatting %d %s", 10,
+      std::string("foo"));
+  /* Write out pending records and stop the backend thread */
+  asynclogger.disable_async();
+
   /* Demo for insertion operator */
   loge<true, 512> log(&std::cerr);
 
@@ -83,6 +83,92 @@ void log_stuff_nocolor() {
 
 extern void log_more_stuff();
 
+#if defined(__linux) || defined(__linux__)
+
+enum { STRESS_THREADS = 8, STRESS_MESSAGES = 20000 };
+
+struct loge stresslogger;
+
+static
+const char stress_pad[] =
+  "................................................................";
+
+static
+void* stress_thread(void *arg) {
+  int id = (int)(intptr_t)arg;
+
+  /* Lengths vary so that a line left over in a reused buffer shows */
+  for (int i = 0; i < STRESS_MESSAGES; i++) {
+    LOGE(&stresslogger, LOGE_INFO, "thread %d message %d %.*s<eol>", id, i,
+        i % 64, stress_pad);
+  }
+
+  return NULL;
+}
+
+/*
+ * Several threads log to one concurrent logger. Every message has to come
+ * out exactly once, on a line of its own.
+ * Returns non-zero on failure.
+ */
+static
+int stress_concurrent(const char *path) {
+  static char seen[STRESS_THREADS][STRESS_MESSAGES];
+  pthread_t threads[STRESS_THREADS];
+
+  remove(path);
+
+  loge_setup(&stresslogger, 256, -1, -1, -1, LOGE_TYPE(0, LOGE_ALL), NULL,
+      NULL);
+  loge_set_concurrent(&stresslogger, 1);
+  loge_set_file(&stresslogger, path);
+
+  for (int t = 0; t < STRESS_THREADS; t++) {
+    pthread_create(&threads[t], NULL, stress_thread, (void*)(intptr_t)t);
+  }
+  for (int t = 0; t < STRESS_THREADS; t++) {
+    pthread_join(threads[t], NULL);
+  }
+
+  loge_unset_file(&stresslogger);
+  loge_destroy(&stresslogger);
+
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    return 1;
+  }
+
+  char line[512];
+  int count = 0;
+  int bad = 0;
+
+  while (fgets(line, sizeof(line), file)) {
+    count++;
+
+    const char *msg = strstr(line, "thread ");
+    size_t len = strlen(line);
+    int t = -1;
+    int i = -1;
+
+    if (!msg || strstr(msg + 1, "thread ") ||
+        len < 6 || strcmp(line + len - 6, "<eol>\n") != 0 ||
+        sscanf(msg, "thread %d message %d", &t, &i) != 2 ||
+        t < 0 || t >= STRESS_THREADS || i < 0 || i >= STRESS_MESSAGES ||
+        seen[t][i]++) {
+      bad++;
+    }
+  }
+
+  fclose(file);
+
+  printf("%s: %d lines, %d bad, %d missing\n", path, count, bad,
+      STRESS_THREADS * STRESS_MESSAGES - count);
+
+  return bad != 0 || count != STRESS_THREADS * STRESS_MESSAGES;
+}
+
+#endif
+
 int main() {
   /* Initialize with increased buffer size, 6 digits for line number,
    * LOGE_ALL level, stdout stream and default callback function
@@ -263,7 +349,14 @@ int main() {
 
   loge_destroy(&logger);
 
-  return 0;
+  int failed = 0;
+
+#if defined(__linux) || defined(__linux__)
+  /* Share a logger between threads */
+  failed = stress_concurrent("ctest-threads.log");
+#endif
+
+  return failed;
 }
 
 #undef _GNU_SOURCE
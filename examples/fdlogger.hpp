@@ -13,10 +13,8 @@ class fd_logger  : public fd_logger_base {
 
   void logfn() override {
 
-    /* buffer char array may not be null-terminated */
-    buffer[buffer.size() - 1] = '\0';
-
-    dprintf(fd_, "%s\n", buffer.data());
+    /* Record may not be null-terminated */
+    dprintf(fd_, "%.*s\n", static_cast<int>(outlen), outptr);
   }
 
   fd_logger(int fd, fd_logger_base::loge_level loglevel)
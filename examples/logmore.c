@@ -1,3 +1,5 @@
+#define _POSIX_C_SOURCE 200809L /* loge.hpp needs POSIX.1-2008 */
+
 #include <loge.hpp>
 
 extern struct loge logger;
@@ -36,16 +36,47 @@
 
 #if defined(__linux) || defined(__linux__)
 
-#undef _POSIX_C_SOURCE
-#define _POSIX_C_SOURCE 1 /* For fdopen */
-
 /* linux */
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <poll.h>
+#include <dirent.h>
+#include <spawn.h>
+#include <signal.h>
+#include <sys/inotify.h>
+
+/*
+ * loge.hpp does not define feature test macros, they would leak into the
+ * including translation unit and have no effect if a libc header was already
+ * included. Compilers in GNU mode and g++ provide POSIX.1-2008 by default,
+ * strict C needs _POSIX_C_SOURCE defined as 200809L or _GNU_SOURCE.
+ */
+#if !defined(_POSIX_C_SOURCE) || _POSIX_C_SOURCE < 200809L
+#error "loge.hpp needs POSIX.1-2008, define _POSIX_C_SOURCE as 200809L before including any header"
+#endif
+
+/* GNU extensions used by the sinks, declared when _GNU_SOURCE hides them */
+#if !defined(_GNU_SOURCE) && !defined(__USE_GNU)
+struct mmsghdr {
+  struct msghdr msg_hdr;
+  unsigned int msg_len;
+};
+extern int sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
+    int flags);
+#if defined(__GLIBC__)
+extern char *program_invocation_short_name;
+#endif
+#endif
 
 #elif defined(_WIN64)
 
@@ -69,6 +100,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
 #include <time.h>
 
 /* glibc and BSD libc only */
@@ -181,6 +213,14 @@
 
 #endif /* !__cplusplus */
 
+/*
+ * Compile time minimum log level. Logging calls below this level are removed
+ * by the compiler together with their arguments.
+ */
+#ifndef LOGE_MIN_LEVEL
+#define LOGE_MIN_LEVEL 0
+#endif
+
 /* Stringification macros */
 #define __xstr(s) __tostr(s)
 #define __tostr(s) #s
@@ -294,1970 +334,11636 @@ void destroy_socket(socket_type sock) {
 
 #endif
 
-/**
- * @brief Replace all occurences of a substring with anohter string. On success
- * a new dynamically allocated string is returned that should be freed after
- * use.
- *
- * https://stackoverflow.com/a/779960
- *
- * @param str The string in which the replacement happens
- * @param pat The substring that will get replaced
- * @param rep The string that will replace the substring
- * @return NULL on failure, pointer to a dynamically allocated string on
- * success
- */
-UNUSED
-static
-char* strreplace(const char *str, const char *pat, const char *rep) {
-  const char *start;
-  char *p;
-  char *result;
-  size_t patlen;
-  size_t replen;
-  size_t reslen;
-  size_t offset;
-  size_t count;
+/* Thread local storage */
+#if defined(__cplusplus)
+#define LOGE_THREAD_LOCAL thread_local
+#elif defined(_MSC_VER)
+#define LOGE_THREAD_LOCAL __declspec(thread)
+#else
+#define LOGE_THREAD_LOCAL _Thread_local
+#endif
 
-  if (!str || !pat) {
-    return NULL;
-  }
+#if defined(__linux) || defined(__linux__)
 
-  patlen = strlen(pat);
-  if (!patlen) {
-    return NULL;
-  }
+typedef pthread_mutex_t loge_mutex;
 
-  if (!rep) {
-    rep = "";
-  }
-  replen = strlen(rep);
+static
+inline
+void loge_mutex_init(loge_mutex *mtx) {
+  pthread_mutex_init(mtx, NULL);
+}
 
-  start = str;
-  for (count = 0; (p = strstr((char*)start, pat)); count++) {
-    start = p + patlen;
-  }
+static
+inline
+void loge_mutex_destroy(loge_mutex *mtx) {
+  pthread_mutex_destroy(mtx);
+}
 
-  reslen = strlen(str) + (replen - patlen) * count;
-  if (!reslen) {
-    return NULL;
-  }
+static
+inline
+void loge_mutex_lock(loge_mutex *mtx) {
+  pthread_mutex_lock(mtx);
+}
 
-  p = result = (char*)malloc(reslen + 1);
-  if (!result) {
-    return NULL;
-  }
+static
+inline
+void loge_mutex_unlock(loge_mutex *mtx) {
+  pthread_mutex_unlock(mtx);
+}
 
-  while (count--) {
-    start = strstr(str, pat);
-    offset = start - str;
-    p = strncpy(p, str, offset) + offset;
-    p = strncpy(p, rep, replen) + replen;
-    str += offset + patlen;
-    reslen -= offset + replen;
-  }
-  strncpy(p, str, reslen);
-  p[reslen] = '\0';
+#else /* defined(__linux) || defined(__linux__) */
 
-  return result;
+typedef CRITICAL_SECTION loge_mutex;
+
+static
+inline
+void loge_mutex_init(loge_mutex *mtx) {
+  InitializeCriticalSection(mtx);
 }
 
-#if defined(_MSC_VER) || !defined(__GLIBC__)
+static
+inline
+void loge_mutex_destroy(loge_mutex *mtx) {
+  DeleteCriticalSection(mtx);
+}
 
 static
-int dprintf(int d, const char *fmt, ...) {
- enum { BUFFER_SIZE_DPRINTF = 4096 };
+inline
+void loge_mutex_lock(loge_mutex *mtx) {
+  EnterCriticalSection(mtx);
+}
 
- va_list ap; 
- int done;
- int at = 0, nwrite = 0;
- char *buf;
+static
+inline
+void loge_mutex_unlock(loge_mutex *mtx) {
+  LeaveCriticalSection(mtx);
+}
 
- buf = (char*)malloc(sizeof(char) * BUFFER_SIZE_DPRINTF);
- if (!buf) {
-   return 0;
- }
+#endif /* defined(__linux) || defined(__linux__) */
 
- va_start(ap, fmt);
- done = vsnprintf(buf, BUFFER_SIZE_DPRINTF, fmt, ap);
- va_end(ap);
+enum { LOGE_TIMESTAMP_LEN = 19 };
 
- do {
-   nwrite = _write(d, buf + at, done);
-   at += nwrite;
-   done -= nwrite;
-  } while (done > 0);
+/*
+ * Per thread cache of the rendered timestamp. The broken down local time is
+ * only recomputed when the minute changes, within a minute the seconds are
+ * patched into the cached text.
+ */
+struct loge_time_cache {
+  time_t minute;
+  char text[LOGE_TIMESTAMP_LEN + 1];
+};
 
- free(buf);
+static
+LOGE_THREAD_LOCAL struct loge_time_cache loge_tcache = { -1, { 0 } };
 
- return at;
+static
+inline
+void loge_put_2digits(char *p, int n) {
+  p[0] = (char)('0' + n / 10);
+  p[1] = (char)('0' + n % 10);
 }
 
-#endif
-
 /**
- * @brief Connect to a TCP server and associate an output stream with the
- * socket. This stream will be set as the output stream for the logger. The log
- * callback function will be overriden by the default. IPv4 and IPv6 addresses
- * are supported.
- * @param ploge Pointer to struct loge
- * @param ip IPv4 or IPv6 address
- * @param port Port number
- * @param ipv6 Uses IPv6 if set to non-zero value, else uses IPv4
- *
- * @see loge_disconnect()
+ * @brief Get the timestamp for a point in time, formatted as
+ * mm-dd-yyyy:HH:MM:SS. The returned string is owned by the calling thread and
+ * stays valid until its next call.
+ * @param t Number of seconds since Epoch
+ * @return Pointer to a string of `LOGE_TIMESTAMP_LEN` characters
  */
+UNUSED
 static
-socket_type sock_connect(const char *host, unsigned short port, int type, int ipv6) {
+const char* loge_timestamp(time_t t) {
+  struct loge_time_cache *cache = &loge_tcache;
 
-  socket_type sock = LOGE_SOCK_ERR;
-
-  if (!host) {
-    return sock;
+  int sec = (int)(t % 60);
+  if (sec < 0) {
+    sec += 60;
   }
+  time_t minute = t - sec;
 
-#if defined(__linux) || defined(__linux__)
+  if (minute != cache->minute) {
+    struct tm tm;
 
-  struct sockaddr_in server_addr;
-  struct sockaddr_in6 server_addr6;
+#if defined(_MSC_VER)
+    localtime_s(&tm, &minute);
+#else
+    localtime_r(&minute, &tm);
+#endif
 
-  int domain = ipv6 ? AF_INET6 : AF_INET;
+    int year = tm.tm_year + 1900;
 
-  if ((sock = socket(domain, type > 0 ? SOCK_STREAM : SOCK_DGRAM, 0)) < 0) {
-    lgperror("socket failed");
-    return sock;
-  }
+    char *p = cache->text;
+    loge_put_2digits(p, tm.tm_mon + 1);
+    p[2] = '-';
+    loge_put_2digits(p + 3, tm.tm_mday);
+    p[5] = '-';
+    loge_put_2digits(p + 6, (year / 100) % 100);
+    loge_put_2digits(p + 8, year % 100);
+    p[10] = ':';
+    loge_put_2digits(p + 11, tm.tm_hour);
+    p[13] = ':';
+    loge_put_2digits(p + 14, tm.tm_min);
+    p[16] = ':';
+    p[LOGE_TIMESTAMP_LEN] = '\0';
 
-  if (ipv6) {
-    memset(&server_addr6, 0, sizeof(struct sockaddr_in6));
-    server_addr6.sin6_family = AF_INET6;
-    server_addr6.sin6_port = htons(port);
-  } else {
-    memset(&server_addr, 0, sizeof(struct sockaddr_in));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
+    cache->minute = minute;
   }
 
-  struct sockaddr *addr = ipv6 ?
-    (struct sockaddr *)&server_addr6 :
-    (struct sockaddr *)&server_addr;
+  loge_put_2digits(cache->text + 17, sec);
 
-  size_t addr_size = ipv6 ?
-    sizeof(struct sockaddr_in6) :
-    sizeof(struct sockaddr_in);
+  return cache->text;
+}
 
-  int ret;
-  /* Convert IPv4/IPv6 address from text to binary form */
-  if (ipv6) {
-    ret = inet_pton(AF_INET6, host, &server_addr6.sin6_addr);
-  } else {
-    ret = inet_pton(AF_INET, host, &server_addr.sin_addr);
-  }
-  if (ret <= 0) {
-    lgperror("inet_pton failed");
-    goto error;
+/* Two decimal digits per table lookup */
+static
+const char loge_digit_pairs[201] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+/**
+ * @brief Write the decimal digits of a number backwards, ending just before
+ * end.
+ * @param end One past the last character to write
+ * @param n Number to convert
+ * @return Number of digits written
+ */
+static
+inline
+size_t loge_utoa_rev(char *end, unsigned long long n) {
+  char *p = end;
+
+  while (n >= 100) {
+    unsigned int idx = (unsigned int)(n % 100) * 2;
+    n /= 100;
+    p -= 2;
+    memcpy(p, loge_digit_pairs + idx, 2);
   }
 
-  if (connect(sock, addr, addr_size) == 0) {
-    return sock;
+  if (n >= 10) {
+    p -= 2;
+    memcpy(p, loge_digit_pairs + n * 2, 2);
   } else {
-    lgperror("connect failed");
+    *--p = (char)('0' + n);
   }
 
-error:
-  close(sock);
-  sock = LOGE_SOCK_ERR;
+  return (size_t)(end - p);
+}
 
-#elif defined(_WIN64)
+/**
+ * @brief Write an integer in decimal, zero padded on the left to the given
+ * width after the sign, like "%0*d" does. Output is truncated to fit the
+ * buffer and kept null terminated.
+ * @param dst Destination buffer
+ * @param cap Capacity of the destination buffer
+ * @param n Magnitude of the number
+ * @param neg Non-zero if the number is negative
+ * @param width Minimum field width, -1 for none
+ * @return Number of characters written, not counting the terminating null
+ */
+UNUSED
+static
+size_t loge_write_integer(char *dst, size_t cap, unsigned long long n,
+    int neg, int width) {
 
-  WSADATA wsadata;
+  if (!cap) {
+    return 0;
+  }
 
-  int ret = WSAStartup(MAKEWORD(2,2), &wsadata);
+  char tmp[24];
+  size_t digits = loge_utoa_rev(tmp + sizeof(tmp), n);
+  const char *start = tmp + sizeof(tmp) - digits;
+  size_t total = digits + (neg ? 1 : 0);
+  size_t zeros = width > 0 && (size_t)width > total ?
+    (size_t)width - total : 0;
 
-  struct sockaddr_in server_addr;
-  struct sockaddr_in6 server_addr6;
+  size_t len = 0;
+  size_t room = cap - 1;
 
-  int domain = ipv6 ? AF_INET6 : AF_INET;
+  if (neg && len < room) {
+    dst[len++] = '-';
+  }
 
-  if ((sock = socket(domain, type > 0 ? SOCK_STREAM : SOCK_DGRAM, 0)) < 0) {
-    lgperror("socket failed");
-    return sock;
+  if (zeros > room - len) {
+    zeros = room - len;
   }
+  memset(dst + len, '0', zeros);
+  len += zeros;
 
-  if (ipv6) {
-    memset(&server_addr6, 0, sizeof(struct sockaddr_in6));
-    server_addr6.sin6_family = AF_INET6;
-    server_addr6.sin6_port = htons(port);
-  } else {
-    memset(&server_addr, 0, sizeof(struct sockaddr_in));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
+  if (digits > room - len) {
+    digits = room - len;
   }
+  memcpy(dst + len, start, digits);
+  len += digits;
 
-  struct sockaddr *addr = ipv6 ?
-    (struct sockaddr *)&server_addr6 :
-    (struct sockaddr *)&server_addr;
+  dst[len] = '\0';
 
-  socklen_t addr_size = ipv6 ?
-    sizeof(struct sockaddr_in6) :
-    sizeof(struct sockaddr_in);
+  return len;
+}
 
-  /* Convert IPv4/IPv6 address from text to binary form */
-  if (ipv6) {
-    ret = inet_pton(AF_INET6, host, &server_addr6.sin6_addr);
-  } else {
-    ret = inet_pton(AF_INET, host, &server_addr.sin_addr);
-  }
-  if (ret <= 0) {
-    lgperror("inet_pton failed");
-    goto error;
-  }
+/**
+ * @brief When a logger writing to a file or stream flushes its output.
+ *
+ * With bytes, messages and interval_ms all zero every message is flushed.
+ * Otherwise the output is flushed once any of the set limits is reached and
+ * whenever a message at or above level comes in. The loss window on a crash
+ * is what is pending at that point.
+ *
+ * An interval is checked as messages come in. An idle logger keeps what is
+ * pending until the next message, an explicit flush or its backend thread
+ * waking up.
+ */
+struct loge_flush_policy {
+  /* Flush once this many bytes are pending, 0 for no limit */
+  size_t bytes;
 
-  if (connect(sock, addr, addr_size) != SOCKET_ERROR) {
-    return sock;
-  } else {
-    lgperror("connect failed");
-  }
+  /* Flush once this many messages are pending, 0 for no limit */
+  size_t messages;
 
-error:
-  closesocket(sock);
-  WSACleanup();
-  sock = LOGE_SOCK_ERR;
+  /* Flush once the oldest pending message is this old, 0 for no limit */
+  unsigned int interval_ms;
 
-#endif
+  /* Flush right away at or above this level, 0 to disable */
+  int level;
 
-  return sock;
-}
+  /*
+   * Non-zero to fdatasync the file after each flush. Combined with the
+   * limits above this is a group commit, one sync for a batch of messages.
+   */
+  int sync;
+};
 
-static
-const char *loglevel_strtbl[] =  {
-  "",
-  "DEBUG",
-  "INFO",
-  "WARNING",
-  "ERROR",
-  "CRITICAL"
+/* What has been written since the last flush */
+struct loge_flush_state {
+  size_t bytes;
+  size_t messages;
+  unsigned long long first_ms;
 };
 
+/* Monotonic clock in milliseconds */
+UNUSED
 static
-const char *loglevel_strtbl_color[] =  {
-  "",
-  ANSI_FG_BLUE   ANSI_BG_RESET "DEBUG"    ANSI_RESET,
-  ANSI_FG_GREEN  ANSI_BG_RESET "INFO"     ANSI_RESET,
-  ANSI_FG_YELLOW ANSI_BG_RESET "WARNING"  ANSI_RESET,
-  ANSI_FG_RED    ANSI_BG_RESET "ERROR"    ANSI_RESET,
-  ANSI_FG_WHITE  ANSI_BG_RED   "CRITICAL" ANSI_RESET
-};
-
-/****************************** Common code ends ******************************/
-
-
-/******************************* C code starts ********************************/
+unsigned long long loge_now_ms(void) {
+#if defined(_WIN64)
+  return (unsigned long long)GetTickCount64();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000ULL +
+    (unsigned long long)ts.tv_nsec / 1000000ULL;
+#endif
+}
 
-#ifndef __cplusplus
+/* Write file data to the storage device, errors are ignored */
+UNUSED
+static
+void loge_fdatasync(int fd) {
+  if (fd < 0) {
+    return;
+  }
+#if defined(_WIN64)
+  _commit(fd);
+#elif defined(__linux) || defined(__linux__)
+  (void)fdatasync(fd);
+#else
+  (void)fsync(fd);
+#endif
+}
 
 /**
- * @brief Macro to be used for logging information.
- * @param ploge Pointer to struct loge.
- * @param level Log type/level. Messages below this level will not be logged.
- * @param ... Message format string and associated arguments.
+ * @brief Account for a message just written and decide if the output has to
+ * be flushed now.
+ * @return Non-zero to flush
  */
-#define LOGE(ploge, level, ...) \
-  do { \
-    if ((ploge) != NULL) \
-      loge_log( \
-          (struct loge*)(ploge), \
-          (level) & ~LOGCOLOR, \
-          __LINE__, \
-          __FILE__, \
-          __VA_ARGS__ \
-        ); \
-  } while (0)
+UNUSED
+static
+int loge_flush_due(const struct loge_flush_policy *policy,
+    struct loge_flush_state *state, int level, size_t len) {
 
-#define LOGE_COLOR(ploge, level, ...) \
-  do { \
-    if ((ploge) != NULL) \
-      loge_log( \
-          (struct loge*)(ploge), \
-          (level) | LOGCOLOR, \
-          __LINE__, \
-          __FILE__, \
-          __VA_ARGS__ \
-        ); \
-  } while (0)
+  state->bytes += len;
+  state->messages++;
 
-#define LOGE_TYPE(entime, level) \
-  (int)( ( (!!(entime)) << LOGTIMESTAMPSHIFT ) | (level) )
+  if (!policy->bytes && !policy->messages && !policy->interval_ms) {
+    return 1;
+  }
 
-#define LOGE_ENTIME(type) \
-  (int)(!!(type & LOGTIMESTAMP))
+  if ((policy->level > 0 && level >= policy->level) ||
+      (policy->bytes && state->bytes >= policy->bytes) ||
+      (policy->messages && state->messages >= policy->messages)) {
+    return 1;
+  }
 
-#define LOGE_LEVEL(type) \
-  (enum loge_level)(type & ~LOGTIMESTAMP)
+  if (policy->interval_ms) {
+    unsigned long long now = loge_now_ms();
+    if (state->messages == 1) {
+      state->first_ms = now;
+    } else if (now - state->first_ms >= policy->interval_ms) {
+      return 1;
+    }
+  }
 
-#define LOGE_LOGTYPE(encolor, level) \
-  (int)( ( (!!(encolor)) << LOGCOLORSHIFT ) | (level) )
+  return 0;
+}
 
-#define LOGE_ENCOLOR(type) \
-  (int)(!!(type & LOGCOLOR))
+/**
+ * @brief Check if pending output has outlived the flush interval. For idle
+ * loggers, called from a timer or an event loop.
+ * @return Non-zero to flush
+ */
+UNUSED
+static
+int loge_flush_overdue(const struct loge_flush_policy *policy,
+    const struct loge_flush_state *state) {
 
-#define LOGE_LOGLEVEL(type) \
-  (enum loge_level)(type & ~LOGCOLOR)
+  return state->messages > 0 && policy->interval_ms &&
+    loge_now_ms() - state->first_ms >= policy->interval_ms;
+}
 
-enum loge_constants {
-  LINENUMBER_WIDTH = 6,
-  NUMBER_WIDTH = 8,
-  BUFFER_SIZE = 1024,
-  LOGTIMESTAMPSHIFT = 31,
-  LOGCOLORSHIFT = 31,
-  LOGTIMESTAMP = 1 << LOGTIMESTAMPSHIFT,
-  LOGCOLOR = 1 << LOGCOLORSHIFT
-};
+UNUSED
+static
+void loge_flush_done(struct loge_flush_state *state) {
+  state->bytes = 0;
+  state->messages = 0;
+}
+
+/* Sizes for memory mapped log files */
+#define LOGE_MMAP_WINDOW (4UL << 20) /* Mapped at a time */
+#define LOGE_MMAP_EXTENT (16UL << 20) /* Preallocated at a time */
 
 /**
- * @brief Enum type for levels of logging. Each level can represent a class of
- * information that is to be logged
+ * @brief Log file written through a shared memory mapping. The file is
+ * preallocated in extents and a window of it is mapped at a time, records
+ * are copied into the window and the page cache writes them back. A record
+ * is in the file as soon as it is copied, only a system crash can lose it
+ * before a flush syncs it.
  *
- * The log level can be used to filter messages. All messages that have log
- * type/level less that the specified type/level will not get logged.
+ * The file keeps its preallocated length while open and is truncated to the
+ * data on close. A file not closed properly ends in zero bytes, appending to
+ * it starts after the last record.
  */
-enum loge_level {
-  LOGE_ALL = 0,  /**< Everything */
-  LOGE_DEBUG,     /**< Debug information */
-  LOGE_INFO,      /**< Run time information like statuses, user output, etc */
-  LOGE_WARNING,   /**< Warnings */
-  LOGE_ERROR,     /**< Errors */
-  LOGE_CRITICAL,  /**< Critical errors */
-  LOGE_MAX
+struct loge_mmap {
+  int fd;
+  char *map;
+  unsigned long long base;      /* File offset of the window */
+  size_t pos;                   /* Write position in the window */
+  size_t synced;                /* Synced up to here in the window */
+  unsigned long long allocated; /* Preallocated length of the file */
+  int slid;                     /* Window moved since the last sync */
 };
 
-/* Forward declaration */
-struct loge;
+#if defined(__linux) || defined(__linux__)
 
-/**
- * @brief Defines the type for function used as log callback function.
- * @param ploge Pointer to struct loge
- *
- * @see loge_set_fn()
- * @see loge_log()
- */
-typedef void (*log_fn)(const struct loge *ploge);
+/* Length of the file without the zero bytes a crash left behind */
+UNUSED
+static
+unsigned long long loge_mmap_end(int fd, unsigned long long size) {
+  char buf[4096];
 
-/**
- * @brief Defines type for function used as raw data callback function.
- * @param ploge,Pointer to struct loge
- * @param file Output stream of the logger
- * @param timestamp Number of seconds since Epoch
- * @param filename Name of the source file
- * @param linenum Line number of the source file from where logging happened
- * @param level Type/level of log
- * @param msg User message. This is the result of applying arguments to the
- * format string passed to loge_log()
- *
- * @see loge_set_data_fn()
- * @see loge_log()
- */
-typedef void (*log_data_fn)(
-    FILE *file,
-    time_t timestamp,
-    const char *filename,
-    int linenum,
-    enum loge_level level,
-    const char *msg
-  );
+  while (size > 0) {
+    size_t n = size < sizeof(buf) ? (size_t)size : sizeof(buf);
+    if (pread(fd, buf, n, (off_t)(size - n)) != (ssize_t)n) {
+      break;
+    }
 
-struct loge {
-  char *bufptr;
-  char buffer[BUFFER_SIZE];
-  size_t bufcap;
-  size_t buflen;
-  log_fn plogfn, pprevlogfn;
-  log_data_fn pdatafn;
-  FILE *file;
-  socket_type sockfd;
-  int log_type;
-  int linenumwidth;
-  int width;
-  int precision;
-  int syslog_priority;
-};
+    size_t i = n;
+    while (i > 0 && buf[i - 1] == '\0') {
+      i--;
+    }
+    if (i > 0) {
+      return size - n + i;
+    }
+    size -= n;
+  }
 
-/**
- * @brief Get pointer to a string containing the name of the log type/level
- * @param level Enum mentioning the log type/level
- * @return Pointer to a string
- *
- * @see enum loge_level
- */
+  return size;
+}
+
+/* Map the window starting at base, preallocating the file as needed */
 UNUSED
 static
-const char* loge_get_level(enum loge_level level) {
-  return level > LOGE_ALL && level < LOGE_MAX ?
-    loglevel_strtbl[level] :
-    NULL;
+int loge_mmap_window(struct loge_mmap *pm, unsigned long long base) {
+  if (pm->map) {
+    munmap(pm->map, LOGE_MMAP_WINDOW);
+    pm->map = NULL;
+  }
+
+  if (base + LOGE_MMAP_WINDOW > pm->allocated) {
+    unsigned long long len = (base + LOGE_MMAP_WINDOW + LOGE_MMAP_EXTENT - 1) /
+      LOGE_MMAP_EXTENT * LOGE_MMAP_EXTENT;
+
+    int err = posix_fallocate(pm->fd, (off_t)pm->allocated,
+        (off_t)(len - pm->allocated));
+    if (err) {
+      errno = err;
+      lgperror("posix_fallocate failed");
+      return -1;
+    }
+    pm->allocated = len;
+  }
+
+  void *p = mmap(NULL, LOGE_MMAP_WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED,
+      pm->fd, (off_t)base);
+  if (p == MAP_FAILED) {
+    lgperror("mmap failed");
+    return -1;
+  }
+
+  pm->map = (char*)p;
+  pm->base = base;
+  pm->pos = 0;
+  pm->synced = 0;
+
+  return 0;
 }
 
 /**
- * @brief Get pointer to a string containing the name of the log type/level
- * along with ANSI escape codes for colored output
- * @param level Enum mentioning the log type/level
- * @return Pointer to a string
- *
- * @see enum loge_level
+ * @brief Open or create a memory mapped log file
+ * @param pm Pointer to struct loge_mmap
+ * @param filepath Path of the log file
+ * @param append Non-zero to append, zero to truncate
+ * @return 0 on success, -1 on failure
  */
 UNUSED
 static
-const char* loge_get_level_color(enum loge_level level) {
-  return level > LOGE_ALL && level < LOGE_MAX ?
-    loglevel_strtbl_color[level] :
-    NULL;
-}
+int loge_mmap_open(struct loge_mmap *pm, const char *filepath, int append) {
+  pm->map = NULL;
+  pm->slid = 0;
 
-UNUSED
-static
-const char* loge_bufptr(const struct loge *ploge) {
-  return !ploge ? (const char*)ploge : ploge->bufptr;
-}
+  pm->fd = open(filepath, O_RDWR | O_CREAT | (append ? 0 : O_TRUNC),
+      S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+  if (pm->fd < 0) {
+    lgperror("open failed");
+    return -1;
+  }
 
-UNUSED
-static
-FILE* loge_fileptr(const struct loge *ploge) {
-  return !ploge ? (FILE*)ploge : ploge->file;
+  struct stat st;
+  if (fstat(pm->fd, &st) < 0) {
+    lgperror("fstat failed");
+    close(pm->fd);
+    pm->fd = -1;
+    return -1;
+  }
+
+  pm->allocated = (unsigned long long)st.st_size;
+
+  unsigned long long end = loge_mmap_end(pm->fd, pm->allocated);
+  unsigned long long page = (unsigned long long)sysconf(_SC_PAGESIZE);
+
+  if (loge_mmap_window(pm, end / page * page) < 0) {
+    close(pm->fd);
+    pm->fd = -1;
+    return -1;
+  }
+
+  pm->pos = (size_t)(end - pm->base);
+  pm->synced = pm->pos / page * page;
+
+  return 0;
 }
 
 /**
- * @brief Write a string followed by a newline character to a stream. This is
- * the default callback function.
- * @param ploge Pointer to struct loge
+ * @brief Append to a memory mapped log file, moving the window along
  */
 UNUSED
 static
-void log_internal(const struct loge *ploge) {
-  if (!ploge) {
-    return;
-  }
+void loge_mmap_write(struct loge_mmap *pm, const char *data, size_t len) {
+  while (len > 0) {
+    if (pm->pos == LOGE_MMAP_WINDOW) {
+      /* Dirty pages stay in the page cache after the unmap */
+      if (loge_mmap_window(pm, pm->base + LOGE_MMAP_WINDOW) < 0) {
+        return;
+      }
+      pm->slid = 1;
+    }
 
-  FILE *file = loge_fileptr(ploge);
-  if (!file) {
-    return;
-  }
+    size_t n = LOGE_MMAP_WINDOW - pm->pos;
+    if (n > len) {
+      n = len;
+    }
 
-  fputs(loge_bufptr(ploge), file);
-  fputc('\n', file);
-  fflush(file);
+    memcpy(pm->map + pm->pos, data, n);
+    pm->pos += n;
+    data += n;
+    len -= n;
+  }
 }
 
-/* glibc and BSD libc only */
-#if defined(__GLIBC__) || defined(__FreeBSD__) || defined(__OpenBSD__)
-
+/**
+ * @brief Write what was appended since the last flush to the storage device
+ * if sync is set. The kernel writes back dirty pages of the mapping by
+ * itself, msync(MS_ASYNC) would not add anything, so without sync there is
+ * no system call.
+ */
 UNUSED
 static
-void log_syslog(const struct loge *ploge) {
-  if (!ploge) {
+void loge_mmap_flush(struct loge_mmap *pm, int sync) {
+  if (!sync || !pm->map || pm->pos == pm->synced) {
     return;
   }
 
-  const char *msg = loge_bufptr(ploge);
-  syslog(ploge->syslog_priority, "%s\n", msg);
-}
+  /* Earlier windows are no longer mapped, sync them through the file */
+  if (pm->slid) {
+    loge_fdatasync(pm->fd);
+    pm->slid = 0;
+  }
 
-#endif
+  msync(pm->map + pm->synced, pm->pos - pm->synced, MS_SYNC);
+
+  /* msync starts at a page boundary */
+  pm->synced = pm->pos & ~(size_t)(sysconf(_SC_PAGESIZE) - 1);
+}
 
 /**
- * @brief Set the log type/level to be filtered by the logger. Messages below
- * this level will not be logged.
- * @param ploge Pointer to struct loge
- * @param level Enum mentioning the log type/level
- *
- * @see enum loge_level
+ * @brief Unmap a memory mapped log file and truncate it to its data
  */
 UNUSED
 static
-void loge_set_level(struct loge *ploge, enum loge_level level) {
-  if (!ploge) {
+void loge_mmap_close(struct loge_mmap *pm) {
+  if (pm->fd < 0) {
     return;
   }
 
-  int en_timestamp = LOGE_ENTIME(ploge->log_type);
+  if (pm->map) {
+    munmap(pm->map, LOGE_MMAP_WINDOW);
+    pm->map = NULL;
+  }
 
-  if (level < LOGE_MAX) {
-    ploge->log_type = LOGE_TYPE(en_timestamp, level);
+  if (ftruncate(pm->fd, (off_t)(pm->base + pm->pos)) < 0) {
+    lgperror("ftruncate failed");
   }
+
+  close(pm->fd);
+  pm->fd = -1;
 }
 
-/**
- * @brief Set the callback function to be used for writing the log message to
- * a stream. This will override previous callback function if a non-NULL
- * address is passed.
- *
- * The output stream and log message are passed on to this callback function.
- * Log string provided to this function will be formatted as:
- * m-dd-yyyy : HH-mm-ss : filename:linenum : loglevel : user_message
- *
- * User message will be the result of applying arguments to a format string.
- *
- * @param ploge Pointer to struct loge
- * @param fn Pointer to the callback function
- *
- * @see log_fn
- * @see loge_log()
- */
+#else /* defined(__linux) || defined(__linux__) */
+
 UNUSED
 static
-void loge_set_fn(struct loge *ploge, log_fn fn) {
-  if (!ploge || !fn) {
-    return;
-  }
-
-  ploge->pprevlogfn = ploge->plogfn;
-  ploge->plogfn = fn;
+int loge_mmap_open(struct loge_mmap *pm, const char *filepath UNUSED,
+    int append UNUSED) {
+
+  pm->fd = -1;
+  pm->map = NULL;
+  errno = ENOSYS;
+  lgperror("memory mapped log file");
+  return -1;
 }
 
-/**
- * @brief Set the callback function that can be used alternatively for writing
- * the the log message to a stream. This will override previous callback
- * function even when a NULL address is passed. Additional arguments are passed
- * to this callback function.
- * @param ploge Pointer to struct loge
- * @param fn Pointer to the callback function
- *
- * @see log_data_fn
- * @see loge_log()
- */
 UNUSED
 static
-void loge_set_data_fn(struct loge *ploge, log_data_fn fn) {
-  if (!ploge) {
-    return;
-  }
+void loge_mmap_write(struct loge_mmap *pm UNUSED, const char *data UNUSED,
+    size_t len UNUSED) {
+}
 
-  ploge->pdatafn = fn;
+UNUSED
+static
+void loge_mmap_flush(struct loge_mmap *pm UNUSED, int sync UNUSED) {
 }
 
 UNUSED
 static
-FILE* loge_set_fd(struct loge *ploge, int fd) {
-  if (!ploge) {
-    return NULL;;
-  }
+void loge_mmap_close(struct loge_mmap *pm) {
+  pm->fd = -1;
+}
 
-  FILE *prev = ploge->file;
+#endif /* defined(__linux) || defined(__linux__) */
 
-  if (fd < 0) {
-    return prev;
-  }
+/* Compressor run on rotated log files, gzip compatible: removes its input */
+#ifndef LOGE_COMPRESS
+#define LOGE_COMPRESS "gzip"
+#endif
+#ifndef LOGE_COMPRESS_SUFFIX
+#define LOGE_COMPRESS_SUFFIX ".gz"
+#endif
 
-  int newfd = dup(fd);
-  if (newfd < 0) {
-    lgperror(dup_str" failed");
-    return prev;
-  }
-  FILE *file = fdopen(newfd, "w");
-  if (!file) {
-    lgperror(fdopen_str" failed");
-    close(newfd);
-    return prev;
-  }
+/* Rotated files waiting for the background thread */
+#define LOGE_ROTATE_QUEUE 16
 
-  ploge->file = file;
+/**
+ * @brief When a log file is rotated and how many rotated files are kept, a
+ * limit of 0 is off. The file is rotated before a message that would take
+ * it past bytes, and once the wall clock passes a multiple of interval_s
+ * (UTC, 86400 rotates at midnight UTC). The newest rotated files are kept
+ * up to max_files and max_bytes in total.
+ */
+struct loge_rotate_policy {
+  unsigned long long bytes;     /* Size of a log file */
+  unsigned int interval_s;      /* Seconds between rotations */
+  unsigned int max_files;       /* Rotated files kept */
+  unsigned long long max_bytes; /* Total size of rotated files kept */
+  int compress;                 /* Compress rotated files with LOGE_COMPRESS */
+};
 
-  ploge->pprevlogfn = ploge->plogfn;
-  ploge->plogfn = &log_internal;
+/**
+ * @brief Rotating log file. On rotation the file is renamed to
+ * path.YYYYmmdd-HHMMSS, which is atomic, and the path is opened again: no
+ * message is lost or written twice. Compression and removal of old files
+ * run on a background thread, the logging thread only pays for the rename
+ * and the open.
+ */
+struct loge_rotate {
+  struct loge_rotate_policy policy;
+  char *path;                   /* NULL when not rotating */
+  int fd;                       /* Descriptor of the current file */
+  unsigned long long size;      /* Bytes in the current file */
+  time_t next;                  /* Next interval rotation */
+  char stamp[16];               /* Stamp of the last rotated file */
+  unsigned int seq;             /* Next sequence number for that stamp */
+#if defined(__linux) || defined(__linux__)
+  pthread_t thread;
+  pthread_mutex_t mtx;
+  pthread_cond_t cond;
+#endif
+  char *queue[LOGE_ROTATE_QUEUE];
+  unsigned int head;
+  unsigned int count;
+  int started;
+  int stop;
+};
 
-  return prev;
+#if defined(__linux) || defined(__linux__)
+
+extern char **environ;
+
+/* First multiple of interval after t */
+UNUSED
+static
+time_t loge_rotate_boundary(time_t t, unsigned int interval) {
+  return (t / interval + 1) * interval;
 }
 
+/* Run the compressor on a rotated file and wait for it */
 UNUSED
 static
-void loge_unset_fd(struct loge *ploge) {
-  if (!ploge) {
+void loge_rotate_compress(char *filepath) {
+  char *argv[] = { (char*)LOGE_COMPRESS, (char*)"-f", filepath, NULL };
+  pid_t pid;
+
+  int err = posix_spawnp(&pid, LOGE_COMPRESS, NULL, NULL, argv, environ);
+  if (err) {
+    errno = err;
+    lgperror("posix_spawnp failed");
     return;
   }
 
-  if (ploge->file != stdout && ploge->file != stderr) {
-    fclose(ploge->file);
+  int status;
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
   }
-
-  ploge->file = NULL;
-
-  ploge->plogfn = ploge->pprevlogfn;
 }
 
-/**
- * @brief Set the stream to which log messages will be written.
- * @param ploge Pointer to struct loge
- * @param file Pointer to the stream
- */
+/* Rotated file, ordered by the time stamp and sequence in its name */
+struct loge_rotated {
+  char *path;
+  char stamp[16];
+  unsigned long seq;
+  unsigned long long size;
+};
+
+/* Newest first */
 UNUSED
 static
-FILE* loge_set_fileptr(struct loge *ploge, FILE *file) {
-  if (!ploge) {
-    return NULL;
-  }
+int loge_rotated_cmp(const void *a, const void *b) {
+  const struct loge_rotated *pa = (const struct loge_rotated*)a;
+  const struct loge_rotated *pb = (const struct loge_rotated*)b;
 
-  FILE *prev = ploge->file;
-  if (file) {
-    ploge->file = file;
+  int cmp = strcmp(pb->stamp, pa->stamp);
+  if (cmp) {
+    return cmp;
   }
-  return prev;
+  return pa->seq < pb->seq ? 1 : pa->seq > pb->seq ? -1 : 0;
 }
 
+/* Remove the oldest rotated files beyond max_files and max_bytes */
 UNUSED
 static
-FILE* loge_unset_fileptr(struct loge *ploge) {
-  if (!ploge) {
-    return NULL;
+void loge_rotate_retain(const struct loge_rotate *pr) {
+  if (!pr->policy.max_files && !pr->policy.max_bytes) {
+    return;
   }
 
-  FILE *prev = ploge->file;
-  ploge->file = NULL;
-  return prev;
-}
+  const char *slash = strrchr(pr->path, '/');
+  const char *base = slash ? slash + 1 : pr->path;
+  size_t dirlen = slash ? (size_t)(slash - pr->path) + 1 : 0;
+  size_t baselen = strlen(base);
 
-/**
- * @brief Set the stdout stream as the output stream. The default callback
- * function will also be set. User may override it.
- * @param ploge Pointer to struct loge
- */
-UNUSED
-static
-FILE* loge_set_stdout(struct loge *ploge) {
-  if (!ploge) {
-    return NULL;
+  char *dirpath = (char*)malloc(dirlen + 2);
+  if (!dirpath) {
+    return;
+  }
+  if (dirlen) {
+    memcpy(dirpath, pr->path, dirlen);
+    dirpath[dirlen] = '\0';
+  } else {
+    strcpy(dirpath, "./");
+    dirlen = 2;
   }
 
-  ploge->pprevlogfn = ploge->plogfn;
-  ploge->plogfn = &log_internal;
+  DIR *dir = opendir(dirpath);
+  if (!dir) {
+    lgperror("opendir failed");
+    free(dirpath);
+    return;
+  }
 
-  FILE *prev = ploge->file;
-  ploge->file = stdout;
-  return prev;
+  struct loge_rotated *files = NULL;
+  size_t n = 0;
+  size_t cap = 0;
+  struct dirent *entry;
+
+  /* Rotated files are named path.YYYYmmdd-HHMMSS[.N][.gz] */
+  while ((entry = readdir(dir))) {
+    const char *name = entry->d_name;
+    const char *stamp = name + baselen + 1;
+    if (strncmp(name, base, baselen) || name[baselen] != '.' ||
+        strlen(stamp) < 15 || stamp[8] != '-') {
+      continue;
+    }
+
+    if (n == cap) {
+      size_t newcap = cap ? cap * 2 : 16;
+      struct loge_rotated *p = (struct loge_rotated*)realloc(files,
+          newcap * sizeof(*files));
+      if (!p) {
+        break;
+      }
+      files = p;
+      cap = newcap;
+    }
+
+    size_t len = dirlen + strlen(name) + 1;
+    char *path = (char*)malloc(len);
+    if (!path) {
+      break;
+    }
+    snprintf(path, len, "%s%s", dirpath, name);
+
+    struct stat st;
+    if (stat(path, &st) < 0) {
+      free(path);
+      continue;
+    }
+
+    files[n].path = path;
+    memcpy(files[n].stamp, stamp, 15);
+    files[n].stamp[15] = '\0';
+    files[n].seq = stamp[15] == '.' ? strtoul(stamp + 16, NULL, 10) : 0;
+    files[n].size = (unsigned long long)st.st_size;
+    n++;
+  }
+  closedir(dir);
+
+  qsort(files, n, sizeof(*files), &loge_rotated_cmp);
+
+  unsigned long long total = 0;
+  for (size_t i = 0; i < n; i++) {
+    total += files[i].size;
+    if ((pr->policy.max_files && i >= pr->policy.max_files) ||
+        (pr->policy.max_bytes && total > pr->policy.max_bytes)) {
+      if (unlink(files[i].path) < 0) {
+        lgperror("unlink failed");
+      }
+    }
+    free(files[i].path);
+  }
+
+  free(files);
+  free(dirpath);
 }
 
-/**
- * @brief Set the stderr stream as the output stream. The default callback
- * function will also be set. User may override it.
- * @param ploge Pointer to struct loge
- */
+/* Background thread, compresses rotated files and applies retention */
 UNUSED
 static
-FILE* loge_set_stderr(struct loge *ploge) {
-  if (!ploge) {
-    return NULL;
+void* loge_rotate_worker(void *arg) {
+  struct loge_rotate *pr = (struct loge_rotate*)arg;
+
+  /* The nice value is per thread on Linux, the compressor inherits it */
+  if (setpriority(PRIO_PROCESS, 0, 19) < 0) {
+    lgperror("setpriority failed");
   }
 
-  ploge->pprevlogfn = ploge->plogfn;
-  ploge->plogfn = &log_internal;
+  pthread_mutex_lock(&pr->mtx);
+  for (;;) {
+    while (!pr->count && !pr->stop) {
+      pthread_cond_wait(&pr->cond, &pr->mtx);
+    }
+    if (!pr->count) {
+      break;
+    }
 
-  FILE *prev = ploge->file;
-  ploge->file = stderr;
-  return prev;
-}
+    char *path = pr->queue[pr->head];
+    pr->head = (pr->head + 1) % LOGE_ROTATE_QUEUE;
+    pr->count--;
+    pthread_mutex_unlock(&pr->mtx);
 
-/* glibc and BSD libc only */
-#if defined(__GLIBC__) || defined(__FreeBSD__) || defined(__OpenBSD__)
+    if (pr->policy.compress) {
+      loge_rotate_compress(path);
+    }
+    free(path);
+
+    /* Files still queued are the newest, sweep once they are done */
+    pthread_mutex_lock(&pr->mtx);
+    if (!pr->count) {
+      pthread_mutex_unlock(&pr->mtx);
+      loge_rotate_retain(pr);
+      pthread_mutex_lock(&pr->mtx);
+    }
+  }
+  pthread_mutex_unlock(&pr->mtx);
+
+  return NULL;
+}
 
+/* Hand a rotated file to the background thread, started on first use */
 UNUSED
 static
-FILE* loge_set_syslog(struct loge *ploge, int priority) {
-  if (!ploge) {
-    return NULL;
+void loge_rotate_queue(struct loge_rotate *pr, char *path) {
+  if (!pr->policy.compress && !pr->policy.max_files &&
+      !pr->policy.max_bytes) {
+    free(path);
+    return;
   }
 
-  FILE *prev = ploge->file;
+  pthread_mutex_lock(&pr->mtx);
 
-  /* Clear FILE pointer and pdatafn */
-  ploge->file = NULL;
-  ploge->pdatafn = NULL;
+  if (!pr->started) {
+    int err = pthread_create(&pr->thread, NULL, &loge_rotate_worker, pr);
+    if (err) {
+      errno = err;
+      lgperror("pthread_create failed");
+    } else {
+      pr->started = 1;
+    }
+  }
 
-  ploge->syslog_priority = priority;
+  /* Left as it is when the thread falls behind */
+  if (pr->started && pr->count < LOGE_ROTATE_QUEUE) {
+    pr->queue[(pr->head + pr->count) % LOGE_ROTATE_QUEUE] = path;
+    pr->count++;
+    path = NULL;
+    pthread_cond_signal(&pr->cond);
+  }
 
-  ploge->pprevlogfn = ploge->plogfn;
-  ploge->plogfn = &log_syslog;
+  pthread_mutex_unlock(&pr->mtx);
 
-  return prev;
+  free(path);
 }
 
-#endif
-
-/**
- * @brief Set file which will be created or appended to, for writing log
- * messages. The file will be opened and a stream will be associated with it.
- * This stream will be set as the output stream for the logger. The default
- * callback function will also be set. User may override it.
- * @param ploge pointer to struct loge
- * @param filepath Relative or absolute path of the output file
+/*
+ * Name for the file rotated now, not taken by an earlier rotation. Sequence
+ * numbers only grow within a second, retention frees the lowest ones first
+ * and reusing them would sort the newest file as the oldest.
  */
 UNUSED
 static
-FILE* loge_set_file(struct loge *ploge, const char *filepath) {
-  if (!ploge) {
+char* loge_rotate_name(struct loge_rotate *pr, time_t now) {
+  struct tm tm;
+  char stamp[32];
+
+  localtime_r(&now, &tm);
+  strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+
+  size_t len = strlen(pr->path) + strlen(stamp) +
+    sizeof(LOGE_COMPRESS_SUFFIX) + 16;
+  char *name = (char*)malloc(len);
+  char *compressed = (char*)malloc(len);
+  if (!name || !compressed) {
+    free(name);
+    free(compressed);
     return NULL;
   }
 
-  FILE *prev = ploge->file;
+  unsigned int seq = strcmp(stamp, pr->stamp) == 0 ? pr->seq : 0;
 
-  if (!filepath) {
-    return prev;
+  struct stat st;
+  for (; ; seq++) {
+    if (seq) {
+      snprintf(name, len, "%s.%s.%u", pr->path, stamp, seq);
+    } else {
+      snprintf(name, len, "%s.%s", pr->path, stamp);
+    }
+    snprintf(compressed, len, "%s" LOGE_COMPRESS_SUFFIX, name);
+
+    if (stat(name, &st) < 0 && stat(compressed, &st) < 0) {
+      break;
+    }
   }
 
-  int fd = -1;
-  FILE *file = NULL;
+  memcpy(pr->stamp, stamp, sizeof(pr->stamp) - 1);
+  pr->seq = seq + 1;
 
-#if defined(__linux) || defined(__linux__)
+  free(compressed);
+  return name;
+}
 
-  fd = open(filepath,
-      O_WRONLY|O_CREAT|O_APPEND|O_SYNC,
-      S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH);
-  if (!fd) {
+/**
+ * @brief Open a rotating log file for appending
+ * @param pr Pointer to struct loge_rotate
+ * @param filepath Path of the log file
+ * @param policy Pointer to the rotation policy
+ * @return Descriptor of the file, -1 on failure
+ */
+UNUSED
+static
+int loge_rotate_open(struct loge_rotate *pr, const char *filepath,
+    const struct loge_rotate_policy *policy) {
+
+  memset(pr, 0, sizeof(*pr));
+  pr->fd = -1;
+
+  int fd = open(filepath, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+      S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+  if (fd < 0) {
     lgperror("open failed");
-    return prev;
+    return -1;
   }
 
-  file = fdopen(fd, "w");
-  if (!file) {
-    lgperror("fdopen failed");
-    if (fd > -1) {
-      close(fd);
-    }
-    return prev;
+  pr->path = strdup(filepath);
+  if (!pr->path) {
+    lgperror("strdup failed");
+    close(fd);
+    return -1;
   }
 
-#else
+  pr->policy = *policy;
+  pr->fd = fd;
 
-  file = fopen(filepath, "a");
-  if (!file) {
-    lgperror("fopen failed");
-    return prev;
+  time_t now = time(NULL);
+  struct stat st;
+  if (fstat(fd, &st) == 0) {
+    pr->size = (unsigned long long)st.st_size;
   }
 
-#endif
-
-  ploge->file = file;
+  /* A file left from an earlier interval is rotated with the first message */
+  if (policy->interval_s) {
+    pr->next = loge_rotate_boundary(pr->size ? st.st_mtime : now,
+        policy->interval_s);
+  }
 
-  ploge->pprevlogfn = ploge->plogfn;
-  ploge->plogfn = &log_internal;
+  pthread_mutex_init(&pr->mtx, NULL);
+  pthread_cond_init(&pr->cond, NULL);
 
-  return prev; 
+  return fd;
 }
 
 /**
- * @brief Close the output file stream and restore the callback function.
- * @param ploge pointer to struct loge
+ * @brief Check if the file is to be rotated before a message is written
+ * @param pr Pointer to struct loge_rotate
+ * @param len Length of the message
+ * @return Non-zero to rotate
  */
 UNUSED
 static
-void loge_unset_file(struct loge *ploge) {
-  if (!ploge || !ploge->file) {
-    return;
+int loge_rotate_due(struct loge_rotate *pr, size_t len) {
+  if (pr->policy.bytes && pr->size &&
+      pr->size + len > pr->policy.bytes) {
+    return 1;
   }
 
-  if (ploge->file != stdout && ploge->file != stderr) {
-    fclose(ploge->file);
+  if (!pr->policy.interval_s) {
+    return 0;
   }
 
-  ploge->file = NULL;
+  time_t now = time(NULL);
+  if (now < pr->next) {
+    return 0;
+  }
+  if (pr->size) {
+    return 1;
+  }
 
-  ploge->plogfn = ploge->pprevlogfn;
+  /* Nothing to rotate */
+  pr->next = loge_rotate_boundary(now, pr->policy.interval_s);
+  return 0;
 }
 
-/* glibc and BSD libc only */
-#if defined(__GLIBC__) || defined(__FreeBSD__) || defined(__OpenBSD__)
-
+/**
+ * @brief Rename the log file and open the path again. The caller flushes
+ * the old descriptor before and closes it after.
+ * @param pr Pointer to struct loge_rotate
+ * @return Descriptor of the new file, -1 on failure
+ */
 UNUSED
 static
-int loge_set_syslog_priority(struct loge *ploge, int priority) {
-  if (!ploge) {
+int loge_rotate_next(struct loge_rotate *pr) {
+  time_t now = time(NULL);
+
+  /* Failures are not retried until the next rotation is due */
+  pr->size = 0;
+  if (pr->policy.interval_s) {
+    pr->next = loge_rotate_boundary(now, pr->policy.interval_s);
+  }
+
+  char *name = loge_rotate_name(pr, now);
+  if (!name) {
     return -1;
   }
 
-  int prev_priority = ploge->syslog_priority;
-  ploge->syslog_priority = priority;
+  if (rename(pr->path, name) < 0) {
+    lgperror("rename failed");
+    free(name);
+    return -1;
+  }
 
-  return prev_priority;
-}
+  int fd = open(pr->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+      S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+  if (fd < 0) {
+    lgperror("open failed");
+    free(name);
+    return -1;
+  }
 
-UNUSED
-static
-int loge_syslog_priority(struct loge *ploge) {
-  return ploge ? ploge->syslog_priority : -1;
-}
+  pr->fd = fd;
+  loge_rotate_queue(pr, name);
 
-#endif
+  return fd;
+}
 
 /**
- * @brief Initialize the logger.
- * @param ploge Pointer to struct loge
- * @param max_log_size If 0, a statically allocated buffer with default size of
- * `BUFFER_SIZE` is used, else the buffer is dynamically allocated.
- * @param linenumwidth Width of line number (right aligned and padded on the
- * left with zeroes). Defaults to `NUMBER_WIDTH` if 0 is passed.
- * @param width Width for integers and integral part of decimal numbers.
- * @param precision Precision for fractional part of decimal numbers.
- * @param logtype Type of log, bitmask of enum loge_level OR'd with 0x80000000
- * if timestamp is to be logged. Messages below this level will not be logged.
- * @param file Output stream to write log messages to. Defaults to stdout if
- * NULL * is passed.
- * @param fn Callback function used for writing log messages to output
- * steam. Default callback function will be set if NULL is passed.
- *
- * @see log_fn
- * @see LOGE_TYPE
+ * @brief Stop rotating, waits for the background thread to finish the
+ * rotated files queued. The current descriptor is left to the caller.
+ * @param pr Pointer to struct loge_rotate
  */
 UNUSED
 static
-void loge_setup(
-    struct loge *ploge,
-    size_t max_log_size,
-    int linenumwidth,
-    int width,
-    int precision,
-    int log_type,
-    FILE *file,
-    log_fn fn
-  ) {
-
-  if (!ploge) {
+void loge_rotate_close(struct loge_rotate *pr) {
+  if (!pr->path) {
     return;
   }
 
-  ploge->bufptr = ploge->buffer;
-  ploge->bufcap = BUFFER_SIZE * sizeof(char);
-
-  if (max_log_size > BUFFER_SIZE) {
-    char *mem = (char*)malloc(max_log_size * sizeof(char));
-    if (!mem) {
-      lgerror("malloc for %zu bytes failed: %s",
-          max_log_size * sizeof(char),
-          strerror(errno));
-      return;
-    }
+  pthread_mutex_lock(&pr->mtx);
+  pr->stop = 1;
+  pthread_cond_signal(&pr->cond);
+  pthread_mutex_unlock(&pr->mtx);
 
-    ploge->bufptr = mem;
-    ploge->bufcap = max_log_size * sizeof(char);
+  if (pr->started) {
+    pthread_join(pr->thread, NULL);
   }
 
-  ploge->buflen = 0;
+  pthread_cond_destroy(&pr->cond);
+  pthread_mutex_destroy(&pr->mtx);
 
-  ploge->linenumwidth = LINENUMBER_WIDTH;
-  if (linenumwidth > -1) {
-    ploge->linenumwidth = linenumwidth;
-  }
+  free(pr->path);
+  pr->path = NULL;
+  pr->fd = -1;
+}
 
-  ploge->width = -1;
-  if (width > -1) {
-    ploge->width = width;
-  }
-  ploge->precision = NUMBER_WIDTH >> 1;
-  if (precision > -1) {
-    ploge->precision = precision;
-  }
+#else /* defined(__linux) || defined(__linux__) */
 
-  int en_timestamp = LOGE_ENTIME(log_type);
-  enum loge_level level = LOGE_LEVEL(log_type);
+UNUSED
+static
+int loge_rotate_open(struct loge_rotate *pr, const char *filepath UNUSED,
+    const struct loge_rotate_policy *policy UNUSED) {
+
+  pr->path = NULL;
+  pr->fd = -1;
+  errno = ENOSYS;
+  lgperror("rotating log file");
+  return -1;
+}
 
-  ploge->log_type = LOGE_TYPE(en_timestamp, LOGE_INFO);
-  if (level < LOGE_MAX) {
-    ploge->log_type = LOGE_TYPE(en_timestamp, level);
-  }
+UNUSED
+static
+int loge_rotate_due(struct loge_rotate *pr UNUSED, size_t len UNUSED) {
+  return 0;
+}
 
-  ploge->sockfd = -1;
+UNUSED
+static
+int loge_rotate_next(struct loge_rotate *pr UNUSED) {
+  return -1;
+}
 
-  ploge->file = NULL;
+UNUSED
+static
+void loge_rotate_close(struct loge_rotate *pr) {
+  pr->path = NULL;
+  pr->fd = -1;
+}
 
-  ploge->pprevlogfn = NULL;
-  ploge->plogfn = NULL;
+#endif /* defined(__linux) || defined(__linux__) */
 
-  /* Set default stream as stdout and use default logger function */
-  loge_set_stdout(ploge);
+/* Flight recorder layout, see struct loge_recorder */
+#define LOGE_RECORDER_MAGIC "LGFR"
+#define LOGE_RECORDER_VERSION 1
+#define LOGE_RECORDER_HEADER_SIZE 64
 
-  if (file != NULL) {
-    ploge->file = file;
-  }
+/* Bytes per flight recorder record, longer messages are cut */
+#ifndef LOGE_RECORDER_RECORD_SIZE
+#define LOGE_RECORDER_RECORD_SIZE 256
+#endif
 
-  /* loge_set_stdout() would have set pprevlogfn to NULL */
-  if (fn != NULL) {
-    ploge->plogfn = fn;
-  }
+/* Start of a flight recorder, the records follow at LOGE_RECORDER_HEADER_SIZE */
+struct loge_recorder_header {
+  char magic[4];                /* LOGE_RECORDER_MAGIC */
+  uint32_t version;
+  uint32_t records;             /* Records in the ring */
+  uint32_t record_size;         /* Bytes per record, loge_recorder_slot included */
+  uint64_t head;                /* Records written */
+  uint64_t tail;                /* Records dumped */
+};
 
-  ploge->syslog_priority = -1;
+/* Start of a record, the message follows */
+struct loge_recorder_slot {
+  uint64_t seq;                 /* Record number + 1 once written, 0 before */
+  uint32_t len;
+  int32_t level;
+};
+
+/* Set in seq with the record number while a writer fills the slot */
+#define LOGE_RECORDER_BUSY ((uint64_t)1 << 63)
+
+/**
+ * @brief Flight recorder. Messages below the level of the logger are
+ * formatted into a fixed ring of records instead of being dropped, which
+ * costs no I/O. A message at or above dump_level first writes out what the
+ * ring holds. Any number of threads record at once, a record is claimed by
+ * an atomic increment and published by its sequence number. A writer takes
+ * the slot of its record from the sequence number, a record whose slot is
+ * taken by another writer or already holds a newer record is dropped.
+ *
+ * hdr is published once the ring is set up. Closing the recorder waits for
+ * the threads that are writing into it or dumping it, counted in users.
+ *
+ * The ring may live in a shared mapping of a file, so whatever was recorded
+ * before a crash can be read back with loge-recorder.
+ */
+struct loge_recorder {
+  struct loge_recorder_header *hdr; /* NULL when off */
+  size_t size;                  /* Length of the ring, header included */
+  int fd;                       /* Backing file, -1 for memory */
+  int level;                    /* Lowest level recorded */
+  int dump_level;               /* Messages from this level dump the ring */
+  uint64_t users;               /* Threads using hdr */
+};
+
+/* Called with each record of a dump, data is null-terminated */
+typedef void (*loge_recorder_fn)(void *ctx, const char *data, size_t len,
+    int level);
+
+UNUSED
+static
+inline
+uint64_t loge_atomic_add(uint64_t *p, uint64_t v) {
+#if defined(_MSC_VER) && !defined(__clang__)
+  return (uint64_t)InterlockedExchangeAdd64((volatile LONG64*)p, (LONG64)v);
+#else
+  return __atomic_fetch_add(p, v, __ATOMIC_RELAXED);
+#endif
 }
 
 UNUSED
 static
-void loge_set_default_width(struct loge *ploge) {
-  if (!ploge) {
-    return;
-  }
+inline
+uint64_t loge_atomic_load(const uint64_t *p) {
+#if defined(_MSC_VER) && !defined(__clang__)
+  return (uint64_t)InterlockedOr64((volatile LONG64*)p, 0);
+#else
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#endif
+}
 
-  ploge->width = -1;
+UNUSED
+static
+inline
+void loge_atomic_store(uint64_t *p, uint64_t v) {
+#if defined(_MSC_VER) && !defined(__clang__)
+  InterlockedExchange64((volatile LONG64*)p, (LONG64)v);
+#else
+  __atomic_store_n(p, v, __ATOMIC_RELEASE);
+#endif
 }
 
+/* On failure expected is set to the current value */
 UNUSED
 static
-void loge_set_width(struct loge *ploge, int width) {
-  if (!ploge) {
-    return;
-  }
+inline
+int loge_atomic_cas(uint64_t *p, uint64_t *expected, uint64_t v) {
+#if defined(_MSC_VER) && !defined(__clang__)
+  uint64_t prev = (uint64_t)InterlockedCompareExchange64((volatile LONG64*)p,
+      (LONG64)v, (LONG64)*expected);
+  if (prev == *expected) {
+    return 1;
+  }
+  *expected = prev;
+  return 0;
+#else
+  return __atomic_compare_exchange_n(p, expected, v, 0, __ATOMIC_ACQ_REL,
+      __ATOMIC_ACQUIRE);
+#endif
+}
 
-  if (width > -1) {
-    ploge->width = width;
-  }
+/* Relaxed, for values that only need to be read whole like levels */
+UNUSED
+static
+inline
+int loge_atomic_load_int(const int *p) {
+#if defined(_MSC_VER) && !defined(__clang__)
+  return *(const volatile int*)p;
+#else
+  return __atomic_load_n(p, __ATOMIC_RELAXED);
+#endif
 }
 
 UNUSED
 static
-void loge_set_precision(struct loge *ploge, unsigned int precision) {
-  if (!ploge) {
-    return;
-  }
+inline
+void loge_atomic_store_int(int *p, int v) {
+#if defined(_MSC_VER) && !defined(__clang__)
+  *(volatile int*)p = v;
+#else
+  __atomic_store_n(p, v, __ATOMIC_RELAXED);
+#endif
+}
 
-  ploge->precision = precision;
+UNUSED
+static
+inline
+void loge_atomic_fence(void) {
+#if defined(_MSC_VER) && !defined(__clang__)
+  MemoryBarrier();
+#else
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
 }
 
-/**
- * @brief Deallocates memory used for internal log buffer if dynamically
- * allocated buffer was opted for.
- * @param ploge Pointer to struct loge
- */
 UNUSED
 static
-void loge_destroy(struct loge *ploge) {
-  if (!ploge) {
-    return;
-  }
+inline
+void* loge_atomic_load_ptr(void *const *p) {
+#if defined(_MSC_VER) && !defined(__clang__)
+  return InterlockedCompareExchangePointer((PVOID volatile*)p, NULL, NULL);
+#else
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#endif
+}
 
-#if defined(__GLIBC__) || defined(__FreeBSD__) || defined(__OpenBSD__)
-  if (ploge->syslog_priority > -1) {
-    closelog();
-  }
+UNUSED
+static
+inline
+void loge_atomic_store_ptr(void **p, void *v) {
+#if defined(_MSC_VER) && !defined(__clang__)
+  InterlockedExchangePointer((PVOID volatile*)p, v);
+#else
+  __atomic_store_n(p, v, __ATOMIC_RELEASE);
 #endif
+}
 
-  if ( (!ploge->bufptr) || (ploge->bufptr == ploge->buffer) ) {
-    return;
-  }
+UNUSED
+static
+inline
+struct loge_recorder_slot* loge_recorder_slot(
+    const struct loge_recorder_header *hdr, uint64_t n) {
 
-  free(ploge->bufptr);
-  ploge->bufptr = ploge->buffer;
+  return (struct loge_recorder_slot*)((char*)hdr + LOGE_RECORDER_HEADER_SIZE +
+      (size_t)(n % hdr->records) * hdr->record_size);
 }
 
 /**
- * @brief Connect to a TCP server and associate an output stream with the
- * socket. This stream will be set as the output stream for the logger. The log
- * callback function will be overriden by the default. IPv4 and IPv6 addresses
- * are supported.
- * @param ploge Pointer to struct loge
- * @param ip IPv4 or IPv6 address
- * @param port Port number
- * @param ipv6 Use IPv6 if set to non-zero value, else use IPv4
- * @paramm fileptr Pointer for a FILE* which shall store the previous FILE*
- * used by the logger
- *
- * @see loge_disconnect()
+ * @brief Set up a flight recorder in memory, or in a file that is created or
+ * overwritten
+ * @param pr Pointer to struct loge_recorder
+ * @param records Number of records kept
+ * @param record_size Bytes per record
+ * @param filepath Path of the backing file, NULL to keep it in memory
+ * @return 0 on success, -1 on failure
  */
 UNUSED
 static
-int loge_connect(struct loge *ploge, const char *host,
-    unsigned short port, int type, int ipv6, FILE **fileptr) {
+int loge_recorder_open(struct loge_recorder *pr, size_t records,
+    size_t record_size, const char *filepath) {
 
-  if (!ploge || !host) {
+  if (loge_atomic_load_ptr((void**)&pr->hdr)) {
+    errno = EBUSY;
     return -1;
   }
+  pr->fd = -1;
 
-  socket_type sock = sock_connect(host, port, type, ipv6);
-  if (sock == LOGE_SOCK_ERR) {
+  record_size = (record_size + 7) & ~(size_t)7;
+  if (!records || records > 0xffffffffUL ||
+      record_size <= sizeof(struct loge_recorder_slot) ||
+      record_size > 0xffffffffUL) {
+    errno = EINVAL;
+    lgperror("flight recorder");
     return -1;
   }
 
-  FILE *file = fdopen(socket_to_native(sock), "w");
-  if (!file) {
-    lgperror(fdopen_str" failed");
-    destroy_socket(sock);
-    return -1;
-  }
+  size_t size = LOGE_RECORDER_HEADER_SIZE + records * record_size;
+  void *p = NULL;
 
-  ploge->sockfd = sock;
+  if (filepath) {
+#if defined(__linux) || defined(__linux__)
+    int fd = open(filepath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+        S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+    if (fd < 0) {
+      lgperror("open failed");
+      return -1;
+    }
 
-  ploge->pprevlogfn = ploge->plogfn;
-  ploge->plogfn = &log_internal;
+    if (ftruncate(fd, (off_t)size) < 0) {
+      lgperror("ftruncate failed");
+      close(fd);
+      return -1;
+    }
 
-  FILE *prev = loge_set_fileptr(ploge, file);
-  if (fileptr) {
-    *fileptr = prev;
-  }
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+      lgperror("mmap failed");
+      close(fd);
+      return -1;
+    }
 
-  return 0;
-}
+    pr->fd = fd;
+#else
+    errno = ENOSYS;
+    lgperror("file backed flight recorder");
+    return -1;
+#endif
 
-/**
- * @brief Disconnect from TCP server. Associated output stream gets closed
- * along with the underlying socket. The output stream pointer is set to NULL
- * and needs to be set afterwards.
- * @param ploge Pointer to struct loge
- *
- * @see loge_connect()
- */
-UNUSED
-static
-void loge_disconnect(struct loge *ploge) {
-  if (!ploge) {
-    return;
+  } else {
+    p = calloc(1, size);
+    if (!p) {
+      lgperror("calloc failed");
+      return -1;
+    }
   }
 
-  if (ploge->sockfd == -1) {
-    return;
+  struct loge_recorder_header *hdr = (struct loge_recorder_header*)p;
+  memcpy(hdr->magic, LOGE_RECORDER_MAGIC, sizeof(hdr->magic));
+  hdr->version = LOGE_RECORDER_VERSION;
+  hdr->records = (uint32_t)records;
+  hdr->record_size = (uint32_t)record_size;
+  hdr->head = 0;
+  hdr->tail = 0;
+
+  pr->size = size;
+  loge_atomic_store_ptr((void**)&pr->hdr, hdr);
+
+  return 0;
+}
+
+/* Ring of a recorder that is on, see loge_recorder_leave() */
+UNUSED
+static
+inline
+struct loge_recorder_header* loge_recorder_enter(struct loge_recorder *pr) {
+  if (!loge_atomic_load_ptr((void**)&pr->hdr)) {
+    return NULL;
   }
 
-  /* Stop data communication */
-  shutdown_socket(ploge->sockfd);
+  /* Either loge_recorder_close() sees the count or this sees hdr gone */
+  loge_atomic_add(&pr->users, 1);
+  loge_atomic_fence();
 
-  /* fclose will close the underlying socket fd on linux */
-  fclose(ploge->file);
+  struct loge_recorder_header *hdr =
+    (struct loge_recorder_header*)loge_atomic_load_ptr((void**)&pr->hdr);
+  if (!hdr) {
+    loge_atomic_add(&pr->users, (uint64_t)-1);
+  }
 
-  ploge->file = NULL;
-  ploge->sockfd = -1;
+  return hdr;
+}
 
-  ploge->plogfn = ploge->pprevlogfn;
+UNUSED
+static
+inline
+void loge_recorder_leave(struct loge_recorder *pr) {
+  /* Writes to the ring come before the ring can be freed */
+  loge_atomic_fence();
+  loge_atomic_add(&pr->users, (uint64_t)-1);
 }
 
+/* Stop recording, waits for the threads still writing into the ring */
 UNUSED
 static
-void loge_reset_logfn(struct loge *ploge) {
-  if (!ploge) {
+void loge_recorder_close(struct loge_recorder *pr) {
+  struct loge_recorder_header *hdr =
+    (struct loge_recorder_header*)loge_atomic_load_ptr((void**)&pr->hdr);
+  if (!hdr) {
     return;
   }
 
-  ploge->pprevlogfn = ploge->plogfn;
-  ploge->plogfn = &log_internal;
+  loge_atomic_store_ptr((void**)&pr->hdr, NULL);
+  loge_atomic_fence();
+  while (loge_atomic_load(&pr->users)) {
+  }
+
+#if defined(__linux) || defined(__linux__)
+  if (pr->fd > -1) {
+    munmap(hdr, pr->size);
+    close(pr->fd);
+  } else
+#endif
+  free(hdr);
+
+  pr->fd = -1;
 }
 
+/**
+ * @brief Claim the next record, overwriting the oldest one
+ * @param pr Pointer to struct loge_recorder
+ * @param cap Set to the room for the message
+ * @return Where the message goes, NULL if the recorder is off or the record
+ * is dropped. Otherwise loge_recorder_commit() has to follow.
+ */
 UNUSED
 static
-void loge_reset(struct loge *ploge) {
-  if (!ploge) {
-    return;
+char* loge_recorder_claim(struct loge_recorder *pr, size_t *cap) {
+  struct loge_recorder_header *hdr = loge_recorder_enter(pr);
+  if (!hdr) {
+    return NULL;
   }
 
-  ploge->buflen = 0;
+  uint64_t n = loge_atomic_add(&hdr->head, 1);
+
+  /* A writer a whole ring ahead or behind may be in the same slot */
+  struct loge_recorder_slot *slot = loge_recorder_slot(hdr, n);
+  uint64_t seq = loge_atomic_load(&slot->seq);
+  do {
+    if ((seq & LOGE_RECORDER_BUSY) || seq > n) {
+      loge_recorder_leave(pr);
+      return NULL;
+    }
+  } while (!loge_atomic_cas(&slot->seq, &seq, LOGE_RECORDER_BUSY | n));
+
+  *cap = hdr->record_size - sizeof(*slot);
+  return (char*)(slot + 1);
 }
 
+/* Publish a record claimed by loge_recorder_claim(), msg is its message */
 UNUSED
 static
-void loge_flush(struct loge *ploge) {
-  if (!ploge) {
-    return;
+void loge_recorder_commit(struct loge_recorder *pr, char *msg, size_t len,
+    int level) {
+
+  struct loge_recorder_slot *slot = (struct loge_recorder_slot*)msg - 1;
+  uint64_t n = loge_atomic_load(&slot->seq) & ~LOGE_RECORDER_BUSY;
+
+  slot->len = (uint32_t)len;
+  slot->level = level;
+  loge_atomic_store(&slot->seq, n + 1);
+
+  loge_recorder_leave(pr);
+}
+
+/**
+ * @brief Hand records from up to to that are still in the ring to fn,
+ * oldest first. Records overwritten while copied are skipped.
+ * @return Number of records handed to fn
+ */
+UNUSED
+static
+size_t loge_recorder_walk(const struct loge_recorder_header *hdr,
+    uint64_t from, uint64_t to, loge_recorder_fn fn, void *ctx) {
+
+  if (to - from > hdr->records) {
+    from = to - hdr->records;
   }
 
-  if (ploge->plogfn) {
-    ploge->plogfn(ploge);
-  } else {
-    lgerror("log callback not set for logger %p", ploge);
+  size_t cap = hdr->record_size - sizeof(struct loge_recorder_slot);
+  char *copy = (char*)malloc(cap + 1);
+  if (!copy) {
+    return 0;
   }
 
-  loge_reset(ploge);
+  size_t count = 0;
+
+  for (uint64_t n = from; n < to; n++) {
+    struct loge_recorder_slot *slot = loge_recorder_slot(hdr, n);
+    if (loge_atomic_load(&slot->seq) != n + 1) {
+      continue;
+    }
+
+    size_t len = slot->len;
+    int level = slot->level;
+    if (len > cap) {
+      continue;
+    }
+    memcpy(copy, slot + 1, len);
+    copy[len] = '\0';
+
+    loge_atomic_fence();
+    if (loge_atomic_load(&slot->seq) != n + 1) {
+      continue;
+    }
+
+    fn(ctx, copy, len, level);
+    count++;
+  }
+
+  free(copy);
+
+  return count;
 }
 
 /**
- * @brief Log information as string, to an output stream.
- *
- * If raw data callback has been set this function will be called. The function
- * shall be called with the following arguments:
- *
- * Otherwise the log message callback will be called. Log message will be
- * formatted as:
- * m-dd-yyyy:HH-mm-ss: filename:linenum: loglevel: <user message>
- *
- * User message shall be in the form of a format string followed by arguments.
- *
- * When the logger is connected to a UDP/TCP server, the output stream will be
- * associated with the socket descriptor that will be used for sending UDP/TCP
- * messages.
- *
- * struct loge *ploge       Pointer to struct loge
- * int logtype              Bitmask of enum loge_level for the level of log
- *                          message, and 0x80000000 for colored message
- * int linenum              Line number to log in log message
- * const char *filename     Output file
- * const char *msg          User message format string
- * ...                      Arguments to format string
- *
- * @param ploge Pointer to struct loge
- * @param logtype Type of log, bitmask of enum loge_level OR'd with 0x80000000
- * @param linenum Line number of the source file from where logging happened
- * for colored output
- * @param filename Name of the source file
- * @param msg Format string for user message that will be appended to formatted
- * information
- * @param ... Arguments for user message format string
- *
- * @see log_fn
- * @see log_data_fn
+ * @brief Hand the records recorded since the last dump to fn, oldest first
+ * @return Number of records handed to fn
  */
 UNUSED
 static
-void loge_log(
-    struct loge *ploge,
-    int logtype,
-    int linenum,
-    const char *filename,
-    const char *msg,
-    ...
-  ) {
+size_t loge_recorder_dump(struct loge_recorder *pr, loge_recorder_fn fn,
+    void *ctx) {
 
-  time_t t = time(NULL);
-  struct tm localtm = *localtime(&t);
+  struct loge_recorder_header *hdr = loge_recorder_enter(pr);
+  if (!hdr) {
+    return 0;
+  }
 
-  if (!ploge) {
-    return;
+  uint64_t to = loge_atomic_load(&hdr->head);
+  uint64_t from = loge_atomic_load(&hdr->tail);
+  size_t count = 0;
+
+  /* Each record is dumped once, by whoever moves the tail past it */
+  do {
+    if (from >= to) {
+      loge_recorder_leave(pr);
+      return 0;
+    }
+  } while (!loge_atomic_cas(&hdr->tail, &from, to));
+
+  count = loge_recorder_walk(hdr, from, to, fn, ctx);
+
+  loge_recorder_leave(pr);
+
+  return count;
+}
+
+/**
+ * @brief Check the header of a flight recorder read back from a file
+ * @param data Contents of the file
+ * @param size Length of the file
+ * @return Pointer to the header, NULL if it is not a flight recorder
+ */
+UNUSED
+static
+const struct loge_recorder_header* loge_recorder_check(const void *data,
+    size_t size) {
+
+  const struct loge_recorder_header *hdr =
+    (const struct loge_recorder_header*)data;
+
+  if (size < LOGE_RECORDER_HEADER_SIZE ||
+      memcmp(hdr->magic, LOGE_RECORDER_MAGIC, sizeof(hdr->magic)) ||
+      hdr->version != LOGE_RECORDER_VERSION || !hdr->records ||
+      hdr->record_size <= sizeof(struct loge_recorder_slot) ||
+      (size - LOGE_RECORDER_HEADER_SIZE) / hdr->record_size < hdr->records) {
+    return NULL;
   }
 
-  enum loge_level loglevel = LOGE_LOGLEVEL(logtype);
-  enum loge_level mylevel = LOGE_LEVEL(ploge->log_type);
+  return hdr;
+}
 
-  if (loglevel >= LOGE_MAX ||
-      loglevel < mylevel) {
+/* One definition shared by every object that includes this header */
+#if defined(_MSC_VER) && !defined(__clang__)
+#define LOGE_SHARED __declspec(selectany)
+#else
+#define LOGE_SHARED __attribute__((weak))
+#endif
+
+/* Thread local counterpart of LOGE_SHARED */
+#if defined(__cplusplus) && __cplusplus >= 201703L
+#define LOGE_SHARED_TLS inline thread_local
+#else
+#define LOGE_SHARED_TLS LOGE_SHARED LOGE_THREAD_LOCAL
+#endif
+
+/**
+ * @brief Token bucket of a rate limited call site, see LOGE_RATELIMIT().
+ * Zero initialized in a static of the macro expansion. The bucket holds
+ * burst tokens and gains burst of them per interval_ms. It is kept as the
+ * time it will be full again, in milliseconds times burst, so that a
+ * single compare and swap takes a token.
+ */
+struct loge_ratelimit {
+  uint64_t full_at;
+  uint64_t suppressed;          /* Calls turned away since the last pass */
+  uint64_t listed;              /* Set once the site is in the list */
+
+  /* Filled in when the site first turns a call away */
+  uint64_t logger;              /* Cleared when the logger goes away */
+  int level;
+  int line;
+  const char *file;
+  unsigned int burst;
+  unsigned int interval_ms;
+  struct loge_ratelimit *next;
+};
+
+/* Sites that turned calls away, see loge_ratelimit_expire() */
+LOGE_SHARED uint64_t loge_ratelimit_head;
+
+/* Log the summary line of a site, see loge_ratelimit_expire() */
+typedef void (*loge_ratelimit_fn)(void *logger, int level, const char *file,
+    int line, unsigned long long suppressed);
+
+/* Add a site to the list the first time it turns a call away */
+UNUSED
+static
+void loge_ratelimit_list(struct loge_ratelimit *rl, void *logger, int level,
+    const char *file, int line, unsigned int burst, unsigned int interval_ms) {
+
+  uint64_t unlisted = 0;
+  if (!loge_atomic_cas(&rl->listed, &unlisted, 1)) {
+    /* Listed for a logger that is gone, taken over by this one */
+    uint64_t none = 0;
+    loge_atomic_cas(&rl->logger, &none, (uint64_t)(uintptr_t)logger);
     return;
   }
 
-  int en_color = LOGE_ENCOLOR(logtype);
+  loge_atomic_store(&rl->logger, (uint64_t)(uintptr_t)logger);
+  rl->level = level;
+  rl->file = file;
+  rl->line = line;
+  rl->burst = burst;
+  rl->interval_ms = interval_ms;
 
-  const char *loglvl_tbl = en_color ?
-    loglevel_strtbl_color[loglevel] :
-    loglevel_strtbl[loglevel];
+  uint64_t head = loge_atomic_load(&loge_ratelimit_head);
+  do {
+    rl->next = (struct loge_ratelimit*)(uintptr_t)head;
+  } while (!loge_atomic_cas(&loge_ratelimit_head, &head,
+        (uint64_t)(uintptr_t)rl));
+}
 
-  int len = 0;
+/* Take the count of calls turned away, for one summary line */
+UNUSED
+static
+inline
+unsigned long long loge_ratelimit_take(struct loge_ratelimit *rl) {
+  uint64_t n = loge_atomic_load(&rl->suppressed);
+  while (n && !loge_atomic_cas(&rl->suppressed, &n, 0)) {
+  }
+  return n;
+}
 
-  if (!ploge->pdatafn) {
-    int en_timestamp = LOGE_ENTIME(ploge->log_type);
+/**
+ * @brief Take a token for a call, before anything is formatted
+ * @param rl Pointer to struct loge_ratelimit of the call site
+ * @param burst Calls let through at once, refilled over interval_ms
+ * @param interval_ms Time to refill the whole bucket
+ * @param suppressed Set to the calls turned away before this one
+ * @param logger, level, file, line Where the summary goes if no call comes
+ * through again, see loge_ratelimit_expire()
+ * @return Non-zero to let the call through
+ */
+UNUSED
+static
+inline
+int loge_ratelimit_pass(struct loge_ratelimit *rl, unsigned int burst,
+    unsigned int interval_ms, unsigned long long *suppressed, void *logger,
+    int level, const char *file, int line) {
 
-    if (en_timestamp) {
-      len = snprintf(
-          ploge->bufptr, ploge->bufcap,
-          "%02d-%02d-%04d:%02d:%02d:%02d: %s:%0*d: %-*s: ",
-          localtm.tm_mon + 1, localtm.tm_mday, localtm.tm_year + 1900,
-          localtm.tm_hour, localtm.tm_min, localtm.tm_sec,
-          filename,
-          ploge->linenumwidth, linenum,
-          en_color ? 22 : 8, loglvl_tbl
-        );
+  if (!burst) {
+    burst = 1;
+  }
 
-    } else {
-      len = snprintf(
-          ploge->bufptr, ploge->bufcap,
-          "%s:%0*d: %-*s: ",
-          filename,
-          ploge->linenumwidth, linenum,
-          en_color ? 22 : 8, loglvl_tbl
-        );
+  uint64_t now = (uint64_t)loge_now_ms() * burst;
+  uint64_t full_at = loge_atomic_load(&rl->full_at);
+  uint64_t later;
+
+  do {
+    uint64_t from = full_at > now ? full_at : now;
+    if (from - now > (uint64_t)interval_ms * (burst - 1)) {
+      if (!loge_atomic_load(&rl->listed) || !loge_atomic_load(&rl->logger)) {
+        loge_ratelimit_list(rl, logger, level, file, line, burst,
+            interval_ms);
+      }
+      loge_atomic_add(&rl->suppressed, 1);
+      return 0;
+    }
+    later = from + interval_ms;
+  } while (!loge_atomic_cas(&rl->full_at, &full_at, later));
+
+  *suppressed = loge_ratelimit_take(rl);
+
+  return 1;
+}
+
+/**
+ * @brief Report the calls a site turned away once its window is over, for
+ * sites that are not called again. The logger flush calls do this, a
+ * logger being destroyed reports everything still pending.
+ * @param logger Logger the summaries are for, sites of others are skipped
+ * @param all Report sites whose window is not over too
+ * @param fn Logs the summary line
+ */
+UNUSED
+static
+void loge_ratelimit_expire(void *logger, int all, loge_ratelimit_fn fn) {
+  struct loge_ratelimit *rl = (struct loge_ratelimit*)(uintptr_t)
+    loge_atomic_load(&loge_ratelimit_head);
+  uint64_t now = (uint64_t)loge_now_ms();
+
+  for (; rl; rl = rl->next) {
+    if (loge_atomic_load(&rl->logger) != (uint64_t)(uintptr_t)logger ||
+        !loge_atomic_load(&rl->suppressed)) {
+      continue;
+    }
+
+    /* Over when a call would be let through again */
+    uint64_t at = now * rl->burst;
+    uint64_t full_at = loge_atomic_load(&rl->full_at);
+    if (!all && full_at > at &&
+        full_at - at > (uint64_t)rl->interval_ms * (rl->burst - 1)) {
+      continue;
+    }
+
+    unsigned long long n = loge_ratelimit_take(rl);
+    if (n) {
+      fn(logger, rl->level, rl->file, rl->line, n);
     }
   }
+}
 
-  va_list args;
-  va_start(args, msg);
+/*
+ * Detach the sites listed for a logger that is going away, after its last
+ * summaries are out. Another logger created at the same address does not
+ * get its pending sites, a site turning a call away for it is taken over.
+ */
+UNUSED
+static
+void loge_ratelimit_forget(void *logger) {
+  struct loge_ratelimit *rl = (struct loge_ratelimit*)(uintptr_t)
+    loge_atomic_load(&loge_ratelimit_head);
+  uint64_t key = (uint64_t)(uintptr_t)logger;
+
+  for (; rl; rl = rl->next) {
+    uint64_t expected = key;
+    if (loge_atomic_cas(&rl->logger, &expected, 0)) {
+      loge_atomic_store(&rl->suppressed, 0);
+    }
+  }
+}
 
-  len += vsnprintf(ploge->bufptr + len, ploge->bufcap - len, msg, args);
+/*
+ * Sampling state of the thread, see loge_sample(). Shared by every object
+ * that includes this header, a key set in one of them holds for logging
+ * calls in the others.
+ */
+LOGE_SHARED_TLS uint64_t loge_sample_rng = 0;
 
-  va_end(args);
+LOGE_SHARED_TLS uint64_t loge_sample_key_hash = 0;
 
-  ploge->buflen = len;
+/* Spread the bits of x over the whole word, the splitmix64 finalizer */
+UNUSED
+static
+inline
+uint64_t loge_mix64(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
 
-  if (ploge->pdatafn) {
-    ploge->pdatafn(
-        ploge->file,
-        t,
-        filename,
-        linenum,
-        loglevel,
-        ploge->bufptr
-      );
+/**
+ * @brief Set the key of the request this thread works on, 0 for none. While
+ * a key is set sampling decisions depend on it alone, every line logged for
+ * a request is kept or dropped together, on any thread and by any logger
+ * with the same rate. A key kept at 1 in n is also kept at any rate that
+ * divides n.
+ * @param key Request id or a hash of it
+ */
+UNUSED
+static
+inline
+void loge_sample_key(uint64_t key) {
+  loge_sample_key_hash = key ? loge_mix64(key) : 0;
+}
+
+/**
+ * @brief Set a string as the sampling key of this thread, NULL for none
+ * @param key Request id
+ *
+ * @see loge_sample_key()
+ */
+UNUSED
+static
+inline
+void loge_sample_key_str(const char *key) {
+  /* FNV-1a */
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (; key && *key; key++) {
+    h = (h ^ (unsigned char)*key) * 0x100000001b3ULL;
+  }
+  loge_sample_key(key ? h : 0);
+}
+
+/**
+ * @brief Decide whether to keep a message sampled at 1 in rate, by the key
+ * of the thread or else at random with a thread local xorshift generator
+ * @param rate Keep one message in rate, 0 or 1 to keep all
+ * @return Non-zero to keep the message
+ */
+UNUSED
+static
+inline
+int loge_sample(uint64_t rate) {
+  if (rate <= 1) {
+    return 1;
+  }
+
+  if (loge_sample_key_hash) {
+    return loge_sample_key_hash % rate == 0;
+  }
+
+  uint64_t x = loge_sample_rng;
+  if (!x) {
+    x = loge_mix64((uint64_t)(uintptr_t)&loge_sample_rng ^
+        loge_now_ms()) | 1;
+  }
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  loge_sample_rng = x;
+
+  return (x * 0x2545f4914f6cdd1dULL) % rate == 0;
+}
+
+/**
+ * @brief Replace all occurences of a substring with anohter string. On success
+ * a new dynamically allocated string is returned that should be freed after
+ * use.
+ *
+ * https://stackoverflow.com/a/779960
+ *
+ * @param str The string in which the replacement happens
+ * @param pat The substring that will get replaced
+ * @param rep The string that will replace the substring
+ * @return NULL on failure, pointer to a dynamically allocated string on
+ * success
+ */
+UNUSED
+static
+char* strreplace(const char *str, const char *pat, const char *rep) {
+  const char *start;
+  char *p;
+  char *result;
+  size_t patlen;
+  size_t replen;
+  size_t reslen;
+  size_t offset;
+  size_t count;
+
+  if (!str || !pat) {
+    return NULL;
+  }
+
+  patlen = strlen(pat);
+  if (!patlen) {
+    return NULL;
+  }
+
+  if (!rep) {
+    rep = "";
+  }
+  replen = strlen(rep);
+
+  start = str;
+  for (count = 0; (p = strstr((char*)start, pat)); count++) {
+    start = p + patlen;
+  }
+
+  reslen = strlen(str) + (replen - patlen) * count;
+  if (!reslen) {
+    return NULL;
+  }
+
+  p = result = (char*)malloc(reslen + 1);
+  if (!result) {
+    return NULL;
+  }
+
+  while (count--) {
+    start = strstr(str, pat);
+    offset = start - str;
+    p = strncpy(p, str, offset) + offset;
+    p = strncpy(p, rep, replen) + replen;
+    str += offset + patlen;
+    reslen -= offset + replen;
+  }
+  strncpy(p, str, reslen);
+  p[reslen] = '\0';
+
+  return result;
+}
+
+#if defined(_MSC_VER) || !defined(__GLIBC__)
+
+static
+int dprintf(int d, const char *fmt, ...) {
+ enum { BUFFER_SIZE_DPRINTF = 4096 };
+
+ va_list ap; 
+ int done;
+ int at = 0, nwrite = 0;
+ char *buf;
+
+ buf = (char*)malloc(sizeof(char) * BUFFER_SIZE_DPRINTF);
+ if (!buf) {
+   return 0;
+ }
+
+ va_start(ap, fmt);
+ done = vsnprintf(buf, BUFFER_SIZE_DPRINTF, fmt, ap);
+ va_end(ap);
+
+ do {
+   nwrite = _write(d, buf + at, done);
+   at += nwrite;
+   done -= nwrite;
+  } while (done > 0);
+
+ free(buf);
+
+ return at;
+}
+
+#endif
+
+/**
+ * @brief Connect to a TCP server and associate an output stream with the
+ * socket. This stream will be set as the output stream for the logger. The log
+ * callback function will be overriden by the default. IPv4 and IPv6 addresses
+ * are supported.
+ * @param ploge Pointer to struct loge
+ * @param ip IPv4 or IPv6 address
+ * @param port Port number
+ * @param ipv6 Uses IPv6 if set to non-zero value, else uses IPv4
+ *
+ * @see loge_disconnect()
+ */
+static
+socket_type sock_connect(const char *host, unsigned short port, int type, int ipv6) {
+
+  socket_type sock = LOGE_SOCK_ERR;
+
+  if (!host) {
+    return sock;
+  }
+
+#if defined(__linux) || defined(__linux__)
+
+  struct sockaddr_in server_addr;
+  struct sockaddr_in6 server_addr6;
+
+  int domain = ipv6 ? AF_INET6 : AF_INET;
+
+  if ((sock = socket(domain, type > 0 ? SOCK_STREAM : SOCK_DGRAM, 0)) < 0) {
+    lgperror("socket failed");
+    return sock;
+  }
+
+  if (ipv6) {
+    memset(&server_addr6, 0, sizeof(struct sockaddr_in6));
+    server_addr6.sin6_family = AF_INET6;
+    server_addr6.sin6_port = htons(port);
+  } else {
+    memset(&server_addr, 0, sizeof(struct sockaddr_in));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+  }
+
+  struct sockaddr *addr = ipv6 ?
+    (struct sockaddr *)&server_addr6 :
+    (struct sockaddr *)&server_addr;
+
+  size_t addr_size = ipv6 ?
+    sizeof(struct sockaddr_in6) :
+    sizeof(struct sockaddr_in);
+
+  int ret;
+  /* Convert IPv4/IPv6 address from text to binary form */
+  if (ipv6) {
+    ret = inet_pton(AF_INET6, host, &server_addr6.sin6_addr);
+  } else {
+    ret = inet_pton(AF_INET, host, &server_addr.sin_addr);
+  }
+  if (ret <= 0) {
+    lgperror("inet_pton failed");
+    goto error;
+  }
+
+  if (connect(sock, addr, addr_size) == 0) {
+    return sock;
+  } else {
+    lgperror("connect failed");
+  }
+
+error:
+  close(sock);
+  sock = LOGE_SOCK_ERR;
+
+#elif defined(_WIN64)
+
+  WSADATA wsadata;
+
+  int ret = WSAStartup(MAKEWORD(2,2), &wsadata);
+
+  struct sockaddr_in server_addr;
+  struct sockaddr_in6 server_addr6;
+
+  int domain = ipv6 ? AF_INET6 : AF_INET;
+
+  if ((sock = socket(domain, type > 0 ? SOCK_STREAM : SOCK_DGRAM, 0)) < 0) {
+    lgperror("socket failed");
+    return sock;
+  }
+
+  if (ipv6) {
+    memset(&server_addr6, 0, sizeof(struct sockaddr_in6));
+    server_addr6.sin6_family = AF_INET6;
+    server_addr6.sin6_port = htons(port);
+  } else {
+    memset(&server_addr, 0, sizeof(struct sockaddr_in));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+  }
+
+  struct sockaddr *addr = ipv6 ?
+    (struct sockaddr *)&server_addr6 :
+    (struct sockaddr *)&server_addr;
+
+  socklen_t addr_size = ipv6 ?
+    sizeof(struct sockaddr_in6) :
+    sizeof(struct sockaddr_in);
+
+  /* Convert IPv4/IPv6 address from text to binary form */
+  if (ipv6) {
+    ret = inet_pton(AF_INET6, host, &server_addr6.sin6_addr);
+  } else {
+    ret = inet_pton(AF_INET, host, &server_addr.sin_addr);
+  }
+  if (ret <= 0) {
+    lgperror("inet_pton failed");
+    goto error;
+  }
+
+  if (connect(sock, addr, addr_size) != SOCKET_ERROR) {
+    return sock;
+  } else {
+    lgperror("connect failed");
+  }
+
+error:
+  closesocket(sock);
+  WSACleanup();
+  sock = LOGE_SOCK_ERR;
+
+#endif
+
+  return sock;
+}
+
+/**
+ * @brief Connect a Unix domain socket to a local server, without reporting
+ * errors, which are left in errno.
+ * @param path Path of the server socket
+ * @param type SOCK_SEQPACKET, SOCK_DGRAM or SOCK_STREAM
+ * @return Socket on success, -1 on failure
+ */
+static
+int sock_connect_unix(const char *path, int type) {
+
+#if defined(__linux) || defined(__linux__)
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+
+  if (!path || strlen(path) >= sizeof(addr.sun_path)) {
+    errno = EINVAL;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int sock = socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
+  if (sock < 0) {
+    return -1;
+  }
+
+  if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    int err = errno;
+    close(sock);
+    errno = err;
+    return -1;
+  }
+
+  return sock;
+
+#else
+
+  (void)path;
+  (void)type;
+  errno = ENOSYS;
+  return -1;
+
+#endif
+}
+
+/* Bytes of records queued in memory by the TCP sink */
+#ifndef LOGE_TCP_QUEUE_SIZE
+#define LOGE_TCP_QUEUE_SIZE (1 << 20)
+#endif
+
+/* Bytes read back from the spool file at a time */
+#define LOGE_TCP_REPLAY_SIZE (64 * 1024)
+
+/* Longest sleep of the poller, bounds how late a stop is noticed */
+#define LOGE_TCP_IDLE_MS 100
+
+/**
+ * @brief How the TCP sink copes with a slow or absent peer, 0 picks the
+ * default of a field. While the peer is down records go to the spool file
+ * and are sent from there, in order, once it is back. Without a spool file
+ * they wait in the queue and are dropped when it is full.
+ */
+struct loge_tcp_policy {
+  size_t queue_bytes;           /* Send queue, LOGE_TCP_QUEUE_SIZE */
+  unsigned int backoff_min_ms;  /* First reconnect delay, 100 */
+  unsigned int backoff_max_ms;  /* Delays double up to this, 30000 */
+  const char *spool_path;       /* Spool file, NULL for none */
+  unsigned long long spool_max_bytes; /* Largest spool, 0 for no limit */
+};
+
+/**
+ * @brief TCP sink that does not block the logging thread. Records are
+ * copied into a bounded queue and a poller thread sends them on a
+ * non-blocking socket, reconnecting with exponential backoff when the
+ * connection fails. Data is only ever given up at record boundaries, a
+ * record cut by a broken connection is sent again whole on the next one.
+ *
+ * The spool file is kept across runs, records left in it are replayed
+ * after the next connection. Records the peer had not read when the
+ * connection broke can be lost or sent twice, as with any TCP sender.
+ */
+struct loge_tcp {
+  struct loge_tcp_policy policy;
+  char *queue;                  /* NULL when closed */
+  int sock;                     /* -1 while disconnected */
+#if defined(__linux) || defined(__linux__)
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  pthread_t thread;
+  pthread_mutex_t mtx;
+  pthread_cond_t cond;
+#endif
+  /* Queue positions, counted from the start */
+  unsigned long long head;      /* Queued by producers */
+  unsigned long long sent;      /* Handed to the socket */
+  unsigned long long tail;      /* Done with, at a record boundary */
+  unsigned long long dropped;   /* Records dropped */
+  char *spool_path;
+  int spool_fd;
+  unsigned long long spool_size;
+  unsigned long long spool_sent; /* Handed to the socket */
+  unsigned long long spool_done; /* Done with, at a record boundary */
+  char *replay;                 /* Buffer for reading the spool back */
+  unsigned int backoff_ms;
+  unsigned long long retry_ms;  /* Next connection attempt */
+  int reported;                 /* Connection failure reported */
+  int waiting;                  /* Poller asleep */
+  int stop;
+};
+
+#if defined(__linux) || defined(__linux__)
+
+/* Records in data, counted by their line breaks */
+UNUSED
+static
+unsigned long long loge_tcp_records(const char *data, size_t len) {
+  unsigned long long n = 0;
+  const char *end = data + len;
+
+  while ((data = (const char*)memchr(data, '\n', (size_t)(end - data)))) {
+    data++;
+    n++;
+  }
+  return n;
+}
+
+/* Past the last line break in data, 0 if there is none */
+UNUSED
+static
+size_t loge_tcp_boundary(const char *data, size_t len) {
+  while (len && data[len - 1] != '\n') {
+    len--;
+  }
+  return len;
+}
+
+/* Drop the connection, what was not done with is sent again */
+UNUSED
+static
+void loge_tcp_drop(struct loge_tcp *pt) {
+  pthread_mutex_lock(&pt->mtx);
+  close(pt->sock);
+  pt->sock = -1;
+  pt->sent = pt->tail;
+  pt->retry_ms = 0;
+  pthread_mutex_unlock(&pt->mtx);
+
+  pt->spool_sent = pt->spool_done;
+}
+
+/* Non-blocking connect, waits for it up to backoff_max_ms */
+UNUSED
+static
+void loge_tcp_connect(struct loge_tcp *pt) {
+  int sock = socket(pt->addr.ss_family, SOCK_STREAM, 0);
+  int err = 0;
+
+  if (sock < 0) {
+    err = errno;
+
+  } else {
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+    if (connect(sock, (struct sockaddr*)&pt->addr, pt->addrlen) < 0) {
+      err = errno;
+    }
+
+    if (err == EINPROGRESS) {
+      struct pollfd pfd = { sock, POLLOUT, 0 };
+      socklen_t errlen = sizeof(err);
+
+      if (poll(&pfd, 1, (int)pt->policy.backoff_max_ms) <= 0) {
+        err = ETIMEDOUT;
+      } else if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0) {
+        err = errno;
+      }
+    }
+  }
+
+  unsigned long long now = loge_now_ms();
+
+  pthread_mutex_lock(&pt->mtx);
+
+  if (!err) {
+    pt->sock = sock;
+    pt->backoff_ms = pt->policy.backoff_min_ms;
+    pt->reported = 0;
+
+  } else {
+    if (sock > -1) {
+      close(sock);
+    }
+
+    /* Once per outage */
+    if (!pt->reported) {
+      errno = err;
+      lgperror("tcp sink connect failed");
+      pt->reported = 1;
+    }
+
+    pt->retry_ms = now + pt->backoff_ms;
+    pt->backoff_ms = pt->backoff_ms * 2 > pt->policy.backoff_max_ms ?
+      pt->policy.backoff_max_ms :
+      pt->backoff_ms * 2;
+  }
+
+  pthread_mutex_unlock(&pt->mtx);
+}
+
+/*
+ * Send data, returns how much of it was sent. *done is set past the last
+ * line break sent, 0 if none was. *status is 0 when all was sent, 1 when
+ * the socket would block for longer than timeout_ms and -1 when the
+ * connection broke.
+ */
+UNUSED
+static
+size_t loge_tcp_send(struct loge_tcp *pt, const char *data, size_t len,
+    int timeout_ms, size_t *done, int *status) {
+
+  size_t sent = 0;
+
+  *done = 0;
+  *status = 0;
+
+  while (sent < len) {
+    ssize_t n = send(pt->sock, data + sent, len - sent,
+        MSG_NOSIGNAL | MSG_DONTWAIT);
+
+    if (n > 0) {
+      size_t end = loge_tcp_boundary(data + sent, (size_t)n);
+      if (end) {
+        *done = sent + end;
+      }
+      sent += (size_t)n;
+      continue;
+    }
+
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      struct pollfd pfd = { pt->sock, POLLOUT, 0 };
+      if (poll(&pfd, 1, timeout_ms) > 0) {
+        continue;
+      }
+      *status = 1;
+      return sent;
+    }
+
+    *status = -1;
+    return sent;
+  }
+
+  return sent;
+}
+
+/* True if the peer closed the connection, noticed before sending to it */
+UNUSED
+static
+int loge_tcp_closed(const struct loge_tcp *pt) {
+  char c;
+  ssize_t n = recv(pt->sock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+      errno != EINTR);
+}
+
+/* Send what is queued, returns 0 when all of it was sent */
+UNUSED
+static
+int loge_tcp_send_queue(struct loge_tcp *pt, unsigned long long head,
+    int timeout_ms) {
+
+  size_t cap = pt->policy.queue_bytes;
+
+  if (loge_tcp_closed(pt)) {
+    loge_tcp_drop(pt);
+    return -1;
+  }
+
+  while (pt->sent < head) {
+    size_t off = (size_t)(pt->sent % cap);
+    size_t len = (size_t)(head - pt->sent);
+    if (len > cap - off) {
+      len = cap - off;
+    }
+
+    size_t done;
+    int status;
+    size_t sent = loge_tcp_send(pt, pt->queue + off, len, timeout_ms, &done,
+        &status);
+
+    pthread_mutex_lock(&pt->mtx);
+    if (done) {
+      pt->tail = pt->sent + done;
+    }
+    pt->sent += sent;
+    if (pt->sent == head) {
+      pt->tail = head;
+    }
+    pthread_mutex_unlock(&pt->mtx);
+
+    if (status < 0) {
+      loge_tcp_drop(pt);
+    }
+    if (status) {
+      return status;
+    }
+  }
+
+  return 0;
+}
+
+/* Move what is queued to the spool file, behind the records already there */
+UNUSED
+static
+void loge_tcp_spool(struct loge_tcp *pt, unsigned long long head) {
+  size_t cap = pt->policy.queue_bytes;
+
+  while (pt->sent < head) {
+    size_t off = (size_t)(pt->sent % cap);
+    size_t len = (size_t)(head - pt->sent);
+    if (len > cap - off) {
+      len = cap - off;
+    }
+
+    int keep = !pt->policy.spool_max_bytes ||
+      pt->spool_size + len <= pt->policy.spool_max_bytes;
+
+    ssize_t n = keep ? write(pt->spool_fd, pt->queue + off, len) : -1;
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (n > 0) {
+      pt->spool_size += (unsigned long long)n;
+      len = (size_t)n;
+    }
+
+    pthread_mutex_lock(&pt->mtx);
+    if (n <= 0) {
+      pt->dropped += loge_tcp_records(pt->queue + off, len);
+    }
+    pt->sent += len;
+    pt->tail = pt->sent;
+    pthread_mutex_unlock(&pt->mtx);
+  }
+}
+
+/* Send a part of the spool file, returns 0 once all of it was sent */
+UNUSED
+static
+int loge_tcp_replay(struct loge_tcp *pt, int timeout_ms) {
+  if (loge_tcp_closed(pt)) {
+    loge_tcp_drop(pt);
+    return -1;
+  }
+
+  unsigned long long left = pt->spool_size - pt->spool_sent;
+  size_t len = left < LOGE_TCP_REPLAY_SIZE ?
+    (size_t)left :
+    LOGE_TCP_REPLAY_SIZE;
+
+  ssize_t n = pread(pt->spool_fd, pt->replay, len, (off_t)pt->spool_sent);
+  if (n <= 0) {
+    /* Not readable, give it up */
+    lgperror("tcp sink spool read failed");
+    pt->spool_sent = pt->spool_size;
+    pt->spool_done = pt->spool_size;
+    n = 0;
+  }
+
+  size_t done;
+  int status;
+  size_t sent = loge_tcp_send(pt, pt->replay, (size_t)n, timeout_ms, &done,
+      &status);
+
+  if (done) {
+    pt->spool_done = pt->spool_sent + done;
+  }
+  pt->spool_sent += sent;
+  if (pt->spool_sent == pt->spool_size) {
+    pt->spool_done = pt->spool_size;
+  }
+
+  if (status < 0) {
+    loge_tcp_drop(pt);
+    return -1;
+  }
+
+  if (pt->spool_done < pt->spool_size) {
+    return 1;
+  }
+
+  if (ftruncate(pt->spool_fd, 0) < 0) {
+    lgperror("tcp sink spool truncate failed");
+  }
+  pt->spool_size = 0;
+  pt->spool_sent = 0;
+  pt->spool_done = 0;
+
+  return 0;
+}
+
+/* Keep only the records of the spool file not replayed, for the next run */
+UNUSED
+static
+void loge_tcp_compact(struct loge_tcp *pt) {
+  size_t len = strlen(pt->spool_path) + 5;
+  char *tmppath = (char*)malloc(len);
+  if (!tmppath) {
+    return;
+  }
+  snprintf(tmppath, len, "%s.tmp", pt->spool_path);
+
+  int fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+      S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+  if (fd < 0) {
+    lgperror("tcp sink spool open failed");
+    free(tmppath);
+    return;
+  }
+
+  unsigned long long off = pt->spool_done;
+  int ok = 1;
+
+  while (ok && off < pt->spool_size) {
+    ssize_t n = pread(pt->spool_fd, pt->replay, LOGE_TCP_REPLAY_SIZE,
+        (off_t)off);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    ok = n > 0 && write(fd, pt->replay, (size_t)n) == n;
+    off += ok ? (unsigned long long)n : 0;
+  }
+
+  close(fd);
+
+  if (!ok || rename(tmppath, pt->spool_path) < 0) {
+    lgperror("tcp sink spool compaction failed");
+    unlink(tmppath);
+  }
+
+  free(tmppath);
+}
+
+/* Poller thread, the only one sending, spooling and connecting */
+UNUSED
+static
+void* loge_tcp_worker(void *arg) {
+  struct loge_tcp *pt = (struct loge_tcp*)arg;
+
+  pthread_mutex_lock(&pt->mtx);
+
+  while (!pt->stop) {
+    unsigned long long head = pt->head;
+    int connected = pt->sock > -1;
+    int spooling = pt->spool_fd > -1 &&
+      (!connected || pt->spool_done < pt->spool_size);
+
+    pthread_mutex_unlock(&pt->mtx);
+
+    /* Records behind the spool go there too, to keep the order */
+    if (spooling && pt->sent < head) {
+      loge_tcp_spool(pt, head);
+    }
+
+    int idle = 0;
+
+    if (!connected) {
+      if (loge_now_ms() >= pt->retry_ms) {
+        loge_tcp_connect(pt);
+        pthread_mutex_lock(&pt->mtx);
+        continue;
+      }
+      idle = 1;
+
+    } else if (pt->spool_done < pt->spool_size) {
+      loge_tcp_replay(pt, LOGE_TCP_IDLE_MS);
+
+    } else if (pt->sent < head) {
+      loge_tcp_send_queue(pt, head, LOGE_TCP_IDLE_MS);
+
+    } else {
+      idle = 1;
+    }
+
+    pthread_mutex_lock(&pt->mtx);
+
+    if (!idle || pt->stop || pt->head != head) {
+      continue;
+    }
+
+    /* Disconnected: until the next attempt, or the queue fills up */
+    unsigned long long wait_ms = LOGE_TCP_IDLE_MS;
+    if (pt->sock < 0) {
+      unsigned long long now = loge_now_ms();
+      wait_ms = pt->retry_ms > now ? pt->retry_ms - now : 0;
+      if (wait_ms > LOGE_TCP_IDLE_MS) {
+        wait_ms = LOGE_TCP_IDLE_MS;
+      }
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += (time_t)(wait_ms / 1000);
+    ts.tv_nsec += (long)(wait_ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000L;
+    }
+
+    pt->waiting = 1;
+    pthread_cond_timedwait(&pt->cond, &pt->mtx, &ts);
+    pt->waiting = 0;
+  }
+
+  pthread_mutex_unlock(&pt->mtx);
+
+  /* Last chance for what is queued, the rest is kept in the spool */
+  unsigned long long head = pt->head;
+  if (pt->sock > -1 && pt->spool_done >= pt->spool_size) {
+    loge_tcp_send_queue(pt, head, (int)pt->policy.backoff_max_ms);
+  }
+  if (pt->spool_fd > -1) {
+    /* A record cut off on the wire is spooled whole */
+    pt->sent = pt->tail;
+    loge_tcp_spool(pt, head);
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Open a TCP sink and start its poller thread, which connects in the
+ * background. Records are accepted before the connection is up.
+ * @param pt Pointer to struct loge_tcp
+ * @param host IPv4 or IPv6 address
+ * @param port Port number
+ * @param ipv6 Non-zero if host is an IPv6 address
+ * @param policy Pointer to the policy, NULL for the defaults
+ * @return 0 on success, -1 on failure
+ */
+UNUSED
+static
+int loge_tcp_open(struct loge_tcp *pt, const char *host, unsigned short port,
+    int ipv6, const struct loge_tcp_policy *policy) {
+
+  memset(pt, 0, sizeof(*pt));
+  pt->sock = -1;
+  pt->spool_fd = -1;
+
+  if (policy) {
+    pt->policy = *policy;
+  }
+  if (!pt->policy.queue_bytes) {
+    pt->policy.queue_bytes = LOGE_TCP_QUEUE_SIZE;
+  }
+  if (!pt->policy.backoff_min_ms) {
+    pt->policy.backoff_min_ms = 100;
+  }
+  if (!pt->policy.backoff_max_ms) {
+    pt->policy.backoff_max_ms = 30000;
+  }
+  if (pt->policy.backoff_max_ms < pt->policy.backoff_min_ms) {
+    pt->policy.backoff_max_ms = pt->policy.backoff_min_ms;
+  }
+  pt->backoff_ms = pt->policy.backoff_min_ms;
+
+  int ret;
+  if (ipv6) {
+    struct sockaddr_in6 *addr6 = (struct sockaddr_in6*)&pt->addr;
+    addr6->sin6_family = AF_INET6;
+    addr6->sin6_port = htons(port);
+    ret = inet_pton(AF_INET6, host, &addr6->sin6_addr);
+    pt->addrlen = sizeof(*addr6);
+  } else {
+    struct sockaddr_in *addr = (struct sockaddr_in*)&pt->addr;
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    ret = inet_pton(AF_INET, host, &addr->sin_addr);
+    pt->addrlen = sizeof(*addr);
+  }
+  if (ret <= 0) {
+    errno = EINVAL;
+    lgperror("inet_pton failed");
+    return -1;
+  }
+
+  pt->queue = (char*)malloc(pt->policy.queue_bytes);
+  if (!pt->queue) {
+    lgperror("malloc failed");
+    return -1;
+  }
+
+  if (pt->policy.spool_path) {
+    pt->replay = (char*)malloc(LOGE_TCP_REPLAY_SIZE);
+    pt->spool_path = strdup(pt->policy.spool_path);
+    pt->spool_fd = open(pt->policy.spool_path,
+        O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC,
+        S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+
+    struct stat st;
+    if (!pt->replay || !pt->spool_path || pt->spool_fd < 0 ||
+        fstat(pt->spool_fd, &st) < 0) {
+      lgperror("tcp sink spool open failed");
+      if (pt->spool_fd > -1) {
+        close(pt->spool_fd);
+      }
+      free(pt->spool_path);
+      free(pt->replay);
+      free(pt->queue);
+      pt->queue = NULL;
+      return -1;
+    }
+
+    /* Left over from an earlier run */
+    pt->spool_size = (unsigned long long)st.st_size;
+  }
+  pt->policy.spool_path = pt->spool_path;
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&pt->cond, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_mutex_init(&pt->mtx, NULL);
+
+  int err = pthread_create(&pt->thread, NULL, &loge_tcp_worker, pt);
+  if (err) {
+    errno = err;
+    lgperror("pthread_create failed");
+    pthread_cond_destroy(&pt->cond);
+    pthread_mutex_destroy(&pt->mtx);
+    if (pt->spool_fd > -1) {
+      close(pt->spool_fd);
+    }
+    free(pt->spool_path);
+    free(pt->replay);
+    free(pt->queue);
+    pt->queue = NULL;
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Queue a record, never blocks on the network
+ * @param pt Pointer to struct loge_tcp
+ * @param data Record
+ * @param len Length of the record
+ * @param newline Non-zero to end the record with a line break
+ * @return 0 on success, -1 if the queue was full and the record dropped
+ */
+UNUSED
+static
+int loge_tcp_write(struct loge_tcp *pt, const char *data, size_t len,
+    int newline) {
+
+  size_t cap = pt->policy.queue_bytes;
+  size_t need = len + !!newline;
+
+  pthread_mutex_lock(&pt->mtx);
+
+  size_t used = (size_t)(pt->head - pt->tail);
+  if (need > cap - used) {
+    pt->dropped++;
+    pthread_mutex_unlock(&pt->mtx);
+    return -1;
+  }
+
+  size_t off = (size_t)(pt->head % cap);
+  size_t first = len < cap - off ? len : cap - off;
+  memcpy(pt->queue + off, data, first);
+  memcpy(pt->queue, data + first, len - first);
+  if (newline) {
+    pt->queue[(off + len) % cap] = '\n';
+  }
+  pt->head += need;
+
+  /* While disconnected the poller only wakes up to spool a fuller queue */
+  if (pt->waiting && (pt->sock > -1 || used + need > cap / 2)) {
+    pthread_cond_signal(&pt->cond);
+  }
+
+  pthread_mutex_unlock(&pt->mtx);
+
+  return 0;
+}
+
+/* Wake the poller up for what was queued */
+UNUSED
+static
+void loge_tcp_flush(struct loge_tcp *pt) {
+  pthread_mutex_lock(&pt->mtx);
+  if (pt->waiting) {
+    pthread_cond_signal(&pt->cond);
+  }
+  pthread_mutex_unlock(&pt->mtx);
+}
+
+/* Records dropped because the queue or the spool file was full */
+UNUSED
+static
+unsigned long long loge_tcp_dropped(struct loge_tcp *pt) {
+  pthread_mutex_lock(&pt->mtx);
+  unsigned long long dropped = pt->dropped;
+  pthread_mutex_unlock(&pt->mtx);
+  return dropped;
+}
+
+/**
+ * @brief Stop the poller after it sent what is queued, waiting for the
+ * peer at most backoff_max_ms. What is left goes to the spool file, which
+ * is removed when empty.
+ * @param pt Pointer to struct loge_tcp
+ */
+UNUSED
+static
+void loge_tcp_close(struct loge_tcp *pt) {
+  if (!pt->queue) {
+    return;
+  }
+
+  pthread_mutex_lock(&pt->mtx);
+  pt->stop = 1;
+  pthread_cond_signal(&pt->cond);
+  pthread_mutex_unlock(&pt->mtx);
+
+  pthread_join(pt->thread, NULL);
+
+  pthread_cond_destroy(&pt->cond);
+  pthread_mutex_destroy(&pt->mtx);
+
+  if (pt->sock > -1) {
+    close(pt->sock);
+  }
+
+  if (pt->spool_fd > -1) {
+    if (pt->spool_done >= pt->spool_size) {
+      unlink(pt->spool_path);
+    } else if (pt->spool_done) {
+      loge_tcp_compact(pt);
+    }
+    close(pt->spool_fd);
+  }
+
+  free(pt->spool_path);
+  free(pt->replay);
+  free(pt->queue);
+  pt->queue = NULL;
+  pt->sock = -1;
+  pt->spool_fd = -1;
+}
+
+#else /* defined(__linux) || defined(__linux__) */
+
+UNUSED
+static
+int loge_tcp_open(struct loge_tcp *pt, const char *host UNUSED,
+    unsigned short port UNUSED, int ipv6 UNUSED,
+    const struct loge_tcp_policy *policy UNUSED) {
+
+  pt->queue = NULL;
+  pt->sock = -1;
+  errno = ENOSYS;
+  lgperror("tcp sink");
+  return -1;
+}
+
+UNUSED
+static
+int loge_tcp_write(struct loge_tcp *pt UNUSED, const char *data UNUSED,
+    size_t len UNUSED, int newline UNUSED) {
+  return -1;
+}
+
+UNUSED
+static
+void loge_tcp_flush(struct loge_tcp *pt UNUSED) {
+}
+
+UNUSED
+static
+unsigned long long loge_tcp_dropped(struct loge_tcp *pt UNUSED) {
+  return 0;
+}
+
+UNUSED
+static
+void loge_tcp_close(struct loge_tcp *pt) {
+  pt->queue = NULL;
+}
+
+#endif /* defined(__linux) || defined(__linux__) */
+
+/* Largest datagram the UDP sink packs records into, fits an Ethernet frame */
+#ifndef LOGE_UDP_MTU
+#define LOGE_UDP_MTU 1472
+#endif
+
+/* Largest message the Unix socket sink packs records into */
+#ifndef LOGE_UNIX_MTU
+#define LOGE_UNIX_MTU (16 * 1024)
+#endif
+
+/* Datagrams handed to the kernel by one sendmmsg(2) */
+#ifndef LOGE_UDP_BATCH
+#define LOGE_UDP_BATCH 16
+#endif
+
+/**
+ * @brief Datagram sink that packs line separated records into datagrams of
+ * up to mtu bytes and sends LOGE_UDP_BATCH of them with one sendmmsg(2). A
+ * record never spans datagrams, longer ones than mtu are sent on their own.
+ *
+ * Over UDP the socket does not block, datagrams the kernel has no room for
+ * are dropped and counted. A Unix domain socket of type SOCK_SEQPACKET or
+ * SOCK_DGRAM to a local collector blocks instead, and is connected again
+ * with exponential backoff when the collector goes away. Messages sent
+ * while it is away are dropped and counted.
+ */
+struct loge_udp {
+  int sock;                     /* -1 while disconnected */
+  size_t mtu;
+  char *buf;                    /* LOGE_UDP_BATCH datagrams, NULL if closed */
+#if defined(__linux) || defined(__linux__)
+  struct mmsghdr msgs[LOGE_UDP_BATCH];
+  struct iovec iov[LOGE_UDP_BATCH];
+#endif
+  unsigned int count;           /* Datagrams filled */
+  size_t len;                   /* Bytes in the datagram being filled */
+  unsigned long long dropped;   /* Datagrams dropped */
+  char *path;                   /* Unix socket, NULL for UDP */
+  int type;
+  unsigned int backoff_ms;
+  unsigned long long retry_ms;  /* Next connection attempt */
+};
+
+#if defined(__linux) || defined(__linux__)
+
+/* Connect the Unix socket again unless it is too early for another try */
+UNUSED
+static
+int loge_udp_reconnect(struct loge_udp *pu) {
+  unsigned long long now = loge_now_ms();
+  if (now < pu->retry_ms) {
+    return -1;
+  }
+
+  pu->sock = sock_connect_unix(pu->path, pu->type);
+  if (pu->sock < 0) {
+    /* Reported once per outage */
+    if (pu->backoff_ms == 100) {
+      lgperror("unix socket sink connect failed");
+    }
+    pu->retry_ms = now + pu->backoff_ms;
+    pu->backoff_ms = pu->backoff_ms < 15000 ? pu->backoff_ms * 2 : 30000;
+    return -1;
+  }
+
+  pu->backoff_ms = 100;
+  pu->retry_ms = 0;
+  return 0;
+}
+
+/* Send the datagrams in msgs, what cannot be sent is dropped */
+UNUSED
+static
+void loge_udp_send(struct loge_udp *pu, struct mmsghdr *msgs,
+    unsigned int count) {
+
+  unsigned int done = 0;
+  while (done < count) {
+    if (pu->sock < 0 && loge_udp_reconnect(pu) < 0) {
+      pu->dropped += count - done;
+      break;
+    }
+
+    int n = sendmmsg(pu->sock, msgs + done, count - done, MSG_NOSIGNAL);
+    if (n > 0) {
+      done += (unsigned int)n;
+    } else if (errno == EINTR) {
+      continue;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+      pu->dropped += count - done;
+      break;
+    } else if (pu->path && (errno == ECONNREFUSED || errno == ENOTCONN ||
+          errno == EPIPE || errno == ECONNRESET)) {
+      /* The collector went away, try a new connection */
+      close(pu->sock);
+      pu->sock = -1;
+    } else {
+      /* Like ECONNREFUSED for an earlier datagram nobody listened to */
+      done++;
+    }
+  }
+}
+
+/**
+ * @brief Send the datagrams filled so far
+ * @param pu Pointer to struct loge_udp
+ */
+UNUSED
+static
+void loge_udp_flush(struct loge_udp *pu) {
+  if (pu->len) {
+    pu->iov[pu->count].iov_len = pu->len;
+    pu->count++;
+    pu->len = 0;
+  }
+
+  if (pu->count) {
+    loge_udp_send(pu, pu->msgs, pu->count);
+    pu->count = 0;
+  }
+}
+
+/* Datagrams of the batch, mtu bytes each */
+UNUSED
+static
+int loge_udp_buffers(struct loge_udp *pu) {
+  pu->buf = (char*)malloc(pu->mtu * LOGE_UDP_BATCH);
+  if (!pu->buf) {
+    lgperror("malloc failed");
+    return -1;
+  }
+
+  for (unsigned int i = 0; i < LOGE_UDP_BATCH; i++) {
+    pu->iov[i].iov_base = pu->buf + i * pu->mtu;
+    pu->msgs[i].msg_hdr.msg_iov = &pu->iov[i];
+    pu->msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Connect a non-blocking UDP socket for the sink
+ * @param pu Pointer to struct loge_udp
+ * @param host IPv4 or IPv6 address
+ * @param port Port number
+ * @param ipv6 Non-zero if host is an IPv6 address
+ * @param mtu Largest datagram, 0 for LOGE_UDP_MTU
+ * @return 0 on success, -1 on failure
+ */
+UNUSED
+static
+int loge_udp_open(struct loge_udp *pu, const char *host, unsigned short port,
+    int ipv6, size_t mtu) {
+
+  memset(pu, 0, sizeof(*pu));
+  pu->mtu = mtu ? mtu : LOGE_UDP_MTU;
+  if (pu->mtu > 65507) {
+    pu->mtu = 65507;
+  }
+
+  pu->sock = sock_connect(host, port, 0, ipv6);
+  if (pu->sock < 0) {
+    pu->sock = -1;
+    return -1;
+  }
+  fcntl(pu->sock, F_SETFL, fcntl(pu->sock, F_GETFL) | O_NONBLOCK);
+
+  if (loge_udp_buffers(pu) < 0) {
+    close(pu->sock);
+    pu->sock = -1;
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Connect a Unix domain socket to a local collector for the sink.
+ * Each record or batch of records arrives as one message. A collector that
+ * is not up yet is connected to later, with backoff.
+ * @param pu Pointer to struct loge_udp
+ * @param path Path of the collector socket
+ * @param type SOCK_SEQPACKET or SOCK_DGRAM
+ * @param mtu Largest message, 0 for LOGE_UNIX_MTU
+ * @return 0 on success, -1 on failure
+ */
+UNUSED
+static
+int loge_unix_open(struct loge_udp *pu, const char *path, int type,
+    size_t mtu) {
+
+  memset(pu, 0, sizeof(*pu));
+  pu->mtu = mtu ? mtu : LOGE_UNIX_MTU;
+  pu->type = type;
+  pu->backoff_ms = 100;
+
+  if (type != SOCK_SEQPACKET && type != SOCK_DGRAM) {
+    errno = EINVAL;
+    lgperror("unix socket sink");
+    return -1;
+  }
+
+  pu->path = strdup(path);
+  if (!pu->path) {
+    lgperror("strdup failed");
+    return -1;
+  }
+
+  pu->sock = sock_connect_unix(path, type);
+  if (pu->sock < 0 && errno != ENOENT && errno != ECONNREFUSED) {
+    lgperror("unix socket sink connect failed");
+    free(pu->path);
+    pu->path = NULL;
+    return -1;
+  }
+
+  if (pu->sock < 0) {
+    /* Not listening yet, tried again later without a report */
+    pu->sock = -1;
+    pu->retry_ms = loge_now_ms() + pu->backoff_ms;
+    pu->backoff_ms *= 2;
+  }
+
+  if (loge_udp_buffers(pu) < 0) {
+    if (pu->sock > -1) {
+      close(pu->sock);
+    }
+    free(pu->path);
+    pu->path = NULL;
+    pu->sock = -1;
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Add a record to the datagram being filled, sending the batch once
+ * all of its datagrams are full
+ * @param pu Pointer to struct loge_udp
+ * @param data Record
+ * @param len Length of the record
+ * @param newline Non-zero to end the record with a line break
+ */
+UNUSED
+static
+void loge_udp_write(struct loge_udp *pu, const char *data, size_t len,
+    int newline) {
+
+  size_t need = len + !!newline;
+
+  if (need > pu->mtu) {
+    /* Keep the order, then send the record alone */
+    loge_udp_flush(pu);
+
+    struct iovec iov[2] = {
+      { (void*)data, len },
+      { (void*)"\n", 1 }
+    };
+    struct mmsghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_hdr.msg_iov = iov;
+    msg.msg_hdr.msg_iovlen = newline ? 2 : 1;
+    loge_udp_send(pu, &msg, 1);
+    return;
+  }
+
+  if (pu->len + need > pu->mtu) {
+    pu->iov[pu->count].iov_len = pu->len;
+    pu->count++;
+    pu->len = 0;
+    if (pu->count == LOGE_UDP_BATCH) {
+      loge_udp_send(pu, pu->msgs, pu->count);
+      pu->count = 0;
+    }
+  }
+
+  char *dst = pu->buf + pu->count * pu->mtu + pu->len;
+  memcpy(dst, data, len);
+  if (newline) {
+    dst[len] = '\n';
+  }
+  pu->len += need;
+}
+
+/* Datagrams dropped because the socket was full or not connected */
+UNUSED
+static
+unsigned long long loge_udp_dropped(const struct loge_udp *pu) {
+  return pu->dropped;
+}
+
+/**
+ * @brief Send what is pending and close the socket
+ * @param pu Pointer to struct loge_udp
+ */
+UNUSED
+static
+void loge_udp_close(struct loge_udp *pu) {
+  if (!pu->buf) {
+    return;
+  }
+
+  loge_udp_flush(pu);
+  if (pu->sock > -1) {
+    close(pu->sock);
+  }
+  free(pu->buf);
+  free(pu->path);
+  pu->buf = NULL;
+  pu->path = NULL;
+  pu->sock = -1;
+}
+
+#else /* defined(__linux) || defined(__linux__) */
+
+UNUSED
+static
+int loge_udp_open(struct loge_udp *pu, const char *host UNUSED,
+    unsigned short port UNUSED, int ipv6 UNUSED, size_t mtu UNUSED) {
+
+  pu->sock = -1;
+  pu->buf = NULL;
+  errno = ENOSYS;
+  lgperror("udp sink");
+  return -1;
+}
+
+UNUSED
+static
+int loge_unix_open(struct loge_udp *pu, const char *path UNUSED,
+    int type UNUSED, size_t mtu UNUSED) {
+
+  pu->sock = -1;
+  pu->buf = NULL;
+  errno = ENOSYS;
+  lgperror("unix socket sink");
+  return -1;
+}
+
+UNUSED
+static
+void loge_udp_write(struct loge_udp *pu UNUSED, const char *data UNUSED,
+    size_t len UNUSED, int newline UNUSED) {
+}
+
+UNUSED
+static
+void loge_udp_flush(struct loge_udp *pu UNUSED) {
+}
+
+UNUSED
+static
+unsigned long long loge_udp_dropped(const struct loge_udp *pu UNUSED) {
+  return 0;
+}
+
+UNUSED
+static
+void loge_udp_close(struct loge_udp *pu) {
+  pu->sock = -1;
+  pu->buf = NULL;
+}
+
+#endif /* defined(__linux) || defined(__linux__) */
+
+/* Record formats of the journal sink */
+#define LOGE_JOURNAL_NATIVE 0   /* systemd-journald native protocol */
+#define LOGE_JOURNAL_RFC5424 1  /* RFC 5424 syslog messages */
+
+/* SD-ID of the structured data in RFC 5424 messages */
+#ifndef LOGE_JOURNAL_SDID
+#define LOGE_JOURNAL_SDID "loge@32473"
+#endif
+
+/**
+ * @brief Where and how the journal sink writes, 0 or NULL picks the default
+ * of a field.
+ */
+struct loge_journal_policy {
+  int format;                   /* LOGE_JOURNAL_NATIVE or _RFC5424 */
+  const char *path;             /* Socket, journald's or /dev/log */
+  const char *ident;            /* Application name, the program name */
+  int facility;                 /* Syslog facility code, 1 (user) */
+  const char *const *fields;    /* "NAME=value" strings, NULL terminated */
+  int nonblock;                 /* Drop records rather than wait */
+};
+
+/**
+ * @brief Sink writing one datagram per record to the Unix socket of
+ * systemd-journald or of a syslog daemon, without going through syslog(3).
+ * What stays the same for every record, the identifier, facility, process
+ * id and the structured fields of the policy, is rendered once when the
+ * sink is opened. Records carry their level and source location as fields
+ * of their own, the text prefix of loge is left out.
+ */
+struct loge_journal {
+  int format;
+  int facility;
+  int flags;                    /* Of sendmsg(2) */
+  int sock;                     /* -1 when closed */
+  char *path;
+  char *header;                 /* Rendered once */
+  size_t headerlen;
+  time_t stamp_sec;             /* Second of the cached RFC 5424 timestamp */
+  char stamp[24];
+  unsigned long long dropped;   /* Datagrams not delivered */
+};
+
+/*
+ * Syslog severity by C loge level, raw records are informational. C++
+ * levels go through loge<>::c_level() first.
+ */
+UNUSED
+static
+const int loge_journal_severity[] = { 6, 7, 6, 4, 3, 2 };
+
+#if defined(__linux) || defined(__linux__)
+
+/* Connect the socket to the path of the sink */
+UNUSED
+static
+int loge_journal_connect(struct loge_journal *pj) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, pj->path, sizeof(addr.sun_path) - 1);
+
+  return connect(pj->sock, (struct sockaddr*)&addr, sizeof(addr));
+}
+
+/* Write value with ", \ and ] escaped as RFC 5424 asks for PARAM-VALUE */
+UNUSED
+static
+void loge_journal_sd_value(FILE *f, const char *value) {
+  for (; *value; value++) {
+    if (*value == '"' || *value == '\\' || *value == ']') {
+      fputc('\\', f);
+    }
+    fputc(*value, f);
+  }
+}
+
+/* Write a journal field, in the binary form if the value spans lines */
+UNUSED
+static
+void loge_journal_field(FILE *f, const char *name, size_t namelen,
+    const char *value) {
+
+  size_t len = strlen(value);
+  fwrite(name, 1, namelen, f);
+
+  if (!memchr(value, '\n', len)) {
+    fputc('=', f);
+  } else {
+    unsigned char size[8];
+    for (int i = 0; i < 8; i++) {
+      size[i] = (unsigned char)((unsigned long long)len >> (8 * i));
+    }
+    fputc('\n', f);
+    fwrite(size, 1, sizeof(size), f);
+  }
+
+  fwrite(value, 1, len, f);
+  fputc('\n', f);
+}
+
+/**
+ * @brief Open the socket and render the header of every record
+ * @param pj Pointer to struct loge_journal
+ * @param policy Pointer to the policy, NULL for the defaults
+ * @return 0 on success, -1 on failure
+ */
+UNUSED
+static
+int loge_journal_open(struct loge_journal *pj,
+    const struct loge_journal_policy *policy) {
+
+  struct loge_journal_policy pol;
+  memset(&pol, 0, sizeof(pol));
+  if (policy) {
+    pol = *policy;
+  }
+
+  memset(pj, 0, sizeof(*pj));
+  pj->sock = -1;
+  pj->stamp_sec = -1;
+  pj->format = pol.format;
+  pj->facility = pol.facility ? pol.facility : 1;
+  pj->flags = MSG_NOSIGNAL | (pol.nonblock ? MSG_DONTWAIT : 0);
+
+  if (!pol.path) {
+    pol.path = pj->format == LOGE_JOURNAL_RFC5424 ?
+      "/dev/log" : "/run/systemd/journal/socket";
+  }
+  if (!pol.ident) {
+#if defined(__GLIBC__)
+    pol.ident = program_invocation_short_name;
+#else
+    pol.ident = "-";
+#endif
+  }
+
+  FILE *f = NULL;
+
+  pj->path = strdup(pol.path);
+  pj->sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (!pj->path || pj->sock < 0 || loge_journal_connect(pj) < 0) {
+    lgperror("journal sink connect failed");
+    goto error;
+  }
+
+  f = open_memstream(&pj->header, &pj->headerlen);
+  if (!f) {
+    lgperror("open_memstream failed");
+    goto error;
+  }
+
+  if (pj->format == LOGE_JOURNAL_RFC5424) {
+    /* Goes between the timestamp and the source location */
+    char host[256] = "-";
+    gethostname(host, sizeof(host) - 1);
+    fprintf(f, " %s %s %d - [" LOGE_JOURNAL_SDID, host, pol.ident,
+        (int)getpid());
+
+    for (const char *const *field = pol.fields; field && *field; field++) {
+      const char *eq = strchr(*field, '=');
+      if (eq) {
+        fprintf(f, " %.*s=\"", (int)(eq - *field), *field);
+        loge_journal_sd_value(f, eq + 1);
+        fputc('"', f);
+      }
+    }
+
+  } else {
+    char value[32];
+    loge_journal_field(f, "SYSLOG_IDENTIFIER", 17, pol.ident);
+    snprintf(value, sizeof(value), "%d", pj->facility);
+    loge_journal_field(f, "SYSLOG_FACILITY", 15, value);
+    snprintf(value, sizeof(value), "%d", (int)getpid());
+    loge_journal_field(f, "SYSLOG_PID", 10, value);
+
+    for (const char *const *field = pol.fields; field && *field; field++) {
+      const char *eq = strchr(*field, '=');
+      if (eq) {
+        loge_journal_field(f, *field, (size_t)(eq - *field), eq + 1);
+      }
+    }
+  }
+
+  if (fclose(f) != 0) {
+    lgperror("journal sink header failed");
+    goto error;
+  }
+
+  return 0;
+
+error:
+  if (pj->sock > -1) {
+    close(pj->sock);
+  }
+  free(pj->header);
+  free(pj->path);
+  pj->header = NULL;
+  pj->path = NULL;
+  pj->sock = -1;
+  return -1;
+}
+
+/**
+ * @brief Send a record as one datagram. A sink that does not block drops
+ * and counts the records the socket has no room for. The socket is
+ * connected again once if the daemon went away.
+ * @param pj Pointer to struct loge_journal
+ * @param level Level of the record, 0 for a raw record
+ * @param filename Source file, NULL to leave out the location
+ * @param linenumber Source line
+ * @param msg Message without the text prefix
+ * @param len Length of the message
+ */
+UNUSED
+static
+void loge_journal_write(struct loge_journal *pj, int level,
+    const char *filename, int linenumber, const char *msg, size_t len) {
+
+  if (level < 0 || level > 5) {
+    level = 0;
+  }
+
+  int severity = loge_journal_severity[level];
+
+  char pre[64];
+  char post[512];
+  int prelen = 0;
+  int postlen = 0;
+  struct iovec iov[5];
+  int iovcnt = 0;
+
+  if (pj->format == LOGE_JOURNAL_RFC5424) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (ts.tv_sec != pj->stamp_sec) {
+      struct tm tm;
+      gmtime_r(&ts.tv_sec, &tm);
+      strftime(pj->stamp, sizeof(pj->stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+      pj->stamp_sec = ts.tv_sec;
+    }
+
+    prelen = snprintf(pre, sizeof(pre), "<%d>1 %s.%06ldZ",
+        pj->facility * 8 + severity, pj->stamp, ts.tv_nsec / 1000);
+
+    if (filename) {
+      FILE *f = fmemopen(post, sizeof(post), "w");
+      if (f) {
+        fputs(" file=\"", f);
+        loge_journal_sd_value(f, filename);
+        fprintf(f, "\" line=\"%d\"] ", linenumber);
+        postlen = (int)ftell(f);
+        fclose(f);
+      }
+    }
+    if (!postlen || postlen >= (int)sizeof(post)) {
+      postlen = snprintf(post, sizeof(post), "] ");
+    }
+
+    iov[iovcnt].iov_base = pre;
+    iov[iovcnt++].iov_len = (size_t)prelen;
+    iov[iovcnt].iov_base = pj->header;
+    iov[iovcnt++].iov_len = pj->headerlen;
+    iov[iovcnt].iov_base = post;
+    iov[iovcnt++].iov_len = (size_t)postlen;
+    iov[iovcnt].iov_base = (void*)msg;
+    iov[iovcnt++].iov_len = len;
+
+  } else {
+    if (filename) {
+      postlen = snprintf(post, sizeof(post),
+          "PRIORITY=%d\nCODE_FILE=%s\nCODE_LINE=%d\n",
+          severity, filename, linenumber);
+    }
+    if (!filename || postlen >= (int)sizeof(post)) {
+      postlen = snprintf(post, sizeof(post), "PRIORITY=%d\n", severity);
+    }
+
+    /* The binary form for messages that span lines */
+    unsigned char size[8];
+    if (memchr(msg, '\n', len)) {
+      for (int i = 0; i < 8; i++) {
+        size[i] = (unsigned char)((unsigned long long)len >> (8 * i));
+      }
+      postlen += snprintf(post + postlen, sizeof(post) - postlen,
+          "MESSAGE\n");
+      prelen = sizeof(size);
+    } else {
+      postlen += snprintf(post + postlen, sizeof(post) - postlen,
+          "MESSAGE=");
+    }
+
+    iov[iovcnt].iov_base = pj->header;
+    iov[iovcnt++].iov_len = pj->headerlen;
+    iov[iovcnt].iov_base = post;
+    iov[iovcnt++].iov_len = (size_t)postlen;
+    if (prelen) {
+      iov[iovcnt].iov_base = size;
+      iov[iovcnt++].iov_len = sizeof(size);
+    }
+    iov[iovcnt].iov_base = (void*)msg;
+    iov[iovcnt++].iov_len = len;
+    iov[iovcnt].iov_base = (void*)"\n";
+    iov[iovcnt++].iov_len = 1;
+  }
+
+  struct msghdr mh;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = iov;
+  mh.msg_iovlen = (size_t)iovcnt;
+
+  for (int attempt = 0; attempt < 2; attempt++) {
+    if (sendmsg(pj->sock, &mh, pj->flags) > -1) {
+      return;
+    }
+    if (errno == EINTR) {
+      attempt--;
+      continue;
+    }
+    if (errno != ECONNREFUSED && errno != ENOTCONN && errno != ENOENT) {
+      break;
+    }
+    /* The daemon was restarted */
+    if (attempt || loge_journal_connect(pj) < 0) {
+      break;
+    }
+  }
+
+  pj->dropped++;
+}
+
+/* Datagrams the socket had no room for or the daemon did not take */
+UNUSED
+static
+unsigned long long loge_journal_dropped(const struct loge_journal *pj) {
+  return pj->dropped;
+}
+
+/**
+ * @brief Close the socket of the journal sink
+ * @param pj Pointer to struct loge_journal
+ */
+UNUSED
+static
+void loge_journal_close(struct loge_journal *pj) {
+  if (pj->sock < 0) {
+    return;
+  }
+
+  close(pj->sock);
+  free(pj->header);
+  free(pj->path);
+  pj->header = NULL;
+  pj->path = NULL;
+  pj->sock = -1;
+}
+
+#else /* defined(__linux) || defined(__linux__) */
+
+UNUSED
+static
+int loge_journal_open(struct loge_journal *pj,
+    const struct loge_journal_policy *policy UNUSED) {
+
+  pj->sock = -1;
+  pj->header = NULL;
+  errno = ENOSYS;
+  lgperror("journal sink");
+  return -1;
+}
+
+UNUSED
+static
+void loge_journal_write(struct loge_journal *pj UNUSED, int level UNUSED,
+    const char *filename UNUSED, int linenumber UNUSED,
+    const char *msg UNUSED, size_t len UNUSED) {
+}
+
+UNUSED
+static
+unsigned long long loge_journal_dropped(
+    const struct loge_journal *pj UNUSED) {
+  return 0;
+}
+
+UNUSED
+static
+void loge_journal_close(struct loge_journal *pj) {
+  pj->sock = -1;
+}
+
+#endif /* defined(__linux) || defined(__linux__) */
+
+static
+const char *loglevel_strtbl[] =  {
+  "",
+  "DEBUG",
+  "INFO",
+  "WARNING",
+  "ERROR",
+  "CRITICAL"
+};
+
+static
+const char *loglevel_strtbl_color[] =  {
+  "",
+  ANSI_FG_BLUE   ANSI_BG_RESET "DEBUG"    ANSI_RESET,
+  ANSI_FG_GREEN  ANSI_BG_RESET "INFO"     ANSI_RESET,
+  ANSI_FG_YELLOW ANSI_BG_RESET "WARNING"  ANSI_RESET,
+  ANSI_FG_RED    ANSI_BG_RESET "ERROR"    ANSI_RESET,
+  ANSI_FG_WHITE  ANSI_BG_RED   "CRITICAL" ANSI_RESET
+};
+
+/* Longest name of a registered logger or of a level rule */
+#ifndef LOGE_NAME_SIZE
+#define LOGE_NAME_SIZE 64
+#endif
+
+/* Name of the rule that applies to every logger */
+#define LOGE_ROOT_NAME "*"
+
+/* Levels ALL to CRITICAL, the same for C and C++ */
+#define LOGE_LEVEL_COUNT \
+  ((int)(sizeof(loglevel_strtbl) / sizeof(loglevel_strtbl[0])))
+
+/* Sets the level of a logger unless level is -1, returns the level before */
+typedef int (*loge_level_fn)(void *logger, int level);
+
+/* A named logger, or a level rule if logger is NULL */
+struct loge_category {
+  char name[LOGE_NAME_SIZE];
+  /* Tells loggers of different types apart, see loge_registry_find() */
+  const char *kind;
+  void *logger;
+  loge_level_fn level_fn;
+  /* Level of a rule, level a logger goes back to without a rule */
+  int level;
+  int ruled;
+  struct loge_category *next;
+};
+
+struct loge_registry {
+  uint64_t lock;
+  struct loge_category *loggers;
+  struct loge_category *rules;
+#if defined(__linux) || defined(__linux__)
+  /* Reloads the rules, see loge_watch_levels() */
+  pthread_t thread;
+  int watching;
+  int inotify_fd;
+  int pipe[2];
+  int signo;
+  struct sigaction old_action;
+  char *path;
+  const char *file;
+#endif
+};
+
+LOGE_SHARED struct loge_registry loge_registry_instance;
+
+UNUSED
+static
+void loge_registry_lock(void) {
+  uint64_t unlocked = 0;
+  while (!loge_atomic_cas(&loge_registry_instance.lock, &unlocked, 1)) {
+    unlocked = 0;
+  }
+}
+
+UNUSED
+static
+void loge_registry_unlock(void) {
+  loge_atomic_store(&loge_registry_instance.lock, 0);
+}
+
+/* Length of the name a rule applies through plus one, -1 if it does not */
+UNUSED
+static
+int loge_rule_match(const char *rule, const char *name) {
+  if (strcmp(rule, LOGE_ROOT_NAME) == 0) {
+    return 0;
+  }
+
+  size_t len = strlen(rule);
+  if (strncmp(rule, name, len) != 0 ||
+      (name[len] != '\0' && name[len] != '.')) {
+    return -1;
+  }
+
+  return (int)len + 1;
+}
+
+/* Called with the lock held, the longest matching rule wins */
+UNUSED
+static
+void loge_registry_apply(struct loge_category *pc) {
+  int best = -1;
+  int level = pc->level;
+
+  for (struct loge_category *r = loge_registry_instance.rules; r;
+      r = r->next) {
+    int match = loge_rule_match(r->name, pc->name);
+    if (match > best) {
+      best = match;
+      level = r->level;
+    }
+  }
+
+  if (best >= 0) {
+    int prev = pc->level_fn(pc->logger, level);
+    if (!pc->ruled) {
+      pc->level = prev;
+      pc->ruled = 1;
+    }
+  } else if (pc->ruled) {
+    /* The rule went away, back to the level the logger had */
+    pc->level_fn(pc->logger, pc->level);
+    pc->ruled = 0;
+  }
+}
+
+/*
+ * Set the level of a registered logger through its level_fn. A logger under
+ * a rule keeps the level as the one it goes back to once no rule applies.
+ * Returns 0 if the logger is not registered, the caller sets the level then.
+ */
+UNUSED
+static
+int loge_registry_set_level(void *logger, int level) {
+  int found = 0;
+
+  loge_registry_lock();
+
+  for (struct loge_category *pc = loge_registry_instance.loggers; pc;
+      pc = pc->next) {
+    if (pc->logger == logger) {
+      pc->level_fn(pc->logger, level);
+      if (pc->ruled) {
+        pc->level = level;
+      }
+      found = 1;
+      break;
+    }
+  }
+
+  loge_registry_unlock();
+
+  return found;
+}
+
+UNUSED
+static
+struct loge_category* loge_category_new(const char *name, int level) {
+  if (!name || !*name || strlen(name) >= LOGE_NAME_SIZE) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  struct loge_category *pc =
+    (struct loge_category*)calloc(1, sizeof(struct loge_category));
+  if (!pc) {
+    return NULL;
+  }
+
+  strcpy(pc->name, name);
+  pc->level = level;
+
+  return pc;
+}
+
+UNUSED
+static
+void loge_category_free(struct loge_category *pc) {
+  while (pc) {
+    struct loge_category *next = pc->next;
+    free(pc);
+    pc = next;
+  }
+}
+
+/**
+ * @brief Register a logger under a unique name. The level rules apply to it
+ * from now on, a rule for "net" covers "net" and "net.http".
+ * @param name Dot separated name, "*" is taken by the root rule
+ * @param kind Type of the logger, loge_registry_find() only returns loggers of
+ * the kind asked for
+ * @param logger Logger, stays registered until loge_registry_remove()
+ * @param level_fn Sets and returns the level of the logger
+ * @return 0 on success, -1 with errno set otherwise
+ */
+UNUSED
+static
+int loge_registry_add(const char *name, const char *kind, void *logger,
+    loge_level_fn level_fn) {
+
+  if (!logger || !level_fn ||
+      (name && strcmp(name, LOGE_ROOT_NAME) == 0)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  struct loge_category *pc = loge_category_new(name, 0);
+  if (!pc) {
+    return -1;
+  }
+  pc->kind = kind;
+  pc->logger = logger;
+  pc->level_fn = level_fn;
+
+  loge_registry_lock();
+
+  for (struct loge_category *p = loge_registry_instance.loggers; p;
+      p = p->next) {
+    if (strcmp(p->name, name) == 0) {
+      loge_registry_unlock();
+      free(pc);
+      errno = EEXIST;
+      return -1;
+    }
+  }
+
+  pc->next = loge_registry_instance.loggers;
+  loge_registry_instance.loggers = pc;
+  loge_registry_apply(pc);
+
+  loge_registry_unlock();
+
+  return 0;
+}
+
+/* Drop a logger from the registry, with the level it had before any rule */
+UNUSED
+static
+void loge_registry_remove(void *logger) {
+  struct loge_category *found = NULL;
+
+  loge_registry_lock();
+
+  struct loge_category **pp = &loge_registry_instance.loggers;
+  while (*pp) {
+    struct loge_category *pc = *pp;
+    if (pc->logger == logger) {
+      *pp = pc->next;
+      if (pc->ruled) {
+        pc->level_fn(pc->logger, pc->level);
+      }
+      pc->next = found;
+      found = pc;
+    } else {
+      pp = &pc->next;
+    }
+  }
+
+  loge_registry_unlock();
+
+  loge_category_free(found);
+}
+
+/**
+ * @brief Look up a registered logger. Nothing keeps it alive once found, the
+ * caller has to know that it is not destroyed meanwhile.
+ * @return The logger, NULL if no logger of that kind has the name
+ */
+UNUSED
+static
+void* loge_registry_find(const char *name, const char *kind) {
+  void *logger = NULL;
+
+  if (!name) {
+    return NULL;
+  }
+
+  loge_registry_lock();
+
+  for (struct loge_category *pc = loge_registry_instance.loggers; pc;
+      pc = pc->next) {
+    if (strcmp(pc->name, name) == 0) {
+      if (strcmp(pc->kind, kind) == 0) {
+        logger = pc->logger;
+      }
+      break;
+    }
+  }
+
+  loge_registry_unlock();
+
+  return logger;
+}
+
+/* Swap in a new set of rules and apply them to every logger */
+UNUSED
+static
+void loge_registry_set_rules(struct loge_category *rules) {
+  loge_registry_lock();
+
+  struct loge_category *old = loge_registry_instance.rules;
+  loge_registry_instance.rules = rules;
+
+  for (struct loge_category *pc = loge_registry_instance.loggers; pc;
+      pc = pc->next) {
+    loge_registry_apply(pc);
+  }
+
+  loge_registry_unlock();
+
+  loge_category_free(old);
+}
+
+/**
+ * @brief Set the level of every logger named name or below it. Safe while
+ * the loggers are in use, a logging thread sees the new level on its next
+ * call.
+ * @param name Dot separated name, "*" for every logger
+ * @param level Level to set, -1 to remove the rule
+ * @return 0 on success, -1 with errno set otherwise
+ */
+UNUSED
+static
+int loge_set_category_level(const char *name, int level) {
+  if (level < -1 || level >= LOGE_LEVEL_COUNT) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  struct loge_category *pc = loge_category_new(name, level);
+  if (!pc) {
+    return -1;
+  }
+
+  loge_registry_lock();
+
+  struct loge_category **pp = &loge_registry_instance.rules;
+  while (*pp && strcmp((*pp)->name, name) != 0) {
+    pp = &(*pp)->next;
+  }
+  if (*pp) {
+    struct loge_category *old = *pp;
+    *pp = old->next;
+    free(old);
+  }
+
+  if (level > -1) {
+    pc->next = loge_registry_instance.rules;
+    loge_registry_instance.rules = pc;
+    pc = NULL;
+  }
+
+  for (struct loge_category *p = loge_registry_instance.loggers; p;
+      p = p->next) {
+    loge_registry_apply(p);
+  }
+
+  loge_registry_unlock();
+
+  free(pc);
+
+  return 0;
+}
+
+/* Level from its name in any case or its number, -1 if it is neither */
+UNUSED
+static
+int loge_parse_level(const char *s) {
+  if (*s >= '0' && *s <= '9') {
+    char *end;
+    long level = strtol(s, &end, 10);
+    return *end == '\0' && level < LOGE_LEVEL_COUNT ? (int)level : -1;
+  }
+
+  for (int level = 0; level < LOGE_LEVEL_COUNT; level++) {
+    const char *name = level ? loglevel_strtbl[level] : "ALL";
+    size_t i = 0;
+    while (s[i] && (s[i] == name[i] || s[i] - ('a' - 'A') == name[i])) {
+      i++;
+    }
+    if (!s[i] && !name[i]) {
+      return level;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * @brief Replace the level rules with those in a file, one "name = level" per
+ * line, '#' starts a comment. The level is a name like WARNING or a number, a
+ * later line for the same name wins. On error the rules in place are kept.
+ * @return Number of rules read, -1 with errno set on error
+ */
+UNUSED
+static
+int loge_load_levels(const char *path) {
+  if (!path) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    return -1;
+  }
+
+  struct loge_category *rules = NULL;
+  char line[256];
+  unsigned int linenum = 0;
+  int count = 0;
+  int err = 0;
+
+  while (fgets(line, sizeof(line), f)) {
+    linenum++;
+
+    for (char *p = line; *p; p++) {
+      if (*p == '#') {
+        *p = '\0';
+        break;
+      }
+      if (*p == '=') {
+        *p = ' ';
+      }
+    }
+
+    char name[LOGE_NAME_SIZE + 1];
+    char level[16];
+    int n = sscanf(line, "%64s %15s", name, level);
+    if (n <= 0) {
+      continue;
+    }
+
+    struct loge_category *pc =
+      n == 2 && loge_parse_level(level) > -1 ?
+      loge_category_new(name, loge_parse_level(level)) :
+      NULL;
+    if (!pc) {
+      fprintf(stderr, "%s: %s:%u: expected name = level\n",
+          __func__, path, linenum);
+      err = EINVAL;
+      break;
+    }
+
+    /* The first of equally long matches wins, that is the later line */
+    pc->next = rules;
+    rules = pc;
+    count++;
+  }
+
+  if (!err && ferror(f)) {
+    err = EIO;
+  }
+  fclose(f);
+
+  if (err) {
+    loge_category_free(rules);
+    errno = err;
+    return -1;
+  }
+
+  loge_registry_set_rules(rules);
+
+  return count;
+}
+
+#if defined(__linux) || defined(__linux__)
+
+UNUSED
+static
+void loge_levels_signal(int signo UNUSED) {
+  int saved = errno;
+  if (write(loge_registry_instance.pipe[1], "r", 1) < 0) {
+    /* Full pipe, a reload is pending anyway */
+  }
+  errno = saved;
+}
+
+/* Background thread, reloads the rules when the file or a signal says so */
+UNUSED
+static
+void* loge_levels_worker(void *arg UNUSED) {
+  struct loge_registry *preg = &loge_registry_instance;
+  char buf[4096]
+    __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct pollfd fds[2] = {
+    { preg->inotify_fd, POLLIN, 0 },
+    { preg->pipe[0], POLLIN, 0 }
+  };
+
+  for (;;) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      lgperror("poll failed");
+      break;
+    }
+
+    int reload = 0;
+
+    if (fds[0].revents & POLLIN) {
+      ssize_t n = read(preg->inotify_fd, buf, sizeof(buf));
+      for (char *p = buf; n > 0 && p < buf + n; ) {
+        const struct inotify_event *ev = (const struct inotify_event*)p;
+        if (ev->len && strcmp(ev->name, preg->file) == 0) {
+          reload = 1;
+        }
+        p += sizeof(struct inotify_event) + ev->len;
+      }
+    }
+
+    if (fds[1].revents & POLLIN) {
+      char cmd[16];
+      ssize_t n = read(preg->pipe[0], cmd, sizeof(cmd));
+      for (ssize_t i = 0; i < n; i++) {
+        if (cmd[i] == 'q') {
+          return NULL;
+        }
+        reload = 1;
+      }
+    }
+
+    /* A bad file is reported and the rules in place are kept */
+    if (reload) {
+      loge_load_levels(preg->path);
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Load the level rules from a file and reload them whenever the file
+ * is written or replaced, and on a signal. Editors that save through a rename
+ * are covered as the directory is watched.
+ * @param path File with the rules, see loge_load_levels()
+ * @param signo Signal that reloads the rules like SIGHUP, 0 for none
+ * @return 0 on success, -1 with errno set otherwise
+ *
+ * @see loge_unwatch_levels()
+ */
+UNUSED
+static
+int loge_watch_levels(const char *path, int signo) {
+  struct loge_registry *preg = &loge_registry_instance;
+
+  if (preg->watching) {
+    errno = EBUSY;
+    return -1;
+  }
+
+  if (loge_load_levels(path) < 0) {
+    return -1;
+  }
+
+  preg->inotify_fd = -1;
+  preg->pipe[0] = preg->pipe[1] = -1;
+  preg->signo = 0;
+
+  char *dir = strdup(path);
+  preg->path = strdup(path);
+  if (!dir || !preg->path) {
+    goto fail;
+  }
+
+  {
+    char *slash = strrchr(dir, '/');
+    preg->file = slash ? preg->path + (slash - dir) + 1 : preg->path;
+    if (!slash) {
+      strcpy(dir, ".");
+    } else if (slash == dir) {
+      dir[1] = '\0';
+    } else {
+      *slash = '\0';
+    }
+  }
+
+  preg->inotify_fd = inotify_init1(IN_CLOEXEC);
+  if (preg->inotify_fd < 0) {
+    lgperror("inotify_init1 failed");
+    goto fail;
+  }
+
+  if (inotify_add_watch(preg->inotify_fd, dir,
+        IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    lgperror("inotify_add_watch failed");
+    goto fail;
+  }
+
+#if defined(_GNU_SOURCE) || defined(__USE_GNU)
+  if (pipe2(preg->pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+    lgperror("pipe2 failed");
+    goto fail;
+  }
+#else
+  if (pipe(preg->pipe) < 0) {
+    lgperror("pipe failed");
+    goto fail;
+  }
+  for (int i = 0; i < 2; i++) {
+    fcntl(preg->pipe[i], F_SETFD, FD_CLOEXEC);
+    fcntl(preg->pipe[i], F_SETFL, O_NONBLOCK);
+  }
+#endif
+
+  if (signo > 0) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = &loge_levels_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(signo, &sa, &preg->old_action) < 0) {
+      lgperror("sigaction failed");
+      goto fail;
+    }
+    preg->signo = signo;
+  }
+
+  {
+    int err = pthread_create(&preg->thread, NULL, &loge_levels_worker, NULL);
+    if (err) {
+      errno = err;
+      lgperror("pthread_create failed");
+      goto fail;
+    }
+  }
+
+  free(dir);
+  preg->watching = 1;
+
+  return 0;
+
+fail:
+  {
+    int err = errno;
+    if (preg->signo) {
+      sigaction(preg->signo, &preg->old_action, NULL);
+    }
+    if (preg->pipe[0] > -1) {
+      close(preg->pipe[0]);
+      close(preg->pipe[1]);
+    }
+    if (preg->inotify_fd > -1) {
+      close(preg->inotify_fd);
+    }
+    free(preg->path);
+    preg->path = NULL;
+    free(dir);
+    errno = err;
+  }
+
+  return -1;
+}
+
+/* Stop reloading the level rules, the rules in place stay */
+UNUSED
+static
+void loge_unwatch_levels(void) {
+  struct loge_registry *preg = &loge_registry_instance;
+
+  if (!preg->watching) {
+    return;
+  }
+
+  if (preg->signo) {
+    sigaction(preg->signo, &preg->old_action, NULL);
+  }
+
+  if (write(preg->pipe[1], "q", 1) < 0) {
+    lgperror("write failed");
+  }
+  pthread_join(preg->thread, NULL);
+
+  close(preg->pipe[0]);
+  close(preg->pipe[1]);
+  close(preg->inotify_fd);
+  free(preg->path);
+  preg->path = NULL;
+  preg->watching = 0;
+}
+
+#else
+
+UNUSED
+static
+int loge_watch_levels(const char *path UNUSED, int signo UNUSED) {
+  errno = ENOSYS;
+  return -1;
+}
+
+UNUSED
+static
+void loge_unwatch_levels(void) {
+}
+
+#endif /* defined(__linux) || defined(__linux__) */
+
+/****************************** Common code ends ******************************/
+
+
+/******************************* C code starts ********************************/
+
+#ifndef __cplusplus
+
+/**
+ * @brief Macro to be used for logging information.
+ * @param ploge Pointer to struct loge.
+ * @param level Log type/level. Messages below this level will not be logged.
+ * @param ... Message format string and associated arguments.
+ */
+#define LOGE(ploge, level, ...) \
+  do { \
+    if (LOGE_LEVEL_ENABLED(level) && (ploge) != NULL && \
+        loge_enabled((struct loge*)(ploge), (level)) && \
+        loge_sampled((struct loge*)(ploge), (level))) \
+      loge_log_sampled( \
+          (struct loge*)(ploge), \
+          (level) & ~LOGCOLOR, \
+          __LINE__, \
+          __FILE__, \
+          __VA_ARGS__ \
+        ); \
+  } while (0)
+
+#define LOGE_COLOR(ploge, level, ...) \
+  do { \
+    if (LOGE_LEVEL_ENABLED(level) && (ploge) != NULL && \
+        loge_enabled((struct loge*)(ploge), (level)) && \
+        loge_sampled((struct loge*)(ploge), (level))) \
+      loge_log_sampled( \
+          (struct loge*)(ploge), \
+          (level) | LOGCOLOR, \
+          __LINE__, \
+          __FILE__, \
+          __VA_ARGS__ \
+        ); \
+  } while (0)
+
+/**
+ * @brief Macro for messages that may repeat in a tight loop, like the
+ * errors of a failing dependency. Each call site lets burst messages
+ * through per interval_ms and turns the rest away before formatting them.
+ * The next message let through is preceded by a line counting the
+ * messages suppressed since the last one. If none comes, the count is
+ * logged by loge_flush_output() or loge_flush_expired() once the site
+ * would let a message through again, or by loge_destroy().
+ * @param ploge Pointer to struct loge.
+ * @param level Log type/level. Messages below this level will not be logged.
+ * @param burst Messages logged at once, then burst per interval_ms.
+ * @param interval_ms Milliseconds to let burst messages through again.
+ * @param ... Message format string and associated arguments.
+ */
+#define LOGE_RATELIMIT(ploge, level, burst, interval_ms, ...) \
+  do { \
+    static struct loge_ratelimit loge_ratelimit_; \
+    unsigned long long loge_suppressed_; \
+    if (LOGE_LEVEL_ENABLED(level) && (ploge) != NULL && \
+        loge_enabled((struct loge*)(ploge), (level)) && \
+        loge_sampled((struct loge*)(ploge), (level)) && \
+        loge_ratelimit_pass(&loge_ratelimit_, (burst), (interval_ms), \
+          &loge_suppressed_, (void*)(ploge), (level) & ~LOGCOLOR, \
+          __FILE__, __LINE__)) { \
+      if (loge_suppressed_) \
+        loge_log_sampled( \
+            (struct loge*)(ploge), \
+            (level) & ~LOGCOLOR, \
+            __LINE__, \
+            __FILE__, \
+            "suppressed %llu similar messages", \
+            loge_suppressed_ \
+          ); \
+      loge_log_sampled( \
+          (struct loge*)(ploge), \
+          (level) & ~LOGCOLOR, \
+          __LINE__, \
+          __FILE__, \
+          __VA_ARGS__ \
+        ); \
+    } \
+  } while (0)
+
+#define LOGE_TYPE(entime, level) \
+  (int)( ( (!!(entime)) << LOGTIMESTAMPSHIFT ) | (level) )
+
+#define LOGE_ENTIME(type) \
+  (int)(!!(type & LOGTIMESTAMP))
+
+#define LOGE_LEVEL(type) \
+  (enum loge_level)(type & ~LOGTIMESTAMP)
+
+#define LOGE_LOGTYPE(encolor, level) \
+  (int)( ( (!!(encolor)) << LOGCOLORSHIFT ) | (level) )
+
+#define LOGE_ENCOLOR(type) \
+  (int)(!!(type & LOGCOLOR))
+
+#define LOGE_LOGLEVEL(type) \
+  (enum loge_level)(type & ~LOGCOLOR)
+
+/* Constant for constant levels, lets the compiler drop the whole call */
+#define LOGE_LEVEL_ENABLED(level) \
+  ((int)((level) & ~LOGCOLOR) >= (int)(LOGE_MIN_LEVEL))
+
+enum loge_constants {
+  LINENUMBER_WIDTH = 6,
+  NUMBER_WIDTH = 8,
+  BUFFER_SIZE = 1024,
+  TLS_BUFFER_SIZE = 4096,
+  LOGTIMESTAMPSHIFT = 31,
+  LOGCOLORSHIFT = 31,
+  LOGTIMESTAMP = 1 << LOGTIMESTAMPSHIFT,
+  LOGCOLOR = 1 << LOGCOLORSHIFT
+};
+
+/**
+ * @brief Enum type for levels of logging. Each level can represent a class of
+ * information that is to be logged
+ *
+ * The log level can be used to filter messages. All messages that have log
+ * type/level less that the specified type/level will not get logged.
+ */
+enum loge_level {
+  LOGE_ALL = 0,  /**< Everything */
+  LOGE_DEBUG,     /**< Debug information */
+  LOGE_INFO,      /**< Run time information like statuses, user output, etc */
+  LOGE_WARNING,   /**< Warnings */
+  LOGE_ERROR,     /**< Errors */
+  LOGE_CRITICAL,  /**< Critical errors */
+  LOGE_MAX
+};
+
+/* Forward declaration */
+struct loge;
+
+/**
+ * @brief Defines the type for function used as log callback function.
+ * @param ploge Pointer to struct loge
+ *
+ * @see loge_set_fn()
+ * @see loge_log()
+ */
+typedef void (*log_fn)(const struct loge *ploge);
+
+/**
+ * @brief Defines type for function used as raw data callback function.
+ * @param ploge,Pointer to struct loge
+ * @param file Output stream of the logger
+ * @param timestamp Number of seconds since Epoch
+ * @param filename Name of the source file
+ * @param linenum Line number of the source file from where logging happened
+ * @param level Type/level of log
+ * @param msg User message. This is the result of applying arguments to the
+ * format string passed to loge_log()
+ *
+ * @see loge_set_data_fn()
+ * @see loge_log()
+ */
+typedef void (*log_data_fn)(
+    FILE *file,
+    time_t timestamp,
+    const char *filename,
+    int linenum,
+    enum loge_level level,
+    const char *msg
+  );
+
+struct loge {
+  char *bufptr;
+  char buffer[BUFFER_SIZE];
+  size_t bufcap;
+  size_t buflen;
+  log_fn plogfn, pprevlogfn;
+  log_data_fn pdatafn;
+  FILE *file;
+  socket_type sockfd;
+  int log_type;
+  int linenumwidth;
+  int width;
+  int precision;
+  int syslog_priority;
+  int concurrent;
+  loge_mutex lock;
+  struct loge_flush_policy flush_policy;
+  int flush_policy_set; /* Policy chosen by loge_set_flush_policy() */
+  struct loge_flush_state flush_state;
+  int msglevel; /* Level of the message being written */
+  size_t msgprefix; /* Length of its text prefix, 0 for raw records */
+  const char *msgfile; /* Its source location, NULL for raw records */
+  int msgline;
+  struct loge_mmap mapfile;
+  struct loge_rotate rotate;
+  struct loge_recorder recorder;
+  struct loge_tcp tcp;
+  struct loge_udp udp;
+  struct loge_journal journal;
+  uint64_t sample_rate[LOGE_MAX]; /* Keep 1 in n messages of a level */
+};
+
+/*
+ * Per thread scratch buffer used for formatting when a logger is shared
+ * between threads
+ */
+static
+LOGE_THREAD_LOCAL char loge_tls_buffer[TLS_BUFFER_SIZE];
+
+/**
+ * @brief Get pointer to a string containing the name of the log type/level
+ * @param level Enum mentioning the log type/level
+ * @return Pointer to a string
+ *
+ * @see enum loge_level
+ */
+UNUSED
+static
+const char* loge_get_level(enum loge_level level) {
+  return level > LOGE_ALL && level < LOGE_MAX ?
+    loglevel_strtbl[level] :
+    NULL;
+}
+
+/**
+ * @brief Get pointer to a string containing the name of the log type/level
+ * along with ANSI escape codes for colored output
+ * @param level Enum mentioning the log type/level
+ * @return Pointer to a string
+ *
+ * @see enum loge_level
+ */
+UNUSED
+static
+const char* loge_get_level_color(enum loge_level level) {
+  return level > LOGE_ALL && level < LOGE_MAX ?
+    loglevel_strtbl_color[level] :
+    NULL;
+}
+
+/**
+ * @brief Check if a message of the given level would be logged. Used by the
+ * logging macros before any argument is evaluated.
+ * @param ploge Pointer to struct loge
+ * @param level Log type/level, may be OR'd with LOGCOLOR
+ * @return Non-zero if the message passes the level filter
+ */
+UNUSED
+static
+inline
+int loge_enabled(const struct loge *ploge, int level) {
+  int loglevel = (int)LOGE_LOGLEVEL(level);
+
+  return loglevel >= (int)LOGE_LEVEL(loge_atomic_load_int(&ploge->log_type)) ||
+    loglevel >= loge_atomic_load_int(&ploge->recorder.level);
+}
+
+/**
+ * @brief Decide whether a message of the given level survives sampling, see
+ * loge_set_sample_rate(). Every call is a decision of its own, the logging
+ * macros make it once per message after loge_enabled() and loge_log() makes
+ * it for direct calls.
+ * @param ploge Pointer to struct loge
+ * @param level Log type/level, may be OR'd with LOGCOLOR
+ * @return Non-zero to keep the message
+ */
+UNUSED
+static
+inline
+int loge_sampled(const struct loge *ploge, int level) {
+  int loglevel = (int)LOGE_LOGLEVEL(level);
+
+  return loglevel >= LOGE_MAX ||
+    loge_sample(loge_atomic_load(&ploge->sample_rate[loglevel]));
+}
+
+UNUSED
+static
+const char* loge_bufptr(const struct loge *ploge) {
+  return !ploge ? (const char*)ploge : ploge->bufptr;
+}
+
+UNUSED
+static
+FILE* loge_fileptr(const struct loge *ploge) {
+  return !ploge ? (FILE*)ploge : ploge->file;
+}
+
+/* Flush the output stream, caller holds the lock of a concurrent logger */
+UNUSED
+static
+void loge_output_flush(struct loge *ploge) {
+  if (ploge->mapfile.map) {
+    loge_mmap_flush(&ploge->mapfile, ploge->flush_policy.sync);
+
+  } else if (ploge->tcp.queue) {
+    loge_tcp_flush(&ploge->tcp);
+
+  } else if (ploge->udp.buf) {
+    loge_udp_flush(&ploge->udp);
+
+  } else if (ploge->file) {
+    fflush(ploge->file);
+    if (ploge->flush_policy.sync) {
+      loge_fdatasync(fileno(ploge->file));
+    }
+  }
+
+  loge_flush_done(&ploge->flush_state);
+}
+
+/* Move on to a new file of loge_set_file_rotate(), caller holds the lock */
+UNUSED
+static
+void loge_rotate_stream(struct loge *ploge) {
+  loge_output_flush(ploge);
+
+  int fd = loge_rotate_next(&ploge->rotate);
+  if (fd < 0) {
+    return;
+  }
+
+  FILE *file = fdopen(fd, "w");
+  if (!file) {
+    /* Go on with the renamed file */
+    lgperror("fdopen failed");
+    close(fd);
+    ploge->rotate.fd = fileno(ploge->file);
+    return;
+  }
+
+  fclose(ploge->file);
+  ploge->file = file;
+}
+
+/**
+ * @brief Write a string followed by a newline character to a stream. This is
+ * the default callback function. The stream is flushed as the flush policy
+ * says, custom callbacks take care of their own output.
+ * @param ploge Pointer to struct loge
+ */
+UNUSED
+static
+void log_internal(const struct loge *ploge) {
+  if (!ploge) {
+    return;
+  }
+
+  FILE *file = loge_fileptr(ploge);
+  if (!file) {
+    return;
+  }
+
+  /* Flush and rotation state is owned by whoever writes to the stream */
+  struct loge *pout = (struct loge*)ploge;
+  int rotating = pout->rotate.fd > -1 && fileno(file) == pout->rotate.fd;
+
+  if (rotating && loge_rotate_due(&pout->rotate, pout->buflen + 1)) {
+    loge_rotate_stream(pout);
+    file = pout->file;
+  }
+
+  fputs(loge_bufptr(ploge), file);
+  fputc('\n', file);
+
+  if (rotating) {
+    pout->rotate.size += pout->buflen + 1;
+  }
+
+  if (loge_flush_due(&pout->flush_policy, &pout->flush_state,
+        pout->msglevel, pout->buflen + 1)) {
+    loge_output_flush(pout);
+  }
+}
+
+/**
+ * @brief Append a string followed by a newline character to the memory
+ * mapped log file. Callback set by loge_set_mmap_file().
+ * @param ploge Pointer to struct loge
+ */
+UNUSED
+static
+void log_mmap(const struct loge *ploge) {
+  if (!ploge || !ploge->mapfile.map) {
+    return;
+  }
+
+  struct loge *pout = (struct loge*)ploge;
+  const char *msg = loge_bufptr(ploge);
+  size_t len = strlen(msg);
+
+  loge_mmap_write(&pout->mapfile, msg, len);
+  loge_mmap_write(&pout->mapfile, "\n", 1);
+
+  if (loge_flush_due(&pout->flush_policy, &pout->flush_state,
+        pout->msglevel, len + 1)) {
+    loge_output_flush(pout);
+  }
+}
+
+/**
+ * @brief Queue a string followed by a newline character for the TCP sink.
+ * Callback set by loge_set_tcp().
+ * @param ploge Pointer to struct loge
+ */
+UNUSED
+static
+void log_tcp(const struct loge *ploge) {
+  if (!ploge || !ploge->tcp.queue) {
+    return;
+  }
+
+  struct loge *pout = (struct loge*)ploge;
+  const char *msg = loge_bufptr(ploge);
+  size_t len = strlen(msg);
+
+  loge_tcp_write(&pout->tcp, msg, len, 1);
+
+  if (loge_flush_due(&pout->flush_policy, &pout->flush_state,
+        pout->msglevel, len + 1)) {
+    loge_output_flush(pout);
+  }
+}
+
+/**
+ * @brief Pack a string followed by a newline character into a datagram of
+ * the UDP sink. Callback set by loge_set_udp().
+ * @param ploge Pointer to struct loge
+ */
+UNUSED
+static
+void log_udp(const struct loge *ploge) {
+  if (!ploge || !ploge->udp.buf) {
+    return;
+  }
+
+  struct loge *pout = (struct loge*)ploge;
+  const char *msg = loge_bufptr(ploge);
+  size_t len = strlen(msg);
+
+  loge_udp_write(&pout->udp, msg, len, 1);
+
+  if (loge_flush_due(&pout->flush_policy, &pout->flush_state,
+        pout->msglevel, len + 1)) {
+    loge_output_flush(pout);
+  }
+}
+
+/**
+ * @brief Send the message without its text prefix to the journal sink.
+ * Callback set by loge_set_journal().
+ * @param ploge Pointer to struct loge
+ */
+UNUSED
+static
+void log_journal(const struct loge *ploge) {
+  if (!ploge || ploge->journal.sock < 0) {
+    return;
+  }
+
+  struct loge *pout = (struct loge*)ploge;
+  const char *msg = loge_bufptr(ploge) + ploge->msgprefix;
+
+  loge_journal_write(&pout->journal, ploge->msglevel, ploge->msgfile,
+      ploge->msgline, msg, strlen(msg));
+}
+
+/* glibc and BSD libc only */
+#if defined(__GLIBC__) || defined(__FreeBSD__) || defined(__OpenBSD__)
+
+UNUSED
+static
+void log_syslog(const struct loge *ploge) {
+  if (!ploge) {
+    return;
+  }
+
+  const char *msg = loge_bufptr(ploge);
+  syslog(ploge->syslog_priority, "%s\n", msg);
+}
+
+#endif
+
+/* Store the level, other threads may be logging */
+UNUSED
+static
+void loge_store_level(struct loge *ploge, enum loge_level level) {
+  int en_timestamp = LOGE_ENTIME(loge_atomic_load_int(&ploge->log_type));
+
+  loge_atomic_store_int(&ploge->log_type, LOGE_TYPE(en_timestamp, level));
+}
+
+/**
+ * @brief Set the log type/level to be filtered by the logger. Messages below
+ * this level will not be logged. A registered logger under a level rule
+ * goes back to this level, not the one it had before the rule, once the
+ * rule is removed.
+ * @param ploge Pointer to struct loge
+ * @param level Enum mentioning the log type/level
+ *
+ * @see enum loge_level
+ */
+UNUSED
+static
+void loge_set_level(struct loge *ploge, enum loge_level level) {
+  if (!ploge || level >= LOGE_MAX) {
+    return;
+  }
+
+  if (!loge_registry_set_level(ploge, level)) {
+    loge_store_level(ploge, level);
+  }
+}
+
+/**
+ * @brief Keep one in rate messages of a level, decided by the logging
+ * macros before any argument is evaluated and by loge_log() for direct
+ * calls. The decision is random unless the thread has a sampling key, see
+ * loge_sample_key(). Safe to call while other threads log.
+ * @param ploge Pointer to struct loge
+ * @param level Level to sample
+ * @param rate Keep one message in rate, 0 or 1 to keep all
+ */
+UNUSED
+static
+void loge_set_sample_rate(struct loge *ploge, enum loge_level level,
+    uint64_t rate) {
+
+  if (!ploge || level >= LOGE_MAX) {
+    return;
+  }
+
+  loge_atomic_store(&ploge->sample_rate[level], rate);
+}
+
+/* Rate a level is sampled at, 0 if every message is kept */
+UNUSED
+static
+uint64_t loge_sample_rate(const struct loge *ploge, enum loge_level level) {
+  if (!ploge || level >= LOGE_MAX) {
+    return 0;
+  }
+
+  return loge_atomic_load(&ploge->sample_rate[level]);
+}
+
+/* Kind of struct loge in the registry, see loge_registry_find() */
+#define LOGE_KIND "struct loge"
+
+UNUSED
+static
+int loge_registry_level(void *logger, int level) {
+  struct loge *ploge = (struct loge*)logger;
+  int prev = LOGE_LEVEL(loge_atomic_load_int(&ploge->log_type));
+
+  if (level > -1 && level < LOGE_MAX) {
+    loge_store_level(ploge, (enum loge_level)level);
+  }
+
+  return prev;
+}
+
+/**
+ * @brief Register the logger under a unique dot separated name. Its level
+ * follows the rule for the longest matching name from now on, "net" covers
+ * "net.http", and "*" covers every logger. See loge_set_category_level(),
+ * loge_load_levels() and loge_watch_levels().
+ * @param ploge Pointer to struct loge
+ * @param name Name of the logger
+ * @return 0 on success, -1 with errno set otherwise
+ */
+UNUSED
+static
+int loge_register(struct loge *ploge, const char *name) {
+  if (!ploge) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  return loge_registry_add(name, LOGE_KIND, ploge, &loge_registry_level);
+}
+
+/* Drop the logger from the registry, loge_destroy() does it too */
+UNUSED
+static
+void loge_unregister(struct loge *ploge) {
+  loge_registry_remove(ploge);
+}
+
+/* Registered logger with the name, NULL if there is none */
+UNUSED
+static
+struct loge* loge_find(const char *name) {
+  return (struct loge*)loge_registry_find(name, LOGE_KIND);
+}
+
+/**
+ * @brief Set the callback function to be used for writing the log message to
+ * a stream. This will override previous callback function if a non-NULL
+ * address is passed.
+ *
+ * The output stream and log message are passed on to this callback function.
+ * Log string provided to this function will be formatted as:
+ * m-dd-yyyy : HH-mm-ss : filename:linenum : loglevel : user_message
+ *
+ * User message will be the result of applying arguments to a format string.
+ *
+ * @param ploge Pointer to struct loge
+ * @param fn Pointer to the callback function
+ *
+ * @see log_fn
+ * @see loge_log()
+ */
+UNUSED
+static
+void loge_set_fn(struct loge *ploge, log_fn fn) {
+  if (!ploge || !fn) {
+    return;
+  }
+
+  ploge->pprevlogfn = ploge->plogfn;
+  ploge->plogfn = fn;
+}
+
+/**
+ * @brief Set the callback function that can be used alternatively for writing
+ * the the log message to a stream. This will override previous callback
+ * function even when a NULL address is passed. Additional arguments are passed
+ * to this callback function.
+ * @param ploge Pointer to struct loge
+ * @param fn Pointer to the callback function
+ *
+ * @see log_data_fn
+ * @see loge_log()
+ */
+UNUSED
+static
+void loge_set_data_fn(struct loge *ploge, log_data_fn fn) {
+  if (!ploge) {
+    return;
+  }
+
+  ploge->pdatafn = fn;
+}
+
+/**
+ * @brief Set when the output stream is flushed. The default flushes after
+ * every message. Pending messages are flushed before the policy changes.
+ * @param ploge Pointer to struct loge
+ * @param policy Pointer to the policy, NULL for the default
+ *
+ * @see struct loge_flush_policy
+ */
+UNUSED
+static
+void loge_set_flush_policy(struct loge *ploge,
+    const struct loge_flush_policy *policy) {
+
+  if (!ploge) {
+    return;
+  }
+
+  if (ploge->concurrent) {
+    loge_mutex_lock(&ploge->lock);
+  }
+
+  if (ploge->flush_state.messages) {
+    loge_output_flush(ploge);
+  }
+
+  if (policy) {
+    ploge->flush_policy = *policy;
+  } else {
+    memset(&ploge->flush_policy, 0, sizeof(ploge->flush_policy));
+  }
+  ploge->flush_policy_set = policy != NULL;
+
+  if (ploge->concurrent) {
+    loge_mutex_unlock(&ploge->lock);
+  }
+}
+
+/*
+ * Sync log files on every flush, as long as no policy has been set with
+ * loge_set_flush_policy(). A policy set before the file is kept as it is.
+ */
+UNUSED
+static
+void loge_default_sync(struct loge *ploge) {
+  if (!ploge->flush_policy_set) {
+    ploge->flush_policy.sync = 1;
+  }
+}
+
+/* Defined with loge_log() */
+static
+void loge_log_sampled(struct loge *ploge, int logtype, int linenum,
+    const char *filename, const char *msg, ...);
+
+/* Summary line of a rate limited call site, see loge_ratelimit_expire() */
+UNUSED
+static
+void loge_ratelimit_summary(void *logger, int level, const char *file,
+    int line, unsigned long long suppressed) {
+
+  loge_log_sampled((struct loge*)logger, level, line, file,
+      "suppressed %llu similar messages", suppressed);
+}
+
+/**
+ * @brief Flush messages held back by the flush policy to the output stream,
+ * and sync the file if the policy asks for it. Rate limited call sites that
+ * are done turning messages away log their summary first.
+ * @param ploge Pointer to struct loge
+ */
+UNUSED
+static
+void loge_flush_output(struct loge *ploge) {
+  if (!ploge) {
+    return;
+  }
+
+  loge_ratelimit_expire(ploge, 0, &loge_ratelimit_summary);
+
+  if (ploge->concurrent) {
+    loge_mutex_lock(&ploge->lock);
+  }
+
+  loge_output_flush(ploge);
+
+  if (ploge->concurrent) {
+    loge_mutex_unlock(&ploge->lock);
+  }
+}
+
+/**
+ * @brief Flush pending messages older than the flush interval. Meant to be
+ * called periodically, e.g. from an event loop, so an idle logger does not
+ * hold messages back for longer than the interval. Rate limited call sites
+ * that are done turning messages away log their summary first.
+ * @param ploge Pointer to struct loge
+ * @return Non-zero if the output was flushed
+ */
+UNUSED
+static
+int loge_flush_expired(struct loge *ploge) {
+  if (!ploge) {
+    return 0;
+  }
+
+  loge_ratelimit_expire(ploge, 0, &loge_ratelimit_summary);
+
+  int flushed = 0;
+
+  if (ploge->concurrent) {
+    loge_mutex_lock(&ploge->lock);
+  }
+
+  if (loge_flush_overdue(&ploge->flush_policy, &ploge->flush_state)) {
+    loge_output_flush(ploge);
+    flushed = 1;
+  }
+
+  if (ploge->concurrent) {
+    loge_mutex_unlock(&ploge->lock);
+  }
+
+  return flushed;
+}
+
+/* Write a record of the flight recorder, caller holds the lock */
+UNUSED
+static
+void loge_recorder_write(void *ctx, const char *data, size_t len,
+    int level) {
+
+  struct loge *ploge = (struct loge*)ctx;
+  if (!ploge->plogfn) {
+    return;
+  }
+
+  /* Callbacks read the message through the logger */
+  char *bufptr = ploge->bufptr;
+  size_t buflen = ploge->buflen;
+
+  ploge->bufptr = (char*)data;
+  ploge->buflen = len;
+  ploge->msglevel = level;
+  ploge->msgprefix = 0;
+  ploge->msgfile = NULL;
+
+  ploge->plogfn(ploge);
+
+  ploge->bufptr = bufptr;
+  ploge->buflen = buflen;
+}
+
+/**
+ * @brief Keep messages below the logger level in a flight recorder. They
+ * are formatted into a ring of the last records instead of being dropped,
+ * with no I/O. A message at or above dump_level first writes out what was
+ * recorded since the last dump, and so does loge_dump_recorder(). Messages
+ * are cut at LOGE_RECORDER_RECORD_SIZE.
+ * @param ploge Pointer to struct loge
+ * @param records Number of records kept
+ * @param level Lowest level recorded
+ * @param dump_level Lowest level that dumps the recorder, LOGE_MAX for none
+ * @param filepath File for the ring to survive a crash, read it back with
+ * loge-recorder. NULL keeps it in memory. The file is overwritten.
+ * @return 0 on success, -1 on failure
+ *
+ * @see struct loge_recorder
+ */
+UNUSED
+static
+int loge_enable_recorder(struct loge *ploge, size_t records,
+    enum loge_level level, enum loge_level dump_level,
+    const char *filepath) {
+
+  if (!ploge || loge_recorder_open(&ploge->recorder, records,
+        LOGE_RECORDER_RECORD_SIZE, filepath) < 0) {
+    return -1;
+  }
+
+  /* Threads logging start recording from here */
+  loge_atomic_store_int(&ploge->recorder.dump_level, dump_level);
+  loge_atomic_store_int(&ploge->recorder.level, level);
+
+  return 0;
+}
+
+/**
+ * @brief Stop recording, records not dumped are dropped. A file backed
+ * recorder keeps them in the file. Safe while other threads log.
+ * @param ploge Pointer to struct loge
+ */
+UNUSED
+static
+void loge_disable_recorder(struct loge *ploge) {
+  if (!ploge) {
+    return;
+  }
+
+  loge_atomic_store_int(&ploge->recorder.level, LOGE_MAX);
+  loge_atomic_store_int(&ploge->recorder.dump_level, LOGE_MAX);
+  loge_recorder_close(&ploge->recorder);
+}
+
+/**
+ * @brief Write out the messages recorded since the last dump, oldest first
+ * @param ploge Pointer to struct loge
+ * @return Number of messages written
+ */
+UNUSED
+static
+size_t loge_dump_recorder(struct loge *ploge) {
+  if (!ploge) {
+    return 0;
+  }
+
+  if (ploge->concurrent) {
+    loge_mutex_lock(&ploge->lock);
+  }
+
+  size_t count = loge_recorder_dump(&ploge->recorder, &loge_recorder_write,
+      ploge);
+
+  if (ploge->concurrent) {
+    loge_mutex_unlock(&ploge->lock);
+  }
+
+  return count;
+}
+
+UNUSED
+static
+FILE* loge_set_fd(struct loge *ploge, int fd) {
+  if (!ploge) {
+    return NULL;;
+  }
+
+  FILE *prev = ploge->file;
+
+  if (fd < 0) {
+    return prev;
+  }
+
+  int newfd = dup(fd);
+  if (newfd < 0) {
+    lgperror(dup_str" failed");
+    return prev;
+  }
+  FILE *file = fdopen(newfd, "w");
+  if (!file) {
+    lgperror(fdopen_str" failed");
+    close(newfd);
+    return prev;
+  }
+
+  ploge->file = file;
+
+  ploge->pprevlogfn = ploge->plogfn;
+  ploge->plogfn = &log_internal;
+
+  return prev;
+}
+
+UNUSED
+static
+void loge_unset_fd(struct loge *ploge) {
+  if (!ploge) {
+    return;
+  }
+
+  loge_output_flush(ploge);
+
+  if (ploge->file != stdout && ploge->file != stderr) {
+    fclose(ploge->file);
+  }
+
+  ploge->file = NULL;
+
+  ploge->plogfn = ploge->pprevlogfn;
+}
+
+/**
+ * @brief Set the stream to which log messages will be written.
+ * @param ploge Pointer to struct loge
+ * @param file Pointer to the stream
+ */
+UNUSED
+static
+FILE* loge_set_fileptr(struct loge *ploge, FILE *file) {
+  if (!ploge) {
+    return NULL;
+  }
+
+  FILE *prev = ploge->file;
+  if (file) {
+    ploge->file = file;
+  }
+  return prev;
+}
+
+UNUSED
+static
+FILE* loge_unset_fileptr(struct loge *ploge) {
+  if (!ploge) {
+    return NULL;
+  }
+
+  FILE *prev = ploge->file;
+  ploge->file = NULL;
+  return prev;
+}
+
+/**
+ * @brief Set the stdout stream as the output stream. The default callback
+ * function will also be set. User may override it.
+ * @param ploge Pointer to struct loge
+ */
+UNUSED
+static
+FILE* loge_set_stdout(struct loge *ploge) {
+  if (!ploge) {
+    return NULL;
+  }
+
+  ploge->pprevlogfn = ploge->plogfn;
+  ploge->plogfn = &log_internal;
+
+  FILE *prev = ploge->file;
+  ploge->file = stdout;
+  return prev;
+}
+
+/**
+ * @brief Set the stderr stream as the output stream. The default callback
+ * function will also be set. User may override it.
+ * @param ploge Pointer to struct loge
+ */
+UNUSED
+static
+FILE* loge_set_stderr(struct loge *ploge) {
+  if (!ploge) {
+    return NULL;
+  }
+
+  ploge->pprevlogfn = ploge->plogfn;
+  ploge->plogfn = &log_internal;
+
+  FILE *prev = ploge->file;
+  ploge->file = stderr;
+  return prev;
+}
+
+/* glibc and BSD libc only */
+#if defined(__GLIBC__) || defined(__FreeBSD__) || defined(__OpenBSD__)
+
+UNUSED
+static
+FILE* loge_set_syslog(struct loge *ploge, int priority) {
+  if (!ploge) {
+    return NULL;
+  }
+
+  FILE *prev = ploge->file;
+
+  /* Clear FILE pointer and pdatafn */
+  ploge->file = NULL;
+  ploge->pdatafn = NULL;
+
+  ploge->syslog_priority = priority;
+
+  ploge->pprevlogfn = ploge->plogfn;
+  ploge->plogfn = &log_syslog;
+
+  return prev;
+}
+
+#endif
+
+/**
+ * @brief Set file which will be created or appended to, for writing log
+ * messages. The file will be opened and a stream will be associated with it.
+ * This stream will be set as the output stream for the logger. The default
+ * callback function will also be set. User may override it.
+ * @param ploge pointer to struct loge
+ * @param filepath Relative or absolute path of the output file
+ */
+UNUSED
+static
+FILE* loge_set_file(struct loge *ploge, const char *filepath) {
+  if (!ploge) {
+    return NULL;
+  }
+
+  FILE *prev = ploge->file;
+
+  if (!filepath) {
+    return prev;
+  }
+
+  int fd = -1;
+  FILE *file = NULL;
+
+#if defined(__linux) || defined(__linux__)
+
+  fd = open(filepath,
+      O_WRONLY|O_CREAT|O_APPEND,
+      S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH);
+  if (!fd) {
+    lgperror("open failed");
+    return prev;
+  }
+
+  file = fdopen(fd, "w");
+  if (!file) {
+    lgperror("fdopen failed");
+    if (fd > -1) {
+      close(fd);
+    }
+    return prev;
+  }
+
+#else
+
+  file = fopen(filepath, "a");
+  if (!file) {
+    lgperror("fopen failed");
+    return prev;
+  }
+
+#endif
+
+  ploge->file = file;
+
+  /* Log files are synced on every flush unless a policy says otherwise */
+  loge_default_sync(ploge);
+
+  ploge->pprevlogfn = ploge->plogfn;
+  ploge->plogfn = &log_internal;
+
+  return prev; 
+}
+
+/**
+ * @brief Set a log file that is rotated by size and time. On rotation the
+ * file is renamed to filepath.YYYYmmdd-HHMMSS and filepath is opened again,
+ * rotated files are compressed and removed on a background thread. Close
+ * with loge_unset_file().
+ * @param ploge Pointer to struct loge
+ * @param filepath Relative or absolute path of the output file
+ * @param policy Pointer to the rotation policy
+ * @return Pointer to previous file stream
+ *
+ * @see struct loge_rotate_policy
+ */
+UNUSED
+static
+FILE* loge_set_file_rotate(struct loge *ploge, const char *filepath,
+    const struct loge_rotate_policy *policy) {
+
+  if (!ploge) {
+    return NULL;
+  }
+
+  FILE *prev = ploge->file;
+
+  if (!filepath || !policy || ploge->rotate.path) {
+    return prev;
+  }
+
+  int fd = loge_rotate_open(&ploge->rotate, filepath, policy);
+  if (fd < 0) {
+    return prev;
+  }
+
+  FILE *file = fdopen(fd, "w");
+  if (!file) {
+    lgperror("fdopen failed");
+    loge_rotate_close(&ploge->rotate);
+    close(fd);
+    return prev;
+  }
+
+  ploge->file = file;
+  loge_default_sync(ploge);
+
+  ploge->pprevlogfn = ploge->plogfn;
+  ploge->plogfn = &log_internal;
+
+  return prev;
+}
+
+/**
+ * @brief Log to a memory mapped file instead of a stream. The file is
+ * preallocated in large extents and records are copied into a mapped window
+ * of it, there is no system call per message. Unlike loge_set_file() the
+ * file is not synced by default, a flush policy with sync set has msync run
+ * when it flushes. The log callback is set to the one writing to the
+ * mapping.
+ * @param ploge Pointer to struct loge
+ * @param filepath Relative or absolute path of the output file
+ * @param append Non-zero to append to the file, zero to truncate it
+ * @return 0 on success, -1 on failure
+ *
+ * @see struct loge_mmap
+ */
+UNUSED
+static
+int loge_set_mmap_file(struct loge *ploge, const char *filepath,
+    int append) {
+
+  if (!ploge || !filepath || ploge->mapfile.fd > -1) {
+    return -1;
+  }
+
+  if (loge_mmap_open(&ploge->mapfile, filepath, append) < 0) {
+    return -1;
+  }
+
+  ploge->pprevlogfn = ploge->plogfn;
+  ploge->plogfn = &log_mmap;
+
+  return 0;
+}
+
+/**
+ * @brief Sync and close the memory mapped log file, truncated to its data,
+ * and restore the callback function.
+ * @param ploge Pointer to struct loge
+ */
+UNUSED
+static
+void loge_unset_mmap_file(struct loge *ploge) {
+  if (!ploge || ploge->mapfile.fd < 0) {
+    return;
+  }
+
+  loge_output_flush(ploge);
+  loge_mmap_close(&ploge->mapfile);
+
+  ploge->plogfn = ploge->pprevlogfn;
+}
+
+/**
+ * @brief Log to a TCP server without ever blocking on it. Records are
+ * queued in memory and sent by a background thread, which connects and
+ * reconnects with exponential backoff. While the server is down records
+ * go to the spool file of the policy and are replayed in order once it is
+ * back. The log callback is set to the one queueing for the sink.
+ * @param ploge Pointer to struct loge
+ * @param host IPv4 or IPv6 address
+ * @param port Port number
+ * @param ipv6 Non-zero if host is an IPv6 address
+ * @param policy Pointer to the policy, NULL for the defaults
+ * @return 0 on success, -1 on failure
+ *
+ * @see struct loge_tcp_policy
+ */
+UNUSED
+static
+int loge_set_tcp(struct loge *ploge, const char *host, unsigned short port,
+    int ipv6, const struct loge_tcp_policy *policy) {
+
+  if (!ploge || !host || ploge->tcp.queue) {
+    return -1;
+  }
+
+  if (loge_tcp_open(&ploge->tcp, host, port, ipv6, policy) < 0) {
+    return -1;
+  }
+
+  ploge->pprevlogfn = ploge->plogfn;
+  ploge->plogfn = &log_tcp;
+
+  return 0;
+}
+
+/**
+ * @brief Send what is queued and close the TCP sink, then restore the
+ * callback function. Records the server did not take within the longest
+ * backoff are left in the spool file.
+ * @param ploge Pointer to struct loge
+ */
+UNUSED
+static
+void loge_unset_tcp(struct loge *ploge) {
+  if (!ploge || !ploge->tcp.queue) {
+    return;
+  }
+
+  loge_tcp_close(&ploge->tcp);
+  loge_flush_done(&ploge->flush_state);
+
+  ploge->plogfn = ploge->pprevlogfn;
+}
+
+/**
+ * @brief Log to a UDP server. Records are packed into datagrams of up to
+ * mtu bytes, which are sent in batches with sendmmsg(2) when the flush
+ * policy says so or a batch is full. A flush policy that lets records
+ * pile up therefore saves both datagrams and system calls. Datagrams the
+ * socket has no room for are dropped, see loge_udp_dropped().
+ * @param ploge Pointer to struct loge
+ * @param host IPv4 or IPv6 address
+ * @param port Port number
+ * @param ipv6 Non-zero if host is an IPv6 address
+ * @param mtu Largest datagram, 0 for LOGE_UDP_MTU
+ * @return 0 on success, -1 on failure
+ *
+ * @see struct loge_udp
+ */
+UNUSED
+static
+int loge_set_udp(struct loge *ploge, const char *host, unsigned short port,
+    int ipv6, size_t mtu) {
+
+  if (!ploge || !host || ploge->udp.buf) {
+    return -1;
+  }
+
+  if (loge_udp_open(&ploge->udp, host, port, ipv6, mtu) < 0) {
+    return -1;
+  }
+
+  ploge->pprevlogfn = ploge->plogfn;
+  ploge->plogfn = &log_udp;
+
+  return 0;
+}
+
+/**
+ * @brief Send what is pending, close the UDP sink and restore the callback
+ * function.
+ * @param ploge Pointer to struct loge
+ */
+UNUSED
+static
+void loge_unset_udp(struct loge *ploge) {
+  if (!ploge || !ploge->udp.buf) {
+    return;
+  }
+
+  loge_udp_close(&ploge->udp);
+  loge_flush_done(&ploge->flush_state);
+
+  ploge->plogfn = ploge->pprevlogfn;
+}
+
+/**
+ * @brief Log to a collector on the same host through a Unix domain socket,
+ * which costs much less per message than TCP over loopback. Records are
+ * packed and sent in batches like with loge_set_udp(), each record or
+ * batch of records arriving as one message. Sends block while the
+ * collector catches up. When it goes away the socket is connected again
+ * with backoff, what is logged in between is dropped. Close with
+ * loge_unset_udp().
+ * @param ploge Pointer to struct loge
+ * @param path Path of the collector socket
+ * @param type SOCK_SEQPACKET or SOCK_DGRAM
+ * @param mtu Largest message, 0 for LOGE_UNIX_MTU
+ * @return 0 on success, -1 on failure
+ *
+ * @see struct loge_udp
+ */
+UNUSED
+static
+int loge_set_unix(struct loge *ploge, const char *path, int type,
+    size_t mtu) {
+
+  if (!ploge || !path || ploge->udp.buf) {
+    return -1;
+  }
+
+  if (loge_unix_open(&ploge->udp, path, type, mtu) < 0) {
+    return -1;
+  }
+
+  ploge->pprevlogfn = ploge->plogfn;
+  ploge->plogfn = &log_udp;
+
+  return 0;
+}
+
+/**
+ * @brief Log straight to systemd-journald or a syslog daemon through its
+ * Unix socket instead of syslog(3). Each record is one datagram made of the
+ * header rendered when the sink was set, the level and source location of
+ * the record and the message without the text prefix.
+ * @param ploge Pointer to struct loge
+ * @param policy Pointer to the policy, NULL for journald and the defaults
+ * @return 0 on success, -1 on failure
+ *
+ * @see struct loge_journal_policy
+ */
+UNUSED
+static
+int loge_set_journal(struct loge *ploge,
+    const struct loge_journal_policy *policy) {
+
+  if (!ploge || ploge->journal.sock > -1) {
+    return -1;
+  }
+
+  if (loge_journal_open(&ploge->journal, policy) < 0) {
+    return -1;
+  }
+
+  ploge->pprevlogfn = ploge->plogfn;
+  ploge->plogfn = &log_journal;
+
+  return 0;
+}
+
+/**
+ * @brief Close the journal sink and restore the callback function.
+ * @param ploge Pointer to struct loge
+ */
+UNUSED
+static
+void loge_unset_journal(struct loge *ploge) {
+  if (!ploge || ploge->journal.sock < 0) {
+    return;
+  }
+
+  loge_journal_close(&ploge->journal);
+
+  ploge->plogfn = ploge->pprevlogfn;
+}
+
+/**
+ * @brief Close the output file stream and restore the callback function.
+ * @param ploge pointer to struct loge
+ */
+UNUSED
+static
+void loge_unset_file(struct loge *ploge) {
+  if (!ploge || !ploge->file) {
+    return;
+  }
+
+  loge_output_flush(ploge);
+  loge_rotate_close(&ploge->rotate);
+
+  if (ploge->file != stdout && ploge->file != stderr) {
+    fclose(ploge->file);
+  }
+
+  ploge->file = NULL;
+
+  ploge->plogfn = ploge->pprevlogfn;
+}
+
+/* glibc and BSD libc only */
+#if defined(__GLIBC__) || defined(__FreeBSD__) || defined(__OpenBSD__)
+
+UNUSED
+static
+int loge_set_syslog_priority(struct loge *ploge, int priority) {
+  if (!ploge) {
+    return -1;
+  }
+
+  int prev_priority = ploge->syslog_priority;
+  ploge->syslog_priority = priority;
+
+  return prev_priority;
+}
+
+UNUSED
+static
+int loge_syslog_priority(struct loge *ploge) {
+  return ploge ? ploge->syslog_priority : -1;
+}
+
+#endif
+
+/**
+ * @brief Initialize the logger.
+ * @param ploge Pointer to struct loge
+ * @param max_log_size If 0, a statically allocated buffer with default size of
+ * `BUFFER_SIZE` is used, else the buffer is dynamically allocated.
+ * @param linenumwidth Width of line number (right aligned and padded on the
+ * left with zeroes). Defaults to `NUMBER_WIDTH` if 0 is passed.
+ * @param width Width for integers and integral part of decimal numbers.
+ * @param precision Precision for fractional part of decimal numbers.
+ * @param logtype Type of log, bitmask of enum loge_level OR'd with 0x80000000
+ * if timestamp is to be logged. Messages below this level will not be logged.
+ * @param file Output stream to write log messages to. Defaults to stdout if
+ * NULL * is passed.
+ * @param fn Callback function used for writing log messages to output
+ * steam. Default callback function will be set if NULL is passed.
+ *
+ * @see log_fn
+ * @see LOGE_TYPE
+ */
+UNUSED
+static
+void loge_setup(
+    struct loge *ploge,
+    size_t max_log_size,
+    int linenumwidth,
+    int width,
+    int precision,
+    int log_type,
+    FILE *file,
+    log_fn fn
+  ) {
+
+  if (!ploge) {
+    return;
+  }
+
+  ploge->bufptr = ploge->buffer;
+  ploge->bufcap = BUFFER_SIZE * sizeof(char);
+
+  if (max_log_size > BUFFER_SIZE) {
+    char *mem = (char*)malloc(max_log_size * sizeof(char));
+    if (!mem) {
+      lgerror("malloc for %zu bytes failed: %s",
+          max_log_size * sizeof(char),
+          strerror(errno));
+      return;
+    }
+
+    ploge->bufptr = mem;
+    ploge->bufcap = max_log_size * sizeof(char);
+  }
+
+  ploge->buflen = 0;
+
+  ploge->linenumwidth = LINENUMBER_WIDTH;
+  if (linenumwidth > -1) {
+    ploge->linenumwidth = linenumwidth;
+  }
+
+  ploge->width = -1;
+  if (width > -1) {
+    ploge->width = width;
+  }
+  ploge->precision = NUMBER_WIDTH >> 1;
+  if (precision > -1) {
+    ploge->precision = precision;
+  }
+
+  int en_timestamp = LOGE_ENTIME(log_type);
+  enum loge_level level = LOGE_LEVEL(log_type);
+
+  ploge->log_type = LOGE_TYPE(en_timestamp, LOGE_INFO);
+  if (level < LOGE_MAX) {
+    ploge->log_type = LOGE_TYPE(en_timestamp, level);
+  }
+
+  ploge->sockfd = -1;
+
+  ploge->file = NULL;
+
+  ploge->pprevlogfn = NULL;
+  ploge->plogfn = NULL;
+
+  /* Set default stream as stdout and use default logger function */
+  loge_set_stdout(ploge);
+
+  if (file != NULL) {
+    ploge->file = file;
+  }
+
+  /* loge_set_stdout() would have set pprevlogfn to NULL */
+  if (fn != NULL) {
+    ploge->plogfn = fn;
+  }
+
+  ploge->syslog_priority = -1;
+
+  ploge->concurrent = 0;
+
+  memset(&ploge->flush_policy, 0, sizeof(ploge->flush_policy));
+  ploge->flush_policy_set = 0;
+  loge_flush_done(&ploge->flush_state);
+  ploge->msglevel = 0;
+  ploge->msgprefix = 0;
+  ploge->msgfile = NULL;
+  ploge->msgline = 0;
+
+  ploge->mapfile.fd = -1;
+  ploge->mapfile.map = NULL;
+
+  ploge->rotate.path = NULL;
+  ploge->rotate.fd = -1;
+
+  ploge->recorder.hdr = NULL;
+  ploge->recorder.fd = -1;
+  ploge->recorder.level = LOGE_MAX;
+  ploge->recorder.dump_level = LOGE_MAX;
+  ploge->recorder.users = 0;
+
+  ploge->tcp.queue = NULL;
+  ploge->tcp.sock = -1;
+
+  ploge->udp.sock = -1;
+  ploge->udp.buf = NULL;
+
+  ploge->journal.sock = -1;
+  ploge->journal.header = NULL;
+
+  memset(ploge->sample_rate, 0, sizeof(ploge->sample_rate));
+}
+
+/**
+ * @brief Make the logger safe to share between threads. Each thread formats
+ * the message into its own thread local buffer and only the call to the log
+ * callback is serialized. The put functions and loge_flush() keep using the
+ * logger buffer and are not covered.
+ *
+ * Messages longer than `TLS_BUFFER_SIZE` are truncated in this mode.
+ *
+ * @param ploge Pointer to struct loge
+ * @param enable Non-zero to enable, zero to disable
+ */
+UNUSED
+static
+void loge_set_concurrent(struct loge *ploge, int enable) {
+  if (!ploge) {
+    return;
+  }
+
+  if (enable && !ploge->concurrent) {
+    loge_mutex_init(&ploge->lock);
+    ploge->concurrent = 1;
+
+  } else if (!enable && ploge->concurrent) {
+    ploge->concurrent = 0;
+    loge_mutex_destroy(&ploge->lock);
+  }
+}
+
+UNUSED
+static
+void loge_set_default_width(struct loge *ploge) {
+  if (!ploge) {
+    return;
+  }
+
+  ploge->width = -1;
+}
+
+UNUSED
+static
+void loge_set_width(struct loge *ploge, int width) {
+  if (!ploge) {
+    return;
+  }
+
+  if (width > -1) {
+    ploge->width = width;
+  }
+}
+
+UNUSED
+static
+void loge_set_precision(struct loge *ploge, unsigned int precision) {
+  if (!ploge) {
+    return;
+  }
+
+  ploge->precision = precision;
+}
+
+/**
+ * @brief Deallocates memory used for internal log buffer if dynamically
+ * allocated buffer was opted for.
+ * @param ploge Pointer to struct loge
+ */
+UNUSED
+static
+void loge_destroy(struct loge *ploge) {
+  if (!ploge) {
+    return;
+  }
+
+  /* Everything still held back by rate limited call sites */
+  loge_ratelimit_expire(ploge, 1, &loge_ratelimit_summary);
+  loge_ratelimit_forget(ploge);
+
+#if defined(__GLIBC__) || defined(__FreeBSD__) || defined(__OpenBSD__)
+  if (ploge->syslog_priority > -1) {
+    closelog();
+  }
+#endif
+
+  loge_unregister(ploge);
+  loge_flush_output(ploge);
+  loge_unset_mmap_file(ploge);
+  loge_rotate_close(&ploge->rotate);
+  loge_disable_recorder(ploge);
+  loge_unset_tcp(ploge);
+  loge_unset_udp(ploge);
+  loge_unset_journal(ploge);
+
+  loge_set_concurrent(ploge, 0);
+
+  if ( (!ploge->bufptr) || (ploge->bufptr == ploge->buffer) ) {
+    return;
+  }
+
+  free(ploge->bufptr);
+  ploge->bufptr = ploge->buffer;
+}
+
+/**
+ * @brief Connect to a TCP server and associate an output stream with the
+ * socket. This stream will be set as the output stream for the logger. The log
+ * callback function will be overriden by the default. IPv4 and IPv6 addresses
+ * are supported.
+ * @param ploge Pointer to struct loge
+ * @param ip IPv4 or IPv6 address
+ * @param port Port number
+ * @param ipv6 Use IPv6 if set to non-zero value, else use IPv4
+ * @paramm fileptr Pointer for a FILE* which shall store the previous FILE*
+ * used by the logger
+ *
+ * @see loge_disconnect()
+ */
+UNUSED
+static
+int loge_connect(struct loge *ploge, const char *host,
+    unsigned short port, int type, int ipv6, FILE **fileptr) {
+
+  if (!ploge || !host) {
+    return -1;
+  }
+
+  socket_type sock = sock_connect(host, port, type, ipv6);
+  if (sock == LOGE_SOCK_ERR) {
+    return -1;
+  }
+
+  FILE *file = fdopen(socket_to_native(sock), "w");
+  if (!file) {
+    lgperror(fdopen_str" failed");
+    destroy_socket(sock);
+    return -1;
+  }
+
+  ploge->sockfd = sock;
+
+  ploge->pprevlogfn = ploge->plogfn;
+  ploge->plogfn = &log_internal;
+
+  FILE *prev = loge_set_fileptr(ploge, file);
+  if (fileptr) {
+    *fileptr = prev;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Disconnect from TCP server. Associated output stream gets closed
+ * along with the underlying socket. The output stream pointer is set to NULL
+ * and needs to be set afterwards.
+ * @param ploge Pointer to struct loge
+ *
+ * @see loge_connect()
+ */
+UNUSED
+static
+void loge_disconnect(struct loge *ploge) {
+  if (!ploge) {
+    return;
+  }
+
+  if (ploge->sockfd == -1) {
+    return;
+  }
+
+  /* Stop data communication */
+  shutdown_socket(ploge->sockfd);
+
+  /* fclose will close the underlying socket fd on linux */
+  fclose(ploge->file);
+  loge_flush_done(&ploge->flush_state);
+
+  ploge->file = NULL;
+  ploge->sockfd = -1;
+
+  ploge->plogfn = ploge->pprevlogfn;
+}
+
+UNUSED
+static
+void loge_reset_logfn(struct loge *ploge) {
+  if (!ploge) {
+    return;
+  }
+
+  ploge->pprevlogfn = ploge->plogfn;
+  ploge->plogfn = &log_internal;
+}
+
+UNUSED
+static
+void loge_reset(struct loge *ploge) {
+  if (!ploge) {
+    return;
+  }
+
+  ploge->buflen = 0;
+}
+
+UNUSED
+static
+void loge_flush(struct loge *ploge) {
+  if (!ploge) {
+    return;
+  }
+
+  if (ploge->plogfn) {
+    ploge->msglevel = 0;
+    ploge->msgprefix = 0;
+    ploge->msgfile = NULL;
+    ploge->plogfn(ploge);
+  } else {
+    lgerror("log callback not set for logger %p", ploge);
+  }
+
+  loge_reset(ploge);
+}
+
+/**
+ * @brief Log information as string, to an output stream.
+ *
+ * If raw data callback has been set this function will be called. The function
+ * shall be called with the following arguments:
+ *
+ * Otherwise the log message callback will be called. Log message will be
+ * formatted as:
+ * m-dd-yyyy:HH-mm-ss: filename:linenum: loglevel: <user message>
+ *
+ * User message shall be in the form of a format string followed by arguments.
+ *
+ * When the logger is connected to a UDP/TCP server, the output stream will be
+ * associated with the socket descriptor that will be used for sending UDP/TCP
+ * messages.
+ *
+ * struct loge *ploge       Pointer to struct loge
+ * int logtype              Bitmask of enum loge_level for the level of log
+ *                          message, and 0x80000000 for colored message
+ * int linenum              Line number to log in log message
+ * const char *filename     Output file
+ * const char *msg          User message format string
+ * va_list args             Arguments to format string
+ *
+ * @param ploge Pointer to struct loge
+ * @param logtype Type of log, bitmask of enum loge_level OR'd with 0x80000000
+ * @param linenum Line number of the source file from where logging happened
+ * for colored output
+ * @param filename Name of the source file
+ * @param msg Format string for user message that will be appended to formatted
+ * information
+ * @param args Arguments for user message format string
+ *
+ * @see log_fn
+ * @see log_data_fn
+ */
+UNUSED
+static
+void loge_vlog(
+    struct loge *ploge,
+    int logtype,
+    int linenum,
+    const char *filename,
+    const char *msg,
+    va_list args
+  ) {
+
+  if (!ploge) {
+    return;
+  }
+
+  enum loge_level loglevel = LOGE_LOGLEVEL(logtype);
+  int log_type = loge_atomic_load_int(&ploge->log_type);
+  enum loge_level mylevel = LOGE_LEVEL(log_type);
+
+  if (loglevel >= LOGE_MAX ||
+      (loglevel < mylevel &&
+       (int)loglevel < loge_atomic_load_int(&ploge->recorder.level))) {
+    return;
+  }
+
+  /* Messages below the logger level only go to the flight recorder */
+  int recording = loglevel < mylevel;
+
+  /* Filtered messages never touch the clock */
+  time_t t = time(NULL);
+
+  int en_color = LOGE_ENCOLOR(logtype);
+
+  const char *loglvl_tbl = en_color ?
+    loglevel_strtbl_color[loglevel] :
+    loglevel_strtbl[loglevel];
+
+  /*
+   * Shared loggers format into a thread local buffer. Their bufptr is
+   * swapped under the lock while a callback runs and is not read here.
+   */
+  char *buf;
+  size_t cap = ploge->bufcap;
+
+  if (recording) {
+    buf = loge_recorder_claim(&ploge->recorder, &cap);
+    if (!buf) {
+      return;
+    }
+
+  } else if (ploge->concurrent) {
+    buf = loge_tls_buffer;
+    if (cap > TLS_BUFFER_SIZE) {
+      cap = TLS_BUFFER_SIZE;
+    }
+
+  } else {
+    buf = ploge->bufptr;
+  }
+
+  int len = 0;
+
+  if (!ploge->pdatafn || recording) {
+    int en_timestamp = LOGE_ENTIME(log_type);
+
+    if (en_timestamp && cap > LOGE_TIMESTAMP_LEN) {
+      memcpy(buf, loge_timestamp(t), LOGE_TIMESTAMP_LEN);
+
+      len = LOGE_TIMESTAMP_LEN + snprintf(
+          buf + LOGE_TIMESTAMP_LEN, cap - LOGE_TIMESTAMP_LEN,
+          ": %s:%0*d: %-*s: ",
+          filename,
+          ploge->linenumwidth, linenum,
+          en_color ? 22 : 8, loglvl_tbl
+        );
+
+    } else {
+      len = snprintf(
+          buf, cap,
+          "%s:%0*d: %-*s: ",
+          filename,
+          ploge->linenumwidth, linenum,
+          en_color ? 22 : 8, loglvl_tbl
+        );
+    }
+
+    if (len < 0) {
+      len = 0;
+    } else if ((size_t)len >= cap) {
+      len = cap - 1;
+    }
+  }
+
+  size_t prefixlen = (size_t)len;
+
+  len += vsnprintf(buf + len, cap - len, msg, args);
+
+  if ((size_t)len >= cap) {
+    len = cap - 1;
+  }
+
+  if (recording) {
+    loge_recorder_commit(&ploge->recorder, buf, len, loglevel);
+    return;
+  }
+
+  int dump =
+    (int)loglevel >= loge_atomic_load_int(&ploge->recorder.dump_level);
+
+  if (!ploge->concurrent) {
+    if (dump) {
+      loge_recorder_dump(&ploge->recorder, &loge_recorder_write, ploge);
+    }
+
+    ploge->buflen = len;
+
+    if (ploge->pdatafn) {
+      ploge->pdatafn(
+          ploge->file,
+          t,
+          filename,
+          linenum,
+          loglevel,
+          buf
+        );
+
+    } else if (ploge->plogfn) {
+      ploge->msglevel = loglevel;
+      ploge->msgprefix = prefixlen;
+      ploge->msgfile = filename;
+      ploge->msgline = linenum;
+      ploge->plogfn(ploge);
+
+    } else {
+      lgerror("log callback not set for logger %p", ploge);
+    }
+
+    return;
+  }
+
+  /* Only the write to the stream is serialized */
+  loge_mutex_lock(&ploge->lock);
+
+  if (dump) {
+    loge_recorder_dump(&ploge->recorder, &loge_recorder_write, ploge);
+  }
+
+  if (ploge->pdatafn) {
+    ploge->pdatafn(
+        ploge->file,
+        t,
+        filename,
+        linenum,
+        loglevel,
+        buf
+      );
+
+  } else if (ploge->plogfn) {
+    /* Callbacks read the message through the logger */
+    char *bufptr = ploge->bufptr;
+    size_t buflen = ploge->buflen;
+
+    ploge->bufptr = buf;
+    ploge->buflen = len;
+    ploge->msglevel = loglevel;
+    ploge->msgprefix = prefixlen;
+    ploge->msgfile = filename;
+    ploge->msgline = linenum;
+
+    ploge->plogfn(ploge);
+
+    ploge->bufptr = bufptr;
+    ploge->buflen = buflen;
+
+  } else {
+    lgerror("log callback not set for logger %p", ploge);
+  }
+
+  loge_mutex_unlock(&ploge->lock);
+}
+
+/* See loge_vlog(), sampling is applied first */
+UNUSED
+static
+void loge_log(
+    struct loge *ploge,
+    int logtype,
+    int linenum,
+    const char *filename,
+    const char *msg,
+    ...
+  ) {
+
+  if (!ploge || !loge_sampled(ploge, logtype)) {
+    return;
+  }
+
+  va_list args;
+  va_start(args, msg);
+  loge_vlog(ploge, logtype, linenum, filename, msg, args);
+  va_end(args);
+}
+
+/* loge_log() for the logging macros, which made the sampling decision */
+UNUSED
+static
+void loge_log_sampled(
+    struct loge *ploge,
+    int logtype,
+    int linenum,
+    const char *filename,
+    const char *msg,
+    ...
+  ) {
+
+  va_list args;
+  va_start(args, msg);
+  loge_vlog(ploge, logtype, linenum, filename, msg, args);
+  va_end(args);
+}
+
+UNUSED
+static
+size_t loge_put_char(struct loge *ploge, char c) {
+  if (!ploge) {
+    return 0;
+  }
+
+  if (ploge->buflen < ploge->bufcap) {
+    ploge->bufptr[ploge->buflen++] = c;
+  }
+
+  return sizeof(c);
+}
+
+UNUSED
+static
+size_t loge_put_str(struct loge *ploge, const char *pstr) {
+  if (!ploge || !pstr) {
+    return 0;
+  }
+
+  size_t ncopy = strlen(pstr);
+  size_t maxcopy = ploge->bufcap - ploge->buflen - 1;
+
+  if (ncopy > maxcopy) {
+    ncopy = maxcopy;
+  }
+
+  memcpy(ploge->bufptr + ploge->buflen, pstr, ncopy);
+
+  ploge->buflen += ncopy;
+
+  /* Keep buffer null terminated */
+  ploge->bufptr[ploge->buflen] = '\0';
+
+  return ncopy;
+}
+
+UNUSED
+static
+size_t loge_put_integer(struct loge *ploge, unsigned long long n, int neg) {
+  if (!ploge) {
+    return 0;
+  }
+
+  size_t len = loge_write_integer(ploge->bufptr + ploge->buflen,
+      ploge->bufcap - ploge->buflen, n, neg, ploge->width);
+
+  ploge->buflen += len;
+
+  return len;
+}
+
+UNUSED
+static
+size_t loge_put_int(struct loge *ploge, int n) {
+  return loge_put_integer(ploge,
+      n < 0 ? 0ULL - (unsigned long long)n : (unsigned long long)n, n < 0);
+}
+
+UNUSED
+static
+size_t loge_put_uint(struct loge *ploge, unsigned int n) {
+  return loge_put_integer(ploge, n, 0);
+}
+
+UNUSED
+static
+size_t loge_put_long(struct loge *ploge, long n) {
+  return loge_put_integer(ploge,
+      n < 0 ? 0ULL - (unsigned long long)n : (unsigned long long)n, n < 0);
+}
+
+UNUSED
+static
+size_t loge_put_ulong(struct loge *ploge, unsigned long n) {
+  return loge_put_integer(ploge, n, 0);
+}
+
+UNUSED
+static
+size_t loge_put_float(struct loge *ploge, float f) {
+  if (!ploge) {
+    return 0;
+  }
+
+  int len = 0;
+  if (ploge->width > -1) {
+    len = snprintf(ploge->bufptr + ploge->buflen,
+        ploge->bufcap - ploge->buflen,
+        "%#0*.*f", ploge->width, ploge->precision, f);
+
+  } else {
+    len = snprintf(ploge->bufptr + ploge->buflen,
+        ploge->bufcap - ploge->buflen,
+        "%#f", f);
+  }
+
+  ploge->buflen += len;
+
+  /* Keep buffer null terminated */
+  ploge->bufptr[ploge->buflen] = '\0';
+
+  return len;
+}
+
+UNUSED
+static
+size_t loge_put_double(struct loge *ploge, double f) {
+  if (!ploge) {
+    return 0;
+  }
+
+  int len = 0;
+  if (ploge->width > -1) {
+    len = snprintf(ploge->bufptr + ploge->buflen,
+        ploge->bufcap - ploge->buflen,
+        "%0#*.*f", ploge->width, ploge->precision, f);
+
+  } else {
+    len = snprintf(ploge->bufptr + ploge->buflen,
+        ploge->bufcap - ploge->buflen,
+        "%#f", f);
+  }
+
+  ploge->buflen += len;
+
+  /* Keep buffer null terminated */
+  ploge->bufptr[ploge->buflen] = '\0';
+
+  return len;
+}
+
+UNUSED
+static
+size_t loge_put_time(struct loge *ploge, struct tm *ptm) {
+  if (!ploge || !ptm) {
+    return 0;
+  }
+
+  int len = snprintf(ploge->bufptr + ploge->buflen,
+      ploge->bufcap - ploge->buflen,
+      "%02d-%02d-%04d:%02d:%02d:%02d",
+      ptm->tm_mon + 1, ptm->tm_mday, ptm->tm_year + 1900,
+      ptm->tm_hour, ptm->tm_min, ptm->tm_sec
+    );
+
+  ploge->buflen += len;
+
+  /* Keep buffer null terminated */
+  ploge->bufptr[ploge->buflen] = '\0';
+
+  return len;
+}
+
+
+#endif /* !__cplusplus */
+
+/******************************** C code ends *********************************/
+
+
+#ifdef __cplusplus
+
+} /* extern "C" */
+
+#endif
+
+
+/****************************** C++ code starts *******************************/
+
+#ifdef __cplusplus
+
+/* libstd++ */
+#if defined(__GLIBCXX__)
+#include <ext/stdio_filebuf.h>
+#endif
+#include <type_traits>
+#include <cstdint>
+#include <string>
+#if __cplusplus >= 201703L
+#include <string_view>
+#include <charconv>
+#endif
+#include <cmath>
+#if __cplusplus >= 202002L
+#include <utility>
+#include <tuple>
+#endif
+#include <iostream>
+#include <fstream>
+#include <array>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstring>
+#include <cstdarg>
+#include <ctime>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+/* io_uring sink, define LOGE_URING as 0 to leave it out */
+#ifndef LOGE_URING
+#if (defined(__linux) || defined(__linux__)) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define LOGE_URING 1
+#endif
+#endif
+#endif
+
+#if LOGE_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(_WIN64)
+/* Used by the descriptor sink, written out one buffer at a time */
+struct iovec {
+  void *iov_base;
+  std::size_t iov_len;
+};
+#endif
+
+#define LOGE(ploge, level, ...) \
+  do { \
+    if (LOGE_LEVEL_ENABLED(level) && (ploge) != nullptr && \
+        (ploge)->enabled(level) && (ploge)->sampled(level)) { \
+      LOGE_SITE(loge_site_, level, LOGE_SITE_FMT(LOGE_FIRST(__VA_ARGS__))); \
+      (ploge)->log( \
+          loge_site_, \
+          (level) & ~loge<>::loge_level::LOGCOLOR, \
+          __VA_ARGS__ \
+        ); \
+    } \
+  } while (0)
+
+#define LOGE_COLOR(ploge, level, ...) \
+  do { \
+    if (LOGE_LEVEL_ENABLED(level) && (ploge) != nullptr && \
+        (ploge)->enabled(level) && (ploge)->sampled(level)) { \
+      LOGE_SITE(loge_site_, level, LOGE_SITE_FMT(LOGE_FIRST(__VA_ARGS__))); \
+      (ploge)->log( \
+          loge_site_, \
+          static_cast<int>(level) | loge<>::loge_level::LOGCOLOR, \
+          __VA_ARGS__ \
+        ); \
+    } \
+  } while (0)
+
+/*
+ * Let burst messages of the call site through per interval_ms and turn the
+ * rest away before formatting them. The next message let through is
+ * preceded by a line counting the suppressed ones. If none comes, the count
+ * is logged by flush_output() or flush_expired() once the site would let a
+ * message through again, or by the destructor.
+ */
+#define LOGE_RATELIMIT(ploge, level, burst, interval_ms, ...) \
+  do { \
+    static loge_ratelimit loge_ratelimit_; \
+    unsigned long long loge_suppressed_; \
+    if (LOGE_LEVEL_ENABLED(level) && (ploge) != nullptr && \
+        (ploge)->enabled(level) && (ploge)->sampled(level) && \
+        loge_ratelimit_pass(&loge_ratelimit_, (burst), (interval_ms), \
+          &loge_suppressed_, (ploge)->ratelimit_key(), \
+          (level) & ~loge<>::loge_level::LOGCOLOR, __FILE__, __LINE__)) { \
+      LOGE_SITE(loge_site_, level, LOGE_SITE_FMT(LOGE_FIRST(__VA_ARGS__))); \
+      if (loge_suppressed_) { \
+        LOGE_SITE(loge_summary_site_, level, \
+            "suppressed %llu similar messages"); \
+        (ploge)->log( \
+            loge_summary_site_, \
+            (level) & ~loge<>::loge_level::LOGCOLOR, \
+            "suppressed %llu similar messages", \
+            loge_suppressed_ \
+          ); \
+      } \
+      (ploge)->log( \
+          loge_site_, \
+          (level) & ~loge<>::loge_level::LOGCOLOR, \
+          __VA_ARGS__ \
+        ); \
+    } \
+  } while (0)
+
+/*
+ * Capture the arguments and leave formatting to the backend thread of an
+ * asynchronous logger. Format string must be a string literal.
+ */
+#define LOGE_DEFER(ploge, level, ...) \
+  do { \
+    if (LOGE_LEVEL_ENABLED(level) && (ploge) != nullptr && \
+        (ploge)->enabled(level) && (ploge)->sampled(level)) { \
+      LOGE_SITE(loge_site_, level, LOGE_SITE_FMT(LOGE_FIRST(__VA_ARGS__))); \
+      (ploge)->log_deferred( \
+          loge_site_, \
+          (level) & ~loge<>::loge_level::LOGCOLOR, \
+          __VA_ARGS__ \
+        ); \
+    } \
+  } while (0)
+
+#define LOGE_DEFER_COLOR(ploge, level, ...) \
+  do { \
+    if (LOGE_LEVEL_ENABLED(level) && (ploge) != nullptr && \
+        (ploge)->enabled(level) && (ploge)->sampled(level)) { \
+      LOGE_SITE(loge_site_, level, LOGE_SITE_FMT(LOGE_FIRST(__VA_ARGS__))); \
+      (ploge)->log_deferred( \
+          loge_site_, \
+          static_cast<int>(level) | loge<>::loge_level::LOGCOLOR, \
+          __VA_ARGS__ \
+        ); \
+    } \
+  } while (0)
+
+#if __cplusplus >= 202002L
+
+/*
+ * Format string is parsed and checked against the argument types at compile
+ * time. Format string must be a string literal.
+ */
+#define LOGE_FMT(ploge, level, fmt, ...) \
+  do { \
+    if (LOGE_LEVEL_ENABLED(level) && (ploge) != nullptr && \
+        (ploge)->enabled(level) && (ploge)->sampled(level)) { \
+      LOGE_SITE(loge_site_, level, fmt); \
+      (ploge)->template log<fmt>( \
+          loge_site_, \
+          (level) & ~loge<>::loge_level::LOGCOLOR \
+          __VA_OPT__(,) __VA_ARGS__ \
+        ); \
+    } \
+  } while (0)
+
+#define LOGE_FMT_COLOR(ploge, level, fmt, ...) \
+  do { \
+    if (LOGE_LEVEL_ENABLED(level) && (ploge) != nullptr && \
+        (ploge)->enabled(level) && (ploge)->sampled(level)) { \
+      LOGE_SITE(loge_site_, level, fmt); \
+      (ploge)->template log<fmt>( \
+          loge_site_, \
+          static_cast<int>(level) | loge<>::loge_level::LOGCOLOR \
+          __VA_OPT__(,) __VA_ARGS__ \
+        ); \
+    } \
+  } while (0)
+
+#endif /* __cplusplus >= 202002L */
+
+#define LOGE_LOGTYPE(encolor, level) \
+  static_cast<int>( ( (!!(encolor)) << loge::loge_level::LOGCOLORSHIFT ) | (level) )
+
+#define LOGE_ENCOLOR(type) \
+  static_cast<int>(!!(type & loge::loge_level::LOGCOLOR))
+
+#define LOGE_LOGLEVEL(type) \
+  static_cast<enum loge_level>(type & ~loge::loge_level::LOGCOLOR)
+
+/* Constant for constant levels, lets the compiler drop the whole call */
+#define LOGE_LEVEL_ENABLED(level) \
+  (static_cast<int>((level) & ~loge<>::loge_level::LOGCOLOR) >= \
+   static_cast<int>(LOGE_MIN_LEVEL))
+
+#if __cplusplus >= 201703L
+
+using loge_string_view = std::string_view;
+
+#else
+
+/* Just enough of std::string_view for loge records before C++17 */
+class loge_string_view {
+  const char *ptr;
+  std::size_t len;
+
+  public:
+
+  constexpr loge_string_view() : ptr(nullptr), len(0) {
+  }
+
+  constexpr loge_string_view(const char *str, std::size_t len_)
+    : ptr(str), len(len_) {
+  }
+
+  loge_string_view(const char *str) : ptr(str), len(str ? strlen(str) : 0) {
+  }
+
+  constexpr const char* data() const {
+    return ptr;
+  }
+
+  constexpr std::size_t size() const {
+    return len;
+  }
+
+  constexpr std::size_t length() const {
+    return len;
+  }
+
+  constexpr bool empty() const {
+    return len == 0;
+  }
+
+  constexpr const char* begin() const {
+    return ptr;
+  }
+
+  constexpr const char* end() const {
+    return ptr + len;
+  }
+
+  std::string to_string() const {
+    return std::string(ptr, len);
+  }
+};
+
+#endif /* __cplusplus >= 201703L */
+
+/*
+ * Static description of a logging call site. The logging macros define one
+ * per expansion and pass it instead of the filename and line number.
+ *
+ * With a constant level and a string literal format the site is constant
+ * initialized, no guard is checked when the call is made. Otherwise it is
+ * set up the first time the call is made and keeps the level and format
+ * string of that call. The site is listed, and ids and cached prefixes are
+ * filled in, when first needed.
+ */
+struct loge_site {
+
+  /* Text prefix after the timestamp, rendered once per site */
+  struct prefix {
+    int linenumwidth;
+    int logtype;
+    std::size_t len;
+    char text[1];
+  };
+
+  const char *file;
+  const char *basename;
+  const char *fmt;
+  int line;
+  int level;
+
+  std::atomic<std::uint32_t> id;
+  std::atomic<std::uint32_t> binary_serial;
+  std::atomic<prefix*> cached_prefix;
+
+  /* Site listed before this one, see for_each() */
+  const loge_site *next;
+  std::atomic<bool> listed;
+
+  static
+  constexpr const char* basename_of(const char *path, const char *last) {
+    return *path == '\0' ? last :
+      basename_of(path + 1, *path == '/' || *path == '\\' ? path + 1 : last);
+  }
+
+  constexpr
+  loge_site(const char *file_, int line_, int level_, const char *fmt_)
+    : file(file_), basename(basename_of(file_, file_)), fmt(fmt_),
+    line(line_), level(level_), id(0), binary_serial(0),
+    cached_prefix(nullptr), next(nullptr), listed(false) {
+  }
+
+  loge_site(const loge_site&) = delete;
+  loge_site& operator=(const loge_site&) = delete;
+
+  /* Add the site to the list the first time its call is made */
+  void enlist() {
+    if (listed.load(std::memory_order_relaxed) ||
+        listed.exchange(true, std::memory_order_relaxed)) {
+      return;
+    }
+
+    /* Sites are static and never unlisted */
+    loge_site *head = sites().load(std::memory_order_relaxed);
+    do {
+      next = head;
+    } while (!sites().compare_exchange_weak(head, this,
+          std::memory_order_release, std::memory_order_relaxed));
+  }
+
+  /* Process wide, shared with call sites without a descriptor */
+  static
+  std::uint32_t next_id() {
+    static std::atomic<std::uint32_t> counter(1);
+    return counter.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  std::uint32_t get_id() {
+    std::uint32_t n = id.load(std::memory_order_relaxed);
+    if (n) {
+      return n;
+    }
+
+    std::uint32_t fresh = next_id();
+    if (id.compare_exchange_strong(n, fresh, std::memory_order_relaxed)) {
+      return fresh;
+    }
+    return n;
+  }
+
+  /**
+   * @brief Cached prefix for a logger configuration, nullptr if another
+   * configuration got cached first
+   */
+  const prefix* get_prefix(int linenumwidth, int logtype) const {
+    const prefix *pre = cached_prefix.load(std::memory_order_acquire);
+    if (pre && pre->linenumwidth == linenumwidth && pre->logtype == logtype) {
+      return pre;
+    }
+    return nullptr;
+  }
+
+  /*
+   * Only the first configuration is kept, the loser of a race frees its
+   * copy. Cached prefixes live as long as the program.
+   */
+  const prefix* set_prefix(int linenumwidth, int logtype, const char *text,
+      std::size_t len) {
+
+    prefix *pre = static_cast<prefix*>(malloc(sizeof(prefix) + len));
+    if (!pre) {
+      return nullptr;
+    }
+
+    pre->linenumwidth = linenumwidth;
+    pre->logtype = logtype;
+    pre->len = len;
+    memcpy(pre->text, text, len);
+    pre->text[len] = '\0';
+
+    prefix *expected = nullptr;
+    if (!cached_prefix.compare_exchange_strong(expected, pre,
+          std::memory_order_acq_rel)) {
+      free(pre);
+      return get_prefix(linenumwidth, logtype);
+    }
+
+    return pre;
+  }
+
+  /**
+   * @brief Call f(const loge_site&) for every call site of the program that
+   * has been set up, that is every call made at least once, newest first.
+   */
+  template <typename F>
+  static
+  void for_each(F &&f) {
+    for (const loge_site *site = sites().load(std::memory_order_acquire);
+        site; site = site->next) {
+      f(*site);
+    }
+  }
+
+  private:
+
+  /* One list for the whole program, inline functions share their statics */
+  static
+  std::atomic<loge_site*>& sites() {
+    static std::atomic<loge_site*> head(nullptr);
+    return head;
+  }
+};
+
+#define LOGE_EXPAND(x) x
+#define LOGE_FIRST_(first, ...) first
+#define LOGE_FIRST(...) LOGE_EXPAND(LOGE_FIRST_(__VA_ARGS__, 0))
+
+inline constexpr
+const char* loge_site_fmt(const char *fmt) {
+  return fmt;
+}
+
+template <typename T>
+constexpr
+const char* loge_site_fmt(const T &fmt UNUSED) {
+  return nullptr;
+}
+
+/*
+ * Format string kept by a site, only a string literal. Anything else is not
+ * evaluated a second time and would not outlive the call.
+ *
+ * Without __builtin_constant_p, as with MSVC, a literal can not be told
+ * apart and no site keeps the format string of LOGE and friends. Binary
+ * outputs then write those calls as TEXT records, formatted when logged.
+ * LOGE_FMT always keeps its format string.
+ */
+#if defined(__GNUC__)
+#define LOGE_SITE_FMT(fmt) \
+  (__builtin_constant_p(fmt) ? loge_site_fmt(fmt) : nullptr)
+#else
+#define LOGE_SITE_FMT(fmt) nullptr
+#endif
+
+/* Call site descriptor named name, see loge_site */
+#define LOGE_SITE(name, level, fmt) \
+  static loge_site name( \
+      __FILE__, \
+      __LINE__, \
+      static_cast<int>((level) & ~loge<>::loge_level::LOGCOLOR), \
+      fmt \
+    )
+
+/*
+ * Binary capture of printf style arguments for deferred formatting.
+ *
+ * Each argument is stored as a one byte tag followed by its payload:
+ *
+ *   INT, UINT   one byte size of the original type, 8 byte value
+ *   DOUBLE      8 byte value
+ *   STRING      2 byte length, characters (copied by value)
+ *   POINTER     8 byte value
+ *
+ * render() later walks the format string and applies one conversion at a
+ * time to the decoded values.
+ */
+struct loge_args {
+
+  enum tag : unsigned char {
+    INT = 1,
+    UINT,
+    DOUBLE,
+    STRING,
+    POINTER
+  };
+
+  static
+  char* put_number(char *p, char *end, tag t, unsigned char size,
+      const void *value) {
+
+    if (end - p < 10) {
+      return nullptr;
+    }
+
+    *p++ = static_cast<char>(t);
+    if (t == INT || t == UINT) {
+      *p++ = static_cast<char>(size);
+    }
+    memcpy(p, value, 8);
+
+    return p + 8;
+  }
+
+  static
+  char* encode_one(char *p, char *end, const char *str) {
+    if (!str) {
+      str = "(null)";
+    }
+    return put_string(p, end, str, strlen(str));
+  }
+
+  static
+  char* encode_one(char *p, char *end, const std::string &str) {
+    return put_string(p, end, str.data(), str.size());
+  }
+
+#if __cplusplus >= 201703L
+
+  static
+  char* encode_one(char *p, char *end, std::string_view str) {
+    return put_string(p, end, str.data(), str.size());
+  }
+
+#endif
+
+  /* Strings are truncated to whatever room is left */
+  static
+  char* put_string(char *p, char *end, const char *str, std::size_t len) {
+    if (end - p < 3) {
+      return nullptr;
+    }
+
+    std::size_t room = end - p - 3;
+    if (len > room) {
+      len = room;
+    }
+    if (len > 0xffff) {
+      len = 0xffff;
+    }
+
+    unsigned short n = static_cast<unsigned short>(len);
+
+    *p++ = static_cast<char>(STRING);
+    memcpy(p, &n, sizeof(n));
+    p += sizeof(n);
+    memcpy(p, str, len);
+
+    return p + len;
+  }
+
+  template <
+    typename T,
+    typename std::enable_if<
+      std::is_integral<T>::value && std::is_signed<T>::value, int>::type = 0
+  >
+  static
+  char* encode_one(char *p, char *end, T value) {
+    long long v = value;
+    return put_number(p, end, INT, sizeof(T), &v);
+  }
+
+  template <
+    typename T,
+    typename std::enable_if<
+      std::is_integral<T>::value && !std::is_signed<T>::value, int>::type = 0
+  >
+  static
+  char* encode_one(char *p, char *end, T value) {
+    unsigned long long v = value;
+    return put_number(p, end, UINT, sizeof(T), &v);
+  }
+
+  template <
+    typename T,
+    typename std::enable_if<std::is_enum<T>::value, int>::type = 0
+  >
+  static
+  char* encode_one(char *p, char *end, T value) {
+    return encode_one(p, end,
+        static_cast<typename std::underlying_type<T>::type>(value));
+  }
+
+  template <
+    typename T,
+    typename std::enable_if<std::is_floating_point<T>::value, int>::type = 0
+  >
+  static
+  char* encode_one(char *p, char *end, T value) {
+    double v = static_cast<double>(value);
+    return put_number(p, end, DOUBLE, sizeof(double), &v);
+  }
+
+  template <
+    typename T,
+    typename std::enable_if<
+      !std::is_same<typename std::remove_cv<T>::type, char>::value, int>::type
+      = 0
+  >
+  static
+  char* encode_one(char *p, char *end, T *value) {
+    unsigned long long v = reinterpret_cast<std::uintptr_t>(value);
+    return put_number(p, end, POINTER, sizeof(void*), &v);
+  }
+
+  static
+  char* encode(char *p, char *end UNUSED) {
+    return p;
+  }
+
+  /* Stops at the first argument that does not fit */
+  template <typename T, typename... Rest>
+  static
+  char* encode(char *p, char *end, const T &value, const Rest &...rest) {
+    char *next = encode_one(p, end, value);
+    if (!next) {
+      return p;
+    }
+    return encode(next, end, rest...);
+  }
+
+  /**
+   * @brief Capture variadic arguments by walking a printf style format
+   * string, the types come from the conversions and their length modifiers.
+   * Stops at the first argument that does not fit or at a conversion whose
+   * type is unknown.
+   * @return End of the captured arguments
+   */
+  static
+  char* vencode(char *p, char *end, const char *fmt, std::va_list args) {
+    while (*fmt) {
+      if (*fmt++ != '%') {
+        continue;
+      }
+      if (*fmt == '%') {
+        fmt++;
+        continue;
+      }
+
+      while (*fmt && strchr("-+ #0'", *fmt)) {
+        fmt++;
+      }
+
+      /* Width and precision given as arguments are captured as ints */
+      for (int part = 0; part < 2; part++) {
+        if (part == 1) {
+          if (*fmt != '.') {
+            break;
+          }
+          fmt++;
+        }
+
+        if (*fmt == '*') {
+          long long v = va_arg(args, int);
+          char *next = put_number(p, end, INT, sizeof(int), &v);
+          if (!next) {
+            return p;
+          }
+          p = next;
+          fmt++;
+        } else {
+          while (*fmt >= '0' && *fmt <= '9') {
+            fmt++;
+          }
+        }
+      }
+
+      /* Same size rules as render() */
+      int size = 4;
+      bool long_double = false;
+      for (;;) {
+        if (*fmt == 'h') {
+          size = size == 2 ? 1 : 2;
+        } else if (*fmt == 'l') {
+          size = size == static_cast<int>(sizeof(long)) ?
+            8 : static_cast<int>(sizeof(long));
+        } else if (*fmt == 'j' || *fmt == 'q') {
+          size = 8;
+        } else if (*fmt == 'z') {
+          size = sizeof(std::size_t);
+        } else if (*fmt == 't') {
+          size = sizeof(std::ptrdiff_t);
+        } else if (*fmt == 'L') {
+          long_double = true;
+        } else {
+          break;
+        }
+        fmt++;
+      }
+
+      char *next = nullptr;
+
+      switch (*fmt++) {
+        case 'd':
+        case 'i': {
+          long long v = size == 8 ?
+            va_arg(args, long long) :
+            static_cast<long long>(va_arg(args, int));
+          next = put_number(p, end, INT, static_cast<unsigned char>(size), &v);
+          break;
+        }
+
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X': {
+          unsigned long long v = size == 8 ?
+            va_arg(args, unsigned long long) :
+            static_cast<unsigned long long>(va_arg(args, unsigned int));
+          next = put_number(p, end, UINT, static_cast<unsigned char>(size), &v);
+          break;
+        }
+
+        case 'c': {
+          unsigned long long v = static_cast<unsigned char>(va_arg(args, int));
+          next = put_number(p, end, UINT, 1, &v);
+          break;
+        }
+
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A': {
+          double v = long_double ?
+            static_cast<double>(va_arg(args, long double)) :
+            va_arg(args, double);
+          next = put_number(p, end, DOUBLE, sizeof(double), &v);
+          break;
+        }
+
+        case 's':
+          next = encode_one(p, end, va_arg(args, const char*));
+          break;
+
+        /* %n is not rendered but still takes its slot */
+        case 'p':
+        case 'n': {
+          unsigned long long v =
+            reinterpret_cast<std::uintptr_t>(va_arg(args, void*));
+          next = put_number(p, end, POINTER, sizeof(void*), &v);
+          break;
+        }
+
+        default:
+          return p;
+      }
+
+      if (!next) {
+        return p;
+      }
+      p = next;
+    }
+
+    return p;
+  }
+
+  /* Decoder state for one captured argument */
+  struct value {
+    tag t;
+    unsigned char size;
+    unsigned long long bits;
+    const char *str;
+    std::size_t len;
+  };
+
+  static
+  bool decode(const char *&p, const char *end, value &v) {
+    v.size = 8;
+    v.bits = 0;
+    v.str = nullptr;
+    v.len = 0;
+
+    if (p >= end) {
+      return false;
+    }
+
+    v.t = static_cast<tag>(*p++);
+
+    switch (v.t) {
+      case INT:
+      case UINT:
+        if (end - p < 9) {
+          return false;
+        }
+        v.size = static_cast<unsigned char>(*p++);
+        memcpy(&v.bits, p, 8);
+        p += 8;
+        return true;
+
+      case DOUBLE:
+      case POINTER:
+        if (end - p < 8) {
+          return false;
+        }
+        memcpy(&v.bits, p, 8);
+        p += 8;
+        return true;
+
+      case STRING: {
+        unsigned short n;
+        if (end - p < 2) {
+          return false;
+        }
+        memcpy(&n, p, sizeof(n));
+        p += sizeof(n);
+        if (end - p < n) {
+          return false;
+        }
+        v.str = p;
+        v.len = n;
+        p += n;
+        return true;
+      }
+
+      default:
+        return false;
+    }
+  }
+
+  static
+  long long as_signed(const value &v) {
+    if (v.t == DOUBLE) {
+      double d;
+      memcpy(&d, &v.bits, sizeof(d));
+      return static_cast<long long>(d);
+    }
+    return static_cast<long long>(v.bits);
+  }
+
+  static
+  double as_double(const value &v) {
+    double d;
+    if (v.t == DOUBLE) {
+      memcpy(&d, &v.bits, sizeof(d));
+    } else if (v.t == INT) {
+      d = static_cast<double>(static_cast<long long>(v.bits));
+    } else {
+      d = static_cast<double>(v.bits);
+    }
+    return d;
+  }
+
+  /* Apply printf semantics of the length modifier to a captured integer */
+  static
+  unsigned long long truncate(unsigned long long bits, int size,
+      bool is_signed) {
+
+    switch (size) {
+      case 1:
+        return is_signed ?
+          static_cast<unsigned long long>(static_cast<signed char>(bits)) :
+          static_cast<unsigned char>(bits);
+      case 2:
+        return is_signed ?
+          static_cast<unsigned long long>(static_cast<short>(bits)) :
+          static_cast<unsigned short>(bits);
+      case 4:
+        return is_signed ?
+          static_cast<unsigned long long>(static_cast<int>(bits)) :
+          static_cast<unsigned int>(bits);
+      default:
+        return bits;
+    }
+  }
+
+  /**
+   * @brief Format captured arguments according to a printf style format
+   * string. Each conversion is handed to snprintf on its own with the length
+   * modifier rewritten for the decoded type.
+   * @return Number of characters written, not counting the terminating null
+   */
+  static
+  std::size_t render(char *dst, std::size_t cap, const char *fmt,
+      const char *args, std::size_t argslen) {
+
+    if (!cap) {
+      return 0;
+    }
+
+    const char *ap = args;
+    const char *aend = args + argslen;
+    std::size_t len = 0;
+    const char *p = fmt;
+
+    while (*p && len + 1 < cap) {
+      if (*p != '%') {
+        const char *q = p;
+        while (*q && *q != '%') {
+          q++;
+        }
+        std::size_t n = q - p;
+        if (n > cap - 1 - len) {
+          n = cap - 1 - len;
+        }
+        memcpy(dst + len, p, n);
+        len += n;
+        p = q;
+        continue;
+      }
+
+      if (p[1] == '%') {
+        dst[len++] = '%';
+        p += 2;
+        continue;
+      }
+
+      /* Rebuild the conversion specification with explicit numbers */
+      char spec[64];
+      std::size_t sl = 0;
+      spec[sl++] = *p++;
+
+      while (*p && strchr("-+ #0'", *p) && sl < 16) {
+        spec[sl++] = *p++;
+      }
+
+      std::size_t dot = 0;
+
+      for (int part = 0; part < 2; part++) {
+        if (part == 1) {
+          if (*p != '.') {
+            break;
+          }
+          dot = sl;
+          spec[sl++] = *p++;
+        }
+
+        if (*p == '*') {
+          value v;
+          int n = decode(ap, aend, v) ? static_cast<int>(as_signed(v)) : 0;
+          int done = snprintf(spec + sl, sizeof(spec) - sl, "%d", n);
+          sl += done > 0 ? done : 0;
+          p++;
+        } else {
+          while (*p >= '0' && *p <= '9' && sl < 40) {
+            spec[sl++] = *p++;
+          }
+        }
+      }
+
+      int size = 4;
+      const char *modifier = p;
+      for (;;) {
+        if (*p == 'h') {
+          size = size == 2 ? 1 : 2;
+        } else if (*p == 'l') {
+          size = size == static_cast<int>(sizeof(long)) ?
+            8 : static_cast<int>(sizeof(long));
+        } else if (*p == 'j' || *p == 'q') {
+          size = 8;
+        } else if (*p == 'z') {
+          size = sizeof(std::size_t);
+        } else if (*p == 't') {
+          size = sizeof(std::ptrdiff_t);
+        } else if (*p != 'L') {
+          break;
+        }
+        p++;
+      }
+
+      char conv = *p;
+      if (!conv) {
+        break;
+      }
+      p++;
+
+      value v;
+      bool have = decode(ap, aend, v);
+
+      /* Without a length modifier wider integers are not cut down to int */
+      if (p - 1 == modifier && have && (v.t == INT || v.t == UINT) &&
+          v.size > size) {
+        size = v.size;
+      }
+
+      char *out = dst + len;
+      std::size_t room = cap - len;
+      int done = 0;
+
+      switch (conv) {
+        case 'd':
+        case 'i':
+          spec[sl++] = 'l';
+          spec[sl++] = 'l';
+          spec[sl++] = conv;
+          spec[sl] = '\0';
+          done = snprintf(out, room, spec, !have ? 0LL :
+              static_cast<long long>(truncate(v.bits, size, true)));
+          break;
+
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+          spec[sl++] = 'l';
+          spec[sl++] = 'l';
+          spec[sl++] = conv;
+          spec[sl] = '\0';
+          done = snprintf(out, room, spec, !have ? 0ULL :
+              truncate(v.bits, size, false));
+          break;
+
+        case 'c':
+          spec[sl++] = conv;
+          spec[sl] = '\0';
+          done = snprintf(out, room, spec, !have ? ' ' :
+              static_cast<int>(static_cast<unsigned char>(v.bits)));
+          break;
+
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+          spec[sl++] = conv;
+          spec[sl] = '\0';
+          done = snprintf(out, room, spec, !have ? 0.0 : as_double(v));
+          break;
+
+        case 'p':
+          spec[sl++] = conv;
+          spec[sl] = '\0';
+          done = snprintf(out, room, spec, !have ? nullptr :
+              reinterpret_cast<void*>(static_cast<std::uintptr_t>(v.bits)));
+          break;
+
+        case 's': {
+          /* Captured strings are not null-terminated, pass the length */
+          int n = have && v.t == STRING ? static_cast<int>(v.len) : 0;
+          if (dot) {
+            int precision = atoi(spec + dot + 1);
+            if (precision < n) {
+              n = precision;
+            }
+            sl = dot;
+          }
+          spec[sl++] = '.';
+          spec[sl++] = '*';
+          spec[sl++] = conv;
+          spec[sl] = '\0';
+          done = snprintf(out, room, spec, n,
+              have && v.t == STRING ? v.str : "");
+          break;
+        }
+
+        default:
+          /* Unsupported conversion, e.g. %n, is dropped */
+          break;
+      }
+
+      if (done > 0) {
+        len += static_cast<std::size_t>(done) < room ?
+          static_cast<std::size_t>(done) : room - 1;
+      }
+    }
+
+    dst[len] = '\0';
+
+    return len;
+  }
+
+  /* Make captured types printable for the synchronous path */
+  template <typename T>
+  static
+  const T& printf_arg(const T &value) {
+    return value;
+  }
+
+  static
+  const char* printf_arg(const std::string &str) {
+    return str.c_str();
+  }
+
+  /*
+   * Keep what printf_arg() can not pass as it is alive for the call, as in
+   * printf_arg(printf_hold(value))
+   */
+  template <typename T>
+  static
+  const T& printf_hold(const T &value) {
+    return value;
+  }
+
+#if __cplusplus >= 201703L
+  /* A view need not be null terminated, %s gets a copy */
+  static
+  std::string printf_hold(std::string_view str) {
+    return std::string(str);
+  }
+#endif /* __cplusplus >= 201703L */
+};
+
+/**
+ * @brief Render the text prefix of a record: timestamp, filename, line
+ * number and level.
+ * @return Number of characters written, not counting the terminating null
+ */
+UNUSED static inline
+int loge_prefix(char *dst, std::size_t cap, bool timestamp, std::time_t t,
+    int linenumwidth, int en_color, const char *filename, int linenumber,
+    const char *loglvlstr) {
+
+  int len = 0;
+
+  if (timestamp) {
+    if (cap > LOGE_TIMESTAMP_LEN) {
+      memcpy(dst, loge_timestamp(t), LOGE_TIMESTAMP_LEN);
+      len = LOGE_TIMESTAMP_LEN;
+    }
+
+    len += snprintf(dst + len, cap - len,
+        ": %s:%0*d: %-*s: ",
+        filename,
+        linenumwidth, linenumber,
+        en_color ? 22 : 8, loglvlstr
+      );
+
+  } else {
+    len = snprintf(dst, cap,
+        "%s:%0*d: %-*s: ",
+        filename,
+        linenumwidth, linenumber,
+        en_color ? 22 : 8, loglvlstr
+      );
+  }
+
+  if (len < 0) {
+    len = 0;
+  } else if (static_cast<std::size_t>(len) >= cap) {
+    len = cap - 1;
+  }
+
+  return len;
+}
+
+/*
+ * Binary log files written by set_binary() and turned back into text by
+ * loge-decode. All fields are in host byte order.
+ *
+ * A file starts with a header, repeated every time a logger starts writing
+ * to it:
+ *
+ *   "LOGEBIN1", 1 byte version, 1 byte timestamp flag, 2 byte line number
+ *   width
+ *
+ * followed by records, each a 4 byte length of the rest of the record and a
+ * 1 byte type:
+ *
+ *   SITE   4 byte id, 4 byte line number, 2 byte filename length, filename,
+ *          2 byte format length, format string
+ *   EVENT  8 byte time, 4 byte site id, 4 byte log type, loge_args values
+ *   TEXT   message built with the insertion operators or logged without a
+ *          call site descriptor
+ *
+ * A SITE record is written the first time a call site logs. Ids are the
+ * process wide loge_site ids and are valid until the next header.
+ */
+struct loge_binary {
+
+  enum constants {
+    VERSION = 1,
+    HEADER_SIZE = 12,
+    RECORD_HEADER_SIZE = 5,
+    EVENT_HEADER_SIZE = RECORD_HEADER_SIZE + 16,
+    RECORD_MAX = 1 << 24
+  };
+
+  enum record_type : unsigned char {
+    SITE = 1,
+    EVENT,
+    TEXT
+  };
+
+  static
+  const char* magic() {
+    return "LOGEBIN1";
+  }
+
+  static
+  std::size_t header(char *dst, bool timestamp, int linenumwidth) {
+    unsigned short width = static_cast<unsigned short>(linenumwidth);
+
+    memcpy(dst, magic(), 8);
+    dst[8] = static_cast<char>(VERSION);
+    dst[9] = static_cast<char>(timestamp);
+    memcpy(dst + 10, &width, sizeof(width));
+
+    return HEADER_SIZE;
+  }
+
+  /* Leaves room for the length, filled in by finish() */
+  static
+  char* start(char *p, record_type type) {
+    p[4] = static_cast<char>(type);
+    return p + RECORD_HEADER_SIZE;
+  }
+
+  static
+  std::size_t finish(char *record, char *end) {
+    std::uint32_t len = static_cast<std::uint32_t>(end - record - 4);
+    memcpy(record, &len, sizeof(len));
+    return end - record;
+  }
+
+  /* Filename and format string are cut to keep the record within cap */
+  static
+  std::string site(std::uint32_t id, int linenumber, const char *filename,
+      const char *fmt, std::size_t cap) {
+
+    std::size_t flen = strlen(filename);
+    std::size_t mlen = strlen(fmt);
+    std::size_t fixed = RECORD_HEADER_SIZE + 12;
+
+    if (fixed + flen > cap) {
+      flen = cap > fixed ? cap - fixed : 0;
+    }
+    if (fixed + flen + mlen > cap) {
+      mlen = cap - fixed - flen;
+    }
+    if (flen > 0xffff) {
+      flen = 0xffff;
+    }
+    if (mlen > 0xffff) {
+      mlen = 0xffff;
+    }
+
+    std::string rec(fixed + flen + mlen, '\0');
+    char *begin = &rec[0];
+    char *p = start(begin, SITE);
+
+    unsigned short n;
+    std::int32_t line = linenumber;
+
+    memcpy(p, &id, sizeof(id));
+    p += sizeof(id);
+    memcpy(p, &line, sizeof(line));
+    p += sizeof(line);
+
+    n = static_cast<unsigned short>(flen);
+    memcpy(p, &n, sizeof(n));
+    p += sizeof(n);
+    memcpy(p, filename, flen);
+    p += flen;
+
+    n = static_cast<unsigned short>(mlen);
+    memcpy(p, &n, sizeof(n));
+    p += sizeof(n);
+    memcpy(p, fmt, mlen);
+    p += mlen;
+
+    finish(begin, p);
+
+    return rec;
+  }
+
+  /* Returns where the arguments go, nullptr if the header does not fit */
+  static
+  char* event(char *p, char *end, std::time_t t, std::uint32_t id,
+      int logtype) {
+
+    if (end - p < EVENT_HEADER_SIZE) {
+      return nullptr;
+    }
+
+    std::int64_t time = t;
+    std::int32_t type = logtype;
+
+    p = start(p, EVENT);
+    memcpy(p, &time, sizeof(time));
+    p += sizeof(time);
+    memcpy(p, &id, sizeof(id));
+    p += sizeof(id);
+    memcpy(p, &type, sizeof(type));
+
+    return p + sizeof(type);
+  }
+
+  /**
+   * @brief Reads a binary log and renders each record in the text format
+   * the logger would have written.
+   */
+  class decoder {
+
+    struct site_info {
+      int linenumber;
+      std::string filename;
+      std::string fmt;
+    };
+
+    std::istream &is;
+    bool list_sites;
+    bool timestamp = true;
+    int linenumwidth = 6;
+    std::unordered_map<std::uint32_t, site_info> sites;
+    std::vector<char> record;
+    std::vector<char> text;
+    const char *err = nullptr;
+
+    const char* fail(const char *what) {
+      err = what;
+      return nullptr;
+    }
+
+    bool read_header() {
+      char hdr[HEADER_SIZE];
+      unsigned short width;
+
+      memcpy(hdr, magic(), 4);
+      if (!is.read(hdr + 4, HEADER_SIZE - 4) ||
+          memcmp(hdr, magic(), 8) != 0 ||
+          hdr[8] != static_cast<char>(VERSION)) {
+        return false;
+      }
+
+      timestamp = hdr[9] != 0;
+      memcpy(&width, hdr + 10, sizeof(width));
+      linenumwidth = width;
+      sites.clear();
+
+      return true;
+    }
+
+    bool read_site(const char *p, const char *end) {
+      std::uint32_t id;
+      std::int32_t line;
+      unsigned short n;
+      site_info info;
+
+      if (end - p < 10) {
+        return false;
+      }
+      memcpy(&id, p, sizeof(id));
+      p += sizeof(id);
+      memcpy(&line, p, sizeof(line));
+      p += sizeof(line);
+      info.linenumber = line;
+
+      memcpy(&n, p, sizeof(n));
+      p += sizeof(n);
+      if (end - p < n + 2) {
+        return false;
+      }
+      info.filename.assign(p, n);
+      p += n;
+
+      memcpy(&n, p, sizeof(n));
+      p += sizeof(n);
+      if (end - p < n) {
+        return false;
+      }
+      info.fmt.assign(p, n);
+
+      sites[id] = std::move(info);
+
+      return true;
+    }
+
+    std::size_t render_site(const char *p) {
+      std::uint32_t id;
+      memcpy(&id, p, sizeof(id));
+
+      const site_info &site = sites[id];
+
+      int len = snprintf(text.data(), text.size(), "%u: %s:%d: %s",
+          static_cast<unsigned int>(id), site.filename.c_str(),
+          site.linenumber, site.fmt.c_str());
+
+      return len < 0 ? 0 :
+        static_cast<std::size_t>(len) < text.size() ?
+        static_cast<std::size_t>(len) : text.size() - 1;
+    }
+
+    std::size_t render_event(const char *p, const char *end) {
+      std::int64_t time;
+      std::uint32_t id;
+      std::int32_t logtype;
+
+      if (end - p < 16) {
+        return 0;
+      }
+      memcpy(&time, p, sizeof(time));
+      p += sizeof(time);
+      memcpy(&id, p, sizeof(id));
+      p += sizeof(id);
+      memcpy(&logtype, p, sizeof(logtype));
+      p += sizeof(logtype);
+
+      auto it = sites.find(id);
+      if (it == sites.end()) {
+        return 0;
+      }
+      const site_info &site = it->second;
+
+      /* Color is the top bit of the log type */
+      std::uint32_t type = static_cast<std::uint32_t>(logtype);
+      int loglevel = static_cast<int>(type & 0x7fffffffu);
+      int en_color = static_cast<int>(type >> 31);
+      const char *loglvlstr = loglevel < 0 || loglevel > 5 ? "" :
+        en_color ?
+        loglevel_strtbl_color[loglevel] :
+        loglevel_strtbl[loglevel];
+
+      std::size_t len = loge_prefix(text.data(), text.size(), timestamp,
+          static_cast<std::time_t>(time), linenumwidth, en_color,
+          site.filename.c_str(), site.linenumber, loglvlstr);
+
+      return len + loge_args::render(text.data() + len, text.size() - len,
+          site.fmt.c_str(), p, end - p);
+    }
+
+    public:
+
+    /**
+     * @param list_sites Return a line per SITE record instead of the
+     * messages: id, filename, line number and format string
+     */
+    decoder(std::istream &is_, bool list_sites_ = false)
+      : is(is_), list_sites(list_sites_), text(1 << 16) {
+    }
+
+    /**
+     * @brief Decode up to the next message
+     * @param len Set to the length of the message
+     * @return The message, nullptr at the end of input or on a truncated or
+     * corrupt record, see error()
+     */
+    const char* next(std::size_t &len) {
+      for (;;) {
+        std::uint32_t reclen;
+        if (!is.read(reinterpret_cast<char*>(&reclen), sizeof(reclen))) {
+          return is.gcount() ? fail("truncated record") : nullptr;
+        }
+
+        if (memcmp(&reclen, magic(), 4) == 0) {
+          if (!read_header()) {
+            return fail(is ? "corrupt header" : "truncated header");
+          }
+          continue;
+        }
+
+        if (reclen < 1 || reclen > RECORD_MAX) {
+          return fail("corrupt record");
+        }
+
+        record.resize(reclen);
+        if (!is.read(record.data(), reclen)) {
+          return fail("truncated record");
+        }
+
+        const char *p = record.data() + 1;
+        const char *end = record.data() + reclen;
+
+        switch (static_cast<record_type>(record[0])) {
+          case SITE:
+            if (!read_site(p, end)) {
+              return fail("corrupt record");
+            }
+            if (list_sites) {
+              len = render_site(p);
+              return text.data();
+            }
+            continue;
+
+          case EVENT:
+            if (list_sites) {
+              continue;
+            }
+            len = render_event(p, end);
+            return text.data();
+
+          case TEXT:
+            if (list_sites) {
+              continue;
+            }
+            len = end - p;
+            return p;
+
+          default:
+            return fail("corrupt record");
+        }
+      }
+    }
+
+    /* Why next() stopped early, nullptr if it reached the end of input */
+    const char* error() const {
+      return err;
+    }
+  };
+};
+
+#if __cplusplus >= 202002L
+
+/*
+ * Compile time parsing of printf style format strings.
+ *
+ * The format string is passed as a template argument, split into literal
+ * pieces and conversion pieces while compiling, and checked against the
+ * argument types. Supported conversions are d i u o x X c s p f F e E g G a
+ * A and %% with flags "-+ #0", width and precision. Length modifiers are
+ * accepted and ignored, the argument type decides the width.
+ */
+template <std::size_t N>
+struct loge_literal {
+  char str[N];
+
+  constexpr loge_literal(const char (&s)[N]) {
+    for (std::size_t i = 0; i < N; i++) {
+      str[i] = s[i];
+    }
+  }
+
+  constexpr std::size_t size() const {
+    return N - 1;
+  }
+};
+
+struct loge_piece {
+  std::size_t offset = 0;
+  std::size_t len = 0;
+  char conv = 0;          /* 0 for a literal piece */
+  bool left = false;
+  bool zero = false;
+  bool plus = false;
+  bool space = false;
+  bool alt = false;
+  int width = -1;
+  int precision = -1;
+
+  /* printf conversion specification for the generic path */
+  char spec[24] = {};
+};
+
+template <loge_literal fmt>
+struct loge_format {
+
+  static
+  constexpr bool is_flag(char c) {
+    return c == '-' || c == '+' || c == ' ' || c == '#' || c == '0';
+  }
+
+  static
+  constexpr bool is_length(char c) {
+    return c == 'h' || c == 'l' || c == 'j' || c == 'z' || c == 't' ||
+      c == 'L' || c == 'q';
+  }
+
+  static
+  constexpr bool is_conv(char c) {
+    for (const char *p = "diuoxXcspfFeEgGaA"; *p; p++) {
+      if (*p == c) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /* Walks the format string, fills pieces when given, returns their count */
+  static
+  constexpr std::size_t parse(loge_piece *pieces) {
+    std::size_t n = 0;
+    std::size_t i = 0;
+    std::size_t size = fmt.size();
+
+    while (i < size) {
+      if (fmt.str[i] != '%') {
+        std::size_t start = i;
+        while (i < size && fmt.str[i] != '%') {
+          i++;
+        }
+        if (pieces) {
+          pieces[n].offset = start;
+          pieces[n].len = i - start;
+        }
+        n++;
+        continue;
+      }
+
+      if (i + 1 < size && fmt.str[i + 1] == '%') {
+        /* Literal percent sign */
+        if (pieces) {
+          pieces[n].offset = i;
+          pieces[n].len = 1;
+        }
+        n++;
+        i += 2;
+        continue;
+      }
+
+      loge_piece piece;
+      std::size_t sl = 0;
+      piece.spec[sl++] = '%';
+      i++;
+
+      while (i < size && is_flag(fmt.str[i])) {
+        char c = fmt.str[i++];
+        piece.left |= c == '-';
+        piece.zero |= c == '0';
+        piece.plus |= c == '+';
+        piece.space |= c == ' ';
+        piece.alt |= c == '#';
+        piece.spec[sl++] = c;
+      }
+
+      if (i < size && fmt.str[i] >= '0' && fmt.str[i] <= '9') {
+        piece.width = 0;
+        while (i < size && fmt.str[i] >= '0' && fmt.str[i] <= '9') {
+          piece.width = piece.width * 10 + (fmt.str[i] - '0');
+          piece.spec[sl++] = fmt.str[i++];
+        }
+      }
+
+      if (i < size && fmt.str[i] == '.') {
+        piece.spec[sl++] = fmt.str[i++];
+        piece.precision = 0;
+        while (i < size && fmt.str[i] >= '0' && fmt.str[i] <= '9') {
+          piece.precision = piece.precision * 10 + (fmt.str[i] - '0');
+          piece.spec[sl++] = fmt.str[i++];
+        }
+      }
+
+      while (i < size && is_length(fmt.str[i])) {
+        i++;
+      }
+
+      if (i >= size || !is_conv(fmt.str[i])) {
+        /* Unknown conversion, fails the compile time check */
+        throw "loge: invalid conversion in format string";
+      }
+
+      piece.conv = fmt.str[i++];
+
+      if (piece.conv == 'd' || piece.conv == 'i' || piece.conv == 'u' ||
+          piece.conv == 'o' || piece.conv == 'x' || piece.conv == 'X') {
+        piece.spec[sl++] = 'l';
+        piece.spec[sl++] = 'l';
+      }
+      piece.spec[sl++] = piece.conv;
+      piece.spec[sl] = '\0';
+
+      if (pieces) {
+        pieces[n] = piece;
+      }
+      n++;
+    }
+
+    return n;
+  }
+
+  static constexpr std::size_t count = parse(nullptr);
+
+  static
+  constexpr std::array<loge_piece, count> make_pieces() {
+    std::array<loge_piece, count> pieces{};
+    parse(pieces.data());
+    return pieces;
+  }
+
+  static constexpr std::array<loge_piece, count> pieces = make_pieces();
+
+  static
+  constexpr std::size_t arg_count() {
+    std::size_t n = 0;
+    for (const loge_piece &piece : pieces) {
+      n += piece.conv != 0;
+    }
+    return n;
+  }
+
+  /* Index of the argument consumed by piece i */
+  static
+  constexpr std::size_t arg_index(std::size_t i) {
+    std::size_t j = 0;
+    for (std::size_t k = 0; k < i; k++) {
+      j += pieces[k].conv != 0;
+    }
+    return j;
+  }
+
+  /* Index of the piece that consumes argument j */
+  static
+  constexpr std::size_t arg_piece(std::size_t j) {
+    for (std::size_t i = 0; i < count; i++) {
+      if (pieces[i].conv && j-- == 0) {
+        return i;
+      }
+    }
+    return count;
+  }
+
+  template <typename T>
+  static
+  constexpr bool is_string() {
+    using U = std::remove_cvref_t<std::decay_t<T>>;
+    return std::is_same_v<U, char*> || std::is_same_v<U, const char*> ||
+      std::is_same_v<U, std::string> || std::is_same_v<U, std::string_view>;
+  }
+
+  template <typename T>
+  static
+  constexpr bool accepts(char conv) {
+    using U = std::remove_cvref_t<std::decay_t<T>>;
+    switch (conv) {
+      case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c':
+        return std::is_integral_v<U> || std::is_enum_v<U>;
+      case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a':
+      case 'A':
+        return std::is_floating_point_v<U>;
+      case 's':
+        return is_string<T>();
+      case 'p':
+        return std::is_pointer_v<U> || std::is_null_pointer_v<U>;
+      default:
+        return false;
+    }
+  }
+
+  template <typename... Args, std::size_t... J>
+  static
+  constexpr bool check(std::index_sequence<J...>) {
+    return (accepts<Args>(pieces[arg_piece(J)].conv) && ...);
+  }
+
+  template <typename... Args>
+  static
+  constexpr bool check() {
+    if constexpr (sizeof...(Args) != arg_count()) {
+      return false;
+    } else {
+      return check<Args...>(std::index_sequence_for<Args...>{});
+    }
+  }
+};
+
+/* Writers for the pieces of a compile time parsed format string */
+struct loge_writer {
+
+  static
+  void append(char *dst, std::size_t cap, std::size_t &len, const char *src,
+      std::size_t n) {
+
+    if (n > cap - 1 - len) {
+      n = cap - 1 - len;
+    }
+    memcpy(dst + len, src, n);
+    len += n;
+  }
+
+  static
+  void pad(char *dst, std::size_t cap, std::size_t &len, char c,
+      std::size_t n) {
+
+    if (n > cap - 1 - len) {
+      n = cap - 1 - len;
+    }
+    memset(dst + len, c, n);
+    len += n;
+  }
+
+  /* Right or left justify a rendered field within the piece width */
+  static
+  void field(const loge_piece &piece, char *dst, std::size_t cap,
+      std::size_t &len, const char *src, std::size_t n) {
+
+    std::size_t width = piece.width > 0 ?
+      static_cast<std::size_t>(piece.width) : 0;
+    std::size_t fill = width > n ? width - n : 0;
+
+    if (!piece.left) {
+      pad(dst, cap, len, ' ', fill);
+    }
+    append(dst, cap, len, src, n);
+    if (piece.left) {
+      pad(dst, cap, len, ' ', fill);
+    }
+  }
+
+  static
+  void printf_piece(const loge_piece &piece, char *dst, std::size_t cap,
+      std::size_t &len, ...) {
+
+    std::va_list args;
+    va_start(args, len);
+    int done = vsnprintf(dst + len, cap - len, piece.spec, args);
+    va_end(args);
+
+    if (done > 0) {
+      len += static_cast<std::size_t>(done) < cap - len ?
+        static_cast<std::size_t>(done) : cap - 1 - len;
+    }
+  }
+
+  static
+  void write_signed(const loge_piece &piece, char *dst, std::size_t cap,
+      std::size_t &len, long long value) {
+
+    /* Plain %d, %Nd, %0Nd and %-Nd are written without printf */
+    if (piece.plus || piece.space || piece.precision > -1) {
+      printf_piece(piece, dst, cap, len, value);
+      return;
+    }
+
+    char tmp[24];
+    char *end = tmp + sizeof(tmp);
+    unsigned long long u = value < 0 ?
+      0ULL - static_cast<unsigned long long>(value) :
+      static_cast<unsigned long long>(value);
+
+    std::size_t digits = loge_utoa_rev(end, u);
+    char *p = end - digits;
+    std::size_t n = digits + (value < 0);
+
+    if (piece.zero && !piece.left && piece.width > static_cast<int>(n)) {
+      if (value < 0) {
+        append(dst, cap, len, "-", 1);
+      }
+      pad(dst, cap, len, '0', piece.width - n);
+      append(dst, cap, len, p, digits);
+      return;
+    }
+
+    if (value < 0) {
+      *--p = '-';
+    }
+    field(piece, dst, cap, len, p, n);
+  }
+
+  static
+  void write_unsigned(const loge_piece &piece, char *dst, std::size_t cap,
+      std::size_t &len, unsigned long long value) {
+
+    if (piece.conv != 'u' || piece.plus || piece.space ||
+        piece.precision > -1) {
+      printf_piece(piece, dst, cap, len, value);
+      return;
+    }
+
+    char tmp[24];
+    char *end = tmp + sizeof(tmp);
+
+    std::size_t n = loge_utoa_rev(end, value);
+    char *p = end - n;
+
+    if (piece.zero && !piece.left && piece.width > static_cast<int>(n)) {
+      pad(dst, cap, len, '0', piece.width - n);
+      append(dst, cap, len, p, n);
+      return;
+    }
+
+    field(piece, dst, cap, len, p, n);
+  }
+
+  static
+  void write_string(const loge_piece &piece, char *dst, std::size_t cap,
+      std::size_t &len, const char *str, std::size_t n) {
+
+    if (piece.precision > -1 && static_cast<std::size_t>(piece.precision) < n) {
+      n = piece.precision;
+    }
+    field(piece, dst, cap, len, str, n);
+  }
+
+  template <typename T>
+  static
+  void write_arg(const loge_piece &piece, char *dst, std::size_t cap,
+      std::size_t &len, const T &value) {
+
+    using U = std::remove_cvref_t<std::decay_t<T>>;
+
+    /* Strings are pointers too, %p prints the address */
+    if constexpr (std::is_pointer_v<U>) {
+      if (piece.conv == 'p') {
+        printf_piece(piece, dst, cap, len, static_cast<const void*>(value));
+        return;
+      }
+    }
+
+    if constexpr (std::is_same_v<U, std::string> ||
+        std::is_same_v<U, std::string_view>) {
+      write_string(piece, dst, cap, len, value.data(), value.size());
+
+    } else if constexpr (std::is_array_v<std::remove_cvref_t<T>>) {
+      write_string(piece, dst, cap, len, value, strlen(value));
+
+    } else if constexpr (std::is_same_v<U, char*> ||
+        std::is_same_v<U, const char*>) {
+      const char *str = value ? value : "(null)";
+      write_string(piece, dst, cap, len, str, strlen(str));
+
+    } else if constexpr (std::is_enum_v<U>) {
+      write_arg(piece, dst, cap, len,
+          static_cast<std::underlying_type_t<U>>(value));
+
+    } else if constexpr (std::is_same_v<U, bool>) {
+      write_arg(piece, dst, cap, len, static_cast<int>(value));
+
+    } else if constexpr (std::is_integral_v<U>) {
+      /* Promoted first like a variadic argument, a short is an int */
+      using P = decltype(+value);
+
+      if (piece.conv == 'c') {
+        char c = static_cast<char>(value);
+        field(piece, dst, cap, len, &c, 1);
+
+      } else if (piece.conv == 'd' || piece.conv == 'i') {
+        write_signed(piece, dst, cap, len,
+            static_cast<long long>(static_cast<std::make_signed_t<P>>(value)));
+
+      } else {
+        write_unsigned(piece, dst, cap, len, static_cast<unsigned long long>(
+              static_cast<std::make_unsigned_t<P>>(value)));
+      }
+
+    } else if constexpr (std::is_floating_point_v<U>) {
+      printf_piece(piece, dst, cap, len, static_cast<double>(value));
+
+    } else {
+      printf_piece(piece, dst, cap, len, static_cast<const void*>(value));
+    }
+  }
+
+  template <loge_literal fmt, std::size_t I, typename Tuple>
+  static
+  void write_piece(char *dst, std::size_t cap, std::size_t &len,
+      const Tuple &args) {
+
+    constexpr loge_piece piece = loge_format<fmt>::pieces[I];
+
+    if constexpr (!piece.conv) {
+      append(dst, cap, len, fmt.str + piece.offset, piece.len);
+
+    } else {
+      constexpr std::size_t j = loge_format<fmt>::arg_index(I);
+      write_arg(piece, dst, cap, len, std::get<j>(args));
+    }
+  }
+
+  template <loge_literal fmt, typename Tuple, std::size_t... I>
+  static
+  void write_pieces(char *dst, std::size_t cap, std::size_t &len,
+      const Tuple &args, std::index_sequence<I...>) {
+
+    (write_piece<fmt, I>(dst, cap, len, args), ...);
+  }
+
+  /* Append the formatted message at dst + len */
+  template <loge_literal fmt, typename... Args>
+  static
+  void write(char *dst, std::size_t cap, std::size_t &len,
+      const Args &...args) {
+
+    if (len + 1 >= cap) {
+      return;
+    }
+
+    write_pieces<fmt>(dst, cap, len, std::tuple<const Args&...>(args...),
+        std::make_index_sequence<loge_format<fmt>::count>{});
+  }
+};
+
+#endif /* __cplusplus >= 202002L */
+
+#if LOGE_URING
+
+/*
+ * Writes a file through io_uring with raw system calls, no liburing. The
+ * caller fills one of BUFFERS registered buffers while the others are in
+ * flight, completions give them back. The descriptor is registered as a
+ * fixed file.
+ *
+ * Files opened for the sink are written at offsets tracked here, so several
+ * writes can be in flight. Other descriptors may be shared or non-seekable
+ * and have one write in flight at a time at the current file position.
+ */
+class loge_uring {
+  public:
+
+  enum constants {
+    BUFFERS = 4,
+    ENTRIES = 8,
+    FSYNC_DATA = ~0U
+  };
+
+  loge_uring() = default;
+  loge_uring(const loge_uring&) = delete;
+  loge_uring& operator=(const loge_uring&) = delete;
+
+  ~loge_uring() {
+    close();
+  }
+
+  /**
+   * @brief Set up the ring for fd
+   * @param fd Descriptor, owned by the caller
+   * @param bufsize Size of each buffer
+   * @param offset Offset of the first write, -1 for one write in flight at
+   * the current position
+   * @return false if io_uring is not available
+   */
+  bool open(int fd_, std::size_t bufsize, long long offset) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int rfd = static_cast<int>(syscall(__NR_io_uring_setup, ENTRIES,
+          &params));
+    if (rfd < 0) {
+      return false;
+    }
+    ringfd = rfd;
+
+    /* Serialized writes need the current position, older kernels lack it */
+    if (offset < 0 && !(params.features & IORING_FEAT_RW_CUR_POS)) {
+      close();
+      return false;
+    }
+
+    sqlen = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqlen = params.cq_off.cqes +
+      params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      sqlen = cqlen = std::max(sqlen, cqlen);
+    }
+
+    sqring = mmap(nullptr, sqlen, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQ_RING);
+    if (sqring == MAP_FAILED) {
+      sqring = nullptr;
+      close();
+      return false;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      cqring = sqring;
+    } else {
+      cqring = mmap(nullptr, cqlen, PROT_READ | PROT_WRITE,
+          MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_CQ_RING);
+      if (cqring == MAP_FAILED) {
+        cqring = nullptr;
+        close();
+        return false;
+      }
+    }
+
+    sqeslen = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *p = mmap(nullptr, sqeslen, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQES);
+    if (p == MAP_FAILED) {
+      close();
+      return false;
+    }
+    sqes = static_cast<struct io_uring_sqe*>(p);
+
+    char *sq = static_cast<char*>(sqring);
+    sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+    char *cq = static_cast<char*>(cqring);
+    cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    /* Buffers are pinned by the kernel, memlock limits apply */
+    mem = new char[BUFFERS * bufsize];
+    cap = bufsize;
+
+    struct iovec iov[BUFFERS];
+    for (unsigned int i = 0; i < BUFFERS; i++) {
+      iov[i].iov_base = mem + i * bufsize;
+      iov[i].iov_len = bufsize;
+      bufs[i].busy = false;
+    }
+
+    if (syscall(__NR_io_uring_register, ringfd, IORING_REGISTER_BUFFERS,
+          iov, BUFFERS) < 0 ||
+        syscall(__NR_io_uring_register, ringfd, IORING_REGISTER_FILES,
+          &fd_, 1) < 0) {
+      close();
+      return false;
+    }
+
+    fd = fd_;
+    off = offset;
+    cur = 0;
+    inflight = 0;
+
+    return true;
+  }
+
+  void close() {
+    if (ringfd > -1 && fd > -1) {
+      wait_all();
+    }
+
+    if (sqes) {
+      munmap(sqes, sqeslen);
+      sqes = nullptr;
+    }
+    if (cqring && cqring != sqring) {
+      munmap(cqring, cqlen);
+    }
+    cqring = nullptr;
+    if (sqring) {
+      munmap(sqring, sqlen);
+      sqring = nullptr;
+    }
+    if (ringfd > -1) {
+      ::close(ringfd);
+      ringfd = -1;
+    }
+
+    delete[] mem;
+    mem = nullptr;
+    fd = -1;
+  }
+
+  /* Buffer being filled */
+  char* buffer() {
+    return mem + cur * cap;
+  }
+
+  std::size_t capacity() const {
+    return cap;
+  }
+
+  /* Queue len bytes of the current buffer, then wait for a free one */
+  void submit(std::size_t len) {
+    if (!len) {
+      return;
+    }
+
+    if (off < 0) {
+      wait_all();
+    }
+
+    buf &b = bufs[cur];
+    b.busy = true;
+    b.len = len;
+    b.off = off;
+    if (off > -1) {
+      off += len;
+    }
+
+    struct io_uring_sqe *sqe = next_sqe();
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = 0;
+    sqe->off = static_cast<__u64>(b.off);
+    sqe->addr = reinterpret_cast<__u64>(buffer());
+    sqe->len = static_cast<__u32>(len);
+    sqe->buf_index = static_cast<__u16>(cur);
+    sqe->user_data = cur;
+    enter(1, 0);
+
+    cur = (cur + 1) % BUFFERS;
+    while (bufs[cur].busy) {
+      reap(true);
+    }
+  }
+
+  /* Queue an fdatasync that runs once every write before it is done */
+  void fsync() {
+    struct io_uring_sqe *sqe = next_sqe();
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_DRAIN;
+    sqe->fd = 0;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->user_data = FSYNC_DATA;
+    enter(1, 0);
+  }
+
+  void wait_all() {
+    while (inflight) {
+      reap(true);
+    }
+  }
+
+  private:
+
+  struct buf {
+    bool busy;
+    std::size_t len;
+    long long off;
+  };
+
+  int ringfd = -1;
+  int fd = -1;
+
+  void *sqring = nullptr;
+  void *cqring = nullptr;
+  std::size_t sqlen = 0;
+  std::size_t cqlen = 0;
+  std::size_t sqeslen = 0;
+
+  unsigned *sq_tail = nullptr;
+  unsigned *sq_array = nullptr;
+  unsigned sq_mask = 0;
+  struct io_uring_sqe *sqes = nullptr;
+
+  unsigned *cq_head = nullptr;
+  unsigned *cq_tail = nullptr;
+  unsigned cq_mask = 0;
+  struct io_uring_cqe *cqes = nullptr;
+
+  char *mem = nullptr;
+  std::size_t cap = 0;
+  buf bufs[BUFFERS];
+  unsigned int cur = 0;
+  unsigned int inflight = 0;
+  long long off = -1;
+
+  struct io_uring_sqe* next_sqe() {
+    /* Keep the completion queue from overflowing */
+    while (inflight >= ENTRIES) {
+      reap(true);
+    }
+
+    unsigned tail = *sq_tail;
+    unsigned index = tail & sq_mask;
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+
+    /* The kernel reads the entry once it sees the new tail */
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    inflight++;
+
+    return sqe;
+  }
+
+  bool enter(unsigned int submit, unsigned int wait) {
+    while (syscall(__NR_io_uring_enter, ringfd, submit, wait,
+          wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0) < 0) {
+      if (errno != EINTR) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /* Handle completions, waiting for one first if asked */
+  void reap(bool block) {
+    unsigned head = *cq_head;
+
+    if (block && head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) &&
+        !enter(0, 1)) {
+      /* The ring is unusable, what is in flight is lost */
+      for (unsigned int i = 0; i < BUFFERS; i++) {
+        bufs[i].busy = false;
+      }
+      inflight = 0;
+      return;
+    }
+
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      const struct io_uring_cqe &cqe = cqes[head & cq_mask];
+      if (cqe.user_data != FSYNC_DATA) {
+        complete(static_cast<unsigned int>(cqe.user_data), cqe.res);
+      }
+      inflight--;
+    }
+
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  /* Short writes are finished synchronously, failures drop the data */
+  void complete(unsigned int i, int res) {
+    buf &b = bufs[i];
+    std::size_t done = res > 0 ? static_cast<std::size_t>(res) : 0;
+
+    while (res >= 0 && done < b.len) {
+      const char *p = mem + i * cap + done;
+      ssize_t n = b.off > -1 ?
+        pwrite(fd, p, b.len - done, static_cast<off_t>(b.off + done)) :
+        write(fd, p, b.len - done);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        break;
+      }
+      done += static_cast<std::size_t>(n);
+    }
+
+    b.busy = false;
+  }
+};
+
+#endif /* LOGE_URING */
+
+template <
+  bool timestamp = true,
+  std::size_t buffer_size = 0,
+  int min_level = LOGE_MIN_LEVEL
+>
+class loge {
+
+  public:
+
+  enum constants {
+    LINENUMBER_WIDTH = 6,
+    NUMBER_WIDTH = 8,
+    BUFFER_SIZE = 1024,
+    LOGCOLORSHIFT = 31,
+    ASYNC_CAPACITY = 1024,
+    ASYNC_SPIN = 64,
+    ASYNC_IDLE_MS = 10,
+    PREFIX_CACHE_SIZE = 512,
+    FD_BUFFER_SIZE = 64 * 1024,
+    IOV_BATCH = 1023
+  };
+
+  enum loge_level {
+    ALL = 0,
+    INFO,
+    DEBUG,
+    WARNING,
+    ERROR,
+    CRITICAL,
+    MAX,
+    LOGCOLOR = 1 << loge::constants::LOGCOLORSHIFT
+  };
+
+  /**
+   * @brief A record as handed to recordfn(). The views point into buffers of
+   * the logger and are only valid during the call. For binary loggers line
+   * is the encoded record and message is empty.
+   */
+  struct record {
+    std::time_t time;
+    enum loge_level level;
+    bool color;
+    loge_string_view filename;
+    unsigned int linenumber;
+
+    /* Format string as passed to log() */
+    loge_string_view format;
+
+    /* Formatted record as it is written, prefix included */
+    loge_string_view line;
+
+    /* Formatted message without the prefix */
+    loge_string_view message;
+
+    /* Call site descriptor, nullptr when log() was called directly */
+    const loge_site *site;
+  };
+
+  /*
+   * Renders a record for a sink, see add_sink(). Writes at most cap bytes
+   * to dst and returns how many, without a line break.
+   */
+  using encoder_fn = std::size_t (*)(const record &rec, char *dst,
+      std::size_t cap);
+
+  private:
+
+  /* Sinks of another kind are written through deliver() */
+  template <bool, std::size_t, int>
+  friend class loge;
+
+  using width_type = struct _width_type {
+    int width;
+
+    _width_type() : width(-1) {
+    }
+
+    _width_type(int width_) : width(width_) {
+    }
+
+    _width_type(const struct _width_type &other) {
+      this->width = other.width;
+    }
+
+    _width_type(struct _width_type &&other) {
+      this->width = other.width;
+    }
+
+    struct _width_type& operator=(const struct _width_type &other) {
+      this->width = other.width;
+      return *this;
+    }
+
+    struct _width_type& operator=(struct _width_type &&other) {
+      this->width = other.width;
+      return *this;
+    }
+
+    struct _width_type& operator=(int width_) {
+      width = width_;
+      return *this;
+    }
+
+    operator int() const {
+      return width;
+    }
+
+    int to_int() const {
+      return width;
+    }
+  };
+
+  using precision_type = struct _precision_type {
+    int precision;
+
+    _precision_type() : precision(-1) {
+    }
+
+    _precision_type(int precision_) : precision(precision_) {
+    }
+
+    _precision_type(const struct _precision_type &other) {
+      this->precision = other.precision;
+    }
+
+    _precision_type(struct _precision_type &&other) {
+      this->precision = other.precision;
+    }
+
+    struct _precision_type& operator=(const struct _precision_type &other) {
+      this->precision = other.precision;
+      return *this;
+    }
+
+    struct _precision_type& operator=(struct _precision_type &&other) {
+      this->precision = other.precision;
+      return *this;
+    }
+
+    struct _precision_type& operator=(int precision_) {
+      precision = precision_;
+      return *this;
+    }
+
+    operator int() const {
+      return precision;
+    }
+
+    int to_int() const {
+      return precision;
+    }
+  };
+
+  static constexpr std::size_t buffer_capacity =
+    !buffer_size ?
+    static_cast<std::size_t>(constants::BUFFER_SIZE) :
+    buffer_size;
+
+  /* Where a record comes from, kept next to its data until it is written */
+  struct record_header {
+    std::time_t t;
+    loge_site *site;
+    const char *filename;
+    const char *fmt;
+    int linenumber;
+    int logtype;
+  };
+
+  /*
+   * Bounded lock-free multi-producer single-consumer ring of log records.
+   *
+   * Every slot carries a sequence number. A producer claims the slot at the
+   * enqueue position with a CAS, formats straight into it and publishes it
+   * by storing pos + 1 into the sequence. The backend thread consumes slots
+   * in order and hands them back by storing pos + capacity.
+   */
+  struct async_ring {
+    /*
+     * A deferred slot holds captured arguments, rendered by the backend.
+     * hdr is unused for raw records pushed by flush().
+     */
+    struct slot {
+      std::atomic<std::size_t> seq;
+      std::size_t len;
+      std::size_t prefixlen;
+      bool deferred;
+      bool raw;
+      bool flush;
+      record_header hdr;
+      std::array<char, buffer_capacity> data;
+    };
+
+    slot *slots;
+    std::size_t mask;
+
+    /* Keep producer and consumer positions on separate cache lines */
+    char pad0[64];
+    std::atomic<std::size_t> tail;
+    char pad1[64];
+    std::atomic<std::size_t> head;
+
+    async_ring(std::size_t capacity)
+      : slots(new slot[capacity]), mask(capacity - 1), tail(0), head(0) {
+
+      for (std::size_t i = 0; i < capacity; i++) {
+        slots[i].seq.store(i, std::memory_order_relaxed);
+      }
+    }
+
+    ~async_ring() {
+      delete[] slots;
+    }
+
+    /* Returns nullptr when the ring is full */
+    slot* claim(std::size_t &pos) {
+      pos = tail.load(std::memory_order_relaxed);
+
+      for (;;) {
+        slot &s = slots[pos & mask];
+        std::size_t seq = s.seq.load(std::memory_order_acquire);
+        std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq) -
+          static_cast<std::ptrdiff_t>(pos);
+
+        if (diff == 0) {
+          if (tail.compare_exchange_weak(pos, pos + 1,
+                std::memory_order_relaxed)) {
+            return &s;
+          }
+
+        } else if (diff < 0) {
+          return nullptr;
+
+        } else {
+          pos = tail.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+    void publish(slot *s, std::size_t pos) {
+      s->seq.store(pos + 1, std::memory_order_release);
+    }
+
+    /* Consumer side only */
+    slot* front() {
+      std::size_t pos = head.load(std::memory_order_relaxed);
+      slot &s = slots[pos & mask];
+      if (s.seq.load(std::memory_order_acquire) == pos + 1) {
+        return &s;
+      }
+      return nullptr;
+    }
+
+    /* Consumer side only, the n-th record after front() */
+    slot* peek(std::size_t n) {
+      std::size_t pos = head.load(std::memory_order_relaxed) + n;
+      slot &s = slots[pos & mask];
+      if (s.seq.load(std::memory_order_acquire) == pos + 1) {
+        return &s;
+      }
+      return nullptr;
+    }
+
+    void pop() {
+      std::size_t pos = head.load(std::memory_order_relaxed);
+      slots[pos & mask].seq.store(pos + mask + 1, std::memory_order_release);
+      head.store(pos + 1, std::memory_order_release);
+    }
+
+    /* True once every record claimed before pos has been written */
+    bool drained(std::size_t pos) const {
+      return head.load(std::memory_order_acquire) >= pos;
+    }
+  };
+
+  struct async_state {
+    async_ring ring;
+    bool block_when_full;
+    std::atomic<bool> running;
+    std::atomic<bool> sleeping;
+    std::atomic<std::size_t> dropped;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::thread worker;
+
+    /* Backend side buffer for rendering deferred records */
+    std::array<char, buffer_capacity> render;
+
+    /*
+     * Records written to a descriptor sink straight from their slots. The
+     * first held slots of the ring stay claimed until the batch is written,
+     * iov points into those that were not dropped by recordfn(). iov[0] is
+     * kept for the sink buffer, the whole array fits in IOV_MAX.
+     */
+    std::array<struct iovec, constants::IOV_BATCH + 1> iov;
+    std::size_t iovcnt;
+    std::size_t held;
+    std::size_t max_held;
+
+    async_state(std::size_t capacity, bool block_when_full_)
+      : ring(capacity), block_when_full(block_when_full_), running(true),
+      sleeping(false), dropped(0), iovcnt(0), held(0),
+      max_held(std::min<std::size_t>(capacity / 2, constants::IOV_BATCH)) {
+    }
+  };
+
+  /* Binary output, call sites remember whether they were described in it */
+  struct binary_state {
+    /* Taken to describe a call site, once per site and output */
+    std::mutex lock;
+    /* Tells binary outputs apart in loge_site::binary_serial */
+    std::uint32_t serial = next_serial();
+
+    static
+    std::uint32_t next_serial() {
+      static std::atomic<std::uint32_t> counter(1);
+      return counter.fetch_add(1, std::memory_order_relaxed);
+    }
+  };
+
+  /* Member variables start */
+
+  /* An enum loge_level, read and written relaxed, see current_level() */
+  int level;
+
+  width_type linenumwidth = constants::LINENUMBER_WIDTH;
+  width_type width = -1;
+  precision_type precision = -1;
+
+  using logfntype = void(loge<timestamp, buffer_size, min_level>::*)();
+  logfntype prevlogfnptr = nullptr;
+  logfntype logfnptr = &loge<timestamp, buffer_size, min_level>::logfn_internal;
+
+  using endl_type = std::true_type;
+
+  int syslog_priority = -1;
+
+  async_state *async = nullptr;
+
+  binary_state *binary = nullptr;
+
+  std::mutex *sinklock = nullptr;
+
+  /* Written from where the records are written, see write_record() */
+  loge_flush_policy flush_policy = loge_flush_policy();
+  loge_flush_state flush_state = loge_flush_state();
+
+  /*
+   * Descriptor the ostream output is synced through, -1 if none. The
+   * descriptor of the stream, or sync_path opened when a policy first syncs.
+   */
+  int sync_fd = -1;
+  std::string sync_path;
+
+  /*
+   * Output written straight to a descriptor, without an ostream. Records
+   * collect in buf and go out with one write per flush, except on datagram
+   * sockets where each record is a write of its own.
+   */
+  struct fd_sink {
+    int fd;
+    std::size_t len;
+    bool datagram;
+
+    std::array<char, constants::FD_BUFFER_SIZE> mem;
+
+    /* Buffer being filled, mem or a registered io_uring buffer */
+    char *buf;
+    std::size_t cap;
+
+#if LOGE_URING
+    loge_uring *uring;
+#endif
+
+    explicit fd_sink(int fd_) : fd(fd_), len(0), datagram(false) {
+      buf = mem.data();
+      cap = mem.size();
+
+#if !defined(_WIN64)
+      int type = 0;
+      socklen_t optlen = sizeof(type);
+      datagram = getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &optlen) == 0 &&
+        type != SOCK_STREAM;
+#endif
+#if LOGE_URING
+      uring = nullptr;
+#endif
+    }
+  };
+
+  fd_sink *fdsink = nullptr;
+
+  /* Memory mapped log file, see set_file_mmap() */
+  loge_mmap *mapfile = nullptr;
+
+  /* Rotation of the file of the descriptor sink, see set_file_rotate() */
+  loge_rotate *rotate = nullptr;
+
+  /* Queued TCP output sent by a poller thread, see set_tcp() */
+  loge_tcp *tcp = nullptr;
+
+  /* Records packed into datagrams, see set_udp() and set_unix() */
+  loge_udp *udp = nullptr;
+
+  /* Datagrams to journald or a syslog daemon, see set_journal() */
+  loge_journal *journal = nullptr;
+
+  /*
+   * Flight recorder for messages below level, see enable_recorder(). Off
+   * while hdr is nullptr, level and dump_level are MAX then.
+   */
+  loge_recorder recorder = { nullptr, 0, -1, loge_level::MAX, loge_level::MAX,
+    0 };
+
+  /* Loggers the formatted records are handed to, see add_sink() */
+  struct fanout_sink {
+    void *sink;
+    void (*deliver)(void *sink, const char *data, std::size_t len,
+        int loglevel);
+    int level;
+    encoder_fn encoder;
+  };
+
+  std::vector<fanout_sink> sinks;
+
+  /* Lowest level of any sink */
+  int sinks_level = loge_level::MAX;
+
+  /* Keep 1 in n messages of a level, see set_sample_rate() */
+  std::uint64_t sample_rates[loge_level::MAX] = {};
+
+  /* Atomic flag that keeps the logger copyable */
+  struct callback_flag {
+    std::atomic<bool> value;
+
+    explicit callback_flag(bool on) : value(on) {
+    }
+
+    callback_flag(const callback_flag &other)
+      : value(other.value.load(std::memory_order_relaxed)) {
+    }
+
+    callback_flag& operator=(const callback_flag &other) {
+      value.store(other.value.load(std::memory_order_relaxed),
+          std::memory_order_relaxed);
+      return *this;
+    }
+
+    bool load() const {
+      return value.load(std::memory_order_relaxed);
+    }
+
+    void set(bool on) {
+      value.store(on, std::memory_order_relaxed);
+    }
+  };
+
+  /* Set with use_datafn() and use_recordfn() */
+  callback_flag has_datafn{true};
+  callback_flag has_recordfn{false};
+
+  protected:
+
+  /*
+   * NOTE
+   * Caution for user while working with p_os
+   * p_os can be set as nullptr. User callbacks shall check it.
+   */
+  std::ostream *p_os = nullptr;
+
+  socket_type sock = LOGE_SOCK_ERR;
+
+  std::array<char, buffer_capacity> buffer;
+  std::size_t buflen = 0;
+
+  /*
+   * Record handed to the log function. Points into buffer for synchronous
+   * logging and into a ring slot when the backend thread is draining
+   * records. Overrides of logfn() shall read the message from here.
+   */
+  const char *outptr = nullptr;
+  std::size_t outlen = 0;
+
+  /* Level of the record, 0 when it is raw */
+  int outlevel = 0;
+
+  /* Member variables end */
+
+  private:
+
+  void logfn_internal() {
+    if (fdsink) {
+      fd_append(outptr, outlen, true);
+    } else if (mapfile) {
+      loge_mmap_write(mapfile, outptr, outlen);
+      loge_mmap_write(mapfile, "\n", 1);
+    } else if (tcp) {
+      loge_tcp_write(tcp, outptr, outlen, 1);
+    } else if (udp) {
+      loge_udp_write(udp, outptr, outlen, 1);
+    } else if (journal) {
+      loge_journal_write(journal, c_level(outlevel), nullptr, 0, outptr,
+          outlen);
+    } else if (p_os) {
+      p_os->write(outptr, outlen);
+      p_os->put('\n');
+    }
+  }
+
+  /* Records are length prefixed, no line break */
+  void logfn_binary() {
+    if (fdsink) {
+      fd_append(outptr, outlen, false);
+    } else if (mapfile) {
+      loge_mmap_write(mapfile, outptr, outlen);
+    } else if (p_os) {
+      p_os->write(outptr, outlen);
+    }
+  }
+
+  /*
+   * Write all of iov, short writes and interrupted calls are retried. Errors
+   * drop the data silently like a failed ostream does, e.g. datagrams to a
+   * port nobody listens on.
+   */
+  static
+  bool fd_writev(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+#if defined(_WIN64)
+      int done = _write(fd, iov->iov_base,
+          static_cast<unsigned int>(iov->iov_len));
+#else
+      ssize_t done = writev(fd, iov, iovcnt);
+#endif
+      if (done < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return false;
+      }
+
+      std::size_t left = static_cast<std::size_t>(done);
+      while (iovcnt > 0 && left >= iov->iov_len) {
+        left -= iov->iov_len;
+        iov++;
+        iovcnt--;
+      }
+      if (iovcnt > 0) {
+        iov->iov_base = static_cast<char*>(iov->iov_base) + left;
+        iov->iov_len -= left;
+      }
+    }
+
+    return true;
+  }
+
+  /*
+   * Add a record to the sink buffer. A record that does not fit goes out
+   * together with what is buffered in a single writev. Datagrams are not
+   * buffered, a batch would soon be larger than a datagram can be.
+   */
+  void fd_append(const char *data, std::size_t len, bool newline) {
+    fd_sink *sink = fdsink;
+
+#if LOGE_URING
+    if (sink->uring) {
+      fd_copy(data, len);
+      if (newline) {
+        fd_copy("\n", 1);
+      }
+      return;
+    }
+#endif
+
+    if (sink->datagram || sink->len + len + newline > sink->cap) {
+      char nl = '\n';
+      struct iovec iov[3];
+      int iovcnt = 0;
+
+      if (sink->len) {
+        iov[iovcnt].iov_base = sink->buf;
+        iov[iovcnt++].iov_len = sink->len;
+      }
+      iov[iovcnt].iov_base = const_cast<char*>(data);
+      iov[iovcnt++].iov_len = len;
+      if (newline) {
+        iov[iovcnt].iov_base = &nl;
+        iov[iovcnt++].iov_len = 1;
+      }
+
+      fd_writev(sink->fd, iov, iovcnt);
+      sink->len = 0;
+      return;
+    }
+
+    memcpy(sink->buf + sink->len, data, len);
+    sink->len += len;
+    if (newline) {
+      sink->buf[sink->len++] = '\n';
+    }
+  }
+
+  /* Write the buffer and the batch of the backend thread with one writev */
+  void fd_drain() {
+    std::size_t held = async ? async->held : 0;
+
+#if LOGE_URING
+    if (fdsink->uring) {
+      fd_submit();
+      return;
+    }
+#endif
+
+    if (!held) {
+      if (fdsink->len) {
+        struct iovec iov;
+        iov.iov_base = fdsink->buf;
+        iov.iov_len = fdsink->len;
+
+        fd_writev(fdsink->fd, &iov, 1);
+        fdsink->len = 0;
+      }
+      return;
+    }
+
+    struct iovec *iov = async->iov.data() + 1;
+    int iovcnt = static_cast<int>(async->iovcnt);
+
+    if (fdsink->len) {
+      iov--;
+      iov->iov_base = fdsink->buf;
+      iov->iov_len = fdsink->len;
+      iovcnt++;
+    }
+
+    if (iovcnt) {
+      fd_writev(fdsink->fd, iov, iovcnt);
+    }
+    fdsink->len = 0;
+
+    async_release();
+  }
+
+  /*
+   * Write out the sink and take over fd, or go back to no sink for -1. A
+   * memory mapped file and the socket sinks are closed either way.
+   */
+  void set_fd_sink(int fd) {
+    if (tcp) {
+      loge_tcp_close(tcp);
+      delete tcp;
+      tcp = nullptr;
+    }
+
+    if (udp) {
+      loge_udp_close(udp);
+      delete udp;
+      udp = nullptr;
+    }
+
+    if (journal) {
+      loge_journal_close(journal);
+      delete journal;
+      journal = nullptr;
+    }
+
+    if (mapfile) {
+      loge_mmap_flush(mapfile, flush_policy.sync);
+      loge_mmap_close(mapfile);
+      delete mapfile;
+      mapfile = nullptr;
+    }
+
+    if (fdsink) {
+      fd_drain();
+#if LOGE_URING
+      delete fdsink->uring;
+#endif
+      close(fdsink->fd);
+      delete fdsink;
+      fdsink = nullptr;
+    }
+
+    if (rotate) {
+      loge_rotate_close(rotate);
+      delete rotate;
+      rotate = nullptr;
+    }
+
+    if (fd > -1) {
+      fdsink = new fd_sink(fd);
+    }
+  }
+
+  /* Wait until the kernel is done with everything written so far */
+  void fd_wait() {
+#if LOGE_URING
+    if (fdsink && fdsink->uring) {
+      fdsink->uring->wait_all();
+    }
+#endif
+  }
+
+#if LOGE_URING
+
+  /* Fill io_uring buffers instead of mem, false if io_uring is unusable */
+  bool fd_sink_uring(long long offset) {
+    loge_uring *uring = new loge_uring();
+    if (!uring->open(fdsink->fd, constants::FD_BUFFER_SIZE, offset)) {
+      delete uring;
+      return false;
+    }
+
+    fdsink->uring = uring;
+    fdsink->buf = uring->buffer();
+    fdsink->cap = uring->capacity();
+
+    return true;
+  }
+
+  void fd_submit() {
+    fdsink->uring->submit(fdsink->len);
+    fdsink->buf = fdsink->uring->buffer();
+    fdsink->len = 0;
+  }
+
+  /* Full buffers go to the kernel, the copy goes on in the next one */
+  void fd_copy(const char *data, std::size_t len) {
+    while (len) {
+      std::size_t n = std::min(len, fdsink->cap - fdsink->len);
+      memcpy(fdsink->buf + fdsink->len, data, n);
+      fdsink->len += n;
+      data += n;
+      len -= n;
+
+      if (fdsink->len == fdsink->cap) {
+        fd_submit();
+      }
+    }
+  }
+
+#endif /* LOGE_URING */
+
+/* glibc and BSD libc only */
+#if defined(__GLIBC__) || defined(__FreeBSD__) || defined(__OpenBSD__)
+
+  void logfn_syslog() {
+    /* Record may not be null-terminated */
+    syslog(syslog_priority, "%.*s\n", static_cast<int>(outlen), outptr);
+  }
+
+#endif
+
+  /* Records of level 0 only count towards the flush limits */
+  void write_record(const char *data, std::size_t len, int level = 0) {
+    if (rotate) {
+      if (loge_rotate_due(rotate, len + 1)) {
+        rotate_file();
+      }
+      rotate->size += len + 1;
+    }
+
+    outptr = data;
+    outlen = len;
+    outlevel = level;
+    (this->*logfnptr)();
+
+    if (loge_flush_due(&flush_policy, &flush_state, level, len + 1)) {
+      output_flush();
+    }
+  }
+
+  /* Flush and sync the file, then carry on in a new one */
+  void rotate_file() {
+    output_flush();
+
+    int fd = loge_rotate_next(rotate);
+    if (fd > -1) {
+      close(fdsink->fd);
+      fdsink->fd = fd;
+    }
+  }
+
+  void output_flush() {
+    if (mapfile) {
+      loge_mmap_flush(mapfile, flush_policy.sync);
+    } else if (tcp) {
+      loge_tcp_flush(tcp);
+    } else if (udp) {
+      loge_udp_flush(udp);
+    } else if (fdsink) {
+      fd_drain();
+      if (flush_policy.sync) {
+#if LOGE_URING
+        if (fdsink->uring) {
+          fdsink->uring->fsync();
+        } else
+#endif
+        loge_fdatasync(fdsink->fd);
+      }
+    } else if (p_os) {
+      p_os->flush();
+      if (flush_policy.sync) {
+        loge_fdatasync(open_sync_fd());
+      }
+    }
+
+    loge_flush_done(&flush_state);
+  }
+
+  static
+  int open_file(const std::string &filepath, bool append) {
+#if defined(_WIN64)
+    int fd = _open(filepath.c_str(),
+        _O_WRONLY | _O_CREAT | _O_BINARY | (append ? _O_APPEND : _O_TRUNC),
+        _S_IREAD | _S_IWRITE);
+#else
+    int fd = open(filepath.c_str(),
+        O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC),
+        S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+#endif
+    if (fd < 0) {
+      lgperror("open failed");
+    }
+    return fd;
+  }
+
+  /* The stream does not expose its descriptor, open the file once more */
+  int open_sync_fd() {
+    if (sync_fd < 0 && !sync_path.empty()) {
+#if defined(_WIN64)
+      sync_fd = _open(sync_path.c_str(), _O_WRONLY);
+#else
+      sync_fd = open(sync_path.c_str(), O_WRONLY);
+#endif
+      if (sync_fd < 0) {
+        lgperror("open failed");
+        sync_path.clear();
+      }
+    }
+    return sync_fd;
+  }
+
+  /*
+   * Sync through fd, owned by the stream, or through the file at path once
+   * a policy syncs. Closes a descriptor opened from the previous path.
+   */
+  void set_sync_fd(int fd, const char *path = nullptr) {
+    if (sync_fd > -1 && !sync_path.empty()) {
+      close(sync_fd);
+    }
+    sync_fd = fd;
+    sync_path = path ? path : "";
+  }
+
+  /*
+   * Let recordfn() see a formatted record, then write it and hand it to the
+   * sinks. Records below level were only formatted for the sinks. The
+   * journal sink takes the message without the prefix.
+   */
+  void dispatch(const record_header &hdr, const char *data, std::size_t len,
+      std::size_t prefixlen) {
+
+    if (!accept(hdr, data, len, prefixlen)) {
+      return;
+    }
+
+    int loglevel = LOGE_LOGLEVEL(hdr.logtype);
+
+    if (loglevel >= current_level()) {
+      if (journal) {
+        loge_journal_write(journal, c_level(loglevel), hdr.filename,
+            hdr.linenumber, data + prefixlen, len - prefixlen);
+      } else {
+        write_record(data, len, loglevel);
+      }
+    } else if (records(loglevel)) {
+      record_copy(data, len, loglevel);
+    }
+
+    if (!sinks.empty()) {
+      fan_out(hdr, data, len, prefixlen);
+    }
+  }
+
+  static
+  record make_record(const record_header &hdr, const char *data,
+      std::size_t len, std::size_t prefixlen) {
+
+    return {
+      hdr.t,
+      LOGE_LOGLEVEL(hdr.logtype),
+      LOGE_ENCOLOR(hdr.logtype) != 0,
+      loge_string_view(hdr.filename),
+      static_cast<unsigned int>(hdr.linenumber),
+      loge_string_view(hdr.fmt),
+      loge_string_view(data, len),
+      loge_string_view(data + prefixlen, len - prefixlen),
+      hdr.site
+    };
+  }
+
+  /* Ask recordfn() about a formatted record */
+  bool accept(const record_header &hdr, const char *data, std::size_t len,
+      std::size_t prefixlen) {
+
+    if (has_recordfn.load()) {
+      return recordfn(make_record(hdr, data, len, prefixlen));
+    }
+
+    return true;
+  }
+
+  /*
+   * Hand a formatted record to the sinks that take its level. Sinks with
+   * the same encoder as the one before reuse its output.
+   */
+  void fan_out(const record_header &hdr, const char *data, std::size_t len,
+      std::size_t prefixlen) {
+
+    int loglevel = LOGE_LOGLEVEL(hdr.logtype);
+    if (loglevel < sinks_level) {
+      return;
+    }
+
+    std::array<char, buffer_capacity> &scratch = encode_buffer();
+    encoder_fn encoded = nullptr;
+    std::size_t encodedlen = 0;
+
+    for (const fanout_sink &sink : sinks) {
+      if (loglevel < sink.level) {
+        continue;
+      }
+
+      if (!sink.encoder) {
+        sink.deliver(sink.sink, data, len, loglevel);
+        continue;
+      }
+
+      if (sink.encoder != encoded) {
+        encodedlen = sink.encoder(make_record(hdr, data, len, prefixlen),
+            scratch.data(), scratch.size());
+        if (encodedlen > scratch.size()) {
+          encodedlen = scratch.size();
+        }
+        encoded = sink.encoder;
+      }
+
+      sink.deliver(sink.sink, scratch.data(), encodedlen, loglevel);
+    }
+  }
+
+  /* Take a record formatted by a logger this one is a sink of */
+  void deliver(const char *data, std::size_t len, int loglevel) {
+    if (binary) {
+      return;
+    }
+
+    if (loglevel < current_level()) {
+      if (records(loglevel)) {
+        record_copy(data, len, loglevel);
+      }
+      return;
+    }
+
+    if (loglevel >= loge_atomic_load_int(&recorder.dump_level)) {
+      dump_recorder();
+    }
+
+    emit(data, len, loglevel);
+  }
+
+  template <typename Sink>
+  static
+  void deliver_to(void *sink, const char *data, std::size_t len,
+      int loglevel) {
+
+    static_cast<Sink*>(sink)->deliver(data, len, loglevel);
+  }
+
+  bool call_datafn(const record_header &hdr) {
+    if (!has_datafn.load()) {
+      return true;
+    }
+
+    std::time_t t = hdr.t;
+
+    return datafn(p_os, t, hdr.filename, hdr.linenumber,
+        LOGE_LOGLEVEL(hdr.logtype), hdr.fmt);
+  }
+
+  /* Messages below level that go to the flight recorder, not binary ones */
+  bool records(int loglevel) const {
+    return !binary && loglevel >= loge_atomic_load_int(&recorder.level);
+  }
+
+  /* Messages some sink takes, binary records are not handed to sinks */
+  bool fans_out(int loglevel) const {
+    return !binary && loglevel >= sinks_level;
+  }
+
+  /* Messages formatted at all, for the output, the recorder or a sink */
+  bool kept(int loglevel) const {
+    return loglevel >= current_level() || records(loglevel) ||
+      fans_out(loglevel);
+  }
+
+  /* Copy an already formatted record into the flight recorder */
+  void record_copy(const char *data, std::size_t len, int loglevel) {
+    std::size_t cap;
+
+    char *dst = loge_recorder_claim(&recorder, &cap);
+    if (!dst) {
+      return;
+    }
+    if (len > cap) {
+      len = cap;
+    }
+    memcpy(dst, data, len);
+    loge_recorder_commit(&recorder, dst, len, loglevel);
+  }
+
+  static
+  void recorder_emit(void *ctx, const char *data, std::size_t len,
+      int level UNUSED) {
+
+    static_cast<loge<timestamp, buffer_size, min_level>*>(ctx)->emit(data,
+        len);
+  }
+
+  /* Write out an already built record the way flush() does */
+  void emit(const char *data, std::size_t len, int loglevel = 0) {
+    if (async) {
+      async_push(data, len, loglevel);
+    } else if (sinklock) {
+      std::lock_guard<std::mutex> lock(*sinklock);
+      write_record(data, len, loglevel);
+    } else {
+      write_record(data, len, loglevel);
+    }
+  }
+
+  /* Per thread scratch buffer for loggers shared between threads */
+  static
+  std::array<char, buffer_capacity>& tls_buffer() {
+    static thread_local std::array<char, buffer_capacity> scratch;
+    return scratch;
+  }
+
+  /* Per thread buffer for sink encoders, the record may be in tls_buffer() */
+  static
+  std::array<char, buffer_capacity>& encode_buffer() {
+    static thread_local std::array<char, buffer_capacity> scratch;
+    return scratch;
+  }
+
+  /*
+   * Claim a ring slot. When the ring is full either wait for the backend
+   * thread to make room or count the record as dropped.
+   */
+  typename async_ring::slot* async_claim(std::size_t &pos) {
+    for (;;) {
+      typename async_ring::slot *s = async->ring.claim(pos);
+      if (s) {
+        return s;
+      }
+
+      if (!async->block_when_full) {
+        async->dropped.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+      }
+
+      std::this_thread::yield();
+    }
+  }
+
+  void async_publish(typename async_ring::slot *s, std::size_t pos) {
+    async->ring.publish(s, pos);
+
+    /* Pairs with the fence in async_worker(), no lost wakeups */
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (async->sleeping.load(std::memory_order_relaxed)) {
+      std::lock_guard<std::mutex> lock(async->mutex);
+      async->cv.notify_one();
+    }
+  }
+
+  /*
+   * Have the backend thread flush the output and wait for it. A flush slot
+   * with a length carries the flush policy to use from then on, the backend
+   * is the only thread reading it while it runs.
+   */
+  void async_flush(const loge_flush_policy *policy) {
+    std::size_t pos;
+    typename async_ring::slot *s = async->ring.claim(pos);
+    while (!s) {
+      std::this_thread::yield();
+      s = async->ring.claim(pos);
+    }
+
+    s->len = policy ? sizeof(*policy) : 0;
+    if (policy) {
+      memcpy(s->data.data(), policy, sizeof(*policy));
+    }
+    s->deferred = false;
+    s->raw = false;
+    s->flush = true;
+
+    async_publish(s, pos);
+    async_wait();
+  }
+
+  /* Records of level 0 only count towards the flush limits */
+  void async_push(const char *data, std::size_t len, int loglevel = 0) {
+    std::size_t pos;
+    typename async_ring::slot *s = async_claim(pos);
+    if (!s) {
+      return;
+    }
+
+    if (len > s->data.size()) {
+      len = s->data.size();
+    }
+    memcpy(s->data.data(), data, len);
+    s->len = len;
+    s->deferred = false;
+    s->raw = true;
+    s->flush = false;
+    s->hdr.logtype = loglevel;
+
+    async_publish(s, pos);
+  }
+
+  /*
+   * Formatted and raw records going to a descriptor sink through the
+   * default log functions are written from their slots. Text records need
+   * room for the line break in the slot.
+   */
+  bool async_batchable(const typename async_ring::slot *s) const {
+    if (!fdsink || fdsink->datagram || s->deferred || s->flush) {
+      return false;
+    }
+
+#if LOGE_URING
+    /* Records are copied into the registered buffers */
+    if (fdsink->uring) {
+      return false;
+    }
+#endif
+
+    if (logfnptr == &loge<timestamp, buffer_size, min_level>::logfn_binary) {
+      return true;
+    }
+
+    return logfnptr ==
+      &loge<timestamp, buffer_size, min_level>::logfn_internal &&
+      s->len < s->data.size();
+  }
+
+  /* Add a record to the batch, the slot is released once it is written */
+  void async_hold(typename async_ring::slot *s) {
+    bool write = true;
+    int loglevel = s->hdr.logtype;
+
+    if (!s->raw) {
+      loglevel = LOGE_LOGLEVEL(s->hdr.logtype);
+      write = accept(s->hdr, s->data.data(), s->len, s->prefixlen);
+
+      if (write && !sinks.empty()) {
+        fan_out(s->hdr, s->data.data(), s->len, s->prefixlen);
+      }
+
+      /* Formatted only for the sinks or the flight recorder */
+      if (write && loglevel < current_level()) {
+        if (records(loglevel)) {
+          record_copy(s->data.data(), s->len, loglevel);
+        }
+        write = false;
+      }
+    }
+
+    /* The batch goes to the old file, before this slot joins it */
+    if (write && rotate) {
+      if (loge_rotate_due(rotate, s->len + 1)) {
+        rotate_file();
+      }
+      rotate->size += s->len + 1;
+    }
+
+    async->held++;
+
+    if (write) {
+      std::size_t len = s->len;
+      if (logfnptr != &loge<timestamp, buffer_size, min_level>::logfn_binary) {
+        s->data[len++] = '\n';
+      }
+
+      struct iovec &iov = async->iov[++async->iovcnt];
+      iov.iov_base = s->data.data();
+      iov.iov_len = len;
+
+      if (loge_flush_due(&flush_policy, &flush_state, loglevel,
+            s->len + 1)) {
+        output_flush();
+        return;
+      }
+    }
+
+    if (async->held == async->max_held) {
+      fd_drain();
+    }
+  }
+
+  void async_release() {
+    for (std::size_t i = 0; i < async->held; i++) {
+      async->ring.pop();
+    }
+    async->held = 0;
+    async->iovcnt = 0;
+  }
+
+  /* Copy the batch to the sink buffer to give the slots back */
+  void async_spill() {
+    for (std::size_t i = 1; i <= async->iovcnt; i++) {
+      fd_append(static_cast<const char*>(async->iov[i].iov_base),
+          async->iov[i].iov_len, false);
+    }
+    async_release();
+  }
+
+  /* Backend thread, sole consumer of the ring */
+  void async_worker() {
+    unsigned int idle = 0;
+
+    for (;;) {
+      typename async_ring::slot *s = async->ring.peek(async->held);
+      if (s && async_batchable(s)) {
+        async_hold(s);
+        idle = 0;
+        continue;
+      }
+
+      if (s) {
+        if (async->held) {
+          async_spill();
+        }
+
+        if (s->deferred) {
+          std::size_t prefixlen;
+          std::size_t len = render_deferred(s->hdr, s->data.data(), s->len,
+              async->render.data(), async->render.size(), prefixlen);
+          dispatch(s->hdr, async->render.data(), len, prefixlen);
+        } else if (s->flush) {
+          output_flush();
+          fd_wait();
+          if (s->len == sizeof(flush_policy)) {
+            memcpy(&flush_policy, s->data.data(), sizeof(flush_policy));
+          }
+        } else if (s->raw) {
+          write_record(s->data.data(), s->len, s->hdr.logtype);
+        } else {
+          dispatch(s->hdr, s->data.data(), s->len, s->prefixlen);
+        }
+        async->ring.pop();
+        idle = 0;
+        continue;
+      }
+
+      /* Drain everything published before exiting */
+      if (!async->running.load(std::memory_order_acquire)) {
+        if (!async->ring.peek(async->held)) {
+          output_flush();
+          break;
+        }
+        continue;
+      }
+
+      if (++idle < constants::ASYNC_SPIN) {
+        std::this_thread::yield();
+        continue;
+      }
+
+      /* Do not keep slots from the producers while asleep */
+      if (async->held) {
+        async_spill();
+      }
+
+      std::unique_lock<std::mutex> lock(async->mutex);
+      async->sleeping.store(true, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+
+      if (!async->ring.front() &&
+          async->running.load(std::memory_order_acquire)) {
+        async->cv.wait_for(lock,
+            std::chrono::milliseconds(constants::ASYNC_IDLE_MS));
+      }
+
+      async->sleeping.store(false, std::memory_order_relaxed);
+      idle = 0;
+
+      /* Nothing new came in, do not hold a batch back past its interval */
+      lock.unlock();
+      if (loge_flush_overdue(&flush_policy, &flush_state)) {
+        output_flush();
+      }
+    }
+  }
+
+  /*
+   * Prefix of a record. With a call site descriptor everything after the
+   * timestamp is rendered once and then copied.
+   */
+  int format_prefix(char *dst, std::size_t cap, std::time_t t,
+      loge_site *site, int logtype, const char *filename, int linenumber) {
+
+    enum loge_level loglevel = LOGE_LOGLEVEL(logtype);
+    int en_color = LOGE_ENCOLOR(logtype);
+    int width = static_cast<int>(linenumwidth);
+
+    const char *loglvlstr = en_color ?
+      loglevel_strtbl_color[loglevel] :
+      loglevel_strtbl[loglevel];
+
+    const loge_site::prefix *pre = site ?
+      site->get_prefix(width, logtype) :
+      nullptr;
+
+    if (site && !pre &&
+        !site->cached_prefix.load(std::memory_order_relaxed)) {
+
+      char text[constants::PREFIX_CACHE_SIZE];
+      int len = loge_prefix(text, sizeof(text), false, t, width, en_color,
+          site->file, site->line, loglvlstr);
+
+      if (static_cast<std::size_t>(len) + 1 < sizeof(text)) {
+        pre = site->set_prefix(width, logtype, text, len);
+      }
+    }
+
+    if (pre) {
+      std::size_t len = (timestamp ? LOGE_TIMESTAMP_LEN + 2 : 0) + pre->len;
+
+      if (len < cap) {
+        char *p = dst;
+        if (timestamp) {
+          memcpy(p, loge_timestamp(t), LOGE_TIMESTAMP_LEN);
+          p += LOGE_TIMESTAMP_LEN;
+          *p++ = ':';
+          *p++ = ' ';
+        }
+        memcpy(p, pre->text, pre->len);
+
+        return static_cast<int>(len);
+      }
+    }
+
+    return loge_prefix(dst, cap, timestamp, t, width, en_color, filename,
+        linenumber, loglvlstr);
+  }
+
+  int vformat(char *dst, std::size_t cap, std::size_t &prefixlen,
+      std::time_t t, loge_site *site, int logtype, const char *filename,
+      int linenumber, const char *msg, std::va_list args) {
+
+    int len = format_prefix(dst, cap, t, site, logtype, filename,
+        linenumber);
+    prefixlen = len;
+
+    int done = vsnprintf(dst + len, cap - len, msg, args);
+    if (done > 0) {
+      len += done;
+    }
+
+    /* Truncated messages keep whatever fit in the buffer */
+    if (static_cast<std::size_t>(len) >= cap) {
+      len = cap - 1;
+    }
+
+    return len;
+  }
+
+  /*
+   * Hand a record to the output. format(dst, cap, prefixlen) renders it,
+   * returns its length and sets prefixlen to the length of the prefix. It
+   * runs straight into a ring slot for asynchronous loggers, into a thread
+   * local buffer for concurrent loggers and into buffer otherwise.
+   */
+  template <typename Formatter>
+  void submit(const record_header &hdr, Formatter &&format) {
+
+    int loglevel = LOGE_LOGLEVEL(hdr.logtype);
+
+    /* Below the logger level, formatted into the flight recorder */
+    if (loglevel < current_level() && records(loglevel) &&
+        !fans_out(loglevel)) {
+      std::size_t cap;
+      std::size_t prefixlen;
+
+      char *dst = loge_recorder_claim(&recorder, &cap);
+      if (dst) {
+        loge_recorder_commit(&recorder, dst, format(dst, cap, prefixlen),
+            loglevel);
+      }
+      return;
+    }
+
+    if (loglevel >= loge_atomic_load_int(&recorder.dump_level)) {
+      dump_recorder();
+    }
+
+    if (async) {
+      /* datafn() only sees raw data, so ask it before claiming a slot */
+      if (!call_datafn(hdr)) {
+        return;
+      }
+
+      /* Format straight into the ring slot, the backend does the I/O */
+      std::size_t pos;
+      typename async_ring::slot *s = async_claim(pos);
+      if (!s) {
+        return;
+      }
+
+      s->len = format(s->data.data(), s->data.size(), s->prefixlen);
+      s->deferred = false;
+      s->raw = false;
+      s->flush = false;
+      s->hdr = hdr;
+
+      async_publish(s, pos);
+      return;
+    }
+
+    std::size_t prefixlen;
+
+    if (sinklock) {
+      /* Format into a thread local buffer, serialize only the write */
+      std::array<char, buffer_capacity> &scratch = tls_buffer();
+
+      std::size_t len = format(scratch.data(), scratch.size(), prefixlen);
+
+      std::lock_guard<std::mutex> lock(*sinklock);
+      if (call_datafn(hdr)) {
+        dispatch(hdr, scratch.data(), len, prefixlen);
+      }
+      return;
+    }
+
+    buflen = format(buffer.data(), buffer.size(), prefixlen);
+
+    if (call_datafn(hdr)) {
+      dispatch(hdr, buffer.data(), buflen, prefixlen);
+    }
+  }
+
+  /*
+   * Id of a call site descriptor in the binary output. A site remembers
+   * which binary output described it last, the lock is only taken the
+   * first time it logs to an output. Its SITE record is written while
+   * holding the lock so that no EVENT record using the id can get ahead of
+   * it.
+   */
+  std::uint32_t binary_site(loge_site *site) {
+    if (site->binary_serial.load(std::memory_order_acquire) ==
+        binary->serial) {
+      return site->get_id();
+    }
+
+    std::lock_guard<std::mutex> lock(binary->lock);
+
+    if (site->binary_serial.load(std::memory_order_relaxed) ==
+        binary->serial) {
+      return site->get_id();
+    }
+
+    std::string rec = loge_binary::site(site->get_id(), site->line,
+        site->file, site->fmt, buffer_capacity);
+    emit(rec.data(), rec.size());
+
+    site->binary_serial.store(binary->serial, std::memory_order_release);
+
+    return site->get_id();
+  }
+
+  /*
+   * Binary counterpart of submit(). encode(p, end) captures the arguments
+   * after the EVENT header and returns where they end.
+   *
+   * Calls without a descriptor for their format string, whose format need
+   * not be a literal, have no id to refer to. Their message is rendered
+   * from the captured arguments and written as a TEXT record.
+   */
+  template <typename Encoder>
+  void submit_binary(std::time_t t, loge_site *site, const char *filename,
+      int linenumber, int logtype, const char *msg, Encoder &&encode) {
+
+    record_header hdr = { t, site, filename, msg, linenumber, logtype };
+
+    if (!site || site->fmt != msg) {
+      submit(hdr,
+          [&](char *dst, std::size_t cap, std::size_t &prefixlen)
+          -> std::size_t {
+            std::array<char, buffer_capacity> &args = encode_buffer();
+            char *end = encode(args.data(), args.data() + args.size());
+            if (!end) {
+              prefixlen = 0;
+              return 0;
+            }
+
+            char *p = loge_binary::start(dst, loge_binary::TEXT);
+            std::size_t room = cap - loge_binary::RECORD_HEADER_SIZE;
+            std::size_t len = format_prefix(p, room, t, nullptr, logtype,
+                filename, linenumber);
+            if (len < room) {
+              len += loge_args::render(p + len, room - len, msg,
+                  args.data(), end - args.data());
+            } else {
+              len = room - 1;
+            }
+
+            prefixlen = loge_binary::finish(dst, p + len);
+            return prefixlen;
+          });
+      return;
+    }
+
+    std::uint32_t id = binary_site(site);
+
+    /* The whole binary record is the prefix, message stays empty */
+    submit(hdr,
+        [&](char *dst, std::size_t cap, std::size_t &prefixlen)
+        -> std::size_t {
+          char *p = loge_binary::event(dst, dst + cap, t, id, logtype);
+          if (!p) {
+            prefixlen = 0;
+            return 0;
+          }
+          prefixlen = loge_binary::finish(dst, encode(p, dst + cap));
+          return prefixlen;
+        });
+  }
+
+  /* Shared by both log() overloads, site may be nullptr */
+  void vlog(loge_site *site, int logtype, int linenumber,
+      const char *filename, const char *msg, std::va_list args) {
+
+    enum loge_level loglevel = LOGE_LOGLEVEL(logtype);
+
+    if (loglevel >= loge_level::MAX ||
+        loglevel < min_level ||
+        !kept(loglevel)) {
+      return;
+    }
+
+    /* Filtered messages never touch the clock */
+    std::time_t t = std::time(NULL);
+
+    if (binary) {
+      submit_binary(t, site, filename, linenumber, logtype, msg,
+          [&](char *p, char *end) -> char* {
+            return loge_args::vencode(p, end, msg, args);
+          });
+      return;
+    }
+
+    record_header hdr = { t, site, filename, msg, linenumber, logtype };
+
+    submit(hdr,
+        [&](char *dst, std::size_t cap, std::size_t &prefixlen)
+        -> std::size_t {
+          return vformat(dst, cap, prefixlen, t, site, logtype, filename,
+              linenumber, msg, args);
+        });
+  }
+
+#if __cplusplus >= 202002L
+
+  template <loge_literal fmt, typename... Args>
+  void log_fmt(loge_site *site, int logtype, int linenumber,
+      const char *filename, const Args &...args) {
+
+    using format = loge_format<fmt>;
+
+    static_assert(format::arg_count() == sizeof...(Args),
+        "loge: number of arguments does not match the format string");
+    static_assert(format::template check<Args...>(),
+        "loge: argument type does not match its conversion");
+
+    enum loge_level loglevel = LOGE_LOGLEVEL(logtype);
+
+    if (loglevel >= loge_level::MAX ||
+        loglevel < min_level ||
+        !kept(loglevel)) {
+      return;
+    }
+
+    std::time_t t = std::time(NULL);
+
+    /*
+     * fmt.str is a copy of the literal, the descriptor LOGE_FMT() makes for
+     * the call holds the literal itself
+     */
+    if (binary) {
+      submit_binary(t, site, filename, linenumber, logtype,
+          site && site->fmt ? site->fmt : fmt.str,
+          [&](char *p, char *end) -> char* {
+            return loge_args::encode(p, end, args...);
+          });
+      return;
+    }
+
+    record_header hdr = { t, site, filename, fmt.str, linenumber, logtype };
+
+    submit(hdr,
+        [&](char *dst, std::size_t cap, std::size_t &prefixlen)
+        -> std::size_t {
+          std::size_t len = format_prefix(dst, cap, t, site, logtype,
+              filename, linenumber);
+          prefixlen = len;
+          loge_writer::write<fmt>(dst, cap, len, args...);
+          return len;
+        });
+  }
+
+#endif /* __cplusplus >= 202002L */
+
+  template <typename... Args>
+  void defer(loge_site *site, int logtype, int linenumber,
+      const char *filename, const char *msg, const Args &...args) {
+
+    if (!async && !binary) {
+      log_formatted(site, logtype, linenumber, filename, msg,
+          loge_args::printf_arg(loge_args::printf_hold(args))...);
+      return;
+    }
+
+    enum loge_level loglevel = LOGE_LOGLEVEL(logtype);
+
+    if (loglevel >= loge_level::MAX ||
+        loglevel < min_level) {
+      return;
+    }
+
+    /* Recorded right away, there is no I/O to leave to the backend */
+    if (loglevel < current_level() && !fans_out(loglevel)) {
+      if (records(loglevel)) {
+        log_formatted(site, logtype, linenumber, filename, msg,
+            loge_args::printf_arg(loge_args::printf_hold(args))...);
+      }
+      return;
+    }
+
+    std::time_t t = std::time(NULL);
+
+    if (binary) {
+      submit_binary(t, site, filename, linenumber, logtype, msg,
+          [&](char *p, char *end) -> char* {
+            return loge_args::encode(p, end, args...);
+          });
+      return;
+    }
+
+    record_header hdr = { t, site, filename, msg, linenumber, logtype };
+
+    if (!call_datafn(hdr)) {
+      return;
+    }
+
+    if (loglevel >= loge_atomic_load_int(&recorder.dump_level)) {
+      dump_recorder();
+    }
+
+    std::size_t pos;
+    typename async_ring::slot *s = async_claim(pos);
+    if (!s) {
+      return;
+    }
+
+    char *begin = s->data.data();
+    char *end = loge_args::encode(begin, begin + s->data.size(), args...);
+
+    s->len = end - begin;
+    s->deferred = true;
+    s->raw = false;
+    s->flush = false;
+    s->hdr = hdr;
+
+    async_publish(s, pos);
+  }
+
+  /* Variadic front end of vlog() for defer() */
+  void log_formatted(loge_site *site, int logtype, int linenumber,
+      const char *filename, const char *msg, ...) {
+
+    std::va_list args;
+    va_start(args, msg);
+    vlog(site, logtype, linenumber, filename, msg, args);
+    va_end(args);
+  }
+
+  /* Returns the record length, prefixlen is set to the prefix length */
+  std::size_t render_deferred(const record_header &hdr, const char *args,
+      std::size_t argslen, char *dst, std::size_t cap,
+      std::size_t &prefixlen) {
+
+    prefixlen = format_prefix(dst, cap, hdr.t, hdr.site, hdr.logtype,
+        hdr.filename, hdr.linenumber);
+
+    return prefixlen + loge_args::render(dst + prefixlen, cap - prefixlen,
+        hdr.fmt, args, argslen);
+  }
+
+  virtual
+  void logfn() {
+    logfn_internal();
+  }
+
+  protected:
+
+  /*
+   * Called with the unformatted data of every record, before it is
+   * formatted. Building the std::string arguments costs two allocations per
+   * record, recordfn() is the cheaper choice. Loggers that override
+   * neither can skip the cost with use_datafn(false).
+   */
+  virtual
+  bool datafn(std::ostream * p_os UNUSED, std::time_t & time UNUSED,
+      const std::string & filename UNUSED, unsigned int linenum UNUSED,
+      enum loge_level loglevel UNUSED, const std::string & msg UNUSED) {
+
+    return true;
+  }
+
+  /**
+   * @brief Called with every formatted record before it is written, on the
+   * backend thread for asynchronous loggers. Nothing is allocated or copied
+   * for the call. Not called for messages built with the insertion
+   * operators. Only called once enabled with use_recordfn().
+   * @return true to write the record, false to drop it
+   */
+  virtual
+  bool recordfn(const record &rec UNUSED) {
+    return true;
+  }
+
+  private:
+
+  /* Kind of this instantiation in the registry, see find() */
+  static const char* kind() {
+    static const std::string name = "loge<" + std::to_string(timestamp) +
+      "," + std::to_string(buffer_size) + "," + std::to_string(min_level) +
+      ">";
+    return name.c_str();
+  }
+
+  /* Summary line of a rate limited call site, see loge_ratelimit_expire() */
+  static void ratelimit_summary(void *logger, int logtype, const char *file,
+      int line, unsigned long long suppressed) {
+
+    static_cast<loge<timestamp, buffer_size, min_level>*>(logger)->summary(
+        logtype, line, file, "suppressed %llu similar messages", suppressed);
+  }
 
-  } else if (ploge->plogfn) {
-    ploge->plogfn(ploge);
+  /* log() without sampling */
+  void summary(int logtype, int linenumber, const char *filename,
+      const char *msg, ...) {
 
-  } else {
-    lgerror("log callback not set for logger %p", ploge);
+    std::va_list args;
+    va_start(args, msg);
+    vlog(nullptr, logtype, linenumber, filename, msg, args);
+    va_end(args);
   }
-}
 
-UNUSED
-static
-size_t loge_put_char(struct loge *ploge, char c) {
-  if (!ploge) {
-    return 0;
+  static int registry_level(void *logger, int level_) {
+    auto *self = static_cast<loge<timestamp, buffer_size, min_level>*>(logger);
+    int prev = c_level(self->current_level());
+
+    if (level_ > -1) {
+      loge_atomic_store_int(&self->level, c_level(level_));
+    }
+
+    return prev;
   }
 
-  if (ploge->buflen < ploge->bufcap) {
-    ploge->bufptr[ploge->buflen++] = c;
+  public:
+
+  loge(enum loge_level loglevel = loge_level::ERROR)
+    : loge(nullptr, -1, -1, -1, loglevel) {
   }
 
-  return sizeof(c);
-}
+  loge(std::ostream &os_, enum loge_level loglevel = loge_level::ERROR)
+    : loge(loglevel) {
 
-UNUSED
-static
-size_t loge_put_str(struct loge *ploge, const char *pstr) {
-  if (!ploge || !pstr) {
-    return 0;
+    set_ostream(&os_);
   }
 
-  size_t ncopy = strlen(pstr);
-  size_t maxcopy = ploge->bufcap - ploge->buflen - 1;
+  loge(std::ofstream &ofs_, enum loge_level loglevel = loge_level::ERROR)
+    : loge(loglevel) {
 
-  if (ncopy > maxcopy) {
-    ncopy = maxcopy;
+    set_ostream(&ofs_);
   }
 
-  memcpy(ploge->bufptr + ploge->buflen, pstr, ncopy);
+  loge(
+      std::ostream *p_os_,
+      int linenumwidth_ = -1,
+      int width_ = -1,
+      int precision_ = -1,
+      enum loge_level level_ = loge_level::INFO
+    ) : level(loge_level::INFO), width(width_), precision(precision_) {
 
-  ploge->buflen += ncopy;
+    if (linenumwidth_ > -1) {
+      linenumwidth = linenumwidth_;
+    }
 
-  /* Keep buffer null terminated */
-  ploge->bufptr[ploge->buflen] = '\0';
+    if (level_ < loge_level::MAX) {
+      level = level_;
+    }
 
-  return ncopy;
-}
+    set_stdout();
 
-UNUSED
-static
-size_t loge_put_int(struct loge *ploge, int n) {
-  if (!ploge) {
-    return 0;
+    if (p_os_) {
+      p_os = p_os_;
+    }
   }
 
-  int len = 0;
-  if (ploge->width > -1) {
-    len = snprintf(ploge->bufptr + ploge->buflen,
-        ploge->bufcap - ploge->buflen,
-        "%0*d", ploge->width, n);
+  virtual
+  ~loge() {
+    unregister();
 
-  } else {
-    len = snprintf(ploge->bufptr + ploge->buflen,
-        ploge->bufcap - ploge->buflen, "%d", n);
-  }
+    /* Everything still held back by rate limited call sites */
+    loge_ratelimit_expire(this, 1, &loge<timestamp, buffer_size,
+        min_level>::ratelimit_summary);
+    loge_ratelimit_forget(this);
 
-  ploge->buflen += len;
+    disable_async();
+    set_concurrent(false);
+    disable_recorder();
 
-  /* Keep buffer null terminated */
-  ploge->bufptr[ploge->buflen] = '\0';
+#if defined(__GLIBC__) || defined(__FreeBSD__) || defined(__OpenBSD__)
+    if (syslog_priority > -1) {
+      closelog();
+    }
+#endif
 
-  return len;
-}
+    unset_file();
+    set_sync_fd(-1);
+    set_fd_sink(-1);
 
-UNUSED
-static
-size_t loge_put_uint(struct loge *ploge, unsigned int n) {
-  if (!ploge) {
-    return 0;
+    delete binary;
   }
 
-  int len = 0;
-  if (ploge->width > -1) {
-    len = snprintf(ploge->bufptr + ploge->buflen,
-        ploge->bufcap - ploge->buflen,
-        "%0*u", ploge->width, n);
+  const char* get_level(enum loge_level level) {
+    return level > loge<>::ALL && level < loge<>::MAX ?
+      loglevel_strtbl[level] :
+      NULL;
+  }
+  
+  const char* get_level_color(enum loge_level level) {
+    return level > loge<>::ALL && level < loge<>::MAX ?
+      loglevel_strtbl_color[level] :
+      NULL;
+  }
 
-  } else {
-    len = snprintf(ploge->bufptr + ploge->buflen,
-        ploge->bufcap - ploge->buflen, "%u", n);
+  /*
+   * Safe while other threads log, they see the new level on their next call.
+   * A registered logger under a level rule goes back to this level once the
+   * rule is removed.
+   */
+  void set_level(enum loge_level level_) {
+    if (!loge_registry_set_level(this, c_level(level_))) {
+      loge_atomic_store_int(&level, level_);
+    }
   }
 
-  ploge->buflen += len;
+  enum loge_level current_level() const {
+    return static_cast<enum loge_level>(loge_atomic_load_int(&level));
+  }
 
-  /* Keep buffer null terminated */
-  ploge->bufptr[ploge->buflen] = '\0';
+  /*
+   * The C levels, used by the registry and the level rules, have DEBUG
+   * before INFO. Maps a level either way.
+   */
+  static constexpr int c_level(int level_) {
+    return level_ == INFO ? DEBUG : level_ == DEBUG ? INFO : level_;
+  }
 
-  return len;
-}
+  /**
+   * @brief Keep one in rate messages of a level, decided by the logging
+   * macros before any argument is evaluated and by log() for direct calls.
+   * The decision is random unless the thread has a sampling key, see
+   * loge_sample_key(). Safe to call while other threads log.
+   * @param level_ Level to sample
+   * @param rate Keep one message in rate, 0 or 1 to keep all
+   */
+  void set_sample_rate(enum loge_level level_, std::uint64_t rate) {
+    if (level_ < loge_level::MAX) {
+      loge_atomic_store(&sample_rates[level_], rate);
+    }
+  }
 
-UNUSED
-static
-size_t loge_put_long(struct loge *ploge, long n) {
-  if (!ploge) {
-    return 0;
+  /* Rate a level is sampled at, 0 if every message is kept */
+  std::uint64_t sample_rate(enum loge_level level_) const {
+    return level_ < loge_level::MAX ?
+      loge_atomic_load(&sample_rates[level_]) : 0;
   }
 
-  int len = 0;
-  if (ploge->width > -1) {
-    len = snprintf(ploge->bufptr + ploge->buflen,
-        ploge->bufcap - ploge->buflen,
-        "%0*ld", ploge->width, n);
+  /**
+   * @brief Register the logger under a unique dot separated name. Its level
+   * follows the rule for the longest matching name from now on, "net" covers
+   * "net.http", and "*" covers every logger. The destructor unregisters it.
+   * @return false if the name is taken or too long
+   *
+   * @see loge_set_category_level(), loge_load_levels(), loge_watch_levels()
+   */
+  bool register_as(const char *name) {
+    return loge_registry_add(name, kind(), this,
+        &loge<timestamp, buffer_size, min_level>::registry_level) == 0;
+  }
 
-  } else {
-    len = snprintf(ploge->bufptr + ploge->buflen,
-        ploge->bufcap - ploge->buflen, "%ld", n);
+  void unregister() {
+    loge_registry_remove(this);
   }
 
-  ploge->buflen += len;
+  /**
+   * @brief Registered logger with the name, nullptr if there is none or it is
+   * a logger of another type. Nothing keeps it alive once found.
+   */
+  static loge<timestamp, buffer_size, min_level>* find(const char *name) {
+    return static_cast<loge<timestamp, buffer_size, min_level>*>(
+        loge_registry_find(name, kind()));
+  }
 
-  /* Keep buffer null terminated */
-  ploge->bufptr[ploge->buflen] = '\0';
+  /**
+   * @brief loge_set_category_level() taking the levels of this class
+   * @param level_ Level to set, -1 to remove the rule
+   */
+  static bool set_category_level(const char *name, int level_) {
+    return loge_set_category_level(name,
+        level_ > -1 ? c_level(level_) : -1) == 0;
+  }
 
-  return len;
-}
+  /* Identifies the logger to its rate limited call sites */
+  void* ratelimit_key() {
+    return this;
+  }
 
-UNUSED
-static
-size_t loge_put_ulong(struct loge *ploge, unsigned long n) {
-  if (!ploge) {
-    return 0;
+  /**
+   * @brief Check if a message of the given level would be logged. Used by the
+   * logging macros before any argument is evaluated. Levels below the
+   * min_level template parameter are rejected at compile time.
+   * @param logtype Log level, may be OR'd with LOGCOLOR
+   */
+  bool enabled(int logtype) const {
+    int loglevel = logtype & ~loge_level::LOGCOLOR;
+    return loglevel >= min_level && kept(loglevel);
   }
 
-  int len = 0;
-  if (ploge->width > -1) {
-    len = snprintf(ploge->bufptr + ploge->buflen,
-        ploge->bufcap - ploge->buflen,
-        "%0*lu", ploge->width, n);
+  /**
+   * @brief Decide whether a message of the given level survives sampling,
+   * see set_sample_rate(). Every call is a decision of its own, the logging
+   * macros make it once per message after enabled() and the log() calls
+   * without a loge_site make it themselves.
+   * @param logtype Log level, may be OR'd with LOGCOLOR
+   */
+  bool sampled(int logtype) const {
+    int loglevel = logtype & ~loge_level::LOGCOLOR;
+    return loglevel >= loge_level::MAX ||
+      loge_sample(loge_atomic_load(&sample_rates[loglevel]));
+  }
 
-  } else {
-    len = snprintf(ploge->bufptr + ploge->buflen,
-        ploge->bufcap - ploge->buflen, "%lu", n);
+  std::ostream* set_ostream(std::ostream *p_os_) {
+    std::ostream *prev = p_os;
+    if (p_os_) {
+      set_fd_sink(-1);
+      p_os = p_os_;
+    }
+    return prev;
   }
 
-  ploge->buflen += len;
+  std::ostream* set_ostream(std::ofstream *p_ofs_) {
+    std::ostream *prev = p_os;
+    if (p_ofs_) {
+      set_fd_sink(-1);
+      p_os = p_ofs_;
+    }
+    return prev;
+  }
 
-  /* Keep buffer null terminated */
-  ploge->bufptr[ploge->buflen] = '\0';
+  std::ostream* unset_ostream() {
+    set_fd_sink(-1);
 
-  return len;
-}
+    std::ostream *prev = p_os;
+    p_os = nullptr;
+    return prev;
+  }
 
-UNUSED
-static
-size_t loge_put_float(struct loge *ploge, float f) {
-  if (!ploge) {
-    return 0;
+  std::ostream* set_stdout() {
+    set_fd_sink(-1);
+
+    prevlogfnptr = logfnptr;
+    logfnptr = &loge<timestamp, buffer_size, min_level>::logfn_internal;
+
+    std::ostream *prev = p_os;
+    p_os = &std::cout;
+    return prev;
   }
 
-  int len = 0;
-  if (ploge->width > -1) {
-    len = snprintf(ploge->bufptr + ploge->buflen,
-        ploge->bufcap - ploge->buflen,
-        "%#0*.*f", ploge->width, ploge->precision, f);
+  std::ostream* set_stderr() {
+    set_fd_sink(-1);
 
-  } else {
-    len = snprintf(ploge->bufptr + ploge->buflen,
-        ploge->bufcap - ploge->buflen,
-        "%#f", f);
+    prevlogfnptr = logfnptr;
+    logfnptr = &loge<timestamp, buffer_size, min_level>::logfn_internal;
+
+    std::ostream *prev = p_os;
+    p_os = &std::cerr;
+    return prev;
   }
 
-  ploge->buflen += len;
+/* glibc and BSD libc only */
+#if defined(__GLIBC__) || defined(__FreeBSD__) || defined(__OpenBSD__)
 
-  /* Keep buffer null terminated */
-  ploge->bufptr[ploge->buflen] = '\0';
+  std::ostream* set_syslog(int priority) {
+    syslog_priority = priority;
 
-  return len;
-}
+    prevlogfnptr = logfnptr;
+    logfnptr = &loge<timestamp, buffer_size, min_level>::logfn_syslog;
 
-UNUSED
-static
-size_t loge_put_double(struct loge *ploge, double f) {
-  if (!ploge) {
-    return 0;
+    return unset_ostream();
   }
 
-  int len = 0;
-  if (ploge->width > -1) {
-    len = snprintf(ploge->bufptr + ploge->buflen,
-        ploge->bufcap - ploge->buflen,
-        "%0#*.*f", ploge->width, ploge->precision, f);
+#endif
 
-  } else {
-    len = snprintf(ploge->bufptr + ploge->buflen,
-        ploge->bufcap - ploge->buflen,
-        "%#f", f);
-  }
+/* libstdc++ */
+#if defined(__GLIBCXX__)
 
-  ploge->buflen += len;
+  /**
+   * @brief Log to a POSIX file descriptor. The descriptor is duplicated.
+   * Records are buffered by the logger and written with write(2), unless an
+   * ostream is asked for.
+   * @param fd File descriptor
+   * @param iostream Write through an ostream on top of the descriptor
+   * @return Previous output stream
+   */
+  std::ostream* set_fd(int fd, bool iostream = false) {
+    std::ostream *prev = p_os;
 
-  /* Keep buffer null terminated */
-  ploge->bufptr[ploge->buflen] = '\0';
+    if (fd < 0) {
+      return prev;
+    }
 
-  return len;
-}
+    int newfd = dup(fd);
+    if (newfd < 0) {
+      lgperror("dup failed");
+      return prev;
+    }
 
-UNUSED
-static
-size_t loge_put_time(struct loge *ploge, struct tm *ptm) {
-  if (!ploge || !ptm) {
-    return 0;
-  }
+    if (!iostream) {
+      set_fd_sink(newfd);
+      p_os = nullptr;
 
-  int len = snprintf(ploge->bufptr + ploge->buflen,
-      ploge->bufcap - ploge->buflen,
-      "%02d-%02d-%04d:%02d:%02d:%02d",
-      ptm->tm_mon + 1, ptm->tm_mday, ptm->tm_year + 1900,
-      ptm->tm_hour, ptm->tm_min, ptm->tm_sec
-    );
+      prevlogfnptr = logfnptr;
+      logfnptr = &loge<timestamp, buffer_size, min_level>::logfn_internal;
 
-  ploge->buflen += len;
+      return prev;
+    }
 
-  /* Keep buffer null terminated */
-  ploge->bufptr[ploge->buflen] = '\0';
+    using filebuf_type = __gnu_cxx::stdio_filebuf<char>;
+    filebuf_type *p_fb = new filebuf_type(newfd, std::ios::out);
 
-  return len;
-}
+    std::ostream *p_ofs = new std::ostream(p_fb);
+    if (!p_ofs) {
+      close(newfd);
+      return prev;
+    }
 
+    p_os = p_ofs;
+    set_sync_fd(newfd);
 
-#endif /* !__cplusplus */
+    prevlogfnptr = logfnptr;
+    logfnptr = &loge<timestamp, buffer_size, min_level>::logfn_internal;
 
-/******************************** C code ends *********************************/
+    return prev;
+  }
 
+  void unset_fd() {
+    if (!p_os && !fdsink && !mapfile && !tcp && !udp && !journal) {
+      return;
+    }
 
-#ifdef __cplusplus
+    output_flush();
+    set_sync_fd(-1);
+    set_fd_sink(-1);
 
-} /* extern "C" */
+    if (p_os && p_os != &std::cout && p_os != &std::cerr) {
+      delete p_os->rdbuf();
+      delete p_os;
+    }
+    p_os = nullptr;
 
-#endif
+    logfnptr = prevlogfnptr;
+  }
 
+#elif defined(_MSC_VER)
 
-/****************************** C++ code starts *******************************/
+  /* Always an ostream, descriptors may be sockets here */
+  std::ostream* set_fd(int fd, bool iostream UNUSED = false) {
+    std::ostream *prev = p_os;
 
-#ifdef __cplusplus
+    if (fd < 0) {
+      return prev;
+    }
 
-/* libstd++ */
-#if defined(__GLIBCXX__)
-#include <ext/stdio_filebuf.h>
-#endif
-#include <type_traits>
-#include <iostream>
-#include <fstream>
-#include <array>
-#include <cstring>
-#include <cstdarg>
-#include <ctime>
+    FILE *file = _fdopen(fd, "wb");
+    if (!file) {
+      lgperror("_fdopen failed");
+      return prev;
+    }
 
-#define LOGE(ploge, level, ...) \
-  do { \
-    if ((ploge) != nullptr) \
-      (ploge)->log( \
-          (level) & ~loge<>::loge_level::LOGCOLOR, \
-          __LINE__, \
-          __FILE__, \
-          __VA_ARGS__ \
-        ); \
-  } while (0)
+    std::ostream *p_ofs = new std::ofstream(file);
+    if (!p_ofs) {
+      return prev;
+    }
 
-#define LOGE_COLOR(ploge, level, ...) \
-  do { \
-    if ((ploge) != nullptr) \
-      (ploge)->log( \
-          (level) | loge<>::loge_level::LOGCOLOR, \
-          __LINE__, \
-          __FILE__, \
-          __VA_ARGS__ \
-        ); \
-  } while (0)
+    p_os = p_ofs;
 
-#define LOGE_LOGTYPE(encolor, level) \
-  static_cast<int>( ( (!!(encolor)) << loge::loge_level::LOGCOLORSHIFT ) | (level) )
+    prevlogfnptr = logfnptr;
+    logfnptr = &loge<timestamp, buffer_size, min_level>::logfn_internal;
 
-#define LOGE_ENCOLOR(type) \
-  static_cast<int>(!!(type & loge::loge_level::LOGCOLOR))
+    return prev;
+  }
 
-#define LOGE_LOGLEVEL(type) \
-  static_cast<enum loge_level>(type & ~loge::loge_level::LOGCOLOR)
+  void unset_fd() {
+    if (!p_os) {
+      return;
+    }
 
-template <
-  bool timestamp = true,
-  std::size_t buffer_size = 0
->
-class loge {
+    output_flush();
 
-  public:
+    if (p_os != &std::cout && p_os != &std::cerr) {
+      delete p_os;
+    }
+    p_os = nullptr;
 
-  enum constants {
-    LINENUMBER_WIDTH = 6,
-    NUMBER_WIDTH = 8,
-    BUFFER_SIZE = 1024,
-    LOGCOLORSHIFT = 31,
-  };
+    logfnptr = prevlogfnptr;
+  }
 
-  enum loge_level {
-    ALL = 0,
-    INFO,
-    DEBUG,
-    WARNING,
-    ERROR,
-    CRITICAL,
-    MAX,
-    LOGCOLOR = 1 << loge::constants::LOGCOLORSHIFT
-  };
+#endif /* defined(__GLIBCXX__) */
 
-  private:
+  /**
+   * @brief Log to a file, created if needed. Records are buffered by the
+   * logger and written with write(2), unless an ostream is asked for.
+   * @param filepath Path of the log file
+   * @param append Append to the file if true, truncate otherwise
+   * @param iostream Write through an std::ofstream
+   * @return Previous output stream
+   */
+  std::ostream* set_file(const std::string &filepath, bool append=true,
+      bool iostream=false) {
 
-  using width_type = struct _width_type {
-    int width;
+    std::ostream *prev = p_os;
 
-    _width_type() : width(-1) {
+    if (filepath.length() == 0) {
+      return prev;
     }
 
-    _width_type(int width_) : width(width_) {
-    }
+    if (!iostream) {
+      int fd = open_file(filepath, append);
+      if (fd < 0) {
+        return prev;
+      }
 
-    _width_type(const struct _width_type &other) {
-      this->width = other.width;
-    }
+      set_fd_sink(fd);
+      p_os = nullptr;
 
-    _width_type(struct _width_type &&other) {
-      this->width = other.width;
-    }
+      prevlogfnptr = logfnptr;
+      logfnptr = &loge<timestamp, buffer_size, min_level>::logfn_internal;
 
-    struct _width_type& operator=(const struct _width_type &other) {
-      this->width = other.width;
-      return *this;
+      return prev;
     }
 
-    struct _width_type& operator=(struct _width_type &&other) {
-      this->width = other.width;
-      return *this;
-    }
+    std::ios_base::openmode mode = std::ios_base::out;
+    !append ? (void)(mode |= std::ios_base::trunc) :
+      (void)(mode |= std::ios_base::app);
 
-    struct _width_type& operator=(int width_) {
-      width = width_;
-      return *this;
+    std::ostream *p_ofs = new std::ofstream(filepath, mode);
+    if (!p_ofs) {
+      return prev;
     }
 
-    operator int() const {
-      return width;
-    }
+    p_os = p_ofs;
+    set_sync_fd(-1, filepath.c_str());
 
-    int to_int() const {
-      return width;
-    }
-  };
+    prevlogfnptr = logfnptr;
+    logfnptr = &loge<timestamp, buffer_size, min_level>::logfn_internal;
 
-  using precision_type = struct _precision_type {
-    int precision;
+    return prev;
+  }
 
-    _precision_type() : precision(-1) {
+  void unset_file() {
+    if (!p_os && !fdsink && !mapfile && !tcp && !udp && !journal) {
+      return;
     }
 
-    _precision_type(int precision_) : precision(precision_) {
-    }
+    output_flush();
+    set_sync_fd(-1);
+    set_fd_sink(-1);
 
-    _precision_type(const struct _precision_type &other) {
-      this->precision = other.precision;
+    if (p_os && p_os != &std::cout && p_os != &std::cerr) {
+      delete p_os;
     }
+    p_os = nullptr;
 
-    _precision_type(struct _precision_type &&other) {
-      this->precision = other.precision;
-    }
+    logfnptr = prevlogfnptr;
+  }
 
-    struct _precision_type& operator=(const struct _precision_type &other) {
-      this->precision = other.precision;
-      return *this;
-    }
+  /**
+   * @brief Log to a file through io_uring. Records are collected in
+   * registered buffers and written without blocking the logging thread, or
+   * the backend thread of an asynchronous logger, while other buffers are
+   * in flight. Falls back to the plain descriptor sink of set_file() when
+   * io_uring is not available. Close with unset_file().
+   *
+   * Writes go to offsets tracked by the logger, other processes appending
+   * to the same file may overwrite them.
+   *
+   * @param filepath Path of the log file
+   * @param append Append to the file if true, truncate otherwise
+   * @return Previous output stream
+   */
+  std::ostream* set_file_uring(const std::string &filepath,
+      bool append = true) {
 
-    struct _precision_type& operator=(struct _precision_type &&other) {
-      this->precision = other.precision;
-      return *this;
-    }
+#if LOGE_URING
+    std::ostream *prev = p_os;
 
-    struct _precision_type& operator=(int precision_) {
-      precision = precision_;
-      return *this;
+    if (filepath.length() == 0) {
+      return prev;
     }
 
-    operator int() const {
-      return precision;
+    int fd = open(filepath.c_str(),
+        O_WRONLY | O_CREAT | (append ? 0 : O_TRUNC),
+        S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+    if (fd < 0) {
+      lgperror("open failed");
+      return prev;
     }
 
-    int to_int() const {
-      return precision;
+    off_t offset = append ? lseek(fd, 0, SEEK_END) : 0;
+
+    set_fd_sink(fd);
+    p_os = nullptr;
+
+    if (offset < 0 || !fd_sink_uring(offset)) {
+      if (append) {
+        fcntl(fd, F_SETFL, O_APPEND);
+      }
     }
-  };
 
-  /* Member variables start */
+    prevlogfnptr = logfnptr;
+    logfnptr = &loge<timestamp, buffer_size, min_level>::logfn_internal;
+
+    return prev;
+#else
+    return set_file(filepath, append);
+#endif
+  }
 
-  enum loge_level level;
+  /**
+   * @brief Log to a file descriptor through io_uring, see set_file_uring().
+   * The descriptor is duplicated and may be shared or non-seekable, so only
+   * one write is in flight at a time. Close with unset_fd().
+   * @param fd File descriptor
+   * @return Previous output stream
+   */
+  std::ostream* set_fd_uring(int fd) {
+#if LOGE_URING
+    std::ostream *prev = p_os;
 
-  width_type linenumwidth = constants::LINENUMBER_WIDTH;
-  width_type width = -1;
-  precision_type precision = -1;
+    if (fd < 0) {
+      return prev;
+    }
 
-  using logfntype = void(loge<timestamp, buffer_size>::*)();
-  logfntype prevlogfnptr = nullptr;
-  logfntype logfnptr = &loge<timestamp, buffer_size>::logfn_internal;
+    int newfd = dup(fd);
+    if (newfd < 0) {
+      lgperror("dup failed");
+      return prev;
+    }
 
-  using endl_type = std::true_type;
+    set_fd_sink(newfd);
+    p_os = nullptr;
+    fd_sink_uring(-1);
 
-  int syslog_priority = -1;
+    prevlogfnptr = logfnptr;
+    logfnptr = &loge<timestamp, buffer_size, min_level>::logfn_internal;
 
-  protected:
+    return prev;
+#else
+    return set_fd(fd);
+#endif
+  }
 
-  /*
-   * NOTE
-   * Caution for user while working with p_os
-   * p_os can be set as nullptr. User callbacks shall check it.
+  /**
+   * @brief Log to a memory mapped file. The file is preallocated in large
+   * extents and records are copied into a mapped window of it, there is no
+   * system call per record. The flush policy decides when msync runs. Close
+   * with unset_file(), which truncates the file to its data.
+   * @param filepath Path of the log file
+   * @param append Append to the file if true, truncate otherwise
+   * @return Previous output stream
+   *
+   * @see loge_mmap
    */
-  std::ostream *p_os = nullptr;
+  std::ostream* set_file_mmap(const std::string &filepath,
+      bool append = true) {
 
-  socket_type sock = LOGE_SOCK_ERR;
+    std::ostream *prev = p_os;
 
-  std::array<
-    char,
-    (
-      !buffer_size ?
-      static_cast<std::size_t>(constants::BUFFER_SIZE) :
-      buffer_size
-    )
-  > buffer;
-  std::size_t buflen = 0;
+    if (filepath.length() == 0) {
+      return prev;
+    }
 
-  /* Member variables end */
+    loge_mmap *pm = new loge_mmap();
+    if (loge_mmap_open(pm, filepath.c_str(), append) < 0) {
+      delete pm;
+      return prev;
+    }
 
-  private:
+    set_fd_sink(-1);
+    mapfile = pm;
+    p_os = nullptr;
 
-#if __cplusplus < 201703L
+    prevlogfnptr = logfnptr;
+    logfnptr = &loge<timestamp, buffer_size, min_level>::logfn_internal;
 
-  template <
-    bool timestamp_ = timestamp,
-    typename std::enable_if<timestamp_, int>::type = 0
-  >
-  int make_prefix(char *buffer, std::size_t bufcap, struct tm *ptm, bool color,
-      const char *filename, int linenumber, const char *loglvlstr) {
-
-    return snprintf(buffer, bufcap,
-        "%02d-%02d-%04d:%02d:%02d:%02d: %s:%0*d: %-*s: ",
-        ptm->tm_mon + 1,
-        ptm->tm_mday,
-        ptm->tm_year + 1900,
-        ptm->tm_hour,
-        ptm->tm_min,
-        ptm->tm_sec,
-        filename,
-        static_cast<int>(linenumwidth),
-        linenumber,
-        color ? 22 : 8,
-        loglvlstr
-      );
+    return prev;
   }
 
-  template <
-    bool timestamp_ = timestamp,
-    typename std::enable_if<!timestamp_, int>::type = 0
-  >
-#ifndef _MSC_VER
-  int make_prefix(char *buffer, std::size_t bufcap,
-      struct tm *ptm UNUSED,
-#else
-  int make_prefix(char *buffer, std::size_t bufcap, struct tm *ptm,
-#endif
-      bool color, const char *filename, int linenumber,
-      const char *loglvlstr) {
+  /**
+   * @brief Log to a file that is rotated by size and time. On rotation the
+   * file is renamed to filepath.YYYYmmdd-HHMMSS and filepath is opened
+   * again, on the logging thread or the backend thread of an asynchronous
+   * logger. Rotated files are compressed and removed on a background
+   * thread. Close with unset_file().
+   * @param filepath Path of the log file, appended to
+   * @param policy Rotation policy
+   * @return Previous output stream
+   *
+   * @see loge_rotate_policy
+   */
+  std::ostream* set_file_rotate(const std::string &filepath,
+      const loge_rotate_policy &policy) {
 
-    return snprintf(buffer, bufcap,
-        "%s:%0*d: %-*s: ",
-        filename,
-        static_cast<int>(linenumwidth),
-        linenumber,
-        color ? 22 : 8,
-        loglvlstr
-      );
-  }
+    std::ostream *prev = p_os;
 
-#endif /* __cplusplus < 201703L */
+    if (filepath.length() == 0) {
+      return prev;
+    }
 
-  void logfn_internal() {
-    if (p_os) {
-      p_os->write(buffer.data(), buflen);
-      p_os->put('\n');
-      p_os->flush();
+    loge_rotate *pr = new loge_rotate();
+    int fd = loge_rotate_open(pr, filepath.c_str(), &policy);
+    if (fd < 0) {
+      delete pr;
+      return prev;
     }
-  }
 
-/* glibc and BSD libc only */
-#if defined(__GLIBC__) || defined(__FreeBSD__) || defined(__OpenBSD__)
+    set_fd_sink(fd);
+    rotate = pr;
+    p_os = nullptr;
 
-  void logfn_syslog() {
-    /* buffer char array may not be null-terminated */
-    buffer[buffer.size() - 1] = '\0';
+    prevlogfnptr = logfnptr;
+    logfnptr = &loge<timestamp, buffer_size, min_level>::logfn_internal;
 
-    syslog(syslog_priority, "%s\n", buffer.data());
+    return prev;
   }
 
-#endif
+  /**
+   * @brief Keep messages below the logger level in a flight recorder. They
+   * are formatted into a ring of the last records instead of being dropped,
+   * with no I/O. A message at or above dump_level first writes out what was
+   * recorded since the last dump, and so does dump_recorder(). Not used by
+   * binary loggers.
+   * @param records Number of records kept
+   * @param record_level Lowest level recorded
+   * @param dump_level Lowest level that dumps the recorder, MAX for none
+   * @param filepath File for the ring to survive a crash, read it back with
+   * loge-recorder. Empty keeps it in memory. The file is overwritten.
+   * @param record_size Bytes per record, longer messages are cut
+   * @return True on success
+   */
+  bool enable_recorder(std::size_t records,
+      enum loge_level record_level = loge_level::ALL,
+      enum loge_level dump_level = loge_level::ERROR,
+      const std::string &filepath = "",
+      std::size_t record_size = LOGE_RECORDER_RECORD_SIZE) {
 
-  virtual
-  void logfn() {
-    logfn_internal();
-  }
+    disable_recorder();
 
-  virtual
-  bool datafn(std::ostream * p_os UNUSED, std::time_t & time UNUSED,
-      const std::string & filename UNUSED, unsigned int linenum UNUSED,
-      enum loge_level loglevel UNUSED, const std::string & msg UNUSED) {
+    if (loge_recorder_open(&recorder, records, record_size,
+          filepath.empty() ? nullptr : filepath.c_str()) < 0) {
+      return false;
+    }
+
+    /* Threads logging start recording from here */
+    loge_atomic_store_int(&recorder.dump_level, dump_level);
+    loge_atomic_store_int(&recorder.level, record_level);
 
     return true;
   }
 
-  public:
-
-  loge(enum loge_level loglevel = loge_level::ERROR)
-    : loge(nullptr, -1, -1, -1, loglevel) {
+  /*
+   * Stop recording, a file backed recorder keeps its records in the file.
+   * Waits for the threads writing into the recorder.
+   */
+  void disable_recorder() {
+    loge_atomic_store_int(&recorder.level, loge_level::MAX);
+    loge_atomic_store_int(&recorder.dump_level, loge_level::MAX);
+    loge_recorder_close(&recorder);
   }
 
-  loge(std::ostream &os_, enum loge_level loglevel = loge_level::ERROR)
-    : loge(loglevel) {
-
-    set_ostream(&os_);
-  }
+  /**
+   * @brief Write out the messages recorded since the last dump, oldest first
+   * @return Number of messages written
+   */
+  std::size_t dump_recorder() {
+    return loge_recorder_dump(&recorder, &recorder_emit, this);
+  }
+
+  /**
+   * @brief Hand every record of at least sink_level to another logger, which
+   * writes it to its own output. The record is formatted once by this
+   * logger, sinks that do not take its level cost nothing. This logger
+   * formats records below its own level when a sink takes them, and only
+   * hands them on.
+   *
+   * The sink applies its own level and flight recorder to what it is
+   * handed, its recordfn() is not called. Records built with the insertion
+   * operators and binary records are not handed to sinks, a binary sink
+   * drops everything. Sinks shall outlive this logger or be removed first,
+   * and are not added or removed while logging.
+   * @param sink Logger to write to, of any kind
+   * @param sink_level Lowest level handed to the sink
+   * @param encoder Renders records for the sink instead of this logger
+   * @return False if sink is this logger
+   */
+  template <bool sink_timestamp, std::size_t sink_buffer_size,
+           int sink_min_level>
+  bool add_sink(
+      loge<sink_timestamp, sink_buffer_size, sink_min_level> &sink,
+      enum loge_level sink_level = loge_level::ALL,
+      encoder_fn encoder = nullptr) {
 
-  loge(std::ofstream &ofs_, enum loge_level loglevel = loge_level::ERROR)
-    : loge(loglevel) {
+    using sink_type = loge<sink_timestamp, sink_buffer_size, sink_min_level>;
 
-    set_ostream(&ofs_);
-  }
+    if (static_cast<void*>(&sink) == static_cast<void*>(this)) {
+      return false;
+    }
 
-  loge(
-      std::ostream *p_os_,
-      int linenumwidth_ = -1,
-      int width_ = -1,
-      int precision_ = -1,
-      enum loge_level level_ = loge_level::INFO
-    ) : level(loge_level::INFO), width(width_), precision(precision_) {
+    sinks.push_back({ &sink, &deliver_to<sink_type>, sink_level, encoder });
 
-    if (linenumwidth_ > -1) {
-      linenumwidth = linenumwidth_;
+    if (sink_level < sinks_level) {
+      sinks_level = sink_level;
     }
 
-    if (level_ < loge_level::MAX) {
-      level = level_;
-    }
+    return true;
+  }
 
-    set_stdout();
+  /* Stop handing records to sink */
+  void remove_sink(const void *sink) {
+    sinks_level = loge_level::MAX;
 
-    if (p_os_) {
-      p_os = p_os_;
-    }
-  }
+    for (auto it = sinks.begin(); it != sinks.end();) {
+      if (it->sink == sink) {
+        it = sinks.erase(it);
+        continue;
+      }
 
-  virtual
-  ~loge() {
-#if defined(__GLIBC__) || defined(__FreeBSD__) || defined(__OpenBSD__)
-    if (syslog_priority > -1) {
-      closelog();
+      if (it->level < sinks_level) {
+        sinks_level = it->level;
+      }
+      ++it;
     }
-#endif
-
-    unset_file();
   }
 
-  const char* get_level(enum loge_level level) {
-    return level > loge<>::ALL && level < loge<>::MAX ?
-      loglevel_strtbl[level] :
-      NULL;
-  }
-  
-  const char* get_level_color(enum loge_level level) {
-    return level > loge<>::ALL && level < loge<>::MAX ?
-      loglevel_strtbl_color[level] :
-      NULL;
+  void clear_sinks() {
+    sinks.clear();
+    sinks_level = loge_level::MAX;
   }
 
-  void set_level(enum loge_level level_) {
-    level = level_;
+  /* True if the output goes through io_uring */
+  bool is_uring() const {
+#if LOGE_URING
+    return fdsink && fdsink->uring;
+#else
+    return false;
+#endif
   }
 
-  std::ostream* set_ostream(std::ostream *p_os_) {
-    std::ostream *prev = p_os;
-    if (p_os_) {
-      p_os = p_os_;
+  /**
+   * @brief Write compact binary records to a file instead of text. A record
+   * holds the time, a call site id, the log type and the raw arguments, the
+   * format string and filename are written once per call site. Nothing is
+   * formatted on the logging thread. Use loge-decode to get the text back.
+   *
+   * The timestamp flag and line number width of this logger are recorded in
+   * the file. The time is rendered in the local time zone of the decoder.
+   *
+   * @param filepath Path of the binary log file
+   * @param append Append to the file if true, truncate otherwise
+   * @return false if the file could not be opened
+   *
+   * @see loge_binary
+   */
+  bool set_binary(const std::string &filepath, bool append=true) {
+    if (filepath.length() == 0 || binary) {
+      return false;
     }
-    return prev;
-  }
 
-  std::ostream* set_ostream(std::ofstream *p_ofs_) {
-    std::ostream *prev = p_os;
-    if (p_ofs_) {
-      p_os = p_ofs_;
+    int fd = open_file(filepath, append);
+    if (fd < 0) {
+      return false;
     }
-    return prev;
-  }
 
-  std::ostream* unset_ostream() {
-    std::ostream *prev = p_os;
+    set_fd_sink(fd);
     p_os = nullptr;
-    return prev;
-  }
 
-  std::ostream* set_stdout() {
-    prevlogfnptr = logfnptr;
-    logfnptr = &loge<timestamp, buffer_size>::logfn_internal;
+    char hdr[loge_binary::HEADER_SIZE];
+    fd_append(hdr, loge_binary::header(hdr, timestamp,
+          static_cast<int>(linenumwidth)), false);
 
-    std::ostream *prev = p_os;
-    p_os = &std::cout;
-    return prev;
-  }
+    binary = new binary_state();
 
-  std::ostream* set_stderr() {
     prevlogfnptr = logfnptr;
-    logfnptr = &loge<timestamp, buffer_size>::logfn_internal;
+    logfnptr = &loge<timestamp, buffer_size, min_level>::logfn_binary;
 
-    std::ostream *prev = p_os;
-    p_os = &std::cerr;
-    return prev;
+    return true;
   }
 
-/* glibc and BSD libc only */
-#if defined(__GLIBC__) || defined(__FreeBSD__) || defined(__OpenBSD__)
-
-  std::ostream* set_syslog(int priority) {
-    syslog_priority = priority;
+  void unset_binary() {
+    if (!binary) {
+      return;
+    }
 
-    prevlogfnptr = logfnptr;
-    logfnptr = &loge<timestamp, buffer_size>::logfn_syslog;
+    unset_file();
 
-    return unset_ostream();
+    delete binary;
+    binary = nullptr;
   }
 
-#endif
+  bool is_binary() const {
+    return binary != nullptr;
+  }
 
-/* libstdc++ */
-#if defined(__GLIBCXX__)
+  void reset_logfn() {
+    prevlogfnptr = logfnptr;
+    logfnptr = &loge<timestamp, buffer_size, min_level>::logfn_internal;
+  }
 
-  /* Set POSIX file descriptor */
-  std::ostream* set_fd(int fd) {
-    std::ostream *prev = p_os;
+  inline
+  void reset() {
+    buflen = 0;
+  }
 
-    if (fd < 0) {
-      return prev;
-    }
+  void flush() {
+    if (binary) {
+      /* Wrap the message in a TEXT record */
+      std::array<char, buffer_capacity> &scratch = tls_buffer();
 
-    int newfd = dup(fd);
-    if (newfd < 0) {
-      lgperror("dup failed");
-      return prev;
-    }
+      std::size_t len = buflen;
+      if (len > scratch.size() - loge_binary::RECORD_HEADER_SIZE) {
+        len = scratch.size() - loge_binary::RECORD_HEADER_SIZE;
+      }
 
-    using filebuf_type = __gnu_cxx::stdio_filebuf<char>;
-    filebuf_type *p_fb = new filebuf_type(newfd, std::ios::out);
+      char *p = loge_binary::start(scratch.data(), loge_binary::TEXT);
+      memcpy(p, buffer.data(), len);
+      emit(scratch.data(), loge_binary::finish(scratch.data(), p + len));
 
-    std::ostream *p_ofs = new std::ostream(p_fb);
-    if (!p_ofs) {
-      close(newfd);
-      return prev;
+    } else {
+      emit(buffer.data(), buflen);
     }
-
-    p_os = p_ofs;
-
-    prevlogfnptr = logfnptr;
-    logfnptr = &loge<timestamp, buffer_size>::logfn_internal;
-
-    return prev;
+    reset();
   }
 
-  void unset_fd() {
-    if (!p_os) {
-      return;
-    }
+  /**
+   * @brief Make log() safe to call from several threads on this logger.
+   * Each thread formats into its own thread local buffer and only the call
+   * to the log function is serialized. The insertion operators keep using
+   * the logger buffer and are not covered.
+   *
+   * Not needed when asynchronous logging is enabled.
+   *
+   * @param enable Enable if true, disable otherwise
+   */
+  void set_concurrent(bool enable = true) {
+    if (enable && !sinklock) {
+      sinklock = new std::mutex();
 
-    if (p_os != &std::cout && p_os != &std::cerr) {
-      delete p_os->rdbuf();
-      delete p_os;
+    } else if (!enable && sinklock) {
+      delete sinklock;
+      sinklock = nullptr;
     }
-    p_os = nullptr;
-
-    logfnptr = prevlogfnptr;
   }
 
-#elif defined(_MSC_VER)
-
-  std::ostream* set_fd(int fd) {
-    std::ostream *prev = p_os;
+  bool is_concurrent() const {
+    return sinklock != nullptr;
+  }
 
-    if (fd < 0) {
-      return prev;
+  /**
+   * @brief Set when the output stream is flushed and the output file synced.
+   * The default flushes after every message and never syncs. Pending
+   * messages are flushed before the policy changes. Asynchronous loggers
+   * have the backend thread flush and switch, the call waits for it.
+   *
+   * @param policy Flush policy, all zero for the default
+   *
+   * @see loge_flush_policy
+   */
+  void set_flush_policy(const loge_flush_policy &policy) {
+    if (async) {
+      async_flush(&policy);
+      return;
     }
 
-    FILE *file = _fdopen(fd, "wb");
-    if (!file) {
-      lgperror("_fdopen failed");
-      return prev;
+    std::unique_lock<std::mutex> lock;
+    if (sinklock) {
+      lock = std::unique_lock<std::mutex>(*sinklock);
     }
 
-    std::ostream *p_ofs = new std::ofstream(file);
-    if (!p_ofs) {
-      return prev;
+    if (flush_state.messages) {
+      output_flush();
     }
+    flush_policy = policy;
+  }
 
-    p_os = p_ofs;
+  const loge_flush_policy& get_flush_policy() const {
+    return flush_policy;
+  }
 
-    prevlogfnptr = logfnptr;
-    logfnptr = &loge<timestamp, buffer_size>::logfn_internal;
+  /**
+   * @brief Have datafn() called for every record. On by default, turning it
+   * off saves building its std::string arguments when it is not overridden.
+   */
+  void use_datafn(bool on = true) {
+    has_datafn.set(on);
+  }
 
-    return prev;
+  /**
+   * @brief Have recordfn() called for every record. Off by default,
+   * subclasses overriding recordfn() turn it on from their constructor.
+   */
+  void use_recordfn(bool on = true) {
+    has_recordfn.set(on);
   }
 
-  void unset_fd() {
-    if (!p_os) {
+  /**
+   * @brief What was written since the last flush, i.e. what a crash would
+   * lose right now. Only meaningful where records are written: on the
+   * logging thread, or the backend thread for asynchronous loggers.
+   */
+  const loge_flush_state& get_flush_state() const {
+    return flush_state;
+  }
+
+  /**
+   * @brief Flush records held back by the flush policy and sync the file if
+   * the policy asks for it. For an asynchronous logger this waits until the
+   * backend thread has written and flushed everything logged so far. Rate
+   * limited call sites that are done turning messages away log their
+   * summary first.
+   */
+  void flush_output() {
+    loge_ratelimit_expire(this, 0,
+        &loge<timestamp, buffer_size, min_level>::ratelimit_summary);
+
+    if (async) {
+      async_flush(nullptr);
       return;
     }
 
-    if (p_os != &std::cout && p_os != &std::cerr) {
-      delete p_os;
+    std::unique_lock<std::mutex> lock;
+    if (sinklock) {
+      lock = std::unique_lock<std::mutex>(*sinklock);
     }
-    p_os = nullptr;
 
-    logfnptr = prevlogfnptr;
+    output_flush();
+    fd_wait();
   }
 
-#endif /* defined(__GLIBCXX__) */
+  /**
+   * @brief Flush pending records older than the flush interval. The backend
+   * thread of an asynchronous logger does this by itself, synchronous
+   * loggers that go idle can call it periodically. Rate limited call sites
+   * that are done turning messages away log their summary, for
+   * asynchronous loggers too.
+   * @return true if the output was flushed
+   */
+  bool flush_expired() {
+    loge_ratelimit_expire(this, 0,
+        &loge<timestamp, buffer_size, min_level>::ratelimit_summary);
 
-  std::ostream* set_file(const std::string &filepath, bool append=true) {
-    std::ostream *prev = p_os;
+    if (async) {
+      return false;
+    }
 
-    if (filepath.length() == 0) {
-      return prev;
+    std::unique_lock<std::mutex> lock;
+    if (sinklock) {
+      lock = std::unique_lock<std::mutex>(*sinklock);
+    }
+
+    if (!loge_flush_overdue(&flush_policy, &flush_state)) {
+      return false;
     }
 
-    std::ios_base::openmode mode = std::ios_base::out;
-    !append ? (void)(mode |= std::ios_base::trunc) :
-      (void)(mode |= std::ios_base::app);
+    output_flush();
+    return true;
+  }
+
+  /**
+   * @brief Start a backend thread that performs all writes to the output
+   * stream, socket or syslog. log() and flush() then only copy the record
+   * into a bounded lock-free ring and return without doing any I/O.
+   *
+   * datafn() is still called on the logging thread. Output stream, file
+   * descriptor, socket and log function should not be changed while the
+   * backend thread is running.
+   *
+   * @param capacity Number of records in the ring, rounded up to a power of
+   * two
+   * @param block_when_full Wait for room when the ring is full if true, drop
+   * the record otherwise
+   * @return false if asynchronous logging is already enabled
+   *
+   * @see disable_async()
+   */
+  bool enable_async(std::size_t capacity = constants::ASYNC_CAPACITY,
+      bool block_when_full = true) {
 
-    std::ostream *p_ofs = new std::ofstream(filepath, mode);
-    if (!p_ofs) {
-      return prev;
+    if (async) {
+      return false;
     }
 
-    p_os = p_ofs;
+    std::size_t n = 2;
+    while (n < capacity) {
+      n <<= 1;
+    }
 
-    prevlogfnptr = logfnptr;
-    logfnptr = &loge<timestamp, buffer_size>::logfn_internal;
+    async = new async_state(n, block_when_full);
+    async->worker = std::thread(&loge<timestamp, buffer_size, min_level>::async_worker,
+        this);
 
-    return prev;
+    return true;
   }
 
-  void unset_file() {
-    if (!p_os) {
+  /**
+   * @brief Write out all pending records and stop the backend thread.
+   * Derived classes overriding logfn() shall call this in their destructor.
+   */
+  void disable_async() {
+    if (!async) {
       return;
     }
 
-    if (p_os != &std::cout && p_os != &std::cerr) {
-      delete p_os;
+    {
+      std::lock_guard<std::mutex> lock(async->mutex);
+      async->running.store(false, std::memory_order_release);
+      async->cv.notify_one();
     }
-    p_os = nullptr;
 
-    logfnptr = prevlogfnptr;
-  }
+    async->worker.join();
 
-  void reset_logfn() {
-    prevlogfnptr = logfnptr;
-    logfnptr = &loge<timestamp, buffer_size>::logfn_internal;
+    delete async;
+    async = nullptr;
   }
 
-  inline
-  void reset() {
-    buflen = 0;
+  bool is_async() const {
+    return async != nullptr;
   }
 
-  void flush() {
-    (this->*logfnptr)();
-    reset();
+  /**
+   * @brief Wait until the backend thread has written every record logged so
+   * far. Does nothing for a synchronous logger.
+   */
+  void async_wait() {
+    if (!async) {
+      return;
+    }
+
+    std::size_t pos = async->ring.tail.load(std::memory_order_acquire);
+    while (!async->ring.drained(pos)) {
+      {
+        std::lock_guard<std::mutex> lock(async->mutex);
+        async->cv.notify_one();
+      }
+      std::this_thread::yield();
+    }
   }
 
+  /**
+   * @brief Number of records dropped because the ring was full
+   */
+  std::size_t async_dropped() const {
+    return async ? async->dropped.load(std::memory_order_relaxed) : 0;
+  }
+
+  /**
+   * @brief Connect to a TCP or UDP server and log to the socket. Records
+   * are written with write(2) unless an ostream is asked for.
+   * @param host IPv4 or IPv6 address
+   * @param port Port number
+   * @param type 0 for UDP, TCP otherwise
+   * @param ipv6 Non-zero if host is an IPv6 address
+   * @param prev Set to the previous output stream if not null
+   * @param iostream Write through an ostream on top of the socket
+   * @return false if the connection failed
+   */
   bool connect(const char *host, unsigned short port, int type = 0,
-      int ipv6 = 0, std::ostream **prev = nullptr) {
+      int ipv6 = 0, std::ostream **prev = nullptr, bool iostream = false) {
 
     if (!host) {
       return false;
@@ -2270,13 +11976,13 @@ class loge {
 
     this->sock = sock;
 
-    std::ostream *prev_os = set_fd(socket_to_native(sock));
+    std::ostream *prev_os = set_fd(socket_to_native(sock), iostream);
     if (prev) {
       *prev = prev_os;
     }
 
     prevlogfnptr = logfnptr;
-    logfnptr = &loge<timestamp, buffer_size>::logfn_internal;
+    logfnptr = &loge<timestamp, buffer_size, min_level>::logfn_internal;
 
     return true;
   }
@@ -2302,6 +12008,171 @@ class loge {
     logfnptr = prevlogfnptr;
   }
 
+  /**
+   * @brief Log to a TCP server without ever blocking on it. Records are
+   * queued in memory and sent by a poller thread on a non-blocking socket,
+   * which connects and reconnects with exponential backoff. While the
+   * server is down records go to the spool file of the policy and are
+   * replayed in order once it is back. Close with unset_file(), which
+   * waits for the server at most backoff_max_ms.
+   * @param host IPv4 or IPv6 address
+   * @param port Port number
+   * @param policy Queue, backoff and spool settings, zeros for defaults
+   * @param ipv6 Non-zero if host is an IPv6 address
+   * @return Previous output stream
+   *
+   * @see loge_tcp_policy
+   */
+  std::ostream* set_tcp(const char *host, unsigned short port,
+      const loge_tcp_policy &policy = loge_tcp_policy(), int ipv6 = 0) {
+
+    std::ostream *prev = p_os;
+
+    if (!host) {
+      return prev;
+    }
+
+    loge_tcp *pt = new loge_tcp();
+    if (loge_tcp_open(pt, host, port, ipv6, &policy) < 0) {
+      delete pt;
+      return prev;
+    }
+
+    set_fd_sink(-1);
+    tcp = pt;
+    p_os = nullptr;
+
+    prevlogfnptr = logfnptr;
+    logfnptr = &loge<timestamp, buffer_size, min_level>::logfn_internal;
+
+    return prev;
+  }
+
+  /* Records the TCP sink dropped because its queue or spool was full */
+  unsigned long long tcp_dropped() const {
+    return tcp ? loge_tcp_dropped(tcp) : 0;
+  }
+
+  /**
+   * @brief Log to a UDP server. Records are packed into datagrams of up to
+   * mtu bytes and whole batches of datagrams are sent with one sendmmsg(2),
+   * on a flush or when the batch is full. Set a flush policy that lets
+   * records pile up to make use of it. Close with unset_file().
+   * @param host IPv4 or IPv6 address
+   * @param port Port number
+   * @param mtu Largest datagram, 0 for LOGE_UDP_MTU
+   * @param ipv6 Non-zero if host is an IPv6 address
+   * @return Previous output stream
+   *
+   * @see loge_udp
+   */
+  std::ostream* set_udp(const char *host, unsigned short port,
+      std::size_t mtu = 0, int ipv6 = 0) {
+
+    std::ostream *prev = p_os;
+
+    if (!host) {
+      return prev;
+    }
+
+    loge_udp *pu = new loge_udp();
+    if (loge_udp_open(pu, host, port, ipv6, mtu) < 0) {
+      delete pu;
+      return prev;
+    }
+
+    set_fd_sink(-1);
+    udp = pu;
+    p_os = nullptr;
+
+    prevlogfnptr = logfnptr;
+    logfnptr = &loge<timestamp, buffer_size, min_level>::logfn_internal;
+
+    return prev;
+  }
+
+  /**
+   * @brief Log to a collector on the same host through a Unix domain
+   * socket, which costs much less per message than TCP over loopback.
+   * Records are packed and sent in batches like with set_udp(), each record
+   * or batch of records arriving as one message. Sends block while the
+   * collector catches up. When it goes away the socket is connected again
+   * with backoff, what is logged in between is dropped and counted by
+   * udp_dropped(). Close with unset_file().
+   * @param path Path of the collector socket
+   * @param type SOCK_SEQPACKET or SOCK_DGRAM
+   * @param mtu Largest message, 0 for LOGE_UNIX_MTU
+   * @return Previous output stream
+   *
+   * @see loge_udp
+   */
+  std::ostream* set_unix(const char *path, int type = SOCK_SEQPACKET,
+      std::size_t mtu = 0) {
+
+    std::ostream *prev = p_os;
+
+    if (!path) {
+      return prev;
+    }
+
+    loge_udp *pu = new loge_udp();
+    if (loge_unix_open(pu, path, type, mtu) < 0) {
+      delete pu;
+      return prev;
+    }
+
+    set_fd_sink(-1);
+    udp = pu;
+    p_os = nullptr;
+
+    prevlogfnptr = logfnptr;
+    logfnptr = &loge<timestamp, buffer_size, min_level>::logfn_internal;
+
+    return prev;
+  }
+
+  /* Datagrams the UDP or Unix socket sink dropped */
+  unsigned long long udp_dropped() const {
+    return udp ? loge_udp_dropped(udp) : 0;
+  }
+
+  /**
+   * @brief Log straight to systemd-journald or a syslog daemon through its
+   * Unix socket instead of syslog(3). Each record is one datagram made of a
+   * header rendered here once, the level and source location of the record
+   * and the message without the text prefix. Close with unset_file().
+   * @param policy Format, socket, identifier and structured fields, zeros
+   * for journald and the defaults
+   * @return Previous output stream
+   *
+   * @see loge_journal_policy
+   */
+  std::ostream* set_journal(
+      const loge_journal_policy &policy = loge_journal_policy()) {
+
+    std::ostream *prev = p_os;
+
+    loge_journal *pj = new loge_journal();
+    if (loge_journal_open(pj, &policy) < 0) {
+      delete pj;
+      return prev;
+    }
+
+    set_fd_sink(-1);
+    journal = pj;
+    p_os = nullptr;
+
+    prevlogfnptr = logfnptr;
+    logfnptr = &loge<timestamp, buffer_size, min_level>::logfn_internal;
+
+    return prev;
+  }
+
+  /* Datagrams the journal sink could not deliver */
+  unsigned long long journal_dropped() const {
+    return journal ? loge_journal_dropped(journal) : 0;
+  }
+
   void log(
       int logtype,
       int linenumber,
@@ -2310,68 +12181,114 @@ class loge {
       ...
     ) {
 
-    std::time_t t = std::time(NULL);
-    struct tm localtm = *std::localtime(&t);
-
-    enum loge_level loglevel = LOGE_LOGLEVEL(logtype);
-
-    if (loglevel >= loge_level::MAX ||
-        loglevel < level) {
+    if (!sampled(logtype)) {
       return;
     }
 
-    int en_color = LOGE_ENCOLOR(logtype);
+    std::va_list args;
+    va_start(args, msg);
+    vlog(nullptr, logtype, linenumber, filename, msg, args);
+    va_end(args);
+  }
 
-    const char *loglvlstr = en_color ?
-      loglevel_strtbl_color[loglevel] :
-      loglevel_strtbl[loglevel];
+  /**
+   * @brief Log a message from a call site described by a loge_site. Used by
+   * the logging macros, the filename and line number come from the site.
+   * The caller has made the sampling decision, see sampled().
+   */
+  void log(
+      loge_site &site,
+      int logtype,
+      const char *msg,
+      ...
+    ) {
 
-    int len = 0;
+    site.enlist();
 
-#if __cplusplus >= 201703L
+    std::va_list args;
+    va_start(args, msg);
+    vlog(&site, logtype, site.line, site.file, msg, args);
+    va_end(args);
+  }
 
-    if constexpr (timestamp) {
-      len = snprintf(buffer.data(), buffer.size(),
-          "%02d-%02d-%04d:%02d:%02d:%02d: %s:%0*d: %-*s: ",
-          localtm.tm_mon + 1, localtm.tm_mday, localtm.tm_year + 1900,
-          localtm.tm_hour, localtm.tm_min, localtm.tm_sec,
-          filename,
-          (unsigned int)static_cast<int>(linenumwidth), linenumber,
-          en_color ? 22 : 8, loglvlstr
-        );
+#if __cplusplus >= 202002L
 
-    } else {
-      len = snprintf(buffer.data(), buffer.size(),
-          "%s:%0*d: %-*s: ",
-          filename,
-          static_cast<int>(linenumwidth), linenumber,
-          en_color ? 22 : 8, loglvlstr
-        );
-    }
+  /**
+   * @brief Log a message with a format string that is parsed at compile
+   * time. The number and types of the arguments are checked against the
+   * conversions while compiling, literal pieces are copied as is and each
+   * argument goes through a writer for its type. A format string without
+   * conversions is copied without any formatting.
+   *
+   * @see LOGE_FMT
+   */
+  template <loge_literal fmt, typename... Args>
+  void log(
+      int logtype,
+      int linenumber,
+      const char *filename,
+      const Args &...args
+    ) {
 
-#else /* __cplusplus >= 201703L */
+    if (sampled(logtype)) {
+      log_fmt<fmt>(nullptr, logtype, linenumber, filename, args...);
+    }
+  }
 
-    len =
-      make_prefix(buffer.data(), buffer.size(), &localtm, en_color, filename,
-          linenumber, loglvlstr);
+  template <loge_literal fmt, typename... Args>
+  void log(
+      loge_site &site,
+      int logtype,
+      const Args &...args
+    ) {
 
-#endif /* __cplusplus >= 201703L */
+    site.enlist();
+    log_fmt<fmt>(&site, logtype, site.line, site.file, args...);
+  }
 
-    std::va_list args;
-    va_start(args, msg);
-    len += vsnprintf(buffer.data() + len, buffer.size() - len, msg, args);
-    va_end(args);
+#endif /* __cplusplus >= 202002L */
 
-    buflen = len;
+  /**
+   * @brief Log a message whose formatting is deferred to the backend thread.
+   * The format string pointer and the argument values are captured in binary
+   * form, strings by value. The format string must outlive the logger, a
+   * string literal is expected.
+   *
+   * A binary logger writes the captured arguments as they are. Without
+   * asynchronous or binary logging the message is formatted right away like
+   * log() does.
+   *
+   * @see LOGE_DEFER
+   */
+  template <typename... Args>
+  void log_deferred(
+      int logtype,
+      int linenumber,
+      const char *filename,
+      const char *msg,
+      const Args &...args
+    ) {
 
-    if (datafn(p_os, t, filename, linenumber, loglevel, msg)) {
-      (this->*logfnptr)();
+    if (sampled(logtype)) {
+      defer(nullptr, logtype, linenumber, filename, msg, args...);
     }
   }
 
-  loge<timestamp, buffer_size>& operator<<(const loge<timestamp, buffer_size> &other) {
+  template <typename... Args>
+  void log_deferred(
+      loge_site &site,
+      int logtype,
+      const char *msg,
+      const Args &...args
+    ) {
+
+    site.enlist();
+    defer(&site, logtype, site.line, site.file, msg, args...);
+  }
+
+  loge<timestamp, buffer_size, min_level>& operator<<(const loge<timestamp, buffer_size, min_level> &other) {
     if (this != &other) {
-      this->level = other.level;
+      this->set_level(other.current_level());
       this->linenumwidth = other.linenumwidth;
       this->width = other.width;
       this->precision = other.precision;
@@ -2385,7 +12302,7 @@ class loge {
     return *this;
   }
 
-  loge<timestamp, buffer_size>& operator<<(const char *pstr) {
+  loge<timestamp, buffer_size, min_level>& operator<<(const char *pstr) {
     if (!pstr) {
       return *this;
     }
@@ -2407,196 +12324,140 @@ class loge {
     return *this;
   }
 
-  loge<timestamp, buffer_size>& operator<<(const std::string &str) {
+  loge<timestamp, buffer_size, min_level>& operator<<(const std::string &str) {
     return this->operator<<(str.c_str());
   }
 
-  loge<timestamp, buffer_size>& operator<<(char c) {
+  loge<timestamp, buffer_size, min_level>& operator<<(char c) {
     if (buflen < buffer.size()) {
       buffer[buflen++] = c;
     }
     return *this;
   }
 
-  loge<timestamp, buffer_size>& operator<<(unsigned char c) {
+  loge<timestamp, buffer_size, min_level>& operator<<(unsigned char c) {
     return this->operator<<(static_cast<char>(c));
   }
 
-  loge<timestamp, buffer_size>& operator<<(short n) {
-    int widthval = static_cast<int>(width);
-    int len = snprintf(buffer.data() + buflen, buffer.size() - buflen,
-        widthval > -1 ? "%0*hd" : "%hd",
-        widthval > -1 ? widthval : n, n);
+  template <typename T>
+  loge<timestamp, buffer_size, min_level>& put_integer(T n) {
+    unsigned long long u = n < 0 ?
+      0ULL - static_cast<unsigned long long>(n) :
+      static_cast<unsigned long long>(n);
 
-    buflen += len;
+    if (buflen < buffer.size()) {
+      buflen += loge_write_integer(buffer.data() + buflen,
+          buffer.size() - buflen, u, n < 0, static_cast<int>(width));
+    }
 
     return *this;
   }
 
-  loge<timestamp, buffer_size>& operator<<(unsigned short n) {
+  loge<timestamp, buffer_size, min_level>& put_fixed(double f) {
     int widthval = static_cast<int>(width);
-    int len = snprintf(buffer.data() + buflen, buffer.size() - buflen,
-        widthval > -1 ? "%0*hu" : "%hu",
-        widthval > -1 ? widthval : n, n);
+    int precisionval = static_cast<int>(precision);
 
-    buflen += len;
+    if (buflen + 1 >= buffer.size()) {
+      return *this;
+    }
 
-    return *this;
-  }
+    char *dst = buffer.data() + buflen;
+    std::size_t room = buffer.size() - buflen - 1;
+    std::size_t len = 0;
 
-  loge<timestamp, buffer_size>& operator<<(int n) {
-    int widthval = static_cast<int>(width);
-    int len = snprintf(buffer.data() + buflen, buffer.size() - buflen,
-        widthval > -1 ? "%0*d" : "%d",
-        widthval > -1 ? widthval : n, n);
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
 
-    buflen += len;
+    /* Same output as "%0#*.*f" without going through printf */
+    std::to_chars_result res = std::to_chars(dst, dst + room, f,
+        std::chars_format::fixed, precisionval > -1 ? precisionval : 6);
 
-    return *this;
-  }
+    if (res.ec == std::errc()) {
+      len = res.ptr - dst;
 
-  loge<timestamp, buffer_size>& operator<<(unsigned int n) {
-    int widthval = static_cast<int>(width);
-    int len = snprintf(buffer.data() + buflen, buffer.size() - buflen,
-        widthval > -1 ? "%0*u" : "%u",
-        widthval > -1 ? widthval : n, n);
+      if (precisionval == 0 && len < room && std::isfinite(f)) {
+        dst[len++] = '.';
+      }
 
-    buflen += len;
+      if (widthval > static_cast<int>(len)) {
+        std::size_t fill = widthval - len;
+        if (fill > room - len) {
+          fill = room - len;
+        }
+
+        /* Zeros go after the sign, infinity and NaN get spaces */
+        std::size_t at = std::isfinite(f) && dst[0] == '-' ? 1 : 0;
+        memmove(dst + at + fill, dst + at, len - at);
+        memset(dst + at, std::isfinite(f) ? '0' : ' ', fill);
+        len += fill;
+      }
 
-    return *this;
-  }
+    } else
 
-  loge<timestamp, buffer_size>& operator<<(long n) {
-    int widthval = static_cast<int>(width);
-    int len = 0;
-    if (widthval > -1) {
-      len = snprintf(buffer.data() + buflen, buffer.size() - buflen,
-          "%0*ld", widthval, n);
+#endif /* __cpp_lib_to_chars */
 
-    } else {
-      len = snprintf(buffer.data() + buflen, buffer.size() - buflen,
-          "%0ld", n);
+    {
+      int done;
+      if (widthval > -1) {
+        done = snprintf(dst, room + 1, "%0#*.*f", widthval,
+            precisionval > -1 ? precisionval : 6, f);
+      } else {
+        done = snprintf(dst, room + 1, "%0#.*f",
+            precisionval > -1 ? precisionval : 6, f);
+      }
+      len = done < 0 ? 0 :
+        static_cast<std::size_t>(done) > room ? room :
+        static_cast<std::size_t>(done);
     }
 
     buflen += len;
+    buffer[buflen] = '\0';
 
     return *this;
   }
 
-  loge<timestamp, buffer_size>& operator<<(long long n) {
-    int widthval = static_cast<int>(width);
-    int len = 0;
-    if (widthval > -1) {
-      len = snprintf(buffer.data() + buflen, buffer.size() - buflen,
-          "%0*lld", widthval, n);
-
-    } else {
-      len = snprintf(buffer.data() + buflen, buffer.size() - buflen,
-          "%0lld", n);
-    }
-
-    buflen += len;
-
-    return *this;
+  loge<timestamp, buffer_size, min_level>& operator<<(short n) {
+    return put_integer(n);
   }
 
-  loge<timestamp, buffer_size>& operator<<(unsigned long n) {
-    int widthval = static_cast<int>(width);
-    int len = 0;
-    if (widthval > -1) {
-      len = snprintf(buffer.data() + buflen, buffer.size() - buflen,
-          "%0*lu", widthval, n);
-
-    } else {
-      len = snprintf(buffer.data() + buflen, buffer.size() - buflen,
-          "%0lu", n);
-    }
-
-    buflen += len;
-
-    return *this;
+  loge<timestamp, buffer_size, min_level>& operator<<(unsigned short n) {
+    return put_integer(n);
   }
 
-  loge<timestamp, buffer_size>& operator<<(unsigned long long n) {
-    int widthval = static_cast<int>(width);
-    int len = 0;
-    if (widthval > -1) {
-      len = snprintf(buffer.data() + buflen, buffer.size() - buflen,
-          "%0*llu", widthval, n);
-
-    } else {
-      len = snprintf(buffer.data() + buflen, buffer.size() - buflen,
-          "%0llu", n);
-    }
-
-    buflen += len;
-
-    return *this;
+  loge<timestamp, buffer_size, min_level>& operator<<(int n) {
+    return put_integer(n);
   }
 
-  loge<timestamp, buffer_size>& operator<<(float f) {
-    int widthval = static_cast<int>(width);
-    int precisionval = static_cast<int>(precision);
-    int len = 0;
-    if (widthval > -1) {
-      if (precisionval > -1) {
-        len = snprintf(buffer.data() + buflen, buffer.size() - buflen,
-            "%0#*.*f", widthval, precisionval, f);
-
-      } else {
-        len = snprintf(buffer.data() + buflen, buffer.size() - buflen,
-            "%0#*f", widthval, f);
-      }
-
-    } else {
-      if (precisionval > -1) {
-        len = snprintf(buffer.data() + buflen, buffer.size() - buflen,
-            "%0#.*f", precisionval, f);
-
-      } else {
-        len = snprintf(buffer.data() + buflen, buffer.size() - buflen,
-            "%0#f", f);
-      }
-    }
-
-    buflen += len;
-
-    return *this;
+  loge<timestamp, buffer_size, min_level>& operator<<(unsigned int n) {
+    return put_integer(n);
   }
 
-  loge<timestamp, buffer_size>& operator<<(double f) {
-    int widthval = static_cast<int>(width);
-    int precisionval = static_cast<int>(precision);
-    int len = 0;
-    if (widthval > -1) {
-      if (precisionval > -1) {
-        len = snprintf(buffer.data() + buflen, buffer.size() - buflen,
-            "%0#*.*f", widthval, precisionval, f);
+  loge<timestamp, buffer_size, min_level>& operator<<(long n) {
+    return put_integer(n);
+  }
 
-      } else {
-        len = snprintf(buffer.data() + buflen, buffer.size() - buflen,
-            "%0#*f", widthval, f);
-      }
+  loge<timestamp, buffer_size, min_level>& operator<<(long long n) {
+    return put_integer(n);
+  }
 
-    } else {
-      if (precisionval > -1) {
-        len = snprintf(buffer.data() + buflen, buffer.size() - buflen,
-            "%0#.*f", precisionval, f);
+  loge<timestamp, buffer_size, min_level>& operator<<(unsigned long n) {
+    return put_integer(n);
+  }
 
-      } else {
-        len = snprintf(buffer.data() + buflen, buffer.size() - buflen,
-            "%0#f", f);
-      }
-    }
+  loge<timestamp, buffer_size, min_level>& operator<<(unsigned long long n) {
+    return put_integer(n);
+  }
 
-    buflen += len;
+  loge<timestamp, buffer_size, min_level>& operator<<(float f) {
+    return put_fixed(f);
+  }
 
-    return *this;
+  loge<timestamp, buffer_size, min_level>& operator<<(double f) {
+    return put_fixed(f);
   }
 
 #if __cplusplus >= 201703L
 
-  loge<timestamp, buffer_size>& operator<<(struct tm &localtm) {
+  loge<timestamp, buffer_size, min_level>& operator<<(struct tm &localtm) {
     if constexpr (timestamp) {
       int len = snprintf(buffer.data() + buflen, buffer.size() - buflen,
           "%02d-%02d-%04d:%02d:%02d:%02d",
@@ -2637,7 +12498,7 @@ class loge {
 #endif
   }
 
-  loge<timestamp, buffer_size>& operator<<(struct tm &localtm) {
+  loge<timestamp, buffer_size, min_level>& operator<<(struct tm &localtm) {
     insert_tm(localtm);
     return *this;
   }
@@ -2659,7 +12520,7 @@ class loge {
     return width_type(width);
   }
 
-  loge<timestamp, buffer_size>& operator<<(width_type width_) {
+  loge<timestamp, buffer_size, min_level>& operator<<(width_type width_) {
     width = width_;
     return *this;
   }
@@ -2674,7 +12535,7 @@ class loge {
     return precision_type(precision_);
   }
 
-  loge<timestamp, buffer_size>& operator<<(precision_type precision_) {
+  loge<timestamp, buffer_size, min_level>& operator<<(precision_type precision_) {
     precision = precision_;
     return *this;
   }
@@ -2682,7 +12543,7 @@ class loge {
   static
   constexpr const endl_type endl = endl_type();
 
-  loge<timestamp, buffer_size>& operator<<(endl_type endl UNUSED) {
+  loge<timestamp, buffer_size, min_level>& operator<<(endl_type endl UNUSED) {
     flush();
     return *this;
   }
@@ -2693,6 +12554,4 @@ class loge {
 
 /******************************* C++ code ends ********************************/
 
-#undef _POSIX_C_SOURCE
-
 #endif /* _LOGE_HPP_ */
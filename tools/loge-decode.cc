@@ -0,0 +1,64 @@
+/*
+ * loge-decode: turn binary logs written by loge::set_binary() back into the
+ * text the logger would have written.
+ *
+ *   loge-decode [--sites] [file...]
+ *
+ * Reads standard input when no file is given. With --sites only the call
+ * sites described in the files are listed.
+ */
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <loge.hpp>
+
+static bool list_sites = false;
+
+static
+bool decode(std::istream &is, const char *name) {
+  loge_binary::decoder dec(is, list_sites);
+  const char *msg;
+  std::size_t len;
+
+  while ((msg = dec.next(len)) != nullptr) {
+    fwrite(msg, 1, len, stdout);
+    fputc('\n', stdout);
+  }
+
+  if (dec.error() || is.bad()) {
+    fprintf(stderr, "loge-decode: %s: %s\n", name,
+        dec.error() ? dec.error() : "read error");
+    return false;
+  }
+
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+
+  int first = 1;
+  if (argc > 1 && strcmp(argv[1], "--sites") == 0) {
+    list_sites = true;
+    first++;
+  }
+
+  if (argc <= first) {
+    return decode(std::cin, "stdin") ? 0 : 1;
+  }
+
+  bool ok = true;
+
+  for (int i = first; i < argc; i++) {
+    std::ifstream ifs(argv[i], std::ios_base::in | std::ios_base::binary);
+    if (!ifs) {
+      fprintf(stderr, "loge-decode: %s: cannot open\n", argv[i]);
+      ok = false;
+      continue;
+    }
+
+    ok = decode(ifs, argv[i]) && ok;
+  }
+
+  return ok ? 0 : 1;
+}
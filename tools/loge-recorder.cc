@@ -0,0 +1,72 @@
+/*
+ * loge-recorder: print the records of a file backed flight recorder, see
+ * loge::enable_recorder() and loge_enable_recorder(). Meant for post-mortem
+ * use, the file keeps what was recorded up to a crash.
+ *
+ *   loge-recorder [--all] file...
+ *
+ * Prints the records not dumped to the log yet, oldest first. With --all
+ * every record still in the ring is printed.
+ */
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <vector>
+#include <loge.hpp>
+
+static bool print_all = false;
+
+static
+void print_record(void *ctx UNUSED, const char *data, std::size_t len,
+    int level UNUSED) {
+
+  fwrite(data, 1, len, stdout);
+  fputc('\n', stdout);
+}
+
+static
+bool print(const char *name) {
+  std::ifstream ifs(name, std::ios_base::in | std::ios_base::binary);
+  if (!ifs) {
+    fprintf(stderr, "loge-recorder: %s: cannot open\n", name);
+    return false;
+  }
+
+  std::vector<char> data((std::istreambuf_iterator<char>(ifs)),
+      std::istreambuf_iterator<char>());
+
+  const loge_recorder_header *hdr =
+    loge_recorder_check(data.data(), data.size());
+  if (!hdr) {
+    fprintf(stderr, "loge-recorder: %s: not a flight recorder\n", name);
+    return false;
+  }
+
+  loge_recorder_walk(hdr, print_all ? 0 : hdr->tail, hdr->head,
+      &print_record, nullptr);
+
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+
+  int first = 1;
+  if (argc > 1 && strcmp(argv[1], "--all") == 0) {
+    print_all = true;
+    first++;
+  }
+
+  if (argc <= first) {
+    fprintf(stderr, "usage: loge-recorder [--all] file...\n");
+    return 2;
+  }
+
+  bool ok = true;
+
+  for (int i = first; i < argc; i++) {
+    ok = print(argv[i]) && ok;
+  }
+
+  return ok ? 0 : 1;
+}